@@ -1,6 +1,8 @@
 #include <stdio.h>  // only for debugging
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <math.h>
 #include "CELS.h"
 
 
@@ -20,14 +22,20 @@ static void* ExtendArray (void** array, int element_size, int* i, int* size)
     return (char*)*array + (*i-1) * element_size;
 }
 
-// Compute hash of the string
-static unsigned StringHash (const char* str)
+// Compute hash of the string incrementally: StringHash(s,n) == StringHashUpdate(StringHash(s,n-1), s[n-1])
+static const unsigned STRING_HASH_INIT = 314159265;
+static unsigned StringHashUpdate (unsigned hash, char c)
 {
-    unsigned hash = 314159265;
-    do {
-        hash = (hash + *str) * 1234567891;
-        hash += hash>>17;
-    } while (*str++);
+    hash = (hash + c) * 1234567891;
+    return hash + (hash>>17);
+}
+
+// Compute hash of the first len chars of the string
+static unsigned StringHash (const char* str, unsigned len)
+{
+    unsigned hash = STRING_HASH_INIT;
+    while (len--)
+        hash = StringHashUpdate (hash, *str++);
     return hash;
 }
 
@@ -60,464 +68,6435 @@ CelsResult DllUnload (void* dll)
     return CELS_OK;
 }
 #else
+#include <dlfcn.h>
 CelsResult DllUnload (void* dll)
 {
-    return CELS_ERROR_NOT_IMPLEMENTED;
+    dlclose (dll);
+    return CELS_OK;
 }
 #endif
 
 
+// Multithreading primitives =======================================================================
+
+#ifdef _WIN32
+#define CELS_THREAD_LOCAL __declspec(thread)
+static long  AtomicAdd (volatile long* p, long x)                    {return InterlockedExchangeAdd(p,x) + x;}
+static void  AtomicAdd64 (volatile CelsNum* p, CelsNum x)             {InterlockedExchangeAdd64(p,x);}
+static void* AtomicCas (void* volatile* p, void* expected, void* x)  {return InterlockedCompareExchangePointer(p,x,expected);}
+static CelsNum AtomicCas64 (volatile CelsNum* p, CelsNum expected, CelsNum x)  {return InterlockedCompareExchange64(p,x,expected);}
+static void  MemoryFence()                                           {MemoryBarrier();}
+static void  YieldCpu()                                              {SwitchToThread();}
+// Thread-specific pointer whose destructor is called on thread exit
+#define THREAD_KEY_DESTRUCTOR WINAPI
+typedef DWORD ThreadKey;
+static int   CreateThreadKey (ThreadKey* key, PFLS_CALLBACK_FUNCTION destructor)  {*key = FlsAlloc(destructor);  return *key != FLS_OUT_OF_INDEXES;}
+static void* GetThreadKey (ThreadKey key)                                         {return FlsGetValue(key);}
+static void  SetThreadKey (ThreadKey key, void* value)                            {FlsSetValue(key,value);}
+// Threads, mutexes and condition variables
+#define THREAD_FUNCTION  DWORD WINAPI
+#define THREAD_RETURN    0
+typedef LPTHREAD_START_ROUTINE ThreadFunction;
+typedef HANDLE             Thread;
+typedef CRITICAL_SECTION   Mutex;
+typedef CONDITION_VARIABLE CondVar;
+static int  StartThread (Thread* thread, ThreadFunction f, void* arg)  {*thread = CreateThread (NULL, 0, f, arg, 0, NULL);  return *thread != NULL;}
+static void JoinThread (Thread thread)              {WaitForSingleObject (thread, INFINITE);  CloseHandle (thread);}
+static void InitMutex (Mutex* mutex)                {InitializeCriticalSection (mutex);}
+static void DestroyMutex (Mutex* mutex)             {DeleteCriticalSection (mutex);}
+static void LockMutex (Mutex* mutex)                {EnterCriticalSection (mutex);}
+static void UnlockMutex (Mutex* mutex)              {LeaveCriticalSection (mutex);}
+static void InitCondVar (CondVar* cv)               {InitializeConditionVariable (cv);}
+static void DestroyCondVar (CondVar* cv)            {}
+static void WaitCondVar (CondVar* cv, Mutex* mutex) {SleepConditionVariableCS (cv, mutex, INFINITE);}
+static void SignalCondVar (CondVar* cv)             {WakeConditionVariable (cv);}
+static void BroadcastCondVar (CondVar* cv)          {WakeAllConditionVariable (cv);}
+static int  NumberOfProcessors()                    {SYSTEM_INFO si;  GetSystemInfo (&si);  return si.dwNumberOfProcessors;}
+static CelsNum Nanoseconds()                        {LARGE_INTEGER freq, t;  QueryPerformanceFrequency (&freq);  QueryPerformanceCounter (&t);  return (CelsNum)((double)t.QuadPart * 1e9 / freq.QuadPart);}
+#else
+#include <sched.h>
+#include <pthread.h>
+#define CELS_THREAD_LOCAL __thread
+static long  AtomicAdd (volatile long* p, long x)                    {return __sync_add_and_fetch(p,x);}
+static void  AtomicAdd64 (volatile CelsNum* p, CelsNum x)             {__sync_add_and_fetch(p,x);}
+static void* AtomicCas (void* volatile* p, void* expected, void* x)  {return __sync_val_compare_and_swap(p,expected,x);}
+static CelsNum AtomicCas64 (volatile CelsNum* p, CelsNum expected, CelsNum x)  {return __sync_val_compare_and_swap(p,expected,x);}
+static void  MemoryFence()                                           {__sync_synchronize();}
+static void  YieldCpu()                                              {sched_yield();}
+
+#define THREAD_KEY_DESTRUCTOR
+typedef pthread_key_t ThreadKey;
+static int   CreateThreadKey (ThreadKey* key, void (*destructor)(void*))  {return pthread_key_create(key,destructor) == 0;}
+static void* GetThreadKey (ThreadKey key)                                 {return pthread_getspecific(key);}
+static void  SetThreadKey (ThreadKey key, void* value)                    {pthread_setspecific(key,value);}
+
+#include <unistd.h>
+#include <time.h>
+#define THREAD_FUNCTION  void*
+#define THREAD_RETURN    NULL
+typedef void* (*ThreadFunction) (void*);
+typedef pthread_t       Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t  CondVar;
+static int  StartThread (Thread* thread, ThreadFunction f, void* arg)  {return pthread_create (thread, NULL, f, arg) == 0;}
+static void JoinThread (Thread thread)              {pthread_join (thread, NULL);}
+static void InitMutex (Mutex* mutex)                {pthread_mutex_init (mutex, NULL);}
+static void DestroyMutex (Mutex* mutex)             {pthread_mutex_destroy (mutex);}
+static void LockMutex (Mutex* mutex)                {pthread_mutex_lock (mutex);}
+static void UnlockMutex (Mutex* mutex)              {pthread_mutex_unlock (mutex);}
+static void InitCondVar (CondVar* cv)               {pthread_cond_init (cv, NULL);}
+static void DestroyCondVar (CondVar* cv)            {pthread_cond_destroy (cv);}
+static void WaitCondVar (CondVar* cv, Mutex* mutex) {pthread_cond_wait (cv, mutex);}
+static void SignalCondVar (CondVar* cv)             {pthread_cond_signal (cv);}
+static void BroadcastCondVar (CondVar* cv)          {pthread_cond_broadcast (cv);}
+static int  NumberOfProcessors()                    {long n = sysconf (_SC_NPROCESSORS_ONLN);  return n>0? n : 1;}
+static CelsNum Nanoseconds()                        {struct timespec t;  clock_gettime (CLOCK_MONOTONIC, &t);  return t.tv_sec*(CelsNum)1000000000 + t.tv_nsec;}
+#endif
+
+// Address of this variable uniquely identifies the current thread
+static CELS_THREAD_LOCAL char ThreadTag;
+
+// Recursive spin lock. It requires only zero initialization, so it's usable from static initializers
+// (like the ones calling CelsRegister) and should guard only short and rare operations
+typedef struct {
+    void* volatile owner;   // &ThreadTag of the owning thread or NULL
+    int            depth;   // recursion depth of the owning thread
+} SpinLock;
+
+static void Lock (SpinLock* lock)
+{
+    // Atomic read of the owner: only the current thread may store &ThreadTag here
+    if (AtomicCas (&lock->owner, &ThreadTag, &ThreadTag) == &ThreadTag)  {lock->depth++;  return;}
+    while (AtomicCas (&lock->owner, NULL, &ThreadTag) != NULL)
+        YieldCpu();
+    lock->depth = 1;
+}
+
+static void Unlock (SpinLock* lock)
+{
+    if (--lock->depth > 0)  return;
+    AtomicCas (&lock->owner, &ThreadTag, NULL);
+}
+
+
 // ****************************************************************************************************************************
-// Method registering/parsing *************************************************************************************************
+// Callback statistics ********************************************************************************************************
 // ****************************************************************************************************************************
 
+// When enabled, callback passed to (de)compression services is wrapped by StatsCallback() that counts calls of each callback
+// service, bytes passed, time spent inside the callback, and builds log2 histograms of request sizes and latencies.
+// Counters are updated with atomic additions, so overhead is a few dozen nanoseconds per call.
+// Collection is enabled by CELS_SET_CALLBACK_STATS or by environment variable CELS_CALLBACK_STATS:
+// "1" prints report to stderr at CelsUnload(), any other non-empty value is the name of file the report is appended to.
+
+const int STATS_SERVICES = 16;   // Callback services CELS_READ..CELS_READ+15 are tracked
+const int STATS_BINS     = 64;   // Histogram bin N counts values in range [2^(N-1), 2^N)
+
 typedef struct {
-    const char *name;  void* self;  CelsFunction* CelsMain;  unsigned hash;
-} RegCodec;
-static RegCodec* RegisteredCodecs = NULL;
-static int NumRegisteredCodecs = 0;
-static int MaxRegisteredCodecs = 0;
+    volatile CelsNum calls, bytes, nanoseconds;
+    volatile CelsNum size_bins[STATS_BINS], time_bins[STATS_BINS];
+} ServiceStats;
 
-CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain)
+static ServiceStats CallbackStats[STATS_SERVICES];
+static volatile long CallbackStatsMode = -1;   // -1: not yet checked, 0: disabled, 1: enabled, 2: enabled with report at CelsUnload()
+static const char* CallbackStatsFile = NULL;   // report destination for mode 2, NULL means stderr
+
+static const char* STATS_SERVICE_NAMES[STATS_SERVICES] = {"READ", "WRITE", "QUASI_WRITE", "PROGRESS",
+    "RECEIVE_FILLED_INBUF", "SEND_EMPTY_INBUF", "RECEIVE_EMPTY_OUTBUF", "SEND_FILLED_OUTBUF", "READ_STREAM", "WRITE_STREAM", "ALLOC", "FREE_MEMORY", "GET_THREAD_POOL"};
+
+static int CallbackStatsEnabled()
 {
-    // Add new record to the list of registered codecs
-    RegCodec* codec = (RegCodec*)  ExtendArray ((void**)&RegisteredCodecs, sizeof(RegCodec), &NumRegisteredCodecs, &MaxRegisteredCodecs);
-    if (codec==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (CallbackStatsMode < 0) {
+        const char* env = getenv ("CELS_CALLBACK_STATS");
+        if (env  &&  *env  &&  strcmp (env, "0") != 0)
+            CallbackStatsFile = (strcmp (env, "1") == 0? NULL : env),  CallbackStatsMode = 2;
+        else
+            CallbackStatsMode = 0;
+    }
+    return CallbackStatsMode > 0;
+}
 
-    // Fill the record
-    if (*name=='\0')  name = "*";
-    const char* wildcard = strchr(name,'*');  // points to a first char after fixed part of wildcard name
-    codec->name     = name;
-    codec->self     = ud;
-    codec->CelsMain = CelsMain;
-    codec->hash     = wildcard? wildcard-name : StringHash(name);   // wildcard: size of fixed part, otherwise: hash of the method name
+// Index of the highest set bit plus 1, i.e. 0 for 0, 1 for 1, 2 for 2..3 and so on
+static int Log2Bin (CelsNum x)
+{
+    int bin = 0;
+    for (;  x > 0  &&  bin < STATS_BINS-1;  x >>= 1)
+        bin++;
+    return bin;
+}
 
-    // Initialize the codec
-    CelsResult result = codec->CelsMain (codec->self, CELS_LOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-    if (result == CELS_ERROR_NOT_IMPLEMENTED)   result = CELS_OK;
-    if (result < CELS_OK)                       --NumRegisteredCodecs;
-    return result;
+static void RecordCallbackStats (int service, CelsNum size, CelsNum nanoseconds)
+{
+    unsigned i = service - CELS_READ;
+    if (i >= (unsigned)STATS_SERVICES)  return;
+    ServiceStats* stats = &CallbackStats[i];
+    AtomicAdd64 (&stats->calls, 1);
+    AtomicAdd64 (&stats->bytes, size);
+    AtomicAdd64 (&stats->nanoseconds, nanoseconds);
+    AtomicAdd64 (&stats->size_bins[Log2Bin(size)], 1);
+    AtomicAdd64 (&stats->time_bins[Log2Bin(nanoseconds)], 1);
 }
 
-// Internal structure placed before parsed compression method
-typedef struct
+static void ResetCallbackStats()
 {
-    char zero;  // first byte of structure should be 0 in order to distinguish between parsed method structure and unparsed method string
-    CelsFunction* CodecMain;
-    void*         CodecSelf;
-    CelsFunction* CelsMain;
-    const char*   CodecName;
-} CELS_CODEC_INSTANCE;
+    memset ((void*)CallbackStats, 0, sizeof(CallbackStats));
+}
 
-const int CELS_HEADER = sizeof(CELS_CODEC_INSTANCE);
+// Callback wrapper collecting statistics about calls to the wrapped callback
+typedef struct {
+    void*          userdata;
+    CelsCallback*  callback;
+} StatsCallbackData;
 
-// Execute operation on parsed codec instance.
-// Only this function and CelsParseSplitted() deals with instance internals.
-static CelsResult CallCels (void* method, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+static CelsResult __cdecl StatsCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
 {
-    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
-    if (IS_CELS_INSTANCE_SERVICE(service)) {
-        // Run requested service on the instance
-        CelsNum result = instance->CelsMain (instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
-        if (result==CELS_ERROR_NOT_IMPLEMENTED && service==CELS_UNPARSE && instance->CodecName) {
-            // Codec lacks PARSE/UNPARSE functionality
-            if (strlen(instance->CodecName) >= outsize)
-                return CELS_ERROR_GENERAL;
-            strcpy ((char*)outbuf, instance->CodecName);
-            return CELS_OK;
-        }
-        return result;
-    } else {
-        // Run requested service on the codec that created this instance
-        return instance->CodecMain (instance->CodecSelf, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
-    }
+    StatsCallbackData* data = (StatsCallbackData*) self;
+    CelsNum start = Nanoseconds();
+    CelsResult result = data->callback (data->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    CelsNum time = Nanoseconds() - start;
+
+    // Size of request: buffer passed to the callback or, for services receiving a buffer, its size
+    CelsNum size = (service==CELS_RECEIVE_FILLED_INBUF || service==CELS_RECEIVE_EMPTY_OUTBUF)?  (result>0? result:0)
+                 : (service==CELS_PROGRESS)?  insize
+                 :  insize + outsize;
+    RecordCallbackStats (service, size, time);
+    return result;
 }
 
-// Parse method already splitted into separate parameters and save parsed method into (method,method_size) buffer.\
-// Only this function creates new codec instances.
-CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+// Append histogram to the line (buffer of size bytes) as list of "lower_bound:count" pairs like " 4K:100 64K:5"
+static void FormatHistogram (char* line, size_t size, volatile CelsNum* bins)
 {
-    const char* name = parameters[0];
-    unsigned hash = StringHash(name);
-    unsigned len = strlen(name);
-    CelsResult errcode_or_size = CELS_ERROR_GENERAL;
-    RegCodec* codec;
+    static const char SUFFIXES[] = "\0KMGTPE";
+    int i;
+    for (i=0; i<STATS_BINS; i++)
+        if (bins[i]) {
+            size_t len = strlen (line);
+            if (i == 0)  snprintf (line+len, size-len, " 0:%lld", (CelsNum)bins[i]);
+            else         snprintf (line+len, size-len, " %d%.1s:%lld", 1 << ((i-1)%10), SUFFIXES + (i-1)/10, (CelsNum)bins[i]);
+        }
+}
 
-    for (codec = RegisteredCodecs+NumRegisteredCodecs;  codec-- > RegisteredCodecs; )
+// Write text report into (outbuf,outsize) as a zero-terminated string; return its length
+static CelsResult FormatCallbackStats (char* outbuf, CelsNum outsize)
+{
+    CelsNum len = 0;
+    int i;
+    for (i=0; i<STATS_SERVICES; i++)
     {
-        // Try only registered codecs with matching name (including wildcards like "aes*")
-        int exact_name_match  =  codec->hash==hash && !strcmp(codec->name, name);   // check for exact name match
-        if (exact_name_match ||  codec->hash<=len && !strncmp(codec->name, name, codec->hash)
-                                 &&  strlen(codec->name) < codec->hash  &&  codec->name[codec->hash]=='*')
-        {
-            CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
-            *(char*)instance    = 0;
-            instance->CodecMain = codec->CelsMain;
-            instance->CodecSelf = codec->self;
-            instance->CelsMain  = codec->CelsMain;
-            instance->CodecName = NULL;
-
-            errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE,0, (void*)parameters,0,
-                                               instance+1, method_size-CELS_HEADER, ud,cb);
-
-            if (errcode_or_size == CELS_ERROR_NOT_IMPLEMENTED  &&  parameters[1] == NULL  &&  exact_name_match) {
-                // Parsing isn't implemented that means method w/o parameters
-                instance->CodecName = codec->name;   // will be used for CELS_UNPARSE if it's not supported too
-                errcode_or_size = 0;
-            }
+        ServiceStats* stats = &CallbackStats[i];
+        if (stats->calls == 0)  continue;
+        char line[2048];
+        snprintf (line, sizeof(line), "CELS_%s: %lld calls, %lld bytes, %.3f ms\n  sizes:",
+                  STATS_SERVICE_NAMES[i]? STATS_SERVICE_NAMES[i] : "?", (CelsNum)stats->calls, (CelsNum)stats->bytes, stats->nanoseconds/1e6);
+        FormatHistogram (line, sizeof(line), stats->size_bins);
+        snprintf (line+strlen(line), sizeof(line)-strlen(line), "\n  nanoseconds:");
+        FormatHistogram (line, sizeof(line), stats->time_bins);
+        snprintf (line+strlen(line), sizeof(line)-strlen(line), "\n");
 
-            if (errcode_or_size >= 0) {
-                // Allow instance to initialize itself
-                CelsResult result = CallCels (method, CELS_INITIALIZE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-                if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)
-                    return result;
-
-                // Successful parsing - errcode_or_size contains size of parsed record
-                return CELS_HEADER + errcode_or_size;
-            }
-        }
+        CelsNum line_len = strlen(line);
+        if (outbuf  &&  len + line_len < outsize)
+            memcpy (outbuf + len, line, line_len+1);
+        len += line_len;
     }
-    return errcode_or_size;   // last error code returned by CELS_PARSE
+    if (outbuf  &&  len >= outsize)
+        return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+    if (outbuf  &&  len == 0  &&  outsize > 0)
+        *outbuf = 0;
+    return len;
 }
 
-// Parse method_str and save parsed method into (method,method_size) buffer
-CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+// Print the report requested by CELS_CALLBACK_STATS environment variable
+static void ReportCallbackStats()
 {
-    // Make modifiable copy of method_str
-    char method_copy[CELS_MAX_METHOD_STRING_SIZE];  int i;
-    for (i=0;  i<CELS_MAX_METHOD_STRING_SIZE-1 && method_str[i]!=0;  i++)
-        method_copy[i] = method_str[i];
-    method_copy[i] = 0;
+    if (CallbackStatsMode != 2)  return;
+    CelsResult len = FormatCallbackStats (NULL, 0);
+    char* report = (char*) malloc (len+1);
+    if (len == 0  ||  report == NULL  ||  FormatCallbackStats (report, len+1) < CELS_OK)  {free (report);  return;}
 
-    // Split method_str into parameters delimited by ':'
-    char *parameters[CELS_MAX_METHOD_PARAMETERS];
-    SplitStr (method_copy, CELS_METHOD_PARAMETERS_DELIMITER, parameters, CELS_MAX_METHOD_PARAMETERS);
+    FILE* f = CallbackStatsFile? fopen (CallbackStatsFile, "a") : stderr;
+    if (f) {
+        fprintf (f, "CELS callback statistics:\n%s", report);
+        if (f != stderr)  fclose (f);
+    }
+    free (report);
+}
 
-    return CelsParseSplitted ((const char**) parameters, method,method_size, ud,cb);
+// Global service CELS_SET_CALLBACK_STATS: 0 disables collection, 1 enables it, 2 also prints report to stderr at CelsUnload()
+static CelsResult SetCallbackStats (CelsNum mode)
+{
+    if (mode < 0  ||  mode > 2)  return CELS_ERROR_NOT_IMPLEMENTED;
+    CallbackStatsEnabled();   // read the environment variable first, so it doesn't override the setting
+    ResetCallbackStats();
+    if (mode == 2)  CallbackStatsFile = NULL;
+    CallbackStatsMode = (long) mode;
+    return CELS_OK;
 }
 
 
 // ****************************************************************************************************************************
-// DLL loading/unloading ******************************************************************************************************
+// Host memory allocation *****************************************************************************************************
 // ****************************************************************************************************************************
 
-typedef struct {
-    void*             dll;          // dynamic library
-    char*             method_name;  // memory allocated for the library
-    CelsFunction*     CelsMain;     // CelsMain() function loaded from the library
-} RegModule;
-static RegModule* RegisteredModules = NULL;
-static int NumRegisteredModules = 0;
-static int MaxRegisteredModules = 0;
-
-CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain)
-{
-    RegModule* module = (RegModule*)  ExtendArray ((void**)&RegisteredModules, sizeof(RegModule), &NumRegisteredModules, &MaxRegisteredModules);
-    if (module==NULL) {
-        if (dll)  DllUnload(dll);
-        return CELS_ERROR_NOT_ENOUGH_MEMORY;
-    }
-    module->dll         = dll;
-    module->method_name = NULL;
-    module->CelsMain    = CelsMain;
-
-    CelsResult result = CelsMain (dll, CELS_LOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+// Default implementation of CELS_ALLOC/CELS_FREE_MEMORY callback services that application may forward to.
+// Blocks of HOST_HUGE_PAGE and larger are mapped directly from OS, trying huge pages first (or asking for transparent
+// huge pages), and preferring NUMA node of the calling thread. Smaller blocks are served by malloc.
+// All blocks are counted against the global budget set by CELS_SET_HOST_MEMORY_BUDGET.
 
-    if (result == CELS_ERROR_NOT_IMPLEMENTED)
-    {
-        module->method_name = (char*) malloc(strlen(method_name)+1);
-        if (module->method_name==NULL)  {result = CELS_ERROR_NOT_ENOUGH_MEMORY;  goto failed;}
-        strcpy (module->method_name, method_name);
-        result = CelsRegister (module->method_name, dll,CelsMain);
-    }
+const CelsNum HOST_HUGE_PAGE = 2<<20;   // Size of huge page on x86, also threshold for mapping memory directly from OS
 
-    if (result >= CELS_OK)  return result;
+static SpinLock HostMemoryLock;         // guards the variables below
+static CelsNum  HostMemoryBudget = 0;   // 0 means unlimited
+static CelsNum  HostMemoryUsed = 0,  HostMemoryPeak = 0;
 
-failed:
-    CelsMain (dll, CELS_UNLOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-    if (dll)  DllUnload(dll);
-    --NumRegisteredModules;
-    return result;
+static CelsNum HostBlockSize (CelsNum size)
+{
+    return size < HOST_HUGE_PAGE?  size : (size + HOST_HUGE_PAGE-1) / HOST_HUGE_PAGE * HOST_HUGE_PAGE;
 }
 
 #ifdef _WIN32
-#include <windows.h>
-#include <string.h>
 
-// Converts UTF-16 string to UTF-8
-static char *UTF16toUTF8 (const wchar_t *utf16, char *_utf8)
+static void* HostMapMemory (CelsNum size)
 {
-  char *utf8 = _utf8;
-  do {
-    unsigned c = utf16[0];
-    if (0xd800<=c && c<=0xdbff && 0xdc00<=utf16[1] && utf16[1]<=0xdfff)
-      c = (c - 0xd800)*0x400 + (unsigned)(*++utf16 - 0xdc00) + 0x10000;
-
-    // Now c represents full 32-bit Unicode char
-         if (c<=0x7F)   *utf8++ = c;
-    else if (c<=0x07FF) *utf8++ = 0xC0|(c>> 6)&0x1F,  *utf8++ = 0x80|(c>> 0)&0x3F;
-    else if (c<=0xFFFF) *utf8++ = 0xE0|(c>>12)&0x0F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
-    else                *utf8++ = 0xF0|(c>>18)&0x0F,  *utf8++ = 0x80|(c>>12)&0x3F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
-
-  } while (*utf16++);
-  return _utf8;
+    void* ptr = NULL;
+    SIZE_T large_page = GetLargePageMinimum();
+#if _WIN32_WINNT >= 0x0600
+    UCHAR node;
+    if (!GetNumaProcessorNode ((UCHAR)GetCurrentProcessorNumber(), &node))  node = 0;
+    // Large pages require SeLockMemoryPrivilege, so usually we fall back to ordinary ones
+    if (large_page  &&  size % large_page == 0)
+        ptr = VirtualAllocExNuma (GetCurrentProcess(), NULL, size, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE, node);
+    if (ptr == NULL)
+        ptr = VirtualAllocExNuma (GetCurrentProcess(), NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE, node);
+#else
+    if (large_page  &&  size % large_page == 0)
+        ptr = VirtualAlloc (NULL, size, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (ptr == NULL)
+        ptr = VirtualAlloc (NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+#endif
+    return ptr;
 }
 
-// Add CELS-enabled compressors from DLLs matching the wildcard
-static void RegisterCelsDlls (const wchar_t *dll_wildcard, wchar_t *path, wchar_t *basename)
+static void HostUnmapMemory (void* ptr, CelsNum size)
 {
-    // Replace basename part with "celsXX-*.dll"
-    wcscpy (basename, dll_wildcard);
-
-    // Find all celsXX-*.dll from program's directory
-    WIN32_FIND_DATAW FindData;
-    HANDLE ff = FindFirstFileW(path, &FindData);
-    BOOL found;
-    for (found = (ff!=INVALID_HANDLE_VALUE);  found;  found = FindNextFileW(ff, &FindData))
-    {
-        // Put full DLL filename into `path`
-        wcscpy (basename, FindData.cFileName);
+    VirtualFree (ptr, 0, MEM_RELEASE);
+}
 
-        // If DLL contains CelsMain() - register included codecs
-        HMODULE dll = LoadLibraryW(path);
-        CelsFunction *CelsMain = (CelsFunction*) GetProcAddress (dll, "CelsMain");
-        if (CelsMain)
-        {
-            // Register new CELS method in the global list of compression methods
-            char method_buf[MAX_PATH], *method_name;
-            UTF16toUTF8 (basename, method_buf);
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
-            // "cels-TeSt.dll" will be registered as "test" compression method
-            method_name = strchr(method_buf,'-')+1;   // skip "cels-" prefix
-            strrchr(method_name,'.')[0] = '\0';       // remove ".dll" suffix
-            strlwr(method_name);
+// Prefer NUMA node of the current CPU for pages of the block (they are allocated on the first touch)
+static void HostBindToCurrentNode (void* ptr, CelsNum size)
+{
+#if defined(SYS_getcpu) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+    const int MPOL_PREFERRED_MODE = 1,  MPOL_F_MEMS_ALLOWED_FLAG = 4;
+    static volatile int multi_node = -1;   // the process may use memory of more than one node
+    if (multi_node < 0) {
+        unsigned long allowed = 0;
+        if (syscall (SYS_get_mempolicy, NULL, &allowed, (unsigned long)(8*sizeof(allowed)), NULL, MPOL_F_MEMS_ALLOWED_FLAG) != 0)
+            allowed = 0;
+        multi_node = (allowed & (allowed-1)) != 0;
+    }
+    unsigned cpu, node;
+    if (multi_node  &&  syscall (SYS_getcpu, &cpu, &node, NULL) == 0  &&  node < 8*sizeof(unsigned long)) {
+        unsigned long nodemask = 1UL << node;
+        syscall (SYS_mbind, ptr, (unsigned long)size, MPOL_PREFERRED_MODE, &nodemask, (unsigned long)(8*sizeof(nodemask)+1), 0);
+    }
+#endif
+}
 
-            // Register included codecs
-            CelsRegisterModule (dll, method_name, CelsMain);
-        }
+static void* HostMapMemory (CelsNum size)
+{
+    void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    ptr = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if (ptr == MAP_FAILED) {
+        // No reserved huge pages: map ordinary memory aligned to huge page, so THP can back it with huge pages
+        char* base = (char*) mmap (NULL, size + HOST_HUGE_PAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)  return NULL;
+        char* aligned = base + (HOST_HUGE_PAGE - (size_t)base % HOST_HUGE_PAGE) % HOST_HUGE_PAGE;
+        if (aligned > base)                              munmap (base, aligned-base);
+        if (base + HOST_HUGE_PAGE > aligned)             munmap (aligned+size, base+HOST_HUGE_PAGE-aligned);
+        ptr = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise (ptr, size, MADV_HUGEPAGE);
+#endif
     }
-    FindClose(ff);
+    HostBindToCurrentNode (ptr, size);
+    return ptr;
 }
 
-// Add CELS-enabled compressors from celsXX-*.dll (also from clsXX-*.dll in order to allow distribution of CLS+CELS-enabled DLLs)
-CelsResult CelsLoad()
+static void HostUnmapMemory (void* ptr, CelsNum size)
 {
-    // Get program's executable/unarc.dll filename (or, more exactly, filename of module containing the CelsLoad function)
-    MEMORY_BASIC_INFORMATION mbi;
-    VirtualQuery ((void*)CelsLoad, &mbi, sizeof(MEMORY_BASIC_INFORMATION));
+    munmap (ptr, size);
+}
 
-    wchar_t path[MAX_PATH];
-    GetModuleFileNameW ((HMODULE) mbi.AllocationBase, path, MAX_PATH);
+#endif
 
-    // Replace basename part with "celsXX-*.dll"
-    wchar_t *basename = wcsrchr (path, L'\\') + 1;
-    RegisterCelsDlls (L"cls-*.dll",        path, basename);
-    RegisterCelsDlls (L"cels-*.dll",       path, basename);
-    if (sizeof(void*) == 8) {
-        RegisterCelsDlls (L"cls64-*.dll",  path, basename);
-        RegisterCelsDlls (L"cels64-*.dll", path, basename);
+// Account size bytes against the budget; negative size releases them
+static int HostMemoryCharge (CelsNum size)
+{
+    int ok = 1;
+    Lock (&HostMemoryLock);
+    if (size > 0  &&  HostMemoryBudget > 0  &&  HostMemoryUsed + size > HostMemoryBudget) {
+        ok = 0;
     } else {
-        RegisterCelsDlls (L"cls32-*.dll",  path, basename);
-        RegisterCelsDlls (L"cels32-*.dll", path, basename);
+        HostMemoryUsed += size;
+        if (HostMemoryPeak < HostMemoryUsed)  HostMemoryPeak = HostMemoryUsed;
     }
+    Unlock (&HostMemoryLock);
+    return ok;
+}
 
+// Allocate size bytes and store pointer to the block into *ptr
+CelsResult CelsHostAlloc (void** ptr, CelsNum size)
+{
+    CelsNum block_size = HostBlockSize (size);
+    *ptr = NULL;
+    if (size < 0)                           return CELS_ERROR_GENERAL;
+    if (!HostMemoryCharge (block_size))     return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    *ptr = (size < HOST_HUGE_PAGE?  malloc (size? size : 1) : HostMapMemory (block_size));
+    if (*ptr == NULL)  {HostMemoryCharge (-block_size);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
     return CELS_OK;
 }
 
-#else
-
-CelsResult CelsLoad()
+// Free block allocated by CelsHostAlloc; size should be the same as requested on allocation
+CelsResult CelsHostFree (void* ptr, CelsNum size)
 {
-    return CELS_ERROR_NOT_IMPLEMENTED;   // Non-Windows platforms aren't yet supported
+    if (ptr == NULL)  return CELS_OK;
+    CelsNum block_size = HostBlockSize (size);
+    if (size < HOST_HUGE_PAGE)  free (ptr);
+    else                        HostUnmapMemory (ptr, block_size);
+    HostMemoryCharge (-block_size);
+    return CELS_OK;
 }
 
-#endif  // _WIN32
-
-void CelsUnload()
+// Global services CELS_SET_HOST_MEMORY_BUDGET and CELS_GET_HOST_MEMORY_USED/PEAK
+static CelsResult SetHostMemoryBudget (CelsNum budget)
 {
-    // Unload codecs
-    while (NumRegisteredCodecs > 0) {
-        RegCodec *codec  =  & RegisteredCodecs[--NumRegisteredCodecs];
-        codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-    }
-    free(RegisteredCodecs);
-    RegisteredCodecs = NULL;
-    MaxRegisteredCodecs = 0;
+    if (budget < 0)  return CELS_ERROR_NOT_IMPLEMENTED;
+    Lock (&HostMemoryLock);
+    HostMemoryBudget = budget;
+    HostMemoryPeak = HostMemoryUsed;
+    Unlock (&HostMemoryLock);
+    return CELS_OK;
+}
 
-    // Unload modules
-    while (NumRegisteredModules > 0) {
-        RegModule* module = & RegisteredModules[--NumRegisteredModules];
-        if (module->CelsMain)       module->CelsMain (module->dll, CELS_UNLOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-        if (module->method_name)    free (module->method_name);
-        if (module->dll)            DllUnload (module->dll);
-    }
-    free(RegisteredModules);
-    RegisteredModules = NULL;
-    MaxRegisteredModules = 0;
+static CelsResult GetHostMemoryUsage (int peak)
+{
+    Lock (&HostMemoryLock);
+    CelsNum result = peak? HostMemoryPeak : HostMemoryUsed;
+    Unlock (&HostMemoryLock);
+    return result;
 }
 
 
 // ****************************************************************************************************************************
-// Providing actual services **************************************************************************************************
+// Shared thread pool *********************************************************************************************************
 // ****************************************************************************************************************************
 
-// Execute global service;
-// or execute service on parsed method;
-// or parse string method, execute service and optionally unparse (only for SET_PARAM services) modified method to (outbuf,outsize)
-CelsResult Cels (const void* method_str, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
-{
-    // First, serve global services
-    if (service==CELS_REGISTER) {
-        return CelsRegister ((const char*)inbuf, ud,(CelsFunction*)cb);  // Register codec with name:=inbuf, CelsMain:=cb(ud...)
-    }
-    else if (service==CELS_LOAD) {
-        return CelsLoad();
-    }
-    else if (service==CELS_UNLOAD) {
-        CelsUnload();
-        return CELS_OK;
-    }
+// Default implementation of the pool returned by CELS_GET_THREAD_POOL. It has one worker per CPU, each owning a deque of jobs:
+// jobs submitted by a worker are pushed to its own deque and popped back LIFO, idle workers steal the oldest jobs from
+// other deques, and jobs submitted by other threads go to the extra shared deque. Threads waiting for their jobs run
+// queued jobs meanwhile, so jobs may submit and wait for subjobs without deadlocks.
+// CELS_SET_MAX_CPU_LOAD limits the number of active workers, as well as CPU load reserved by block-parallel operations.
 
-    // Then, try to process it as parsed method
-    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method_str;
-    if (*(char*)instance == 0)   return CallCels (instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+const int POOL_MAX_THREADS = 64;
 
-    // And finally, parse method string, execute the service on the parsed method and unparse it back if necessary
-    char method[CELS_MAX_PARSED_METHOD_SIZE];
-    CelsResult errcode_or_size = CelsParseStr ((const char*) method_str,
-                                               service==CELS_PARSE? outbuf : method,
-                                               service==CELS_PARSE? outsize : sizeof(method),
-                                               ud, cb);
+typedef struct {
+    CelsJobFunction*  job;
+    void*             arg;
+    volatile long*    pending;
+} PoolJob;
 
-    if (errcode_or_size < CELS_OK) {
-        return errcode_or_size;  // error code
+// Ring buffer of jobs: owner pushes and pops at the bottom, thieves take from the top
+typedef struct {
+    Mutex     lock;
+    PoolJob*  jobs;
+    int       capacity, top, count;
+    void*     pool;                                 // WorkPool owning the deque
+} PoolDeque;
+
+typedef struct {
+    CelsThreadPool  api;                            // should be the first field
+    int             workers;                        // number of workers, i.e. deques owned by them
+    int             started;                        // number of successfully started threads
+    volatile long   active;                         // workers 0..active-1 may run jobs
+    volatile long   queued;                         // jobs in all deques
+    volatile long   sleepers;                       // threads waiting for wake condition variable
+    volatile long   stop;
+    PoolDeque       deque[POOL_MAX_THREADS+1];      // deque[workers] receives jobs submitted by other threads
+    Thread          thread[POOL_MAX_THREADS];
+    Mutex           lock;
+    CondVar         wake;
+} WorkPool;
+
+static WorkPool* volatile DefaultPool = NULL;
+static SpinLock  DefaultPoolLock;
+static CelsNum   MaxCpuLoad = 0;                    // 0 means all CPUs
+static volatile long CpuLoadInUse = 0;              // CPU load reserved by running block-parallel operations
+
+static CELS_THREAD_LOCAL WorkPool* CurrentWorkPool;
+static CELS_THREAD_LOCAL int       CurrentWorker;
+
+static long CpuLoadLimit()
+{
+    return MaxCpuLoad>0? (long)MaxCpuLoad : NumberOfProcessors()*100;
+}
+
+static long PoolActiveWorkers (WorkPool* pool)
+{
+    long active = (CpuLoadLimit() + 99) / 100;
+    return active < 1? 1 : active > pool->workers? pool->workers : active;
+}
+
+static int DequePush (PoolDeque* deque, PoolJob* job)
+{
+    LockMutex (&deque->lock);
+    if (deque->count == deque->capacity) {
+        int capacity = deque->capacity? deque->capacity*2 : 64,  i;
+        PoolJob* jobs = (PoolJob*) malloc (capacity * sizeof(PoolJob));
+        if (jobs == NULL)  {UnlockMutex (&deque->lock);  return 0;}
+        for (i=0; i<deque->count; i++)
+            jobs[i] = deque->jobs [(deque->top + i) % deque->capacity];
+        free (deque->jobs);
+        deque->jobs = jobs,  deque->capacity = capacity,  deque->top = 0;
     }
-    else if (service==CELS_PARSE)  {
-        // Return size of parsed method structure (the structure itself was stored to the outbuf)
-        return errcode_or_size;
+    deque->jobs [(deque->top + deque->count++) % deque->capacity] = *job;
+    UnlockMutex (&deque->lock);
+    return 1;
+}
+
+static int DequePop (PoolDeque* deque, PoolJob* job, int steal)
+{
+    int found = 0;
+    LockMutex (&deque->lock);
+    if (deque->count > 0) {
+        if (steal)  {*job = deque->jobs [deque->top];  deque->top = (deque->top + 1) % deque->capacity;}
+        else        *job = deque->jobs [(deque->top + deque->count - 1) % deque->capacity];
+        deque->count--,  found = 1;
     }
-    else {
-        int set_param  =  IS_CELS_SET_INSTANCE_PARAM_SERVICE(service);
+    UnlockMutex (&deque->lock);
+    return found;
+}
 
-        // Run requested service on the parsed method
-        CelsResult result = CallCels (method, service,subservice,
-                                      inbuf, insize,
-                                      set_param? NULL : outbuf,
-                                      set_param?    0 : outsize,
-                                      ud, cb);
+static void PoolWakeSleepers (WorkPool* pool)
+{
+    if (AtomicAdd (&pool->sleepers, 0) == 0)  return;
+    LockMutex (&pool->lock);
+    BroadcastCondVar (&pool->wake);
+    UnlockMutex (&pool->lock);
+}
 
-        // Unparse for "set parameter" services
-        if (result >= CELS_OK  &&  outbuf && outsize > 0  &&  set_param) {
-            CelsResult errcode = CallCels (method, CELS_UNPARSE,CELS_UNPARSE_FULL, NULL,0, outbuf,outsize, ud,cb);
-            if (errcode < CELS_OK)   result = errcode;
-        }
+// Find and run one queued job; me is index of own deque or -1
+static int PoolRunJob (WorkPool* pool, int me)
+{
+    PoolJob job;
+    int found = (me >= 0  &&  me < pool->workers  &&  DequePop (&pool->deque[me], &job, 0)),  i;
+    for (i=0;  !found  &&  i <= pool->workers;  i++)
+        found = DequePop (&pool->deque [(me + 1 + i) % (pool->workers + 1)], &job, 1);
+    if (!found)  return 0;
 
-        // Free any memory allocated by the parsed method. Returned error code is silently ignored.
-        CallCels (method, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
-        return result;
+    AtomicAdd (&pool->queued, -1);
+    job.job (job.arg);
+    if (AtomicAdd (job.pending, -1) == 0)
+        PoolWakeSleepers (pool);
+    return 1;
+}
+
+// Sleep until condition becomes false or the pool is stopped. Both submitters and finishing jobs wake sleepers.
+static void PoolSleep (WorkPool* pool, int (*condition) (WorkPool* pool, void* arg), void* arg)
+{
+    LockMutex (&pool->lock);
+    AtomicAdd (&pool->sleepers, 1);
+    while (!AtomicAdd (&pool->stop, 0)  &&  condition (pool, arg))
+        WaitCondVar (&pool->wake, &pool->lock);
+    AtomicAdd (&pool->sleepers, -1);
+    UnlockMutex (&pool->lock);
+}
+
+static int WorkerHasNothingToDo (WorkPool* pool, void* arg)
+{
+    return (long)(size_t)arg >= AtomicAdd (&pool->active, 0)  ||  AtomicAdd (&pool->queued, 0) == 0;
+}
+
+static int GroupIsRunning (WorkPool* pool, void* pending)
+{
+    return AtomicAdd ((volatile long*)pending, 0) != 0  &&  AtomicAdd (&pool->queued, 0) == 0;
+}
+
+static THREAD_FUNCTION PoolWorker (void* arg)
+{
+    PoolDeque* deque = (PoolDeque*) arg;
+    WorkPool* pool = CurrentWorkPool = (WorkPool*) deque->pool;
+    int me = CurrentWorker = (int)(deque - pool->deque);
+
+    while (!AtomicAdd (&pool->stop, 0)) {
+        if (me < AtomicAdd (&pool->active, 0)  &&  PoolRunJob (pool, me))  continue;
+        PoolSleep (pool, WorkerHasNothingToDo, (void*)(size_t)me);
     }
+    return THREAD_RETURN;
 }
 
-// English description for error code
-const char* CelsErrorMessage (CelsResult errcode)
+// Run job(arg) on the pool. *pending is incremented now and decremented when the job is finished
+static CelsResult __cdecl PoolSubmit (CelsThreadPool* api, CelsJobFunction* job_function, void* arg, volatile long* pending)
 {
-    if (errcode == CELS_OK)                             return "ALL RIGHT";
-    if (errcode == CELS_ERROR_GENERAL)                  return "Some error when (de)compressing";
-    if (errcode == CELS_ERROR_INVALID_COMPRESSOR)       return "Invalid compression method or parameters";
-    if (errcode == CELS_ERROR_ONLY_DECOMPRESS)          return "Program was compiled with CELS_DECOMPRESS_ONLY, so don't try to use compression functions";
-    if (errcode == CELS_ERROR_OUTBLOCK_TOO_SMALL)       return "Output block size in (de)compressMem is not enough for all output data";
-    if (errcode == CELS_ERROR_NOT_ENOUGH_MEMORY)        return "Can't allocate memory needed for (de)compression";
-    if (errcode == CELS_ERROR_READ)                     return "Error when reading data";
-    if (errcode == CELS_ERROR_BAD_COMPRESSED_DATA)      return "Data can't be decompressed";
-    if (errcode == CELS_ERROR_NOT_IMPLEMENTED)          return "Requested feature isn't supported";
-    if (errcode == CELS_ERROR_NO_MORE_DATA_REQUIRED)    return "Required part of data was already decompressed";
-    if (errcode == CELS_ERROR_OPERATION_TERMINATED)     return "Operation terminated by user";
-    if (errcode == CELS_ERROR_WRITE)                    return "Error when writing data";
-    if (errcode == CELS_ERROR_BAD_CRC)                  return "File failed CRC check";
-    if (errcode == CELS_ERROR_BAD_PASSWORD)             return "Password/keyfile failed checkcode test";
-    if (errcode == CELS_ERROR_BAD_HEADERS)              return "Archive headers are corrupted";
-    if (errcode == CELS_ERROR_INTERNAL)                 return "It should never happen: implementation error. Please report this bug to developers!";
-    else                                                return "Unknown error";
+    WorkPool* pool = (WorkPool*) api;
+    PoolJob job = {job_function, arg, pending};
+    int me = (CurrentWorkPool == pool?  CurrentWorker : pool->workers);
+    AtomicAdd (pending, 1);
+    if (!DequePush (&pool->deque[me], &job))  {AtomicAdd (pending, -1);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    AtomicAdd (&pool->queued, 1);
+    PoolWakeSleepers (pool);
+    return CELS_OK;
+}
+
+// Wait until all jobs counted by *pending are finished, running queued jobs meanwhile
+static CelsResult __cdecl PoolWait (CelsThreadPool* api, volatile long* pending)
+{
+    WorkPool* pool = (WorkPool*) api;
+    int me = (CurrentWorkPool == pool?  CurrentWorker : -1);
+    while (AtomicAdd (pending, 0) != 0) {
+        if (PoolRunJob (pool, me))  continue;
+        PoolSleep (pool, GroupIsRunning, (void*)pending);
+    }
+    return CELS_OK;
 }
 
+static void DestroyWorkPool (WorkPool* pool)
+{
+    int i;
+    LockMutex (&pool->lock);
+    AtomicAdd (&pool->stop, 1);
+    BroadcastCondVar (&pool->wake);
+    UnlockMutex (&pool->lock);
+    for (i=0; i<pool->started; i++)
+        JoinThread (pool->thread[i]);
+    for (i=0; i<=pool->workers; i++) {
+        DestroyMutex (&pool->deque[i].lock);
+        free (pool->deque[i].jobs);
+    }
+    DestroyCondVar (&pool->wake);
+    DestroyMutex (&pool->lock);
+    free (pool);
+}
+
+static WorkPool* CreateWorkPool()
+{
+    WorkPool* pool = (WorkPool*) calloc (1, sizeof(WorkPool));
+    if (pool == NULL)  return NULL;
+    int workers = NumberOfProcessors(),  i;
+    if (workers > POOL_MAX_THREADS)  workers = POOL_MAX_THREADS;
+
+    pool->api.self   = pool;
+    pool->api.Submit = PoolSubmit;
+    pool->api.Wait   = PoolWait;
+    pool->workers    = workers;
+    pool->active     = PoolActiveWorkers (pool);
+    pool->api.threads = pool->active;
+    InitMutex (&pool->lock);
+    InitCondVar (&pool->wake);
+    for (i=0; i<=workers; i++)
+        InitMutex (&pool->deque[i].lock),  pool->deque[i].pool = pool;
+    for (i=0; i<workers; i++)
+        if (StartThread (&pool->thread[pool->started], PoolWorker, &pool->deque[i]))
+            pool->started++;
+    if (pool->started == 0)  {DestroyWorkPool (pool);  return NULL;}
+    return pool;
+}
+
+// Global service CELS_SET_MAX_CPU_LOAD: limit total CPU load (100 = 1 thread) of the pool and block-parallel operations
+static CelsResult SetMaxCpuLoad (CelsNum cpu_load)
+{
+    if (cpu_load < 0)  return CELS_ERROR_NOT_IMPLEMENTED;
+    Lock (&DefaultPoolLock);
+    MaxCpuLoad = cpu_load;
+    WorkPool* pool = DefaultPool;
+    if (pool) {
+        long active = PoolActiveWorkers (pool);
+        pool->api.threads = active;
+        AtomicAdd (&pool->active, active - AtomicAdd (&pool->active, 0));
+        PoolWakeSleepers (pool);
+    }
+    Unlock (&DefaultPoolLock);
+    return CELS_OK;
+}
+
+// Pool shared by all codecs, created on the first request
+CelsThreadPool* CelsDefaultThreadPool()
+{
+    WorkPool* pool = (WorkPool*) AtomicCas ((void* volatile*)&DefaultPool, NULL, NULL);
+    if (pool == NULL) {
+        Lock (&DefaultPoolLock);
+        pool = DefaultPool;
+        if (pool == NULL)
+            AtomicCas ((void* volatile*)&DefaultPool, NULL, pool = CreateWorkPool());
+        Unlock (&DefaultPoolLock);
+    }
+    return pool? &pool->api : NULL;
+}
+
+// Stop the default pool at CelsUnload(). Codecs shouldn't use it at this moment
+static void StopDefaultThreadPool()
+{
+    Lock (&DefaultPoolLock);
+    WorkPool* pool = (WorkPool*) AtomicCas ((void* volatile*)&DefaultPool, DefaultPool, NULL);
+    if (pool)  DestroyWorkPool (pool);
+    Unlock (&DefaultPoolLock);
+}
+
+// Serve CELS_GET_THREAD_POOL request not implemented by the application
+static CelsResult ServeThreadPoolRequest (void* outbuf)
+{
+    CelsThreadPool* pool = CelsDefaultThreadPool();
+    *(CelsThreadPool**)outbuf = pool;
+    return pool? pool->threads : CELS_ERROR_NOT_ENOUGH_MEMORY;
+}
 
-// ****************************************************************************************************************************
-// Extensions (these functions aren't required for CELS functioning and use only official API,                                *
-//   so it's a sort of 3rd-party code, shipped with the library)                                                              *
-// ****************************************************************************************************************************
 
 // ****************************************************************************************************************************
-// (De)compress data from memory buffer (input) to another memory buffer (output).                                            *
-// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.                                      *
+// Adapters between read/write and buffer-sharing APIs ************************************************************************
 // ****************************************************************************************************************************
 
-// Internal structure keeping read/write buffer positions for in-memory (de)compression operations
+// Codec may exchange data either with CELS_READ/CELS_WRITE or with buffer-sharing services, and application callback
+// may implement either API too. So the framework passes to (de)compression services its own callback that forwards
+// each request to the application callback and, if the callback doesn't implement it, emulates it with another API.
+// When both sides use the same API, buffers go directly between them, otherwise the data are copied once - either between
+// the codec buffer and the application one, or by CELS_READ/CELS_WRITE into/from buffers of the pool below.
+
+const CelsNum ADAPTER_BUFFER_SIZE = 1<<20;   // Size of pool buffers lent to the codec
+const int     MAX_POOLED_BUFFERS  = 16;      // Number of free buffers kept in the pool for the next operations
+
+// Pool buffer header, followed by the buffer itself
+typedef struct PoolBuffer {
+    struct PoolBuffer *next, *prev;
+} PoolBuffer;
+
+static PoolBuffer* FreeBuffers = NULL;   // buffers available for reuse
+static int NumFreeBuffers = 0;
+static SpinLock BufferPoolLock;
+
+static char* BufferData (PoolBuffer* buf)  {return (char*)(buf+1);}
+
+static PoolBuffer* AllocBuffer()
+{
+    Lock (&BufferPoolLock);
+    PoolBuffer* buf = FreeBuffers;
+    if (buf)  FreeBuffers = buf->next,  NumFreeBuffers--;
+    Unlock (&BufferPoolLock);
+    return buf? buf : (PoolBuffer*) malloc (sizeof(PoolBuffer) + ADAPTER_BUFFER_SIZE);
+}
+
+static void FreeBuffer (PoolBuffer* buf)
+{
+    Lock (&BufferPoolLock);
+    if (NumFreeBuffers < MAX_POOLED_BUFFERS) {
+        buf->next = FreeBuffers,  FreeBuffers = buf,  NumFreeBuffers++;
+        buf = NULL;
+    }
+    Unlock (&BufferPoolLock);
+    free (buf);
+}
+
+static void FreeBufferPool()
+{
+    Lock (&BufferPoolLock);
+    while (FreeBuffers) {
+        PoolBuffer* buf = FreeBuffers;
+        FreeBuffers = buf->next;
+        free (buf);
+    }
+    NumFreeBuffers = 0;
+    Unlock (&BufferPoolLock);
+}
+
+// State of the adapter during single (de)compression operation
 typedef struct
 {
-    char    *readPtr;           // current read position in inbuf (or NULL for redirecting reads to the original callback)
-    size_t   readLeft;          // remaining bytes in the inbuf
-    char    *writePtr;          // current write position in outbuf (or NULL for redirecting writes to the original callback)
-    size_t   writeLeft;         // remaining bytes in the outbuf
-    void    *userdata;          // data passed to the original callback
-    CelsCallback* callback;     // original callback to serve all other requests
-} CelsMemBuf;
+    void*          userdata;            // data passed to the original callback
+    CelsCallback*  callback;            // original callback
+    volatile int   no_read, no_write;                       // original callback doesn't implement CELS_READ/CELS_WRITE
+    volatile int   no_shared_inbufs, no_shared_outbufs;     // original callback doesn't implement buffer-sharing input/output
 
-// Callback emulating CELS_READ/CELS_WRITE for in-memory (de)compression operations
-static CelsResult __cdecl CelsReadWriteMem (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+    char*          inbuf;               // application input buffer consumed by emulated CELS_READ
+    CelsNum        inbuf_size, inbuf_pos;
+    int            eof;                 // application has no more input data
+    char*          outbuf;              // application output buffer filled by emulated CELS_WRITE
+    CelsNum        outbuf_size, outbuf_pos;
+
+    SpinLock       lock;                // guards the list below, since buffer-sharing services may be called from multiple threads
+    PoolBuffer*    lent;                // pool buffers lent to the codec
+} CelsStreamAdapter;
+
+static CelsResult CallOriginal (CelsStreamAdapter* adapter, int service, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize)
 {
-    CelsMemBuf *membuf = (CelsMemBuf*)self;
-    if (service==CELS_READ  &&  membuf->readPtr)
-    {
-        // Copy data from readPtr to inbuf and advance the read pointer
-        size_t read_bytes = membuf->readLeft<insize ? membuf->readLeft : insize;
-        memcpy (inbuf, membuf->readPtr, read_bytes);
-        membuf->readPtr  += read_bytes;
-        membuf->readLeft -= read_bytes;
-        return read_bytes;
+    return adapter->callback (adapter->userdata, service,0, inbuf,insize, outbuf,outsize, NULL,NULL);
+}
+
+// Lend pool buffer to the codec
+static char* LendBuffer (CelsStreamAdapter* adapter)
+{
+    PoolBuffer* buf = AllocBuffer();
+    if (buf == NULL)  return NULL;
+    Lock (&adapter->lock);
+    buf->prev = NULL;
+    buf->next = adapter->lent;
+    if (adapter->lent)  adapter->lent->prev = buf;
+    adapter->lent = buf;
+    Unlock (&adapter->lock);
+    return BufferData(buf);
+}
+
+// Take back pool buffer containing ptr; return 0 if it isn't a pool buffer lent to the codec
+static int TakeBackBuffer (CelsStreamAdapter* adapter, void* ptr)
+{
+    PoolBuffer* buf;
+    Lock (&adapter->lock);
+    for (buf = adapter->lent;  buf;  buf = buf->next)
+        if (BufferData(buf) <= (char*)ptr  &&  (char*)ptr < BufferData(buf)+ADAPTER_BUFFER_SIZE)
+            break;
+    if (buf) {
+        if (buf->prev)  buf->prev->next = buf->next;  else adapter->lent = buf->next;
+        if (buf->next)  buf->next->prev = buf->prev;
     }
-    else if (service==CELS_WRITE  &&  membuf->writePtr)
-    {
-        // Copy data from outbuf to writePtr and advance the write pointer
-        if (outsize > membuf->writeLeft)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
-        memcpy (membuf->writePtr, outbuf, outsize);
-        membuf->writePtr  += outsize;
-        membuf->writeLeft -= outsize;
-        return outsize;
+    Unlock (&adapter->lock);
+    if (buf)  FreeBuffer (buf);
+    return buf != NULL;
+}
+
+// Callback passed to the codec
+static CelsResult __cdecl CelsStreamAdapterCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsStreamAdapter* adapter = (CelsStreamAdapter*) self;
+    CelsResult result;
+
+    // First, try the original callback
+    int emulated = (service==CELS_READ                  && adapter->no_read)
+                || (service==CELS_WRITE                 && adapter->no_write)
+                || (service==CELS_RECEIVE_FILLED_INBUF  && adapter->no_shared_inbufs)
+                || (service==CELS_SEND_EMPTY_INBUF      && adapter->no_shared_inbufs)
+                || (service==CELS_RECEIVE_EMPTY_OUTBUF  && adapter->no_shared_outbufs)
+                || (service==CELS_SEND_FILLED_OUTBUF    && adapter->no_shared_outbufs);
+    if (!emulated) {
+        result = adapter->callback (adapter->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        if (result != CELS_ERROR_NOT_IMPLEMENTED)  return result;
     }
-    else
+
+    switch (service)
     {
-        // All unhandled requests are passed to the original callback
-        return (membuf->callback? membuf->callback (membuf->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
-                                : CELS_ERROR_NOT_IMPLEMENTED);
+    case CELS_READ:
+        // Copy data from the application input buffers into the codec buffer
+        adapter->no_read = 1;
+        {
+            CelsNum done = 0;
+            while (done < insize)
+            {
+                if (adapter->inbuf_pos == adapter->inbuf_size) {
+                    if (done > 0)  break;     // return available data instead of waiting for the next buffer
+                    if (adapter->inbuf) {
+                        CallOriginal (adapter, CELS_SEND_EMPTY_INBUF, adapter->inbuf,adapter->inbuf_size, NULL,0);
+                        adapter->inbuf = NULL,  adapter->inbuf_size = adapter->inbuf_pos = 0;
+                    }
+                    if (adapter->eof)  break;
+                    void* buf = NULL;
+                    result = CallOriginal (adapter, CELS_RECEIVE_FILLED_INBUF, &buf,0, NULL,0);
+                    if (result < CELS_OK)  return result;
+                    if (result == 0)       {adapter->eof = 1;  break;}
+                    adapter->inbuf = (char*)buf,  adapter->inbuf_size = result,  adapter->inbuf_pos = 0;
+                }
+                CelsNum n = adapter->inbuf_size - adapter->inbuf_pos;
+                if (n > insize-done)  n = insize-done;
+                memcpy ((char*)inbuf+done, adapter->inbuf+adapter->inbuf_pos, n);
+                adapter->inbuf_pos += n,  done += n;
+            }
+            return done;
+        }
+
+    case CELS_WRITE:
+        // Copy data from the codec buffer into the application output buffers
+        adapter->no_write = 1;
+        {
+            CelsNum done = 0;
+            while (done < outsize)
+            {
+                if (adapter->outbuf_pos == adapter->outbuf_size) {
+                    if (adapter->outbuf) {
+                        result = CallOriginal (adapter, CELS_SEND_FILLED_OUTBUF, NULL,0, adapter->outbuf,adapter->outbuf_size);
+                        adapter->outbuf = NULL,  adapter->outbuf_size = adapter->outbuf_pos = 0;
+                        if (result < CELS_OK)  return result;
+                    }
+                    void* buf = NULL;
+                    result = CallOriginal (adapter, CELS_RECEIVE_EMPTY_OUTBUF, NULL,0, &buf,0);
+                    if (result < CELS_OK)  return result;
+                    if (result == 0)       return CELS_ERROR_WRITE;
+                    adapter->outbuf = (char*)buf,  adapter->outbuf_size = result,  adapter->outbuf_pos = 0;
+                }
+                CelsNum n = adapter->outbuf_size - adapter->outbuf_pos;
+                if (n > outsize-done)  n = outsize-done;
+                memcpy (adapter->outbuf+adapter->outbuf_pos, (char*)outbuf+done, n);
+                adapter->outbuf_pos += n,  done += n;
+            }
+            return done;
+        }
+
+    case CELS_RECEIVE_FILLED_INBUF:
+        // Read application data into the pool buffer and lend it to the codec
+        adapter->no_shared_inbufs = 1;
+        {
+            char* buf = LendBuffer (adapter);
+            if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            result = CallOriginal (adapter, CELS_READ, buf,ADAPTER_BUFFER_SIZE, NULL,0);
+            if (result <= 0)  {TakeBackBuffer (adapter, buf);  buf = NULL;}
+            *(void**)inbuf = buf;
+            return result;
+        }
+
+    case CELS_SEND_EMPTY_INBUF:
+        adapter->no_shared_inbufs = 1;
+        return TakeBackBuffer (adapter, inbuf)?  CELS_OK : CELS_ERROR_INTERNAL;
+
+    case CELS_RECEIVE_EMPTY_OUTBUF:
+        // Lend pool buffer to the codec
+        adapter->no_shared_outbufs = 1;
+        {
+            char* buf = LendBuffer (adapter);
+            if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            *(void**)outbuf = buf;
+            return ADAPTER_BUFFER_SIZE;
+        }
+
+    case CELS_SEND_FILLED_OUTBUF:
+        // Write the pool buffer contents to the application
+        adapter->no_shared_outbufs = 1;
+        result = (outsize > 0?  CallOriginal (adapter, CELS_WRITE, NULL,0, outbuf,outsize) : CELS_OK);
+        if (!TakeBackBuffer (adapter, outbuf)  &&  result >= CELS_OK)
+            result = CELS_ERROR_INTERNAL;
+        return result;
+
+    case CELS_READ_STREAM:
+    case CELS_WRITE_STREAM:
+        // Stream 0 is the ordinary input/output stream
+        if (subservice != 0)  return CELS_ERROR_NOT_IMPLEMENTED;
+        return CelsStreamAdapterCallback (self, service==CELS_READ_STREAM? CELS_READ : CELS_WRITE,0, inbuf,insize, outbuf,outsize, ud,cb);
+
+    case CELS_GET_THREAD_POOL:
+        return ServeThreadPoolRequest (outbuf);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
     }
 }
 
-// Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size or error_code<0.
-// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
-CelsResult CelsCompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+// Return application buffers still held by the adapter (sending partially filled output buffer only on success),
+// and take back pool buffers that the codec hasn't returned
+static CelsResult FinishStreamAdapter (CelsStreamAdapter* adapter, int success)
 {
-    CelsResult result = Cels(method, CELS_COMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
-    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
-        return result;
-    } else {
-        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
-        result = CelsCompress (method, &membuf, CelsReadWriteMem);
-        // Return error code or number of bytes written to the buffer
-        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+    CelsResult result = CELS_OK;
+    if (adapter->outbuf  &&  adapter->outbuf_pos > 0  &&  success)
+        result = CallOriginal (adapter, CELS_SEND_FILLED_OUTBUF, NULL,0, adapter->outbuf,adapter->outbuf_pos);
+    if (adapter->inbuf)
+        CallOriginal (adapter, CELS_SEND_EMPTY_INBUF, adapter->inbuf,adapter->inbuf_size, NULL,0);
+    while (adapter->lent) {
+        PoolBuffer* buf = adapter->lent;
+        adapter->lent = buf->next;
+        FreeBuffer (buf);
     }
+    return result;
 }
 
-// Decompress buffer (inbuf,insize) into buffer (outbuf,outsize) and return decompressed size or error_code<0.
-// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
-CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+// Run (de)compression service providing the codec with callback that supports both data exchange APIs
+static CelsResult CallWithStreamAdapter (CelsFunction* CelsMain, void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
 {
-    CelsResult result = Cels(method, CELS_DECOMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
-    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
-        return result;
+    CelsStreamAdapter adapter;
+    memset (&adapter, 0, sizeof(adapter));
+    adapter.userdata = ud;
+    adapter.callback = cb;
+
+    CelsResult result;
+    if (CallbackStatsEnabled()) {
+        StatsCallbackData stats = {&adapter, CelsStreamAdapterCallback};
+        result = CelsMain (self, service,subservice, inbuf,insize, outbuf,outsize, &stats,StatsCallback);
     } else {
-        CelsMemBuf membuf = {(char*)inbuf,(size_t)insize, (char*)outbuf,(size_t)outsize, ud,cb};
-        result = CelsDecompress (method, &membuf, CelsReadWriteMem);
-        // Return error code or number of bytes written to the buffer
-        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+        result = CelsMain (self, service,subservice, inbuf,insize, outbuf,outsize, &adapter,CelsStreamAdapterCallback);
+    }
+    CelsResult errcode = FinishStreamAdapter (&adapter, result >= CELS_OK);
+    return (result >= CELS_OK  &&  errcode < CELS_OK)?  errcode : result;
+}
+
+
+// ****************************************************************************************************************************
+// Method registering/parsing *************************************************************************************************
+// ****************************************************************************************************************************
+
+const unsigned REGISTRY_BUCKETS = 1024;          // Number of buckets in each hash table of the codec registry
+const unsigned NOT_WILDCARD     = (unsigned)-1;  // RegCodec::prefix_len value for ordinary (non-wildcard) codec names
+
+typedef struct RegCodec {
+    const char *name;  void* self;  CelsFunction* CelsMain;
+    unsigned hash;                      // hash of the name, or of the fixed part of wildcard name (i.e. "aes" for "aes*")
+    unsigned prefix_len;                // size of the fixed part of wildcard name, or NOT_WILDCARD
+    unsigned seq;                       // registration number: codecs registered later are tried first
+    struct RegCodec* volatile next;     // next codec in the same hash bucket (always registered earlier)
+    struct RegCodec* prev_registered;   // codec registered just before this one
+} RegCodec;
+
+// Codec registry: hash table of exact codec names plus hash table of fixed parts of wildcard names.
+// Readers traverse it without any locks. Writers are serialized by RegistryLock and publish new codec
+// by a single pointer store, so readers always see consistent bucket lists.
+typedef struct {
+    RegCodec* volatile exact  [REGISTRY_BUCKETS];           // ordinary codecs, by hash of the name
+    RegCodec* volatile prefix [REGISTRY_BUCKETS];           // wildcard codecs, by hash of the fixed part of the name
+    volatile char prefix_used [CELS_MAX_METHOD_STRING_SIZE];  // prefix_used[n]: there are wildcard codecs with n-char fixed part
+    RegCodec* last_registered;                              // list of all codecs, in reverse registration order
+    unsigned  num_registered;
+} Registry;
+
+static Registry* volatile CurrentRegistry = NULL;
+static SpinLock RegistryLock;            // serializes registry modifications (and module list too)
+static volatile long RegistryGeneration = 0;   // incremented on each registry modification, invalidating cached instances
+
+// Registry readers don't take locks, but announce themselves in the RegistryReaders[RegistryEpoch&1] counter,
+// allowing CelsUnload() to detach the registry and then wait until all its readers are gone
+static volatile long RegistryEpoch = 0;
+static volatile long RegistryReaders[2] = {0,0};
+
+static long EnterRegistry()
+{
+    long epoch = RegistryEpoch & 1;
+    AtomicAdd (&RegistryReaders[epoch], 1);   // full memory barrier: CurrentRegistry is read after announcing ourselves
+    return epoch;
+}
+
+static void LeaveRegistry (long epoch)
+{
+    AtomicAdd (&RegistryReaders[epoch], -1);
+}
+
+// Wait until all readers that may have seen the registry before it was detached are gone.
+// Each epoch flip redirects new readers to another counter, so waiting can't be starved by them.
+static void WaitForRegistryReaders()
+{
+    int i;
+    for (i=0; i<2; i++) {
+        long epoch = RegistryEpoch;
+        RegistryEpoch = epoch+1;
+        MemoryFence();
+        while (RegistryReaders[epoch&1] != 0)
+            YieldCpu();
     }
 }
+
+// Find the most recently registered codec, among codecs registered before codec number max_seq,
+// whose name is equal to the method name or is a wildcard matching the method name
+static RegCodec* FindCodec (Registry* reg, const char* name, unsigned max_seq)
+{
+    RegCodec *found = NULL, *codec;
+    unsigned hash = STRING_HASH_INIT, len;
+
+    // Try wildcard codecs with each fixed part length, computing hash of the method name prefix on the fly
+    for (len=0;  ;  hash = StringHashUpdate(hash, name[len++]))
+    {
+        if (len < CELS_MAX_METHOD_STRING_SIZE  &&  reg->prefix_used[len]) {
+            // Bucket lists are ordered by descending seq, so the first matching codec is the best one in the list
+            for (codec = reg->prefix[hash % REGISTRY_BUCKETS];  codec;  codec = codec->next)
+                if (codec->seq < max_seq  &&  codec->hash==hash  &&  codec->prefix_len==len  &&  !strncmp(codec->name, name, len)) {
+                    if (!found  ||  codec->seq > found->seq)   found = codec;
+                    break;
+                }
+        }
+        if (name[len] == '\0')  break;
+    }
+
+    // Now hash contains hash of the entire method name
+    for (codec = reg->exact[hash % REGISTRY_BUCKETS];  codec;  codec = codec->next)
+        if (codec->seq < max_seq  &&  codec->hash==hash  &&  !strcmp(codec->name, name)) {
+            if (!found  ||  codec->seq > found->seq)   found = codec;
+            break;
+        }
+
+    return found;
+}
+
+CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain)
+{
+    // Create new record for the list of registered codecs
+    RegCodec* codec = (RegCodec*) malloc (sizeof(RegCodec));
+    if (codec==NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    // Fill the record
+    if (*name=='\0')  name = "*";
+    const char* wildcard = strchr(name,'*');  // points to a first char after fixed part of wildcard name
+    codec->name       = name;
+    codec->self       = ud;
+    codec->CelsMain   = CelsMain;
+    codec->prefix_len = wildcard? wildcard-name : NOT_WILDCARD;
+    codec->hash       = StringHash (name, wildcard? wildcard-name : strlen(name));
+
+    // Initialize the codec prior to making it visible to other threads
+    CelsResult result = codec->CelsMain (codec->self, CELS_LOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)   result = CELS_OK;
+    if (result < CELS_OK)                       {free(codec);  return result;}
+
+    Lock (&RegistryLock);
+    Registry* reg = CurrentRegistry;
+    if (reg == NULL) {
+        reg = (Registry*) calloc (1, sizeof(Registry));
+        if (reg == NULL) {
+            Unlock (&RegistryLock);
+            codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+            free(codec);
+            return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        }
+        MemoryFence();
+        CurrentRegistry = reg;
+    }
+
+    // Add the record to the registry
+    RegCodec* volatile* bucket = (wildcard? reg->prefix : reg->exact) + codec->hash % REGISTRY_BUCKETS;
+    codec->seq             = ++reg->num_registered;
+    codec->next            = *bucket;
+    codec->prev_registered = reg->last_registered;
+    reg->last_registered   = codec;
+    if (wildcard  &&  codec->prefix_len < CELS_MAX_METHOD_STRING_SIZE)
+        reg->prefix_used[codec->prefix_len] = 1;
+    MemoryFence();
+    *bucket = codec;    // publish the codec
+    AtomicAdd (&RegistryGeneration, 1);
+    Unlock (&RegistryLock);
+
+    return result;
+}
+
+// Internal structure placed before parsed compression method
+typedef struct
+{
+    char zero;  // first byte of structure should be 0 in order to distinguish between parsed method structure and unparsed method string
+    CelsFunction* CodecMain;
+    void*         CodecSelf;
+    CelsFunction* CelsMain;
+    const char*   CodecName;
+} CELS_CODEC_INSTANCE;
+
+const int CELS_HEADER = sizeof(CELS_CODEC_INSTANCE);
+
+// Serve CELS_COMPRESS_BATCH/CELS_DECOMPRESS_BATCH for codecs lacking them by (de)compressing items one by one
+static CelsResult BatchFallback (void* method, int service, CelsBatchItem* items, CelsNum num_items, void* ud, CelsCallback* cb)
+{
+    CelsResult errcode = CELS_OK;
+    CelsNum i;
+    for (i=0; i<num_items; i++) {
+        CelsBatchItem* item = &items[i];
+        item->result = (service==CELS_COMPRESS_BATCH)
+                          ?  CelsCompressMem   (method, item->inbuf,item->insize, item->outbuf,item->outsize, ud,cb)
+                          :  CelsDecompressMem (method, item->inbuf,item->insize, item->outbuf,item->outsize, ud,cb);
+        if (item->result < CELS_OK  &&  errcode == CELS_OK)
+            errcode = item->result;
+    }
+    return errcode;
+}
+
+// Serve CELS_GET_ALL_PARAMS for codecs lacking it by calling individual getters on the instance
+static CelsResult GetAllParamsFallback (void* method, CelsParams* params, CelsNum size)
+{
+    static const struct {int service;  size_t offset;} getters[] = {
+        {CELS_GET_COMPRESSION_MEMORY,           offsetof(CelsParams, compression_memory)},
+        {CELS_GET_DECOMPRESSION_MEMORY,         offsetof(CelsParams, decompression_memory)},
+        {CELS_GET_MINIMUM_COMPRESSION_MEMORY,   offsetof(CelsParams, minimum_compression_memory)},
+        {CELS_GET_MINIMUM_DECOMPRESSION_MEMORY, offsetof(CelsParams, minimum_decompression_memory)},
+        {CELS_GET_DICTIONARY_SIZE,              offsetof(CelsParams, dictionary_size)},
+        {CELS_GET_BLOCKSIZE,                    offsetof(CelsParams, blocksize)},
+        {CELS_GET_COMPRESSION_CPU_LOAD,         offsetof(CelsParams, compression_cpu_load)},
+        {CELS_GET_DECOMPRESSION_CPU_LOAD,       offsetof(CelsParams, decompression_cpu_load)},
+        {CELS_GET_MINIMAL_INPUT_SIZE,           offsetof(CelsParams, minimal_input_size)},
+        {CELS_GET_CACHING,                      offsetof(CelsParams, caching)},
+        {CELS_GET_NUM_INPUT_STREAMS,            offsetof(CelsParams, num_input_streams)},
+        {CELS_GET_NUM_OUTPUT_STREAMS,           offsetof(CelsParams, num_output_streams)},
+    };
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+    size_t i;
+
+    // Fill only fields present in the caller's version of the structure
+    for (i=0; i < sizeof(getters)/sizeof(*getters); i++)
+        if (getters[i].offset + sizeof(CelsResult) <= (size_t)size)
+            *(CelsResult*)((char*)params + getters[i].offset) = instance->CelsMain (instance+1, getters[i].service,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    return CELS_OK;
+}
+
+// Execute operation on parsed codec instance.
+// Only this function and CelsParseSplitted() deals with instance internals.
+static CelsResult CallCels (void* method, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+    if ((service==CELS_COMPRESS || service==CELS_DECOMPRESS)  &&  cb) {
+        // Let codec and application use different data exchange APIs
+        return CallWithStreamAdapter (instance->CelsMain, instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    }
+    else if (IS_CELS_INSTANCE_SERVICE(service)) {
+        // Run requested service on the instance
+        CelsNum result = instance->CelsMain (instance+1, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        if (result==CELS_ERROR_NOT_IMPLEMENTED && (service==CELS_COMPRESS_BATCH || service==CELS_DECOMPRESS_BATCH)) {
+            // Codec can't process batch at once
+            return BatchFallback (method, service, (CelsBatchItem*)inbuf, insize, ud,cb);
+        }
+        if (result==CELS_ERROR_NOT_IMPLEMENTED && service==CELS_GET_ALL_PARAMS) {
+            // Codec can't report all parameters at once
+            if (outbuf==NULL  ||  outsize < (CelsNum)sizeof(CelsNum))
+                return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+            return GetAllParamsFallback (method, (CelsParams*)outbuf, outsize);
+        }
+        if (result==CELS_ERROR_NOT_IMPLEMENTED && service==CELS_UNPARSE && instance->CodecName) {
+            // Codec lacks PARSE/UNPARSE functionality
+            if (strlen(instance->CodecName) >= outsize)
+                return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, instance->CodecName);
+            return CELS_OK;
+        }
+        return result;
+    } else {
+        // Run requested service on the codec that created this instance
+        return instance->CodecMain (instance->CodecSelf, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    }
+}
+
+#ifdef _WIN32
+static int LoadPendingModules (const char* method_name)  {return 0;}   // Windows CelsLoad() loads all DLLs immediately
+#else
+static int LoadPendingModules (const char* method_name);   // Load libraries found by CelsLoad() on first use; returns number of loaded libraries
+#endif
+
+// Parse method already splitted into separate parameters and save parsed method into (method,method_size) buffer.\
+// Only this function creates new codec instances.
+CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    const char* name = parameters[0];
+    CelsResult errcode_or_size = CELS_ERROR_GENERAL;
+    RegCodec* codec;
+
+    // Libraries found by CelsLoad() but not yet loaded: load the ones named after the method now
+    LoadPendingModules (name);
+
+    long epoch = EnterRegistry();
+    Registry* reg = CurrentRegistry;
+    unsigned max_seq = (unsigned)-1;
+
+    // Try registered codecs with matching name (including wildcards like "aes*"), most recently registered first
+    while (reg  &&  (codec = FindCodec (reg, name, max_seq)) != NULL)
+    {
+        max_seq = codec->seq;
+        int exact_name_match = (codec->prefix_len == NOT_WILDCARD);
+
+        CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method;
+        *(char*)instance    = 0;
+        instance->CodecMain = codec->CelsMain;
+        instance->CodecSelf = codec->self;
+        instance->CelsMain  = codec->CelsMain;
+        instance->CodecName = NULL;
+
+        errcode_or_size = codec->CelsMain (codec->self, CELS_PARSE,0, (void*)parameters,0,
+                                           instance+1, method_size-CELS_HEADER, ud,cb);
+
+        if (errcode_or_size == CELS_ERROR_NOT_IMPLEMENTED  &&  parameters[1] == NULL  &&  exact_name_match) {
+            // Parsing isn't implemented that means method w/o parameters
+            instance->CodecName = codec->name;   // will be used for CELS_UNPARSE if it's not supported too
+            errcode_or_size = 0;
+        }
+
+        if (errcode_or_size >= 0) {
+            // Allow instance to initialize itself
+            CelsResult result = CallCels (method, CELS_INITIALIZE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+            LeaveRegistry (epoch);
+            if (result < CELS_OK  &&  result != CELS_ERROR_NOT_IMPLEMENTED)
+                return result;
+
+            // Successful parsing - errcode_or_size contains size of parsed record
+            return CELS_HEADER + errcode_or_size;
+        }
+    }
+    LeaveRegistry (epoch);
+    return errcode_or_size;   // last error code returned by CELS_PARSE
+}
+
+// Parse method_str and save parsed method into (method,method_size) buffer
+CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb)
+{
+    // Make modifiable copy of method_str
+    char method_copy[CELS_MAX_METHOD_STRING_SIZE];  int i;
+    for (i=0;  i<CELS_MAX_METHOD_STRING_SIZE-1 && method_str[i]!=0;  i++)
+        method_copy[i] = method_str[i];
+    method_copy[i] = 0;
+
+    // Split method_str into parameters delimited by ':'
+    char *parameters[CELS_MAX_METHOD_PARAMETERS];
+    SplitStr (method_copy, CELS_METHOD_PARAMETERS_DELIMITER, parameters, CELS_MAX_METHOD_PARAMETERS);
+
+    return CelsParseSplitted ((const char**) parameters, method,method_size, ud,cb);
+}
+
+
+// ****************************************************************************************************************************
+// Cache of parsed instances **************************************************************************************************
+// ****************************************************************************************************************************
+
+// Each thread keeps a few recently parsed instances, so repeated parameter queries and CELS_UNPARSE calls with the same method
+// string skip CelsParseStr()+CELS_FREE. Data operations aren't cached: they may modify the instance, allocate its buffers
+// and bind it to the caller's callback, so each one still gets a freshly parsed instance. The cache key is the method string exactly as CelsParseStr() sees it
+// (i.e. truncated to CELS_MAX_METHOD_STRING_SIZE-1 chars) - computing the true canonical form would require the parsing
+// we are trying to avoid. Any registry modification invalidates all cached instances.
+const int INSTANCE_CACHE_SIZE = 16;   // Number of parsed instances cached by each thread
+
+typedef struct {
+    char*    method_str;   // cache key (malloc'ed), or NULL for empty entry
+    unsigned hash;         // hash of the key
+    unsigned last_used;    // InstanceCache::clock value at the last use of the entry
+    long     generation;   // RegistryGeneration at the time of parsing
+    int      busy;         // entry is used by the running Cels() call, so nobody else may touch it
+    struct InstanceCache* cache;   // cache owning the entry (a fiber may release it on another thread)
+    CelsNum  instance [CELS_MAX_PARSED_METHOD_SIZE / sizeof(CelsNum)];   // parsed method
+} CachedInstance;
+
+typedef struct InstanceCache {
+    SpinLock lock;                          // taken by the owner thread and by threads flushing all caches
+    unsigned clock;                         // incremented on each cache lookup
+    CelsNum  hits, misses;
+    struct InstanceCache *next, **pprev;    // list of caches of all threads
+    CachedInstance entry [INSTANCE_CACHE_SIZE];
+} InstanceCache;
+
+static InstanceCache* AllInstanceCaches = NULL;
+static SpinLock  InstanceCachesLock;                    // guards the list above, retired counters and key creation
+static CelsNum   RetiredHits = 0, RetiredMisses = 0;    // counters collected from caches of finished threads
+static ThreadKey InstanceCacheKey;
+static volatile int InstanceCacheKeyCreated = 0;        // 1: key created, -1: key can't be created
+
+// Free the cached instance. Caller should own the entry, i.e. either mark it busy or hold lock of the cache with non-busy entry
+static void FreeCachedInstance (CachedInstance* entry)
+{
+    if (entry->method_str == NULL)  return;
+    CallCels (entry->instance, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    free (entry->method_str);
+    entry->method_str = NULL;
+}
+
+// Free all cached instances that aren't in use
+static void FlushInstanceCache (InstanceCache* cache)
+{
+    int i;
+    Lock (&cache->lock);
+    for (i=0; i<INSTANCE_CACHE_SIZE; i++)
+        if (!cache->entry[i].busy)
+            FreeCachedInstance (&cache->entry[i]);
+    Unlock (&cache->lock);
+}
+
+static void FlushAllInstanceCaches()
+{
+    InstanceCache* cache;
+    Lock (&InstanceCachesLock);
+    for (cache = AllInstanceCaches;  cache;  cache = cache->next)
+        FlushInstanceCache (cache);
+    Unlock (&InstanceCachesLock);
+}
+
+// Sum of hit or miss counters over caches of all threads, including already finished ones
+static CelsNum InstanceCacheCounter (int misses)
+{
+    InstanceCache* cache;
+    Lock (&InstanceCachesLock);
+    CelsNum total = misses? RetiredMisses : RetiredHits;
+    for (cache = AllInstanceCaches;  cache;  cache = cache->next)
+        total += misses? cache->misses : cache->hits;
+    Unlock (&InstanceCachesLock);
+    return total;
+}
+
+// Called on thread exit
+static void THREAD_KEY_DESTRUCTOR DestroyInstanceCache (void* ptr)
+{
+    InstanceCache* cache = (InstanceCache*) ptr;
+    if (cache == NULL)  return;
+
+    Lock (&InstanceCachesLock);
+    *cache->pprev = cache->next;
+    if (cache->next)  cache->next->pprev = cache->pprev;
+    RetiredHits   += cache->hits;
+    RetiredMisses += cache->misses;
+    Unlock (&InstanceCachesLock);
+
+    int i;
+    for (i=0; i<INSTANCE_CACHE_SIZE; i++)
+        FreeCachedInstance (&cache->entry[i]);
+    free (cache);
+}
+
+// Return cache of the current thread, creating it on the first use
+static InstanceCache* GetInstanceCache()
+{
+    if (InstanceCacheKeyCreated == 0) {
+        Lock (&InstanceCachesLock);
+        if (InstanceCacheKeyCreated == 0) {
+            int created = CreateThreadKey (&InstanceCacheKey, DestroyInstanceCache);
+            MemoryFence();
+            InstanceCacheKeyCreated = created? 1 : -1;
+        }
+        Unlock (&InstanceCachesLock);
+    }
+    if (InstanceCacheKeyCreated < 0)  return NULL;
+
+    InstanceCache* cache = (InstanceCache*) GetThreadKey (InstanceCacheKey);
+    if (cache == NULL) {
+        cache = (InstanceCache*) calloc (1, sizeof(InstanceCache));
+        if (cache == NULL)  return NULL;
+
+        Lock (&InstanceCachesLock);
+        cache->next  = AllInstanceCaches;
+        cache->pprev = &AllInstanceCaches;
+        if (AllInstanceCaches)  AllInstanceCaches->pprev = &cache->next;
+        AllInstanceCaches = cache;
+        Unlock (&InstanceCachesLock);
+
+        SetThreadKey (InstanceCacheKey, cache);
+    }
+    return cache;
+}
+
+// Return cached instance for the method string, parsing it on cache miss, and mark the instance busy.
+// Return NULL if the method should be served without cache (this includes parsing errors - the uncached path will report them)
+static CachedInstance* AcquireCachedInstance (const char* method_str)
+{
+    InstanceCache* cache = GetInstanceCache();
+    if (cache == NULL)  return NULL;
+
+    unsigned len = 0;
+    while (len < CELS_MAX_METHOD_STRING_SIZE-1  &&  method_str[len])  len++;
+    unsigned hash = StringHash (method_str, len);
+    long generation = RegistryGeneration;
+    CachedInstance *entry, *victim = NULL;
+    unsigned victim_age = 0;
+    int i;
+
+    Lock (&cache->lock);
+    cache->clock++;
+    for (i=0; i<INSTANCE_CACHE_SIZE; i++)
+    {
+        entry = &cache->entry[i];
+        if (entry->busy)  continue;
+        int valid = (entry->method_str  &&  entry->generation == generation);
+        if (valid  &&  entry->hash == hash  &&  !strncmp (entry->method_str, method_str, len)  &&  entry->method_str[len] == '\0') {
+            entry->busy      = 1;
+            entry->cache     = cache;
+            entry->last_used = cache->clock;
+            cache->hits++;
+            Unlock (&cache->lock);
+            return entry;
+        }
+        // Replace empty/invalidated entry or, if there are none, the least recently used one
+        unsigned age = valid? entry->last_used : 0;
+        if (victim == NULL  ||  age < victim_age)
+            victim = entry,  victim_age = age;
+    }
+    cache->misses++;
+    if (victim == NULL)  {Unlock (&cache->lock);  return NULL;}   // all entries are used by nested Cels() calls
+    victim->busy      = 1;
+    victim->cache     = cache;
+    victim->last_used = cache->clock;
+    Unlock (&cache->lock);
+
+    // Now we own the entry, so it can be modified without lock.
+    // The instance outlives this call, so it's parsed without the caller's callback, like it's freed
+    FreeCachedInstance (victim);
+    char* key = (char*) malloc (len+1);
+    if (key == NULL  ||  CelsParseStr (method_str, victim->instance, sizeof(victim->instance), NULL,(CelsCallback*)Cels) < CELS_OK) {
+        free (key);
+        Lock (&cache->lock);
+        victim->busy = 0;
+        Unlock (&cache->lock);
+        return NULL;
+    }
+    memcpy (key, method_str, len);
+    key[len] = '\0';
+    victim->method_str = key;
+    victim->hash       = hash;
+    victim->generation = generation;
+    return victim;
+}
+
+// Services that don't modify the instance and don't run the data through it
+static int IsCachedService (int service)
+{
+    if (service == CELS_GET_NAMED_SERVICE)  return 0;
+    return service == CELS_UNPARSE  ||  (service&0xFF000000)==0x01000000  ||  (service&0xFF000000)==0x02000000;
+}
+
+static void ReleaseCachedInstance (CachedInstance* entry)
+{
+    // Instance invalidated while it was running can't be reused, so free it immediately
+    if (entry->generation != RegistryGeneration)
+        FreeCachedInstance (entry);
+
+    InstanceCache* cache = entry->cache;
+    Lock (&cache->lock);
+    entry->busy = 0;
+    Unlock (&cache->lock);
+}
+
+
+// ****************************************************************************************************************************
+// Pool of warm instances *****************************************************************************************************
+// ****************************************************************************************************************************
+
+// Instances handed out by CelsAcquireInstance() are shared by all threads and have caching enabled, so codec memory
+// (f.e. large dictionaries) is allocated once per instance rather than once per operation. Instances are looked up by
+// the method string used to acquire them last time and, if it doesn't match, by canonical method string computed
+// after parsing. Idle instances are dropped, least recently used first, when memory of idle caching instances exceeds the limit.
+const CelsNum DEFAULT_INSTANCE_POOL_MEMORY = (CelsNum)1 << 30;
+
+typedef struct PooledInstance {
+    struct PooledInstance *next, **pprev;   // list of all pooled instances
+    char*    method_str;    // string passed to the last CelsAcquireInstance() call returning this instance
+    char*    canonical;     // canonical method string
+    CelsNum  memory;        // memory kept by the instance between operations (0 if codec doesn't support caching)
+    long     generation;    // RegistryGeneration at the time of parsing
+    int      busy;          // instance is handed out to the application
+    unsigned last_used;     // InstancePoolClock value at the last release
+    CelsNum  instance [CELS_MAX_PARSED_METHOD_SIZE / sizeof(CelsNum)];   // parsed method
+} PooledInstance;
+
+static PooledInstance* InstancePool = NULL;
+static SpinLock InstancePoolLock;             // guards the list above and the variables below
+static unsigned InstancePoolClock = 0;
+static CelsNum  InstancePoolMemory = DEFAULT_INSTANCE_POOL_MEMORY;
+
+static PooledInstance* PooledInstanceOf (void* instance)
+{
+    return (PooledInstance*) ((char*)instance - offsetof(PooledInstance,instance));
+}
+
+static void UnlinkPooledInstance (PooledInstance* p)
+{
+    *p->pprev = p->next;
+    if (p->next)  p->next->pprev = p->pprev;
+}
+
+static void FreePooledInstance (PooledInstance* p)
+{
+    CallCels (p->instance, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    free (p->method_str);
+    free (p->canonical);
+    free (p);
+}
+
+// Unlink idle instances (all or only invalidated ones, or LRU ones exceeding the memory limit) into the list of instances to free
+static PooledInstance* TrimInstancePool (int all)
+{
+    PooledInstance *p, *next, *freed = NULL;
+    CelsNum idle_memory = 0;
+    for (p = InstancePool;  p;  p = next) {
+        next = p->next;
+        if (p->busy)  continue;
+        if (all  ||  p->generation != RegistryGeneration) {
+            UnlinkPooledInstance (p);
+            p->next = freed,  freed = p;
+        } else {
+            idle_memory += p->memory;
+        }
+    }
+    while (idle_memory > InstancePoolMemory) {
+        PooledInstance* lru = NULL;
+        for (p = InstancePool;  p;  p = p->next)
+            if (!p->busy  &&  p->memory  &&  (lru == NULL  ||  (int)(p->last_used - lru->last_used) < 0))
+                lru = p;
+        UnlinkPooledInstance (lru);
+        idle_memory -= lru->memory;
+        lru->next = freed,  freed = lru;
+    }
+    return freed;
+}
+
+static void FreePooledInstances (PooledInstance* freed)
+{
+    while (freed) {
+        PooledInstance* p = freed;
+        freed = p->next;
+        FreePooledInstance (p);
+    }
+}
+
+// Free all pooled instances that aren't in use
+static void FlushInstancePool()
+{
+    Lock (&InstancePoolLock);
+    PooledInstance* freed = TrimInstancePool (1);
+    Unlock (&InstancePoolLock);
+    FreePooledInstances (freed);
+}
+
+// Global service CELS_SET_INSTANCE_POOL_MEMORY
+static CelsResult SetInstancePoolMemory (CelsNum memory)
+{
+    if (memory < 0)  return CELS_ERROR_NOT_IMPLEMENTED;
+    Lock (&InstancePoolLock);
+    InstancePoolMemory = memory;
+    PooledInstance* freed = TrimInstancePool (0);
+    Unlock (&InstancePoolLock);
+    FreePooledInstances (freed);
+    return CELS_OK;
+}
+
+// Find idle instance with the given method string (or canonical string, if by_canonical), and mark it busy.
+// Should be called with InstancePoolLock held
+static PooledInstance* FindPooledInstance (const char* key, int by_canonical)
+{
+    PooledInstance* p;
+    for (p = InstancePool;  p;  p = p->next)
+        if (!p->busy  &&  p->generation == RegistryGeneration  &&  !strcmp (by_canonical? p->canonical : p->method_str, key)) {
+            p->busy = 1;
+            return p;
+        }
+    return NULL;
+}
+
+// Hand out parsed and initialized instance of the method with caching enabled; it should be returned by CelsReleaseInstance()
+CelsResult CelsAcquireInstance (const char* method_str, void** instance)
+{
+    // Fast path: instance acquired with the same string before
+    Lock (&InstancePoolLock);
+    PooledInstance* p = FindPooledInstance (method_str, 0);
+    Unlock (&InstancePoolLock);
+    if (p)  {*instance = p->instance;  return CELS_OK;}
+
+    // Parse the method and find its canonical form
+    PooledInstance* parsed = (PooledInstance*) calloc (1, sizeof(PooledInstance));
+    if (parsed == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    parsed->generation = RegistryGeneration;
+    CelsResult errcode = CelsParseStr (method_str, parsed->instance, sizeof(parsed->instance), NULL,NULL);
+    if (errcode < CELS_OK)  {free (parsed);  return errcode;}
+
+    char canonical [CELS_MAX_METHOD_STRING_SIZE];
+    errcode = CallCels (parsed->instance, CELS_UNPARSE,CELS_UNPARSE_FULL, NULL,0, canonical,sizeof(canonical), NULL,NULL);
+    parsed->method_str = strdup (method_str);
+    parsed->canonical  = strdup (canonical);
+    if (errcode < CELS_OK  ||  parsed->method_str == NULL  ||  parsed->canonical == NULL) {
+        FreePooledInstance (parsed);
+        return errcode < CELS_OK? errcode : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Reuse idle instance of the same canonical method, remembering the new string for the fast path
+    Lock (&InstancePoolLock);
+    p = FindPooledInstance (canonical, 1);
+    if (p) {
+        char* old_str = p->method_str;
+        p->method_str = parsed->method_str,  parsed->method_str = old_str;
+        Unlock (&InstancePoolLock);
+        FreePooledInstance (parsed);
+        *instance = p->instance;
+        return CELS_OK;
+    }
+    parsed->busy  = 1;
+    parsed->next  = InstancePool;
+    parsed->pprev = &InstancePool;
+    if (InstancePool)  InstancePool->pprev = &parsed->next;
+    InstancePool = parsed;
+    Unlock (&InstancePoolLock);
+
+    // Enable caching and estimate memory it will keep; codecs not supporting caching just save us parsing time,
+    // and instances of codecs not reporting their memory requirements aren't limited by the pool memory
+    CallCels (parsed->instance, CELS_SET_CACHING,0, NULL,1, NULL,0, NULL,NULL);
+    if (CallCels (parsed->instance, CELS_GET_CACHING,0, NULL,0, NULL,0, NULL,NULL) > 0) {
+        CelsResult cmem = CallCels (parsed->instance, CELS_GET_COMPRESSION_MEMORY,  0, NULL,0, NULL,0, NULL,NULL);
+        CelsResult dmem = CallCels (parsed->instance, CELS_GET_DECOMPRESSION_MEMORY,0, NULL,0, NULL,0, NULL,NULL);
+        parsed->memory = (cmem > dmem? cmem : dmem > 0? dmem : 0);
+    }
+    *instance = parsed->instance;
+    return CELS_OK;
+}
+
+// Return instance acquired by CelsAcquireInstance() to the pool
+CelsResult CelsReleaseInstance (void* instance)
+{
+    PooledInstance* p = PooledInstanceOf (instance);
+    Lock (&InstancePoolLock);
+    p->busy = 0;
+    p->last_used = ++InstancePoolClock;
+    PooledInstance* freed = TrimInstancePool (0);
+    Unlock (&InstancePoolLock);
+    FreePooledInstances (freed);
+    return CELS_OK;
+}
+
+
+// Built-in codecs are registered by CelsLoad(), and registered again after CelsUnload()
+static int BuiltinCodecsRegistered = 0;
+static void RegisterBuiltinCodecs();
+
+
+// ****************************************************************************************************************************
+// DLL loading/unloading ******************************************************************************************************
+// ****************************************************************************************************************************
+
+typedef struct {
+    void*             dll;          // dynamic library
+    char*             method_name;  // memory allocated for the library
+    CelsFunction*     CelsMain;     // CelsMain() function loaded from the library
+} RegModule;
+static RegModule* RegisteredModules = NULL;
+static int NumRegisteredModules = 0;
+static int MaxRegisteredModules = 0;
+
+CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain)
+{
+    // The record is allocated first, so codecs registered by the module can always be unloaded with it
+    Lock (&RegistryLock);
+    RegModule* module = (RegModule*)  ExtendArray ((void**)&RegisteredModules, sizeof(RegModule), &NumRegisteredModules, &MaxRegisteredModules);
+    if (module==NULL) {
+        Unlock (&RegistryLock);
+        if (dll)  DllUnload(dll);
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    int index = (int)(module - RegisteredModules);
+    module->dll         = NULL;     // filled on success, so CelsUnload() skips the record until then
+    module->method_name = NULL;
+    module->CelsMain    = NULL;
+    Unlock (&RegistryLock);
+
+    // Module initialization may take long and parse methods itself, so it runs without the lock
+    char* name = NULL;
+    CelsResult result = CelsMain (dll, CELS_LOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)
+    {
+        name = (char*) malloc(strlen(method_name)+1);
+        if (name==NULL)  result = CELS_ERROR_NOT_ENOUGH_MEMORY;
+        else             strcpy (name, method_name),  result = CelsRegister (name, dll,CelsMain);
+    }
+
+    Lock (&RegistryLock);
+    if (result >= CELS_OK  &&  index < NumRegisteredModules) {
+        module = &RegisteredModules[index];
+        module->dll         = dll;
+        module->method_name = name;
+        module->CelsMain    = CelsMain;
+        Unlock (&RegistryLock);
+        return result;
+    }
+    Unlock (&RegistryLock);
+
+    if (result >= CELS_OK)  return result;     // CelsUnload() was called meanwhile
+    free (name);
+    CelsMain (dll, CELS_UNLOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+    if (dll)  DllUnload(dll);
+    return result;
+}
+
+#ifdef _WIN32
+#include <windows.h>
+#include <string.h>
+
+// Converts UTF-16 string to UTF-8
+static char *UTF16toUTF8 (const wchar_t *utf16, char *_utf8)
+{
+  char *utf8 = _utf8;
+  do {
+    unsigned c = utf16[0];
+    if (0xd800<=c && c<=0xdbff && 0xdc00<=utf16[1] && utf16[1]<=0xdfff)
+      c = (c - 0xd800)*0x400 + (unsigned)(*++utf16 - 0xdc00) + 0x10000;
+
+    // Now c represents full 32-bit Unicode char
+         if (c<=0x7F)   *utf8++ = c;
+    else if (c<=0x07FF) *utf8++ = 0xC0|(c>> 6)&0x1F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+    else if (c<=0xFFFF) *utf8++ = 0xE0|(c>>12)&0x0F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+    else                *utf8++ = 0xF0|(c>>18)&0x0F,  *utf8++ = 0x80|(c>>12)&0x3F,  *utf8++ = 0x80|(c>> 6)&0x3F,  *utf8++ = 0x80|(c>> 0)&0x3F;
+
+  } while (*utf16++);
+  return _utf8;
+}
+
+// Add CELS-enabled compressors from DLLs matching the wildcard
+static void RegisterCelsDlls (const wchar_t *dll_wildcard, wchar_t *path, wchar_t *basename)
+{
+    // Replace basename part with "celsXX-*.dll"
+    wcscpy (basename, dll_wildcard);
+
+    // Find all celsXX-*.dll from program's directory
+    WIN32_FIND_DATAW FindData;
+    HANDLE ff = FindFirstFileW(path, &FindData);
+    BOOL found;
+    for (found = (ff!=INVALID_HANDLE_VALUE);  found;  found = FindNextFileW(ff, &FindData))
+    {
+        // Put full DLL filename into `path`
+        wcscpy (basename, FindData.cFileName);
+
+        // If DLL contains CelsMain() - register included codecs
+        HMODULE dll = LoadLibraryW(path);
+        CelsFunction *CelsMain = (CelsFunction*) GetProcAddress (dll, "CelsMain");
+        if (CelsMain)
+        {
+            // Register new CELS method in the global list of compression methods
+            char method_buf[MAX_PATH], *method_name;
+            UTF16toUTF8 (basename, method_buf);
+
+            // "cels-TeSt.dll" will be registered as "test" compression method
+            method_name = strchr(method_buf,'-')+1;   // skip "cels-" prefix
+            strrchr(method_name,'.')[0] = '\0';       // remove ".dll" suffix
+            strlwr(method_name);
+
+            // Register included codecs
+            CelsRegisterModule (dll, method_name, CelsMain);
+        }
+    }
+    FindClose(ff);
+}
+
+// Add CELS-enabled compressors from celsXX-*.dll (also from clsXX-*.dll in order to allow distribution of CLS+CELS-enabled DLLs)
+CelsResult CelsLoad()
+{
+    RegisterBuiltinCodecs();
+
+    // Get program's executable/unarc.dll filename (or, more exactly, filename of module containing the CelsLoad function)
+    MEMORY_BASIC_INFORMATION mbi;
+    VirtualQuery ((void*)CelsLoad, &mbi, sizeof(MEMORY_BASIC_INFORMATION));
+
+    wchar_t path[MAX_PATH];
+    GetModuleFileNameW ((HMODULE) mbi.AllocationBase, path, MAX_PATH);
+
+    // Replace basename part with "celsXX-*.dll"
+    wchar_t *basename = wcsrchr (path, L'\\') + 1;
+    RegisterCelsDlls (L"cls-*.dll",        path, basename);
+    RegisterCelsDlls (L"cels-*.dll",       path, basename);
+    if (sizeof(void*) == 8) {
+        RegisterCelsDlls (L"cls64-*.dll",  path, basename);
+        RegisterCelsDlls (L"cels64-*.dll", path, basename);
+    } else {
+        RegisterCelsDlls (L"cls32-*.dll",  path, basename);
+        RegisterCelsDlls (L"cels32-*.dll", path, basename);
+    }
+
+    return CELS_OK;
+}
+
+#else
+#include <dirent.h>
+#include <ctype.h>
+
+#ifdef __APPLE__
+#define DLL_SUFFIX ".dylib"
+#else
+#define DLL_SUFFIX ".so"
+#endif
+
+// Dynamic libraries found by CelsLoad() but not yet loaded
+typedef struct {
+    char* path;           // full filename of the library
+    char* method_name;    // method name derived from the filename (placed in the same memory block as the path)
+    void* loader;         // &ThreadTag of the thread loading the library right now, or NULL
+    int   loaded;         // library was already loaded, so CelsLoad() shouldn't add it again
+} PendingModule;
+static PendingModule* PendingModules = NULL;
+static int NumPendingModules = 0;
+static int MaxPendingModules = 0;
+static volatile int NumUnloadedModules = 0;   // pending modules with loaded==0, including the ones being loaded
+static int NumLoadingModules = 0;             // pending modules with loader!=NULL
+
+// The list of pending modules is guarded by its own mutex, held only for short list operations. Libraries are
+// loaded without any lock, so dlopen() and module initialization don't block threads parsing other methods;
+// a thread needing the library that another thread is loading waits on ModuleLoaded.
+static Mutex   ModuleListMutex;
+static CondVar ModuleLoaded;
+static pthread_once_t ModuleListOnce = PTHREAD_ONCE_INIT;
+static void InitModuleList()        {InitMutex (&ModuleListMutex);  InitCondVar (&ModuleLoaded);}
+static void LockModuleList()        {pthread_once (&ModuleListOnce, InitModuleList);  LockMutex (&ModuleListMutex);}
+static void UnlockModuleList()      {UnlockMutex (&ModuleListMutex);}
+
+// Load the library and register its codecs
+static void LoadModule (const char* path, const char* method_name)
+{
+    void* dll = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+    if (dll == NULL)  return;
+    CelsFunction *CelsMain = (CelsFunction*) dlsym (dll, "CelsMain");
+    if (CelsMain)
+        CelsRegisterModule (dll, method_name, CelsMain);
+    else
+        DllUnload (dll);
+}
+
+// Does the library named after lib_name serve the method? Besides the exact name, "cels-aes.so" is expected
+// to serve "aes-256" and other methods starting with its name, since it may register wildcard codecs like "aes*"
+static int ModuleServesMethod (const char* lib_name, const char* method_name)
+{
+    size_t len = strlen (lib_name), i;
+    if (len == 0)  return 0;
+    for (i=0; i<len; i++)
+        if (tolower ((unsigned char) method_name[i]) != lib_name[i])  return 0;   // also stops at the end of method_name
+    return 1;
+}
+
+// Load pending libraries serving the method
+static int LoadPendingModules (const char* method_name)
+{
+    if (NumUnloadedModules == 0)  return 0;   // fast path without locking
+    LockModuleList();
+    int i, loaded = 0;
+    for (i=0; i < NumPendingModules; i++) {
+        PendingModule* module = &PendingModules[i];
+        if (module->loaded  ||  !ModuleServesMethod (module->method_name, method_name))  continue;
+        if (module->loader == &ThreadTag)  continue;     // recursive call from the initialization of this library
+        if (module->loader) {
+            // Another thread loads the library: wait until its codecs are registered
+            while (i < NumPendingModules  &&  !PendingModules[i].loaded)
+                WaitCondVar (&ModuleLoaded, &ModuleListMutex);
+            continue;
+        }
+
+        // Claim the library and load it without the lock. Its names stay valid, since CelsUnload() waits for loading libraries
+        module->loader = &ThreadTag;
+        NumLoadingModules++;
+        const char *path = module->path,  *name = module->method_name;
+        UnlockModuleList();
+        LoadModule (path, name);
+        loaded++;
+        LockModuleList();
+        PendingModules[i].loader = NULL;
+        PendingModules[i].loaded = 1;
+        NumUnloadedModules--;
+        NumLoadingModules--;
+        BroadcastCondVar (&ModuleLoaded);
+    }
+    UnlockModuleList();
+    return loaded;
+}
+
+// Remember CELS-enabled libraries with filenames "{dll_prefix}*.so" from the directory
+static void FindCelsDlls (const char *dll_prefix, const char *dir)
+{
+    DIR* d = opendir (dir);
+    if (d == NULL)  return;
+
+    struct dirent* entry;
+    size_t prefix_len = strlen(dll_prefix),  suffix_len = strlen(DLL_SUFFIX),  dir_len = strlen(dir);
+    while ((entry = readdir(d)) != NULL)
+    {
+        const char* filename = entry->d_name;
+        size_t len = strlen(filename);
+        if (len <= prefix_len+suffix_len  ||  strncmp (filename, dll_prefix, prefix_len)  ||  strcmp (filename+len-suffix_len, DLL_SUFFIX))
+            continue;
+
+        // "cels-TeSt.so" will be registered as "test" compression method
+        size_t name_len = len - prefix_len - suffix_len;
+        char* path = (char*) malloc (dir_len + 1 + len + 1 + name_len + 1);
+        if (path == NULL)  break;
+        char* method_name = path + dir_len + 1 + len + 1;
+        sprintf (path, "%s/%s", dir, filename);
+        size_t i;
+        for (i=0; i<name_len; i++)
+            method_name[i] = tolower ((unsigned char) filename[prefix_len+i]);
+        method_name[name_len] = '\0';
+
+        // Repeated CelsLoad() calls find the same libraries again
+        LockModuleList();
+        int j, known = 0;
+        for (j=0; j < NumPendingModules; j++)
+            if (!strcmp (PendingModules[j].path, path))  known = 1;
+        PendingModule* module = known? NULL : (PendingModule*)  ExtendArray ((void**)&PendingModules, sizeof(PendingModule), &NumPendingModules, &MaxPendingModules);
+        if (module)  module->path = path,  module->method_name = method_name,  module->loader = NULL,  module->loaded = 0,  NumUnloadedModules++;
+        UnlockModuleList();
+        if (module == NULL)  free(path);
+        if (module == NULL  &&  !known)  break;
+    }
+    closedir (d);
+}
+
+// Find CELS-enabled libraries cels-*.so (also cls-*.so in order to allow distribution of CLS+CELS-enabled libraries).
+// They are actually loaded only when CelsParseSplitted() needs them, so unused codecs don't slow down the program startup.
+CelsResult CelsLoad()
+{
+    RegisterBuiltinCodecs();
+
+    // Get directory of the program's executable (or, more exactly, of the module containing the CelsLoad function)
+    Dl_info info;
+    if (!dladdr ((void*)CelsLoad, &info)  ||  info.dli_fname == NULL)
+        return CELS_ERROR_GENERAL;
+
+    char dir[4096];
+    const char* slash = strrchr (info.dli_fname, '/');
+    if (slash == NULL)                      strcpy (dir, ".");
+    else if (slash-info.dli_fname >= 4096)  return CELS_ERROR_GENERAL;
+    else                                    {memcpy (dir, info.dli_fname, slash-info.dli_fname);  dir[slash-info.dli_fname] = '\0';}
+    if (dir[0] == '\0')                     strcpy (dir, "/");
+
+    FindCelsDlls ("cls-",        dir);
+    FindCelsDlls ("cels-",       dir);
+    if (sizeof(void*) == 8) {
+        FindCelsDlls ("cls64-",  dir);
+        FindCelsDlls ("cels64-", dir);
+    } else {
+        FindCelsDlls ("cls32-",  dir);
+        FindCelsDlls ("cels32-", dir);
+    }
+
+    return CELS_OK;
+}
+
+#endif  // _WIN32
+
+void CelsUnload()
+{
+#ifndef _WIN32
+    // Forget libraries that weren't loaded, so running CelsParseSplitted() calls can't load them anymore.
+    // Libraries being loaded are waited for without RegistryLock, since they register their codecs
+    LockModuleList();
+    while (NumLoadingModules > 0)
+        WaitCondVar (&ModuleLoaded, &ModuleListMutex);
+    while (NumPendingModules > 0)
+        free (PendingModules[--NumPendingModules].path);
+    free(PendingModules);
+    PendingModules = NULL;
+    MaxPendingModules = 0;
+    NumUnloadedModules = 0;
+    BroadcastCondVar (&ModuleLoaded);
+    UnlockModuleList();
+#endif
+
+    Lock (&RegistryLock);
+
+    // Invalidate cached instances and free those not in use while their codecs are still here
+    AtomicAdd (&RegistryGeneration, 1);
+    FlushAllInstanceCaches();
+    FlushInstancePool();
+    BuiltinCodecsRegistered = 0;
+
+    // Detach the registry from new readers and wait until already running CelsParseSplitted() calls are finished.
+    // The lock is released while waiting, since these calls may take it for nested parsing
+    Registry* reg = CurrentRegistry;
+    CurrentRegistry = NULL;
+    Unlock (&RegistryLock);
+    WaitForRegistryReaders();
+    Lock (&RegistryLock);
+    StopDefaultThreadPool();
+
+    // Unload codecs
+    while (reg  &&  reg->last_registered) {
+        RegCodec *codec = reg->last_registered;
+        reg->last_registered = codec->prev_registered;
+        codec->CelsMain (codec->self, CELS_UNLOAD_CODEC,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        free(codec);
+    }
+    free(reg);
+
+    // Unload modules
+    while (NumRegisteredModules > 0) {
+        RegModule* module = & RegisteredModules[--NumRegisteredModules];
+        if (module->CelsMain)       module->CelsMain (module->dll, CELS_UNLOAD_MODULE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        if (module->method_name)    free (module->method_name);
+        if (module->dll)            DllUnload (module->dll);
+    }
+    free(RegisteredModules);
+    RegisteredModules = NULL;
+    MaxRegisteredModules = 0;
+    FreeBufferPool();
+    ReportCallbackStats();
+
+    Unlock (&RegistryLock);
+}
+
+
+// ****************************************************************************************************************************
+// Providing actual services **************************************************************************************************
+// ****************************************************************************************************************************
+
+// Execute global service;
+// or execute service on parsed method;
+// or execute service on the cached instance parsed from the same string;
+// or parse string method, execute service and optionally unparse (only for SET_PARAM services) modified method to (outbuf,outsize)
+CelsResult Cels (const void* method_str, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    // First, serve global services
+    if (service==CELS_REGISTER) {
+        return CelsRegister ((const char*)inbuf, ud,(CelsFunction*)cb);  // Register codec with name:=inbuf, CelsMain:=cb(ud...)
+    }
+    else if (service==CELS_LOAD) {
+        return CelsLoad();
+    }
+    else if (service==CELS_UNLOAD) {
+        CelsUnload();
+        return CELS_OK;
+    }
+    else if (service==CELS_GET_INSTANCE_CACHE_HITS  ||  service==CELS_GET_INSTANCE_CACHE_MISSES) {
+        return InstanceCacheCounter (service==CELS_GET_INSTANCE_CACHE_MISSES);
+    }
+    else if (service==CELS_FLUSH_INSTANCE_CACHE) {
+        FlushAllInstanceCaches();
+        FlushInstancePool();
+        return CELS_OK;
+    }
+    else if (service==CELS_SET_INSTANCE_POOL_MEMORY) {
+        return SetInstancePoolMemory (subservice);
+    }
+    else if (service==CELS_SET_HOST_MEMORY_BUDGET) {
+        return SetHostMemoryBudget (subservice);
+    }
+    else if (service==CELS_GET_HOST_MEMORY_USED  ||  service==CELS_GET_HOST_MEMORY_PEAK) {
+        return GetHostMemoryUsage (service==CELS_GET_HOST_MEMORY_PEAK);
+    }
+    else if (service==CELS_SET_MAX_CPU_LOAD) {
+        return SetMaxCpuLoad (subservice);
+    }
+    else if (service==CELS_SET_CALLBACK_STATS) {
+        return SetCallbackStats (subservice);
+    }
+    else if (service==CELS_GET_CALLBACK_STATS) {
+        return FormatCallbackStats ((char*)outbuf, outsize);
+    }
+
+    // Then, try to process it as parsed method
+    CELS_CODEC_INSTANCE* instance = (CELS_CODEC_INSTANCE*) method_str;
+    if (*(char*)instance == 0)   return CallCels (instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+
+    // Then, try to execute the service on the instance cached by the current thread.
+    // Only parameter getters and unparsing are cached, other services are served only by the code below.
+    if (IsCachedService(service)) {
+        CachedInstance* cached = AcquireCachedInstance ((const char*) method_str);
+        if (cached) {
+            CelsResult result = CallCels (cached->instance, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+            ReleaseCachedInstance (cached);
+            return result;
+        }
+    }
+
+    // And finally, parse method string, execute the service on the parsed method and unparse it back if necessary
+    char method[CELS_MAX_PARSED_METHOD_SIZE];
+    CelsResult errcode_or_size = CelsParseStr ((const char*) method_str,
+                                               service==CELS_PARSE? outbuf : method,
+                                               service==CELS_PARSE? outsize : sizeof(method),
+                                               ud, cb);
+
+    if (errcode_or_size < CELS_OK) {
+        return errcode_or_size;  // error code
+    }
+    else if (service==CELS_PARSE)  {
+        // Return size of parsed method structure (the structure itself was stored to the outbuf)
+        return errcode_or_size;
+    }
+    else {
+        int set_param  =  IS_CELS_SET_INSTANCE_PARAM_SERVICE(service);
+
+        // Run requested service on the parsed method
+        CelsResult result = CallCels (method, service,subservice,
+                                      inbuf, insize,
+                                      set_param? NULL : outbuf,
+                                      set_param?    0 : outsize,
+                                      ud, cb);
+
+        // Unparse for "set parameter" services
+        if (result >= CELS_OK  &&  outbuf && outsize > 0  &&  set_param) {
+            CelsResult errcode = CallCels (method, CELS_UNPARSE,CELS_UNPARSE_FULL, NULL,0, outbuf,outsize, ud,cb);
+            if (errcode < CELS_OK)   result = errcode;
+        }
+
+        // Free any memory allocated by the parsed method. Returned error code is silently ignored.
+        CallCels (method, CELS_FREE,0, NULL,0, NULL,0, NULL,(CelsCallback*)Cels);
+        return result;
+    }
+}
+
+// English description for error code
+const char* CelsErrorMessage (CelsResult errcode)
+{
+    if (errcode == CELS_OK)                             return "ALL RIGHT";
+    if (errcode == CELS_ERROR_GENERAL)                  return "Some error when (de)compressing";
+    if (errcode == CELS_ERROR_INVALID_COMPRESSOR)       return "Invalid compression method or parameters";
+    if (errcode == CELS_ERROR_ONLY_DECOMPRESS)          return "Program was compiled with CELS_DECOMPRESS_ONLY, so don't try to use compression functions";
+    if (errcode == CELS_ERROR_OUTBLOCK_TOO_SMALL)       return "Output block size in (de)compressMem is not enough for all output data";
+    if (errcode == CELS_ERROR_NOT_ENOUGH_MEMORY)        return "Can't allocate memory needed for (de)compression";
+    if (errcode == CELS_ERROR_READ)                     return "Error when reading data";
+    if (errcode == CELS_ERROR_BAD_COMPRESSED_DATA)      return "Data can't be decompressed";
+    if (errcode == CELS_ERROR_NOT_IMPLEMENTED)          return "Requested feature isn't supported";
+    if (errcode == CELS_ERROR_NO_MORE_DATA_REQUIRED)    return "Required part of data was already decompressed";
+    if (errcode == CELS_ERROR_OPERATION_TERMINATED)     return "Operation terminated by user";
+    if (errcode == CELS_ERROR_WRITE)                    return "Error when writing data";
+    if (errcode == CELS_ERROR_BAD_CRC)                  return "File failed CRC check";
+    if (errcode == CELS_ERROR_BAD_PASSWORD)             return "Password/keyfile failed checkcode test";
+    if (errcode == CELS_ERROR_BAD_HEADERS)              return "Archive headers are corrupted";
+    if (errcode == CELS_ERROR_INTERNAL)                 return "It should never happen: implementation error. Please report this bug to developers!";
+    if (errcode == CELS_ERROR_WOULD_BLOCK)              return "Request can't be served right now";
+    else                                                return "Unknown error";
+}
+
+
+// ****************************************************************************************************************************
+// Extensions (these functions aren't required for CELS functioning and use only official API,                                *
+//   so it's a sort of 3rd-party code, shipped with the library)                                                              *
+// ****************************************************************************************************************************
+
+// ****************************************************************************************************************************
+// (De)compress data from memory buffer (input) to another memory buffer (output).                                            *
+// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.                                      *
+// ****************************************************************************************************************************
+
+const CelsNum MEM_TEMP_BUFFER_SIZE = 1<<20;   // Size of temporary output buffers lent to the codec
+
+// Temporary output buffer header, followed by the buffer itself
+typedef struct MemTempBuf
+{
+    struct MemTempBuf *next;    // next buffer in the list
+    CelsNum   size;             // amount of data in the buffer sent back by the codec
+} MemTempBuf;
+
+// Internal structure keeping read/write buffer positions for in-memory (de)compression operations
+typedef struct
+{
+    char    *readPtr;           // current read position in inbuf (or NULL for redirecting reads to the original callback)
+    size_t   readLeft;          // remaining bytes in the inbuf
+    char    *writePtr;          // current write position in outbuf (or NULL for redirecting writes to the original callback)
+    size_t   writeLeft;         // remaining bytes in the outbuf
+    void    *userdata;          // data passed to the original callback
+    CelsCallback* callback;     // original callback to serve all other requests
+
+    // Buffer-sharing services lend to the codec the rest of outbuf starting at writePtr.
+    // Until it's sent back, additional output buffers are allocated temporarily.
+    char       *lentOutbuf;     // == writePtr when the rest of outbuf is lent to the codec, otherwise NULL
+    MemTempBuf *tempBufs;       // temporary buffers lent to the codec
+    MemTempBuf *queued;         // temporary buffers sent back before lentOutbuf, i.e. whose data precede the lentOutbuf contents
+    size_t      queuedSize;     // total size of data in the queued buffers
+    SpinLock    lock;           // buffer-sharing services may be called from multiple threads
+} CelsMemBuf;
+
+static char* MemTempBufData (MemTempBuf* buf)  {return (char*)(buf+1);}
+
+// Start in-memory operation on (inbuf,insize) and (outbuf,outsize), passing other requests to the original callback
+static void MemBufInit (CelsMemBuf *membuf, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    memset (membuf, 0, sizeof(*membuf));
+    membuf->readPtr   = (char*) inbuf;
+    membuf->readLeft  = (size_t) insize;
+    membuf->writePtr  = (char*) outbuf;
+    membuf->writeLeft = (size_t) outsize;
+    membuf->userdata  = ud;
+    membuf->callback  = cb;
+}
+
+// Find temporary buffer containing ptr in the list and remove it from the list
+static MemTempBuf* MemTempBufExtract (MemTempBuf** list, void* ptr)
+{
+    for (;  *list;  list = &(*list)->next)
+    {
+        MemTempBuf* buf = *list;
+        if (MemTempBufData(buf) <= (char*)ptr  &&  (char*)ptr < MemTempBufData(buf)+MEM_TEMP_BUFFER_SIZE) {
+            *list = buf->next;
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+// Append data to the outbuf
+static CelsResult MemBufWrite (CelsMemBuf *membuf, void* data, size_t size)
+{
+    if (size > membuf->writeLeft)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+    memcpy (membuf->writePtr, data, size);
+    membuf->writePtr  += size;
+    membuf->writeLeft -= size;
+    return size;
+}
+
+// Free temporary buffers left after the operation
+static void MemBufFree (CelsMemBuf *membuf)
+{
+    MemTempBuf* lists[2] = {membuf->tempBufs, membuf->queued};
+    int i;
+    for (i=0; i<2; i++)
+        while (lists[i]) {
+            MemTempBuf* buf = lists[i];
+            lists[i] = buf->next;
+            free (buf);
+        }
+}
+
+// Callback emulating CELS_READ/CELS_WRITE and buffer-sharing services for in-memory (de)compression operations
+static CelsResult __cdecl CelsReadWriteMem (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsMemBuf *membuf = (CelsMemBuf*)self;
+    if (service==CELS_READ  &&  membuf->readPtr)
+    {
+        // Copy data from readPtr to inbuf and advance the read pointer
+        size_t read_bytes = membuf->readLeft<insize ? membuf->readLeft : insize;
+        memcpy (inbuf, membuf->readPtr, read_bytes);
+        membuf->readPtr  += read_bytes;
+        membuf->readLeft -= read_bytes;
+        return read_bytes;
+    }
+    else if (service==CELS_WRITE  &&  membuf->writePtr)
+    {
+        // Copy data from outbuf to writePtr and advance the write pointer
+        if (membuf->lentOutbuf)  return CELS_ERROR_GENERAL;   // can't mix with buffer-sharing output
+        return MemBufWrite (membuf, outbuf, outsize);
+    }
+    else if (service==CELS_RECEIVE_FILLED_INBUF  &&  membuf->readPtr)
+    {
+        // Lend the rest of inbuf to the codec
+        size_t read_bytes = membuf->readLeft;
+        *(void**)inbuf = read_bytes? membuf->readPtr : NULL;
+        membuf->readPtr  += read_bytes;
+        membuf->readLeft -= read_bytes;
+        return read_bytes;
+    }
+    else if (service==CELS_SEND_EMPTY_INBUF  &&  membuf->readPtr)
+    {
+        return CELS_OK;   // it's a part of inbuf, nothing to free
+    }
+    else if (service==CELS_RECEIVE_EMPTY_OUTBUF  &&  membuf->writePtr)
+    {
+        Lock (&membuf->lock);
+        if (membuf->lentOutbuf == NULL) {
+            // Lend the rest of outbuf to the codec
+            membuf->lentOutbuf = membuf->writePtr;
+            *(void**)outbuf = membuf->writePtr;
+            Unlock (&membuf->lock);
+            return membuf->writeLeft;
+        }
+        Unlock (&membuf->lock);
+
+        // The rest of outbuf is already lent, so lend a temporary buffer
+        MemTempBuf* buf = (MemTempBuf*) malloc (sizeof(MemTempBuf) + MEM_TEMP_BUFFER_SIZE);
+        if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        Lock (&membuf->lock);
+        buf->next = membuf->tempBufs;
+        membuf->tempBufs = buf;
+        Unlock (&membuf->lock);
+        *(void**)outbuf = MemTempBufData(buf);
+        return MEM_TEMP_BUFFER_SIZE;
+    }
+    else if (service==CELS_SEND_FILLED_OUTBUF  &&  membuf->writePtr)
+    {
+        CelsResult result = CELS_OK;
+        Lock (&membuf->lock);
+        if (membuf->lentOutbuf  &&  outbuf == membuf->lentOutbuf) {
+            // Data are already in place, unless there are queued data that should precede them
+            if (membuf->queuedSize + outsize > membuf->writeLeft) {
+                result = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+            } else {
+                if (membuf->queuedSize > 0) {
+                    memmove (membuf->writePtr + membuf->queuedSize, membuf->writePtr, outsize);
+                    while (membuf->queued) {
+                        MemTempBuf* buf = membuf->queued;
+                        membuf->queued = buf->next;
+                        MemBufWrite (membuf, MemTempBufData(buf), buf->size);
+                        free (buf);
+                    }
+                    membuf->queuedSize = 0;
+                }
+                membuf->writePtr  += outsize;
+                membuf->writeLeft -= outsize;
+            }
+            membuf->lentOutbuf = NULL;
+        } else {
+            MemTempBuf* buf = MemTempBufExtract (&membuf->tempBufs, outbuf);
+            if (buf == NULL) {
+                result = CELS_ERROR_INTERNAL;
+            } else if (membuf->lentOutbuf) {
+                // Keep the data until the lent part of outbuf is sent back
+                MemTempBuf** tail = &membuf->queued;
+                while (*tail)  tail = &(*tail)->next;
+                memmove (MemTempBufData(buf), outbuf, outsize);
+                buf->size = outsize;
+                buf->next = NULL;
+                *tail = buf;
+                membuf->queuedSize += outsize;
+            } else {
+                result = MemBufWrite (membuf, outbuf, outsize);
+                free (buf);
+            }
+        }
+        Unlock (&membuf->lock);
+        return result<CELS_OK? result : CELS_OK;
+    }
+    else
+    {
+        // All unhandled requests are passed to the original callback
+        CelsResult result = (membuf->callback? membuf->callback (membuf->userdata, service,subservice, inbuf,insize, outbuf,outsize, ud,cb)
+                                             : CELS_ERROR_NOT_IMPLEMENTED);
+        if (result == CELS_ERROR_NOT_IMPLEMENTED  &&  service == CELS_GET_THREAD_POOL)
+            result = ServeThreadPoolRequest (outbuf);
+        return result;
+    }
+}
+
+// Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size or error_code<0.
+// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
+CelsResult CelsCompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CelsResult result = Cels(method, CELS_COMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
+    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
+        return result;
+    } else {
+        CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+        result = CelsCompress (method, &membuf, CelsReadWriteMem);
+        MemBufFree (&membuf);
+        // Return error code or number of bytes written to the buffer
+        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+    }
+}
+
+// Decompress buffer (inbuf,insize) into buffer (outbuf,outsize) and return decompressed size or error_code<0.
+// When inbuf and/or outbuf is NULL, read/write data via CELS_READ/CELS_WRITE callbacks.
+CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CelsResult result = Cels(method, CELS_DECOMPRESS,0, inbuf,insize, outbuf,outsize, ud,cb);
+    if (result != CELS_ERROR_NOT_IMPLEMENTED) {
+        return result;
+    } else {
+        CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+        result = CelsDecompress (method, &membuf, CelsReadWriteMem);
+        MemBufFree (&membuf);
+        // Return error code or number of bytes written to the buffer
+        return result<CELS_OK ? result : outsize-membuf.writeLeft;
+    }
+}
+
+
+// ****************************************************************************************************************************
+// Order-0 entropy estimation and automatic storing of incompressible data. CelsCompressAuto() output format: 1 byte          *
+// AUTO_STORED followed by original data, or 1 byte AUTO_COMPRESSED followed by data compressed with the method.             *
+// ****************************************************************************************************************************
+
+const CelsNum ENTROPY_WINDOW_SIZE   = 4096;      // Large buffers are estimated by ENTROPY_MAX_WINDOWS windows of this size,
+const int     ENTROPY_MAX_WINDOWS   = 64;        //   spread evenly over the buffer
+const CelsNum AUTO_SAMPLE_SIZE      = 256<<10;   // Prefix of streamed input estimated prior to choosing compression or storing
+const char    AUTO_STORED           = 0;
+const char    AUTO_COMPRESSED       = 1;
+
+// Count bytes into four histograms, so that increments of the same counter by consecutive bytes don't wait for each other
+static void CountBytes (const unsigned char* p, CelsNum size, unsigned counts[4][256])
+{
+    CelsNum i;
+    for (i=0;  i+4 <= size;  i+=4) {
+        counts[0][p[i]]++;
+        counts[1][p[i+1]]++;
+        counts[2][p[i+2]]++;
+        counts[3][p[i+3]]++;
+    }
+    for (;  i < size;  i++)
+        counts[0][p[i]]++;
+}
+
+// Order-0 entropy of the buffer, in percents of 8 bits/byte (100 means that data are incompressible by order-0 coder)
+double CelsOrder0Entropy (const void* buf, CelsNum size)
+{
+    const unsigned char* p = (const unsigned char*) buf;
+    unsigned counts[4][256];
+    memset (counts, 0, sizeof(counts));
+    int i;
+    if (size <= ENTROPY_WINDOW_SIZE * ENTROPY_MAX_WINDOWS) {
+        CountBytes (p, size, counts);
+    } else {
+        CelsNum step = (size - ENTROPY_WINDOW_SIZE) / (ENTROPY_MAX_WINDOWS-1);
+        for (i=0; i<ENTROPY_MAX_WINDOWS; i++)
+            CountBytes (p + i*step, ENTROPY_WINDOW_SIZE, counts);
+    }
+
+    // entropy = sum(-c*log2(c/total)) = total*log2(total) - sum(c*log2(c))
+    double total = 0, sum = 0;
+    for (i=0; i<256; i++) {
+        unsigned c = counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+        if (c)  total += c,  sum += c * log2((double)c);
+    }
+    return total>0?  (total*log2(total) - sum) / (8*total) * 100  :  0;
+}
+
+// Callback for compression of streamed input: serves input from the already read prefix, then from the membuf
+typedef struct {
+    CelsMemBuf*  membuf;
+    char*        prefix;
+    CelsNum      prefix_size, prefix_pos;
+} AutoStream;
+
+static CelsResult __cdecl AutoCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    AutoStream* s = (AutoStream*) self;
+    CelsNum left = s->prefix_size - s->prefix_pos;
+    if (service==CELS_READ  &&  left > 0) {
+        if (left > insize)  left = insize;
+        memcpy (inbuf, s->prefix + s->prefix_pos, left);
+        s->prefix_pos += left;
+        return left;
+    }
+    else if (service==CELS_RECEIVE_FILLED_INBUF  &&  left > 0) {
+        *(void**)inbuf = s->prefix + s->prefix_pos;
+        s->prefix_pos += left;
+        return left;
+    }
+    else if (service==CELS_SEND_EMPTY_INBUF  &&  s->prefix <= (char*)inbuf  &&  (char*)inbuf < s->prefix + s->prefix_size) {
+        return CELS_OK;
+    }
+    return CelsReadWriteMem (s->membuf, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+// Read from the membuf as much as possible into the buffer, returning number of bytes read or error code
+static CelsResult AutoRead (CelsMemBuf* membuf, char* buf, CelsNum size)
+{
+    CelsNum total = 0;
+    while (total < size) {
+        CelsResult result = CelsReadWriteMem (membuf, CELS_READ,0, buf+total,size-total, NULL,0, NULL,NULL);
+        if (result < CELS_OK)  return result;
+        if (result == 0)  break;
+        total += result;
+    }
+    return total;
+}
+
+static CelsResult AutoWrite (CelsMemBuf* membuf, const void* buf, CelsNum size)
+{
+    return size>0?  CelsReadWriteMem (membuf, CELS_WRITE,0, NULL,0, (void*)buf,size, NULL,NULL) : CELS_OK;
+}
+
+// Copy the rest of input to output, using buf as temporary buffer
+static CelsResult AutoCopy (CelsMemBuf* membuf, char* buf, CelsNum size)
+{
+    for (;;) {
+        CelsResult result = AutoRead (membuf, buf, size);
+        if (result <= 0)  return result;
+        result = AutoWrite (membuf, buf, result);
+        if (result < CELS_OK)  return result;
+    }
+}
+
+// Compress data with the method, or store them if their order-0 entropy is higher than ratio percents (f.e. 99).
+// When inbuf is NULL, only the first AUTO_SAMPLE_SIZE bytes of input are estimated
+CelsResult CelsCompressAuto (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, double ratio, void* ud, CelsCallback* cb)
+{
+    if (inbuf  &&  outbuf) {
+        if (outsize < 1)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        if (CelsOrder0Entropy (inbuf, insize) > ratio) {
+            if (insize >= outsize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+            *(char*)outbuf = AUTO_STORED;
+            memcpy ((char*)outbuf+1, inbuf, insize);
+            return insize+1;
+        }
+        *(char*)outbuf = AUTO_COMPRESSED;
+        CelsResult result = CelsCompressMem (method, inbuf,insize, (char*)outbuf+1,outsize-1, ud,cb);
+        return result<CELS_OK ? result : result+1;
+    }
+
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    AutoStream stream = {&membuf, (char*) malloc (AUTO_SAMPLE_SIZE), 0, 0};
+    CelsResult result = CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (stream.prefix == NULL)  goto done;
+
+    result = stream.prefix_size = AutoRead (&membuf, stream.prefix, AUTO_SAMPLE_SIZE);
+    if (result < CELS_OK)  goto done;
+    if (CelsOrder0Entropy (stream.prefix, stream.prefix_size) > ratio) {
+        if ((result = AutoWrite (&membuf, &AUTO_STORED, 1)) >= CELS_OK
+        &&  (result = AutoWrite (&membuf, stream.prefix, stream.prefix_size)) >= CELS_OK)
+            result = AutoCopy (&membuf, stream.prefix, AUTO_SAMPLE_SIZE);
+    } else {
+        if ((result = AutoWrite (&membuf, &AUTO_COMPRESSED, 1)) >= CELS_OK)
+            result = CelsCompress (method, &stream, AutoCallback);
+    }
+
+done:
+    free (stream.prefix);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+// Decompress data produced by CelsCompressAuto()
+CelsResult CelsDecompressAuto (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (inbuf  &&  outbuf) {
+        if (insize < 1)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+        if (*(char*)inbuf == AUTO_COMPRESSED)
+            return CelsDecompressMem (method, (char*)inbuf+1,insize-1, outbuf,outsize, ud,cb);
+        if (*(char*)inbuf != AUTO_STORED)  return CELS_ERROR_BAD_COMPRESSED_DATA;
+        if (insize-1 > outsize)            return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        memcpy (outbuf, (char*)inbuf+1, insize-1);
+        return insize-1;
+    }
+
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    char flag, *buf = NULL;
+    CelsResult result = AutoRead (&membuf, &flag, 1);
+    if (result == 0  ||  (result > 0  &&  flag != AUTO_STORED  &&  flag != AUTO_COMPRESSED))
+        result = CELS_ERROR_BAD_COMPRESSED_DATA;
+    if (result < CELS_OK)  goto done;
+
+    if (flag == AUTO_COMPRESSED) {
+        result = CelsDecompress (method, &membuf, CelsReadWriteMem);
+    } else {
+        buf = (char*) malloc (AUTO_SAMPLE_SIZE);
+        result = buf?  AutoCopy (&membuf, buf, AUTO_SAMPLE_SIZE) : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+done:
+    free (buf);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+
+// ****************************************************************************************************************************
+// Block-parallel (de)compression with any codec. Input is split into blocks compressed independently by multiple threads,  *
+// each using its own instance of the method. Output format: 4-byte signature "CELP", 4-byte block size, then sequence of     *
+// blocks, each prefixed by 4-byte original and 4-byte compressed size, and finally 4 zero bytes.                             *
+// Block with compressed size equal to original size is stored. All numbers are little-endian.                                *
+// ****************************************************************************************************************************
+
+const CelsNum PARALLEL_DEFAULT_BLOCKSIZE = 8<<20;    // Default block size, unless the codec dictionary is larger
+const CelsNum PARALLEL_MAX_BLOCKSIZE     = 1<<30;    // Block size limit, keeping it far below 4 GB
+const int     PARALLEL_MAX_THREADS       = 64;
+const char    PARALLEL_SIGNATURE[4]      = {'C','E','L','P'};
+
+// State shared by all threads performing the operation
+typedef struct
+{
+    char           method[CELS_MAX_METHOD_STRING_SIZE];   // canonical method string, parsed by each thread into its own instance
+    int            decompress;
+    CelsNum        blocksize;
+    void*          ud;                  // callback used for reading input and writing output
+    CelsCallback*  cb;
+    Mutex          lock;                // serializes all callback calls
+    CondVar        turn;                // signalled when next_write is incremented or error occurs
+    CelsNum        next_read;           // number of the next block to read
+    CelsNum        next_write;          // number of the next block to write
+    int            eof;                 // all blocks were already read
+    CelsResult     error;               // first error code reported by any thread
+} ParallelJob;
+
+static void PutUint32 (char* p, CelsNum x)  {p[0] = x,  p[1] = x>>8,  p[2] = x>>16,  p[3] = x>>24;}
+static CelsNum GetUint32 (const char* p)    {const unsigned char* u = (const unsigned char*)p;  return u[0] + (u[1]<<8) + (u[2]<<16) + ((CelsNum)u[3]<<24);}
+
+// Read size bytes unless input is finished; return amount of data read or error code
+static CelsResult ParallelRead (ParallelJob* job, void* buf, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size) {
+        CelsResult len = CelsRead (job->cb, job->ud, (char*)buf+done, size-done);
+        if (len < CELS_OK)  return len;
+        if (len == 0)       break;
+        done += len;
+    }
+    return done;
+}
+
+static CelsResult ParallelWrite (ParallelJob* job, void* buf, CelsNum size)
+{
+    CelsResult len = (size > 0? CelsWrite (job->cb, job->ud, buf, size) : 0);
+    return len<CELS_OK? len : len!=size? CELS_ERROR_WRITE : CELS_OK;
+}
+
+// Save the first error and wake up threads waiting for their turn to write. Should be called with job->lock taken.
+static void ParallelFail (ParallelJob* job, CelsResult errcode)
+{
+    if (job->error == CELS_OK)  job->error = errcode;
+    BroadcastCondVar (&job->turn);
+}
+
+// Read the next block into buf; return the block number or -1 if there are no more blocks
+static CelsNum ParallelReadBlock (ParallelJob* job, char* buf, CelsNum* origsize, CelsNum* compsize)
+{
+    CelsNum seq = -1;
+    LockMutex (&job->lock);
+    if (job->eof  ||  job->error)  goto done;
+
+    if (!job->decompress) {
+        CelsResult result = ParallelRead (job, buf, job->blocksize);
+        if (result < CELS_OK)  {ParallelFail (job, result);  goto done;}
+        if (result == 0)       {job->eof = 1;  goto done;}
+        *origsize = result;
+    } else {
+        char header[8];
+        CelsResult result = ParallelRead (job, header, 4);
+        if (result == 4  &&  (*origsize = GetUint32(header)) == 0)  {job->eof = 1;  goto done;}
+        if (result == 4)   result = ParallelRead (job, header+4, 4);
+        if (result == 4) {
+            *compsize = GetUint32(header+4);
+            if (*origsize > job->blocksize  ||  *compsize > *origsize)   result = CELS_ERROR_BAD_COMPRESSED_DATA;
+            else if ((result = ParallelRead (job, buf, *compsize)) != *compsize  &&  result >= CELS_OK)   result = CELS_ERROR_BAD_COMPRESSED_DATA;
+        } else if (result >= CELS_OK) {
+            result = CELS_ERROR_BAD_COMPRESSED_DATA;   // no end-of-data mark
+        }
+        if (result < CELS_OK)  {ParallelFail (job, result);  goto done;}
+    }
+    seq = job->next_read++;
+
+done:
+    UnlockMutex (&job->lock);
+    return seq;
+}
+
+// Wait for turn of the block number seq and write it
+static void ParallelWriteBlock (ParallelJob* job, CelsNum seq, char* header, CelsNum header_size, char* buf, CelsNum size)
+{
+    LockMutex (&job->lock);
+    while (job->next_write != seq  &&  !job->error)
+        WaitCondVar (&job->turn, &job->lock);
+    if (!job->error) {
+        CelsResult result = ParallelWrite (job, header, header_size);
+        if (result >= CELS_OK)  result = ParallelWrite (job, buf, size);
+        if (result < CELS_OK)   ParallelFail (job, result);
+        job->next_write++;
+        BroadcastCondVar (&job->turn);
+    }
+    UnlockMutex (&job->lock);
+}
+
+static THREAD_FUNCTION ParallelWorker (void* arg)
+{
+    ParallelJob* job = (ParallelJob*) arg;
+    char instance[CELS_MAX_PARSED_METHOD_SIZE];
+    char header[8];
+    CelsNum origsize = 0, compsize = 0, seq;
+
+    char* inbuf  = (char*) malloc (job->blocksize);
+    char* outbuf = (char*) malloc (job->blocksize);
+    CelsResult result = (inbuf && outbuf)?  CelsParse (job->method, instance) : CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (result < CELS_OK) {
+        LockMutex (&job->lock);
+        ParallelFail (job, result);
+        UnlockMutex (&job->lock);
+        free (inbuf);  free (outbuf);
+        return THREAD_RETURN;
+    }
+
+    while ((seq = ParallelReadBlock (job, inbuf, &origsize, &compsize)) >= 0)
+    {
+        char* data = outbuf;
+        if (!job->decompress) {
+            result = CelsCompressMem (instance, inbuf,origsize, outbuf,origsize, NULL,NULL);
+            if (result == CELS_ERROR_OUTBLOCK_TOO_SMALL  ||  result >= origsize)
+                data = inbuf,  result = origsize;   // store incompressible block
+            compsize = result;
+            PutUint32 (header,   origsize);
+            PutUint32 (header+4, compsize);
+        } else if (compsize == origsize) {
+            data = inbuf,  result = origsize;       // stored block
+        } else {
+            result = CelsDecompressMem (instance, inbuf,compsize, outbuf,origsize, NULL,NULL);
+            if (result >= CELS_OK  &&  result != origsize)   result = CELS_ERROR_BAD_COMPRESSED_DATA;
+        }
+
+        if (result < CELS_OK) {
+            LockMutex (&job->lock);
+            ParallelFail (job, result);
+            UnlockMutex (&job->lock);
+            break;
+        }
+        if (job->decompress)  ParallelWriteBlock (job, seq, NULL,0, data,origsize);
+        else                  ParallelWriteBlock (job, seq, header,8, data,compsize);
+    }
+
+    CelsFree (instance);
+    free (inbuf);  free (outbuf);
+    return THREAD_RETURN;
+}
+
+// Choose number of threads from the codec CPU load and memory requirements, and reserve their CPU load
+// from the limit shared with other block-parallel operations (at least one thread is always allowed).
+// num_blocks is the number of blocks to process, or 0 if it's unknown
+static int ParallelThreads (ParallelJob* job, CelsNum num_blocks, CelsNum memory_budget, long* reserved_cpu_load)
+{
+    CelsParams params;
+    *reserved_cpu_load = 0;
+    if (CelsGetAllParams (job->method, &params) < CELS_OK)  return 1;
+    CelsResult cpu_load = job->decompress? params.decompression_cpu_load : params.compression_cpu_load;
+    CelsResult memory   = job->decompress? params.decompression_memory   : params.compression_memory;
+    if (cpu_load <= 0)  cpu_load = 100;
+    if (memory < 0)     memory = 0;
+
+    CelsNum threads = (CpuLoadLimit() - AtomicAdd (&CpuLoadInUse, 0)) / cpu_load;
+    if (memory_budget > 0)   {CelsNum n = memory_budget / (memory + 2*job->blocksize);  if (threads > n)  threads = n;}
+    if (num_blocks > 0  &&  threads > num_blocks)   threads = num_blocks;
+    if (threads > PARALLEL_MAX_THREADS)  threads = PARALLEL_MAX_THREADS;
+    if (threads < 1)                     threads = 1;
+    *reserved_cpu_load = (long)(threads * cpu_load);
+    AtomicAdd (&CpuLoadInUse, *reserved_cpu_load);
+    return (int)threads;
+}
+
+static CelsResult RunParallel (ParallelJob* job, CelsNum num_blocks, CelsNum memory_budget)
+{
+    Thread threads[PARALLEL_MAX_THREADS];
+    long reserved_cpu_load;
+    int num_threads = ParallelThreads (job, num_blocks, memory_budget, &reserved_cpu_load),  i;
+
+    InitMutex (&job->lock);
+    InitCondVar (&job->turn);
+    for (i=0; i<num_threads; i++)
+        if (!StartThread (&threads[i], ParallelWorker, job))
+            break;
+    if (i == 0)  job->error = CELS_ERROR_GENERAL;
+    num_threads = i;
+    for (i=0; i<num_threads; i++)
+        JoinThread (threads[i]);
+    AtomicAdd (&CpuLoadInUse, -reserved_cpu_load);
+    DestroyCondVar (&job->turn);
+    DestroyMutex (&job->lock);
+    return job->error;
+}
+
+// Compress buffer (inbuf,insize) into buffer (outbuf,outsize) by blocks of blocksize bytes (0 - choose automatically),
+// using multiple threads; return compressed size or error_code<0. When inbuf and/or outbuf is NULL, read/write data via callbacks.
+CelsResult CelsCompressParallel (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum blocksize, CelsNum memory_budget, void* ud, CelsCallback* cb)
+{
+    ParallelJob job;
+    memset (&job, 0, sizeof(job));
+    CelsResult result = CelsCanonize (method, job.method);
+    if (result < CELS_OK)  return result;
+
+    // Blocks shouldn't be smaller than dictionary, otherwise compression ratio suffers
+    if (blocksize <= 0) {
+        blocksize = CelsGetDictionary (job.method);
+        if (blocksize < PARALLEL_DEFAULT_BLOCKSIZE)  blocksize = PARALLEL_DEFAULT_BLOCKSIZE;
+    }
+    job.blocksize = blocksize<PARALLEL_MAX_BLOCKSIZE? blocksize : PARALLEL_MAX_BLOCKSIZE;
+
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    job.ud = &membuf;
+    job.cb = CelsReadWriteMem;
+
+    char header[8];
+    memcpy (header, PARALLEL_SIGNATURE, 4);
+    PutUint32 (header+4, job.blocksize);
+    result = ParallelWrite (&job, header, 8);
+    if (result >= CELS_OK)  result = RunParallel (&job, inbuf? (insize + job.blocksize-1) / job.blocksize : 0, memory_budget);
+    if (result >= CELS_OK)  {PutUint32 (header, 0);  result = ParallelWrite (&job, header, 4);}
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+// Number of blocks in the compressed data (inbuf,insize), found by walking the block headers
+static CelsNum ParallelCountBlocks (char* inbuf, CelsNum insize)
+{
+    CelsNum pos = 8, num_blocks = 0;
+    while (pos+8 <= insize  &&  GetUint32 (inbuf+pos) != 0)
+        pos += 8 + GetUint32 (inbuf+pos+4),  num_blocks++;
+    return num_blocks;
+}
+
+// Decompress data produced by CelsCompressParallel using multiple threads; return decompressed size or error_code<0.
+// When inbuf and/or outbuf is NULL, read/write data via callbacks.
+CelsResult CelsDecompressParallel (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum memory_budget, void* ud, CelsCallback* cb)
+{
+    ParallelJob job;
+    memset (&job, 0, sizeof(job));
+    job.decompress = 1;
+    CelsResult result = CelsCanonize (method, job.method);
+    if (result < CELS_OK)  return result;
+
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    job.ud = &membuf;
+    job.cb = CelsReadWriteMem;
+
+    char header[8];
+    result = ParallelRead (&job, header, 8);
+    if (result >= CELS_OK) {
+        job.blocksize = GetUint32 (header+4);
+        if (result != 8  ||  memcmp (header, PARALLEL_SIGNATURE, 4)  ||  job.blocksize == 0  ||  job.blocksize > PARALLEL_MAX_BLOCKSIZE)
+            result = CELS_ERROR_BAD_COMPRESSED_DATA;
+        else
+            result = RunParallel (&job, inbuf? ParallelCountBlocks ((char*)inbuf, insize) : 0, memory_budget);
+    }
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+
+// ****************************************************************************************************************************
+// Chained methods like "rep+lzma+aes". All stages are (de)compressing simultaneously, each in its own thread, and          *
+// pass data to the next stage via bounded queues of buffers. Queues support both read/write and buffer-sharing APIs,        *
+// so data are passed without copying when both neighbour stages use buffer-sharing API.                                     *
+// ****************************************************************************************************************************
+
+const char    CHAIN_DELIMITER     = '+';
+const int     CHAIN_MAX_STAGES    = 16;
+const int     CHAIN_QUEUE_BUFFERS = 4;         // Number of buffers in each queue between stages
+const CelsNum CHAIN_BUFFER_SIZE   = 1<<20;
+
+// Queue of buffers between two stages
+typedef struct
+{
+    Mutex       lock;
+    CondVar     changed;                            // signalled on any change of the queue state
+    char*       bufs [CHAIN_QUEUE_BUFFERS];         // all buffers of the queue
+    char*       empty [CHAIN_QUEUE_BUFFERS];        // stack of empty buffers
+    int         num_empty;
+    char*       filled [CHAIN_QUEUE_BUFFERS];       // FIFO of filled buffers
+    CelsNum     filled_size [CHAIN_QUEUE_BUFFERS];
+    int         first_filled, num_filled;
+    int         closed;                             // producer finished, so no more filled buffers will arrive
+    CelsResult  aborted;                            // <0: operation was aborted with this error code
+
+    char*       wbuf;  CelsNum wpos;                // buffer filled by producer CELS_WRITE
+    char*       rbuf;  CelsNum rsize, rpos;         // buffer consumed by consumer CELS_READ
+} ChainQueue;
+
+struct Chain;
+
+typedef struct
+{
+    struct Chain* chain;
+    char          instance [CELS_MAX_PARSED_METHOD_SIZE];
+    ChainQueue   *in, *out;                         // queues to the previous and next stages, NULL for the application callback
+    Thread        thread;
+} ChainStage;
+
+typedef struct Chain
+{
+    int            decompress;
+    void*          ud;                              // application callback
+    CelsCallback*  cb;
+    Mutex          callback_lock;                   // serializes calls to the application callback
+    Mutex          error_lock;
+    CelsResult     error;                           // first error code reported by any stage
+    int            num_stages;
+    ChainStage     stage [CHAIN_MAX_STAGES];        // stages in the data flow order
+    ChainQueue     queue [CHAIN_MAX_STAGES-1];
+} Chain;
+
+static int InitChainQueue (ChainQueue* q)
+{
+    memset (q, 0, sizeof(*q));
+    InitMutex (&q->lock);
+    InitCondVar (&q->changed);
+    int i;
+    for (i=0; i<CHAIN_QUEUE_BUFFERS; i++)
+        if ((q->empty[q->num_empty++] = q->bufs[i] = (char*) malloc (CHAIN_BUFFER_SIZE)) == NULL)
+            return 0;
+    return 1;
+}
+
+static void DestroyChainQueue (ChainQueue* q)
+{
+    int i;
+    for (i=0; i<CHAIN_QUEUE_BUFFERS; i++)
+        free (q->bufs[i]);
+    DestroyCondVar (&q->changed);
+    DestroyMutex (&q->lock);
+}
+
+// Abort the queue operations; the first error code is kept
+static void AbortChainQueue (ChainQueue* q, CelsResult errcode)
+{
+    LockMutex (&q->lock);
+    if (!q->aborted)  q->aborted = errcode;
+    BroadcastCondVar (&q->changed);
+    UnlockMutex (&q->lock);
+}
+
+// Producer: get empty buffer
+static CelsResult ChainReceiveEmpty (ChainQueue* q, void** buf)
+{
+    LockMutex (&q->lock);
+    while (q->num_empty == 0  &&  !q->aborted)
+        WaitCondVar (&q->changed, &q->lock);
+    CelsResult result = q->aborted;
+    if (!result)  *buf = q->empty[--q->num_empty],  result = CHAIN_BUFFER_SIZE;
+    UnlockMutex (&q->lock);
+    return result;
+}
+
+// Find the queue buffer containing ptr
+static char* ChainQueueBuffer (ChainQueue* q, void* ptr)
+{
+    int i;
+    for (i=0; i<CHAIN_QUEUE_BUFFERS; i++)
+        if (q->bufs[i] <= (char*)ptr  &&  (char*)ptr < q->bufs[i]+CHAIN_BUFFER_SIZE)
+            return q->bufs[i];
+    return NULL;
+}
+
+// Producer: send filled buffer to the consumer
+static CelsResult ChainSendFilled (ChainQueue* q, void* ptr, CelsNum size)
+{
+    char* buf = ChainQueueBuffer (q, ptr);
+    if (buf == NULL  ||  (char*)ptr+size > buf+CHAIN_BUFFER_SIZE)  return CELS_ERROR_INTERNAL;
+
+    LockMutex (&q->lock);
+    CelsResult result = q->aborted;
+    if (result  ||  size == 0) {
+        q->empty[q->num_empty++] = buf;
+    } else {
+        if (ptr != buf)  memmove (buf, ptr, size);
+        int i = (q->first_filled + q->num_filled++) % CHAIN_QUEUE_BUFFERS;
+        q->filled[i] = buf,  q->filled_size[i] = size;
+    }
+    BroadcastCondVar (&q->changed);
+    UnlockMutex (&q->lock);
+    return result;
+}
+
+// Consumer: get filled buffer; return 0 at the end of data
+static CelsResult ChainReceiveFilled (ChainQueue* q, void** buf)
+{
+    LockMutex (&q->lock);
+    while (q->num_filled == 0  &&  !q->closed  &&  !q->aborted)
+        WaitCondVar (&q->changed, &q->lock);
+    CelsResult result = q->aborted;
+    if (!result  &&  q->num_filled == 0) {
+        *buf = NULL,  result = 0;
+    } else if (!result) {
+        *buf   = q->filled[q->first_filled];
+        result = q->filled_size[q->first_filled];
+        q->first_filled = (q->first_filled+1) % CHAIN_QUEUE_BUFFERS,  q->num_filled--;
+    }
+    UnlockMutex (&q->lock);
+    return result;
+}
+
+// Consumer: return buffer to the producer
+static CelsResult ChainSendEmpty (ChainQueue* q, void* ptr)
+{
+    char* buf = ChainQueueBuffer (q, ptr);
+    if (buf == NULL)  return CELS_ERROR_INTERNAL;
+    LockMutex (&q->lock);
+    q->empty[q->num_empty++] = buf;
+    BroadcastCondVar (&q->changed);
+    UnlockMutex (&q->lock);
+    return CELS_OK;
+}
+
+// Producer: CELS_WRITE emulation
+static CelsResult ChainWrite (ChainQueue* q, char* data, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size)
+    {
+        if (q->wbuf == NULL) {
+            CelsResult result = ChainReceiveEmpty (q, (void**)&q->wbuf);
+            if (result < CELS_OK)  return result;
+            q->wpos = 0;
+        }
+        CelsNum n = CHAIN_BUFFER_SIZE - q->wpos;
+        if (n > size-done)  n = size-done;
+        memcpy (q->wbuf + q->wpos, data+done, n);
+        q->wpos += n,  done += n;
+        if (q->wpos == CHAIN_BUFFER_SIZE) {
+            CelsResult result = ChainSendFilled (q, q->wbuf, q->wpos);
+            q->wbuf = NULL;
+            if (result < CELS_OK)  return result;
+        }
+    }
+    return done;
+}
+
+// Consumer: CELS_READ emulation
+static CelsResult ChainRead (ChainQueue* q, char* data, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size)
+    {
+        if (q->rbuf  &&  q->rpos == q->rsize) {
+            ChainSendEmpty (q, q->rbuf);
+            q->rbuf = NULL;
+        }
+        if (q->rbuf == NULL) {
+            if (done > 0)  break;     // return available data instead of waiting for the next buffer
+            CelsResult result = ChainReceiveFilled (q, (void**)&q->rbuf);
+            if (result <= 0)  {q->rbuf = NULL;  return result;}
+            q->rsize = result,  q->rpos = 0;
+        }
+        CelsNum n = q->rsize - q->rpos;
+        if (n > size-done)  n = size-done;
+        memcpy (data+done, q->rbuf + q->rpos, n);
+        q->rpos += n,  done += n;
+    }
+    return done;
+}
+
+static CelsResult ChainCallApplication (Chain* chain, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    if (chain->cb == NULL)  return CELS_ERROR_NOT_IMPLEMENTED;
+    LockMutex (&chain->callback_lock);
+    CelsResult result = chain->cb (chain->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+    UnlockMutex (&chain->callback_lock);
+    return result;
+}
+
+// Callback of each stage: input/output requests are served by the queues, other requests are passed to the application callback
+static CelsResult __cdecl ChainCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    ChainStage* stage = (ChainStage*) self;
+    ChainQueue *in = stage->in,  *out = stage->out;
+
+    if (in  &&  service==CELS_READ)                    return ChainRead (in, (char*)inbuf, insize);
+    if (in  &&  service==CELS_RECEIVE_FILLED_INBUF)    return ChainReceiveFilled (in, (void**)inbuf);
+    if (in  &&  service==CELS_SEND_EMPTY_INBUF)        return ChainSendEmpty (in, inbuf);
+    if (out &&  service==CELS_WRITE)                   return ChainWrite (out, (char*)outbuf, outsize);
+    if (out &&  service==CELS_RECEIVE_EMPTY_OUTBUF)    return ChainReceiveEmpty (out, (void**)outbuf);
+    if (out &&  service==CELS_SEND_FILLED_OUTBUF)      return ChainSendFilled (out, outbuf, outsize);
+
+    // Application sees input progress of the first stage and output progress of the last one
+    if (service==CELS_PROGRESS) {
+        if (in)   insize  = 0;
+        if (out)  outsize = 0;
+        return (insize || outsize)?  ChainCallApplication (stage->chain, service,subservice, inbuf,insize, outbuf,outsize, ud,cb) : CELS_OK;
+    }
+    if (service==CELS_QUASI_WRITE  &&  out)   return CELS_OK;
+
+    return ChainCallApplication (stage->chain, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+// Remember the first error and abort all queues, so blocked stages wake up
+static void ChainFail (Chain* chain, CelsResult errcode)
+{
+    int i;
+    LockMutex (&chain->error_lock);
+    if (chain->error == CELS_OK)  chain->error = errcode;
+    UnlockMutex (&chain->error_lock);
+    for (i=0; i<chain->num_stages-1; i++)
+        AbortChainQueue (&chain->queue[i], CELS_ERROR_OPERATION_TERMINATED);
+}
+
+static void RunChainStage (ChainStage* stage)
+{
+    ChainQueue *in = stage->in,  *out = stage->out;
+    CelsResult result = Cels (stage->instance, stage->chain->decompress? CELS_DECOMPRESS : CELS_COMPRESS,0, NULL,0, NULL,0, stage,ChainCallback);
+
+    // Flush data written by CELS_WRITE, then tell the next stage there will be no more data
+    if (out  &&  out->wbuf) {
+        CelsResult errcode = ChainSendFilled (out, out->wbuf, result>=CELS_OK? out->wpos : 0);
+        if (result >= CELS_OK)  result = errcode;
+        out->wbuf = NULL;
+    }
+    // Stage stopped reading input, so previous stage should stop writing
+    if (in)
+        AbortChainQueue (in, CELS_ERROR_NO_MORE_DATA_REQUIRED);
+
+    if (result < CELS_OK  &&  result != CELS_ERROR_NO_MORE_DATA_REQUIRED)
+        ChainFail (stage->chain, result);
+
+    if (out) {
+        LockMutex (&out->lock);
+        out->closed = 1;
+        BroadcastCondVar (&out->changed);
+        UnlockMutex (&out->lock);
+    }
+}
+
+static THREAD_FUNCTION ChainStageThread (void* arg)
+{
+    RunChainStage ((ChainStage*) arg);
+    return THREAD_RETURN;
+}
+
+// Run all stages of the method chain, using the callback for reading input and writing output
+static CelsResult RunChain (const char* method, int decompress, void* ud, CelsCallback* cb)
+{
+    // Split method into stages
+    char method_copy[CELS_MAX_METHOD_STRING_SIZE];  int i;
+    for (i=0;  i<CELS_MAX_METHOD_STRING_SIZE-1 && method[i]!=0;  i++)
+        method_copy[i] = method[i];
+    method_copy[i] = 0;
+    int num_delimiters = 0;
+    for (i=0;  method_copy[i];  i++)
+        num_delimiters += (method_copy[i]==CHAIN_DELIMITER);
+    if (num_delimiters >= CHAIN_MAX_STAGES)  return CELS_ERROR_INVALID_COMPRESSOR;   // more than CHAIN_MAX_STAGES stages
+    char *methods[CHAIN_MAX_STAGES+1];
+    int num_stages = SplitStr (method_copy, CHAIN_DELIMITER, methods, CHAIN_MAX_STAGES+1);
+
+    Chain* chain = (Chain*) calloc (1, sizeof(Chain));
+    if (chain == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    chain->decompress = decompress;
+    chain->ud = ud;
+    chain->cb = cb;
+    InitMutex (&chain->callback_lock);
+    InitMutex (&chain->error_lock);
+
+    // Parse stages, ordering them by the data flow: decompression runs the chain backwards
+    int num_parsed = 0,  num_queues = 0,  num_threads = 0;
+    CelsResult result = CELS_OK;
+    for (i=0;  i<num_stages  &&  result>=CELS_OK;  i++)
+        if ((result = CelsParse (methods[decompress? num_stages-1-i : i], chain->stage[i].instance)) >= CELS_OK)
+            num_parsed++;
+    for (i=0;  i<num_stages-1  &&  result>=CELS_OK;  i++, num_queues++)
+        if (!InitChainQueue (&chain->queue[i]))
+            result = CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    if (result >= CELS_OK) {
+        chain->num_stages = num_stages;
+        for (i=0; i<num_stages; i++) {
+            chain->stage[i].chain = chain;
+            chain->stage[i].in    = (i > 0?             &chain->queue[i-1] : NULL);
+            chain->stage[i].out   = (i < num_stages-1?  &chain->queue[i]   : NULL);
+        }
+
+        // All stages except for the last one run in new threads, and the last one - in the current thread
+        for (num_threads=0;  num_threads < num_stages-1;  num_threads++)
+            if (!StartThread (&chain->stage[num_threads].thread, ChainStageThread, &chain->stage[num_threads]))
+                break;
+        if (num_threads < num_stages-1)
+            ChainFail (chain, CELS_ERROR_GENERAL);
+        else
+            RunChainStage (&chain->stage[num_stages-1]);
+        for (i=0; i<num_threads; i++)
+            JoinThread (chain->stage[i].thread);
+        result = chain->error;
+    }
+
+    for (i=0; i<num_parsed; i++)
+        CelsFree (chain->stage[i].instance);
+    for (i=0; i<num_queues; i++)
+        DestroyChainQueue (&chain->queue[i]);
+    DestroyMutex (&chain->error_lock);
+    DestroyMutex (&chain->callback_lock);
+    free (chain);
+    return result;
+}
+
+// Compress buffer (inbuf,insize) with chain of methods like "rep+lzma+aes" into buffer (outbuf,outsize), running all methods
+// simultaneously; return compressed size or error_code<0. When inbuf and/or outbuf is NULL, read/write data via callbacks.
+CelsResult CelsCompressChain (const char* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    CelsResult result = RunChain (method, 0, &membuf, CelsReadWriteMem);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+// Decompress data compressed by CelsCompressChain with the same method chain
+CelsResult CelsDecompressChain (const char* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    CelsResult result = RunChain (method, 1, &membuf, CelsReadWriteMem);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+
+// ****************************************************************************************************************************
+// Multi-output codecs: codec writes output streams with CELS_WRITE_STREAM, and they are interleaved into single output      *
+// by chunks. Output format: sequence of chunks, then chunk map, then 4-byte little-endian size of the chunk map.              *
+// Chunk map: varint number of streams, varint number of chunks, and for each chunk varint stream*2+partial, followed by      *
+// varint chunk size for partial chunks (i.e. smaller than INTERLEAVE_CHUNK_SIZE). Decompression reads each stream            *
+// directly from the chunks of that stream.                                                                                   *
+// ****************************************************************************************************************************
+
+const CelsNum INTERLEAVE_CHUNK_SIZE  = 64<<10;
+const int     INTERLEAVE_MAX_STREAMS = 256;
+
+typedef struct
+{
+    void*           ud;                  // application callback
+    CelsCallback*   cb;
+    int             num_streams;
+
+    // Compression: partially filled chunk of each stream, and the chunk map being built
+    char*           chunk [INTERLEAVE_MAX_STREAMS];
+    CelsNum         chunk_pos [INTERLEAVE_MAX_STREAMS];
+    unsigned char*  map;
+    CelsNum         map_size, map_alloc, num_chunks;
+
+    // Decompression: all chunks of the input, and read position in each stream
+    char*           data;
+    CelsNum        *chunk_offset, *chunk_size;
+    int            *next_chunk;                          // next chunk of the same stream, or -1
+    int             cur_chunk [INTERLEAVE_MAX_STREAMS];  // chunk being read for each stream, or -1
+    CelsNum         cur_pos [INTERLEAVE_MAX_STREAMS];
+} Interleaver;
+
+static int PutVarint (unsigned char* p, CelsNum x)
+{
+    int n = 0;
+    for (;  x >= 128;  x >>= 7)
+        p[n++] = (unsigned char)(x | 128);
+    p[n++] = (unsigned char)x;
+    return n;
+}
+
+// Decode varint from [*p,end), advancing *p; return -1 on error
+static CelsNum GetVarint (const unsigned char** p, const unsigned char* end)
+{
+    CelsNum x = 0;  int shift;
+    for (shift = 0;  *p < end  &&  shift < 63;  shift += 7) {
+        unsigned char c = *(*p)++;
+        x |= (CelsNum)(c & 127) << shift;
+        if (c < 128)  return x;
+    }
+    return -1;
+}
+
+// Write chunk to the output and add it to the chunk map
+static CelsResult InterleaveChunk (Interleaver* il, int stream)
+{
+    CelsNum size = il->chunk_pos[stream];
+    if (il->map_size + 20 > il->map_alloc) {
+        CelsNum new_alloc = il->map_alloc*2 + 4096;
+        unsigned char* new_map = (unsigned char*) realloc (il->map, new_alloc);
+        if (new_map == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+        il->map = new_map,  il->map_alloc = new_alloc;
+    }
+    int partial = (size != INTERLEAVE_CHUNK_SIZE);
+    il->map_size += PutVarint (il->map + il->map_size, stream*2 + partial);
+    if (partial)  il->map_size += PutVarint (il->map + il->map_size, size);
+    il->num_chunks++;
+    il->chunk_pos[stream] = 0;
+
+    CelsResult result = CelsWrite (il->cb, il->ud, il->chunk[stream], size);
+    return result<CELS_OK? result : result!=size? CELS_ERROR_WRITE : CELS_OK;
+}
+
+static CelsResult InterleaveWrite (Interleaver* il, CelsNum stream, char* data, CelsNum size)
+{
+    if (stream < 0  ||  stream >= INTERLEAVE_MAX_STREAMS)  return CELS_ERROR_NOT_IMPLEMENTED;
+    if (il->chunk[stream] == NULL  &&  (il->chunk[stream] = (char*) malloc (INTERLEAVE_CHUNK_SIZE)) == NULL)
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (stream >= il->num_streams)  il->num_streams = stream+1;
+
+    CelsNum done = 0;
+    while (done < size) {
+        CelsNum n = INTERLEAVE_CHUNK_SIZE - il->chunk_pos[stream];
+        if (n > size-done)  n = size-done;
+        memcpy (il->chunk[stream] + il->chunk_pos[stream], data+done, n);
+        il->chunk_pos[stream] += n,  done += n;
+        if (il->chunk_pos[stream] == INTERLEAVE_CHUNK_SIZE) {
+            CelsResult result = InterleaveChunk (il, stream);
+            if (result < CELS_OK)  return result;
+        }
+    }
+    return size;
+}
+
+// Advance to the next chunk of the stream if the current one was read completely; return remaining bytes in the chunk
+static CelsNum DeinterleaveAvail (Interleaver* il, int stream)
+{
+    int* chunk = &il->cur_chunk[stream];
+    while (*chunk >= 0  &&  il->cur_pos[stream] == il->chunk_size[*chunk])
+        *chunk = il->next_chunk[*chunk],  il->cur_pos[stream] = 0;
+    return *chunk >= 0?  il->chunk_size[*chunk] - il->cur_pos[stream] : 0;
+}
+
+static CelsResult DeinterleaveRead (Interleaver* il, CelsNum stream, char* buf, CelsNum size)
+{
+    if (stream < 0  ||  stream >= INTERLEAVE_MAX_STREAMS)  return CELS_ERROR_NOT_IMPLEMENTED;
+    if (stream >= il->num_streams)  return 0;
+    CelsNum done = 0, avail;
+    while (done < size  &&  (avail = DeinterleaveAvail (il, stream)) > 0) {
+        CelsNum n = avail<size-done? avail : size-done;
+        memcpy (buf+done, il->data + il->chunk_offset[il->cur_chunk[stream]] + il->cur_pos[stream], n);
+        il->cur_pos[stream] += n,  done += n;
+    }
+    return done;
+}
+
+static CelsResult __cdecl InterleaverCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    Interleaver* il = (Interleaver*) self;
+    if (il->data == NULL) {
+        // Compression: output buffers can't be lent since all output goes through chunks, so the stream adapter
+        // emulates them with CELS_WRITE into stream 0
+        if (service==CELS_WRITE)                    return InterleaveWrite (il, 0, (char*)outbuf, outsize);
+        if (service==CELS_WRITE_STREAM)             return InterleaveWrite (il, subservice, (char*)outbuf, outsize);
+        if (service==CELS_RECEIVE_EMPTY_OUTBUF  ||  service==CELS_SEND_FILLED_OUTBUF)  return CELS_ERROR_NOT_IMPLEMENTED;
+    } else {
+        // Decompression: chunks of stream 0 are also lent directly by buffer-sharing services
+        if (service==CELS_READ)                     return DeinterleaveRead (il, 0, (char*)inbuf, insize);
+        if (service==CELS_READ_STREAM)              return DeinterleaveRead (il, subservice, (char*)inbuf, insize);
+        if (service==CELS_SEND_EMPTY_INBUF)         return CELS_OK;
+        if (service==CELS_RECEIVE_FILLED_INBUF) {
+            CelsNum avail = (il->num_streams > 0?  DeinterleaveAvail (il, 0) : 0);
+            *(void**)inbuf = avail?  il->data + il->chunk_offset[il->cur_chunk[0]] + il->cur_pos[0] : NULL;
+            if (avail)  il->cur_pos[0] += avail;
+            return avail;
+        }
+    }
+    return il->cb (il->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+}
+
+static void FreeInterleaver (Interleaver* il)
+{
+    int i;
+    for (i=0; i<INTERLEAVE_MAX_STREAMS; i++)
+        free (il->chunk[i]);
+    free (il->map);
+    free (il->chunk_offset);
+    free (il->chunk_size);
+    free (il->next_chunk);
+}
+
+// Compress buffer (inbuf,insize) with multi-output codec into buffer (outbuf,outsize), interleaving the output streams;
+// return compressed size or error_code<0. When inbuf and/or outbuf is NULL, read/write data via callbacks.
+CelsResult CelsCompressInterleaved (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    CelsMemBuf membuf;  MemBufInit (&membuf, inbuf,insize, outbuf,outsize, ud,cb);
+    Interleaver il;
+    memset (&il, 0, sizeof(il));
+    il.ud = &membuf;
+    il.cb = CelsReadWriteMem;
+
+    CelsResult result = CelsCompress (method, &il, InterleaverCallback);
+
+    // Flush partial chunks and write the chunk map
+    int stream;
+    for (stream=0;  stream < il.num_streams  &&  result >= CELS_OK;  stream++)
+        if (il.chunk_pos[stream] > 0)
+            result = InterleaveChunk (&il, stream);
+    if (result >= CELS_OK) {
+        unsigned char header[20], trailer[4];
+        int header_size  = PutVarint (header, il.num_streams);
+        header_size     += PutVarint (header+header_size, il.num_chunks);
+        CelsNum map_size = header_size + il.map_size;
+        PutUint32 ((char*)trailer, map_size);
+        if (map_size > 0xFFFFFFFF)  result = CELS_ERROR_GENERAL;
+        if (result >= CELS_OK)  result = (CelsWrite (il.cb, il.ud, header, header_size) == header_size?  CELS_OK : CELS_ERROR_WRITE);
+        if (result >= CELS_OK  &&  il.map_size > 0)  result = (CelsWrite (il.cb, il.ud, il.map, il.map_size) == il.map_size?  CELS_OK : CELS_ERROR_WRITE);
+        if (result >= CELS_OK)  result = (CelsWrite (il.cb, il.ud, trailer, 4) == 4?  CELS_OK : CELS_ERROR_WRITE);
+    }
+
+    FreeInterleaver (&il);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+// Decompress data produced by CelsCompressInterleaved from buffer (inbuf,insize) into buffer (outbuf,outsize);
+// return decompressed size or error_code<0. The input should be in memory, but output may be written via callbacks (outbuf==NULL).
+CelsResult CelsDecompressInterleaved (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    if (inbuf == NULL)  return CELS_ERROR_NOT_IMPLEMENTED;
+    if (insize < 4)     return CELS_ERROR_BAD_COMPRESSED_DATA;
+
+    CelsMemBuf membuf;  MemBufInit (&membuf, NULL,0, outbuf,outsize, ud,cb);
+    Interleaver il;
+    memset (&il, 0, sizeof(il));
+    il.ud   = &membuf;
+    il.cb   = CelsReadWriteMem;
+    il.data = (char*)inbuf;
+
+    // Decode the chunk map and link chunks of each stream
+    CelsResult result = CELS_ERROR_BAD_COMPRESSED_DATA;
+    CelsNum map_size = GetUint32 ((char*)inbuf + insize-4),  data_size = insize-4-map_size,  offset = 0,  i;
+    const unsigned char *p = (unsigned char*)inbuf + data_size,  *end = (unsigned char*)inbuf + insize-4;
+    int last_chunk [INTERLEAVE_MAX_STREAMS];
+    CelsNum num_streams = (map_size <= insize-4?  GetVarint (&p, end) : -1);
+    CelsNum num_chunks  = (num_streams >= 0?  GetVarint (&p, end) : -1);
+    if (num_streams < 0  ||  num_streams > INTERLEAVE_MAX_STREAMS  ||  num_chunks < 0  ||  num_chunks > data_size)
+        goto done;
+    il.num_streams  = num_streams;
+    il.chunk_offset = (CelsNum*) malloc ((num_chunks+1) * sizeof(CelsNum));
+    il.chunk_size   = (CelsNum*) malloc ((num_chunks+1) * sizeof(CelsNum));
+    il.next_chunk   = (int*)     malloc ((num_chunks+1) * sizeof(int));
+    if (!il.chunk_offset || !il.chunk_size || !il.next_chunk)  {result = CELS_ERROR_NOT_ENOUGH_MEMORY;  goto done;}
+
+    for (i=0; i<num_streams; i++)
+        il.cur_chunk[i] = last_chunk[i] = -1;
+    for (i=0; i<num_chunks; i++) {
+        CelsNum code = GetVarint (&p, end);
+        CelsNum size = (code >= 0  &&  (code&1)?  GetVarint (&p, end) : INTERLEAVE_CHUNK_SIZE);
+        if (code < 0  ||  size < 0  ||  (code >> 1) >= num_streams  ||  size > data_size-offset)
+            goto done;
+        int stream = (int)(code >> 1);
+        il.chunk_offset[i] = offset,  il.chunk_size[i] = size,  il.next_chunk[i] = -1;
+        if (last_chunk[stream] >= 0)  il.next_chunk[last_chunk[stream]] = i;
+        else                          il.cur_chunk[stream] = i;
+        last_chunk[stream] = i;
+        offset += size;
+    }
+    if (offset != data_size)  goto done;
+
+    result = CelsDecompress (method, &il, InterleaverCallback);
+
+done:
+    FreeInterleaver (&il);
+    MemBufFree (&membuf);
+    return result<CELS_OK ? result : outsize-membuf.writeLeft;
+}
+
+
+// ****************************************************************************************************************************
+// Asynchronous tasks: (de)compression runs on its own fiber (coroutine with a separate stack), so codec calls to blocking     *
+// callbacks don't hold the OS thread. When application callback can't serve the request right now, it returns              *
+// CELS_ERROR_WOULD_BLOCK, the fiber suspends, and CelsResumeTask() returns to the application. Later, any thread may call     *
+// CelsResumeTask() again (f.e. when input data arrived or output buffers were freed) and the callback is retried.            *
+// ****************************************************************************************************************************
+
+const CelsNum DEFAULT_TASK_STACK_SIZE = 1<<20;
+
+enum {TASK_CREATED, TASK_RUNNING, TASK_SUSPENDED, TASK_FINISHED};
+
+#ifdef _WIN32
+typedef LPVOID FiberContext;
+#else
+#include <ucontext.h>
+typedef ucontext_t FiberContext;
+#endif
+
+struct CelsTask
+{
+    char            method [CELS_MAX_PARSED_METHOD_SIZE];   // parsed method
+    int             service;              // CELS_COMPRESS or CELS_DECOMPRESS
+    void*           ud;                   // application callback
+    CelsCallback*   cb;
+    volatile int    state;
+    volatile int    aborted;              // CelsFreeTask() called on unfinished task
+    void*           fiber_thread;         // &ThreadTag of the thread running the fiber
+    CelsResult      result;               // result of the finished operation
+    FiberContext    fiber, caller;        // contexts of the task and of the CelsResumeTask() caller
+    void*           stack;
+};
+
+// Switch from the fiber back to the CelsResumeTask() caller
+static void SuspendTask (CelsTask* task)
+{
+#ifdef _WIN32
+    SwitchToFiber (task->caller);
+#else
+    swapcontext (&task->fiber, &task->caller);
+#endif
+}
+
+// Callback passed to the codec: retry application callback until it can serve the request
+static CelsResult __cdecl TaskCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsTask* task = (CelsTask*) self;
+    for (;;) {
+        if (task->aborted)  return CELS_ERROR_OPERATION_TERMINATED;
+        CelsResult result = task->cb (task->ud, service,subservice, inbuf,insize, outbuf,outsize, ud,cb);
+        if (result != CELS_ERROR_WOULD_BLOCK)  return result;
+
+        // Only the fiber itself can be suspended; codec helper threads just wait until the request can be served
+        if (task->fiber_thread == &ThreadTag) {
+            task->state = TASK_SUSPENDED;
+            SuspendTask (task);
+        } else {
+            YieldCpu();
+        }
+    }
+}
+
+static void RunTask (CelsTask* task)
+{
+    task->result = Cels (task->method, task->service,0, NULL,0, NULL,0, task,TaskCallback);
+    task->state  = TASK_FINISHED;
+}
+
+#ifdef _WIN32
+static VOID WINAPI TaskFiber (LPVOID arg)
+{
+    CelsTask* task = (CelsTask*) arg;
+    RunTask (task);
+    SwitchToFiber (task->caller);   // fiber function should never return
+}
+#else
+// makecontext() passes only int arguments, so the pointer is splitted into two halves
+static void TaskFiber (unsigned lo, unsigned hi)
+{
+    CelsTask* task = (CelsTask*) (size_t) (((unsigned long long)hi << 32) | lo);
+    RunTask (task);
+    setcontext (&task->caller);
+}
+#endif
+
+// Create task that will (de)compress data with the method using callback (ud,cb), which may return CELS_ERROR_WOULD_BLOCK.
+// service is CELS_COMPRESS or CELS_DECOMPRESS, stack_size is the fiber stack size (0 - default).
+// The operation starts on the first CelsResumeTask() call.
+CelsResult CelsCreateTask (CelsTask** ptask, const void* method, int service, CelsNum stack_size, void* ud, CelsCallback* cb)
+{
+    if (stack_size <= 0)  stack_size = DEFAULT_TASK_STACK_SIZE;
+    CelsTask* task = (CelsTask*) calloc (1, sizeof(CelsTask));
+    if (task == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    task->service = service;
+    task->ud      = ud;
+    task->cb      = cb;
+
+    // Parsed method is owned by the task, since fiber may be resumed by other threads having their own instance caches
+    CelsResult errcode = CelsParseStr ((const char*)method, task->method, sizeof(task->method), NULL,NULL);
+    if (errcode < CELS_OK)  {free (task);  return errcode;}
+
+#ifdef _WIN32
+    task->fiber = CreateFiber ((SIZE_T)stack_size, TaskFiber, task);
+    if (task->fiber == NULL)  {CelsFree (task->method);  free (task);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+#else
+    task->stack = malloc (stack_size);
+    if (task->stack == NULL  ||  getcontext (&task->fiber) != 0) {
+        CelsFree (task->method);  free (task->stack);  free (task);
+        return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    task->fiber.uc_stack.ss_sp   = task->stack;
+    task->fiber.uc_stack.ss_size = stack_size;
+    task->fiber.uc_link = NULL;
+    size_t ptr = (size_t) task;
+    makecontext (&task->fiber, (void(*)()) TaskFiber, 2, (unsigned) ptr, (unsigned) ((unsigned long long)ptr >> 32));
+#endif
+
+    task->state = TASK_CREATED;
+    *ptask = task;
+    return CELS_OK;
+}
+
+// Run the task until the operation finishes (returning its result) or the callback returns CELS_ERROR_WOULD_BLOCK
+// (returning CELS_ERROR_WOULD_BLOCK). The task may be resumed by any thread, but only by one thread at a time.
+CelsResult CelsResumeTask (CelsTask* task)
+{
+    if (task->state == TASK_FINISHED)  return task->result;
+    task->state = TASK_RUNNING;
+    task->fiber_thread = &ThreadTag;
+#ifdef _WIN32
+    task->caller = IsThreadAFiber()?  GetCurrentFiber() : ConvertThreadToFiber (NULL);
+    if (task->caller == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    SwitchToFiber (task->fiber);
+#else
+    swapcontext (&task->caller, &task->fiber);
+#endif
+    return task->state == TASK_FINISHED?  task->result : CELS_ERROR_WOULD_BLOCK;
+}
+
+// Free the task. Unfinished operation is terminated: all further callbacks return CELS_ERROR_OPERATION_TERMINATED to the codec
+CelsResult CelsFreeTask (CelsTask* task)
+{
+    if (task->state != TASK_CREATED) {
+        task->aborted = 1;
+        while (task->state != TASK_FINISHED)
+            CelsResumeTask (task);
+    }
+#ifdef _WIN32
+    DeleteFiber (task->fiber);
+#endif
+    free (task->stack);
+    CelsFree (task->method);
+    free (task);
+    return CELS_OK;
+}
+
+
+
+// ****************************************************************************************************************************
+// Checksum codecs "crc32c", "xxh3", "xxh128" and "sha256": pass-through pipeline stages appending checksum of the data     *
+// (4, 8, 16 or 32 bytes; xxh128 stores the low half first) on compression, and verifying and removing it on decompression. *
+// These codecs are built-in, i.e. registered by CelsLoad().                                                                  *
+// ****************************************************************************************************************************
+
+typedef unsigned long long Uint64;
+
+static unsigned ReadLE32 (const unsigned char* p)  {return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned)p[3]<<24);}
+static Uint64   ReadLE64 (const unsigned char* p)  {return ReadLE32(p) | ((Uint64)ReadLE32(p+4) << 32);}
+static void     WriteLE64 (unsigned char* p, Uint64 x)  {int i;  for (i=0; i<8; i++)  p[i] = (unsigned char)(x >> (i*8));}
+
+
+// CRC-32C (Castagnoli) ========================================================================================================
+
+const unsigned CRC32C_POLY = 0x82F63B78;    // reflected polynomial
+const CelsNum  CRC32C_LANE = 8192;          // hardware CRC processes three lanes of this size simultaneously
+
+static unsigned Crc32cTable [8][256];       // tables for slicing-by-8 software implementation
+static unsigned Crc32cLaneShift [4][256];   // tables multiplying CRC by x^(8*CRC32C_LANE), i.e. appending CRC32C_LANE zero bytes
+
+// Multiply polynomials a and b modulo CRC32C_POLY (in the reflected bit order, so 0x80000000 is 1)
+static unsigned Crc32cMultiply (unsigned a, unsigned b)
+{
+    unsigned m = 1u << 31,  p = 0;
+    if (a == 0)  return 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m-1)) == 0)  break;
+        }
+        m >>= 1;
+        b = (b & 1)?  (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8*size) modulo CRC32C_POLY: multiplying CRC by it appends size zero bytes to the data
+static unsigned Crc32cShiftOperator (CelsNum size)
+{
+    unsigned p = 1u << 31,  power = 1u << 23;   // x^0 and x^8
+    for (;  size;  size >>= 1) {
+        if (size & 1)  p = Crc32cMultiply (power, p);
+        power = Crc32cMultiply (power, power);
+    }
+    return p;
+}
+
+// Software CRC-32C without pre/post-inversion
+static unsigned Crc32cSoftware (unsigned crc, const unsigned char* p, CelsNum size)
+{
+    for (;  size >= 8;  p += 8, size -= 8) {
+        unsigned lo = crc ^ ReadLE32(p),  hi = ReadLE32(p+4);
+        crc = Crc32cTable[7][lo & 255] ^ Crc32cTable[6][(lo>>8) & 255] ^ Crc32cTable[5][(lo>>16) & 255] ^ Crc32cTable[4][lo>>24]
+            ^ Crc32cTable[3][hi & 255] ^ Crc32cTable[2][(hi>>8) & 255] ^ Crc32cTable[1][(hi>>16) & 255] ^ Crc32cTable[0][hi>>24];
+    }
+    for (;  size > 0;  size--)
+        crc = (crc >> 8) ^ Crc32cTable[0][(crc ^ *p++) & 255];
+    return crc;
+}
+
+static unsigned Crc32cLaneShiftApply (unsigned crc)
+{
+    return Crc32cLaneShift[0][crc & 255] ^ Crc32cLaneShift[1][(crc>>8) & 255] ^ Crc32cLaneShift[2][(crc>>16) & 255] ^ Crc32cLaneShift[3][crc>>24];
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE42
+static int CpuHasCrc32c()  {int info[4];  __cpuid (info, 1);  return (info[2] >> 20) & 1;}
+#else
+#define TARGET_SSE42  __attribute__((target("sse4.2")))
+static int CpuHasCrc32c()  {return __builtin_cpu_supports ("sse4.2");}
+#endif
+
+// SSE4.2 CRC-32C without pre/post-inversion. The crc32 instruction has 3-cycle latency and 1-cycle throughput,
+// so three independent lanes are processed simultaneously and then combined
+TARGET_SSE42 static unsigned Crc32cHardware (unsigned crc, const unsigned char* p, CelsNum size)
+{
+    Uint64 crc0 = crc;
+    for (;  size > 0  &&  ((size_t)p & 7);  size--)
+        crc0 = _mm_crc32_u8 ((unsigned)crc0, *p++);
+
+    for (;  size >= 3*CRC32C_LANE;  p += 3*CRC32C_LANE, size -= 3*CRC32C_LANE) {
+        Uint64 crc1 = 0,  crc2 = 0;
+        const unsigned char* end = p + CRC32C_LANE;
+        const unsigned char* q;
+        for (q = p;  q < end;  q += 8) {
+            crc0 = _mm_crc32_u64 (crc0, *(const Uint64*)q);
+            crc1 = _mm_crc32_u64 (crc1, *(const Uint64*)(q + CRC32C_LANE));
+            crc2 = _mm_crc32_u64 (crc2, *(const Uint64*)(q + 2*CRC32C_LANE));
+        }
+        crc0 = Crc32cLaneShiftApply ((unsigned)crc0) ^ (unsigned)crc1;
+        crc0 = Crc32cLaneShiftApply ((unsigned)crc0) ^ (unsigned)crc2;
+    }
+
+    for (;  size >= 8;  p += 8, size -= 8)
+        crc0 = _mm_crc32_u64 (crc0, *(const Uint64*)p);
+    for (;  size > 0;  size--)
+        crc0 = _mm_crc32_u8 ((unsigned)crc0, *p++);
+    return (unsigned)crc0;
+}
+#endif
+
+static unsigned (*Crc32cUpdate) (unsigned crc, const unsigned char* p, CelsNum size) = Crc32cSoftware;
+
+static int InitCrc32c()
+{
+    unsigned i, k;
+    for (i=0; i<256; i++) {
+        unsigned crc = i;
+        for (k=0; k<8; k++)
+            crc = (crc & 1)?  (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        Crc32cTable[0][i] = crc;
+    }
+    for (i=0; i<256; i++)
+        for (k=1; k<8; k++)
+            Crc32cTable[k][i] = (Crc32cTable[k-1][i] >> 8) ^ Crc32cTable[0][Crc32cTable[k-1][i] & 255];
+
+    unsigned shift = Crc32cShiftOperator (CRC32C_LANE);
+    for (k=0; k<4; k++)
+        for (i=0; i<256; i++)
+            Crc32cLaneShift[k][i] = Crc32cMultiply (shift, i << (k*8));
+
+#if defined(__x86_64__) || defined(_M_X64)
+    if (CpuHasCrc32c())  Crc32cUpdate = Crc32cHardware;
+#endif
+    return 1;
+}
+static int Crc32cInitialized = InitCrc32c();
+
+// CRC-32C of the data preceded by data having CRC-32C equal to crc (0 for the beginning of data)
+unsigned CelsCrc32c (unsigned crc, const void* buf, CelsNum size)
+{
+    return ~Crc32cUpdate (~crc, (const unsigned char*)buf, size);
+}
+
+// CRC-32C of concatenation of data1 and data2, given CRC-32C of both parts and size of data2
+unsigned CelsCrc32cCombine (unsigned crc1, unsigned crc2, CelsNum size2)
+{
+    return Crc32cMultiply (Crc32cShiftOperator (size2), crc1) ^ crc2;
+}
+
+
+// XXH3 (64-bit and 128-bit, default secret and zero seed) =====================================================================
+
+const int    XXH_STRIPE_LEN       = 64;
+const int    XXH_SECRET_SIZE      = 192;
+const int    XXH_STRIPES_PER_BLOCK = (192-64)/8;
+const int    XXH_BUFFER_SIZE      = 256;     // streaming state buffers this many bytes (4 stripes)
+const Uint64 XXH_PRIME32_1 = 0x9E3779B1U,  XXH_PRIME32_2 = 0x85EBCA77U,  XXH_PRIME32_3 = 0xC2B2AE3DU;
+const Uint64 XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL,  XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL,  XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const Uint64 XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL,  XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+const Uint64 XXH_PRIME_MX1 = 0x165667919E3779F9ULL,  XXH_PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+static const unsigned char XxhSecret [XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+typedef struct {Uint64 low, high;} XxhHash128;
+
+static Uint64 XxhRotl64 (Uint64 x, int r)     {return (x << r) | (x >> (64-r));}
+static unsigned XxhRotl32 (unsigned x, int r) {return (x << r) | (x >> (32-r));}
+static unsigned XxhSwap32 (unsigned x)        {return (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);}
+static Uint64 XxhSwap64 (Uint64 x)            {return ((Uint64)XxhSwap32((unsigned)x) << 32) | XxhSwap32((unsigned)(x >> 32));}
+static Uint64 XxhXorshift (Uint64 x, int s)   {return x ^ (x >> s);}
+
+static XxhHash128 XxhMult64to128 (Uint64 a, Uint64 b)
+{
+    XxhHash128 r;
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    r.low = (Uint64)product,  r.high = (Uint64)(product >> 64);
+#else
+    Uint64 lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF),  hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    Uint64 lo_hi = (a & 0xFFFFFFFF) * (b >> 32),         hi_hi = (a >> 32) * (b >> 32);
+    Uint64 cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    r.high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    r.low  = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+    return r;
+}
+
+static Uint64 XxhMulFold64 (Uint64 a, Uint64 b)  {XxhHash128 r = XxhMult64to128 (a, b);  return r.low ^ r.high;}
+
+static Uint64 Xxh64Avalanche (Uint64 h)
+{
+    h ^= h >> 33;  h *= XXH_PRIME64_2;
+    h ^= h >> 29;  h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static Uint64 Xxh3Avalanche (Uint64 h)
+{
+    h = XxhXorshift (h, 37) * XXH_PRIME_MX1;
+    return XxhXorshift (h, 32);
+}
+
+static Uint64 Xxh3Rrmxmx (Uint64 h, Uint64 len)
+{
+    h ^= XxhRotl64 (h, 49) ^ XxhRotl64 (h, 24);
+    h *= XXH_PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_PRIME_MX2;
+    return XxhXorshift (h, 28);
+}
+
+static Uint64 XxhMix16 (const unsigned char* p, const unsigned char* secret)
+{
+    return XxhMulFold64 (ReadLE64(p) ^ ReadLE64(secret), ReadLE64(p+8) ^ ReadLE64(secret+8));
+}
+
+// Mix two 16-byte inputs into 128-bit accumulator
+static void XxhMix32 (XxhHash128* acc, const unsigned char* p1, const unsigned char* p2, const unsigned char* secret)
+{
+    acc->low  += XxhMix16 (p1, secret);
+    acc->low  ^= ReadLE64(p2) + ReadLE64(p2+8);
+    acc->high += XxhMix16 (p2, secret+16);
+    acc->high ^= ReadLE64(p1) + ReadLE64(p1+8);
+}
+
+// Long inputs are processed by stripes of 64 bytes, accumulated into 8 lanes
+static void XxhAccumulate512 (Uint64* acc, const unsigned char* p, const unsigned char* secret)
+{
+    int i;
+    for (i=0; i<8; i++) {
+        Uint64 data = ReadLE64 (p + 8*i);
+        Uint64 key  = data ^ ReadLE64 (secret + 8*i);
+        acc[i^1] += data;
+        acc[i]   += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void XxhScramble (Uint64* acc, const unsigned char* secret)
+{
+    int i;
+    for (i=0; i<8; i++)
+        acc[i] = (XxhXorshift (acc[i], 47) ^ ReadLE64 (secret + 8*i)) * XXH_PRIME32_1;
+}
+
+static void XxhAccumulate (Uint64* acc, const unsigned char* p, const unsigned char* secret, CelsNum stripes)
+{
+    CelsNum n;
+    for (n=0; n<stripes; n++)
+        XxhAccumulate512 (acc, p + n*XXH_STRIPE_LEN, secret + n*8);
+}
+
+static Uint64 XxhMergeAccs (const Uint64* acc, const unsigned char* secret, Uint64 start)
+{
+    Uint64 result = start;
+    int i;
+    for (i=0; i<4; i++)
+        result += XxhMulFold64 (acc[2*i] ^ ReadLE64 (secret + 16*i), acc[2*i+1] ^ ReadLE64 (secret + 16*i + 8));
+    return Xxh3Avalanche (result);
+}
+
+static void XxhInitAccs (Uint64* acc)
+{
+    acc[0] = XXH_PRIME32_3,  acc[1] = XXH_PRIME64_1,  acc[2] = XXH_PRIME64_2,  acc[3] = XXH_PRIME64_3;
+    acc[4] = XXH_PRIME64_4,  acc[5] = XXH_PRIME32_2,  acc[6] = XXH_PRIME64_5,  acc[7] = XXH_PRIME32_1;
+}
+
+// Accumulate all stripes of the long input except for the last one, which is accumulated by the caller
+static void XxhHashLong (Uint64* acc, const unsigned char* p, CelsNum len)
+{
+    const CelsNum block_len = XXH_STRIPE_LEN * XXH_STRIPES_PER_BLOCK;
+    CelsNum blocks = (len-1) / block_len,  n;
+    XxhInitAccs (acc);
+    for (n=0; n<blocks; n++) {
+        XxhAccumulate (acc, p + n*block_len, XxhSecret, XXH_STRIPES_PER_BLOCK);
+        XxhScramble (acc, XxhSecret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+    }
+    XxhAccumulate (acc, p + blocks*block_len, XxhSecret, ((len-1) - blocks*block_len) / XXH_STRIPE_LEN);
+    XxhAccumulate512 (acc, p + len - XXH_STRIPE_LEN, XxhSecret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+}
+
+static Uint64 Xxh3_64 (const unsigned char* p, CelsNum len)
+{
+    const unsigned char* secret = XxhSecret;
+    if (len == 0)
+        return Xxh64Avalanche (ReadLE64(secret+56) ^ ReadLE64(secret+64));
+    if (len <= 3) {
+        unsigned combined = ((unsigned)p[0] << 16) | ((unsigned)p[len>>1] << 24) | p[len-1] | ((unsigned)len << 8);
+        return Xxh64Avalanche ((Uint64)combined ^ (ReadLE32(secret) ^ ReadLE32(secret+4)));
+    }
+    if (len <= 8) {
+        Uint64 input = ReadLE32(p+len-4) + ((Uint64)ReadLE32(p) << 32);
+        return Xxh3Rrmxmx (input ^ (ReadLE64(secret+8) ^ ReadLE64(secret+16)), len);
+    }
+    if (len <= 16) {
+        Uint64 lo = ReadLE64(p)         ^ (ReadLE64(secret+24) ^ ReadLE64(secret+32));
+        Uint64 hi = ReadLE64(p+len-8)   ^ (ReadLE64(secret+40) ^ ReadLE64(secret+48));
+        return Xxh3Avalanche (len + XxhSwap64(lo) + hi + XxhMulFold64 (lo, hi));
+    }
+    Uint64 acc = len * XXH_PRIME64_1;
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96)
+                    acc += XxhMix16 (p+48, secret+96) + XxhMix16 (p+len-64, secret+112);
+                acc += XxhMix16 (p+32, secret+64) + XxhMix16 (p+len-48, secret+80);
+            }
+            acc += XxhMix16 (p+16, secret+32) + XxhMix16 (p+len-32, secret+48);
+        }
+        acc += XxhMix16 (p, secret) + XxhMix16 (p+len-16, secret+16);
+        return Xxh3Avalanche (acc);
+    }
+    if (len <= 240) {
+        int i, rounds = (int)(len / 16);
+        for (i=0; i<8; i++)
+            acc += XxhMix16 (p + 16*i, secret + 16*i);
+        acc = Xxh3Avalanche (acc);
+        for (i=8; i<rounds; i++)
+            acc += XxhMix16 (p + 16*i, secret + 16*(i-8) + 3);
+        acc += XxhMix16 (p+len-16, secret + 136-17);
+        return Xxh3Avalanche (acc);
+    }
+    Uint64 accs[8];
+    XxhHashLong (accs, p, len);
+    return XxhMergeAccs (accs, secret+11, len * XXH_PRIME64_1);
+}
+
+static XxhHash128 Xxh3_128 (const unsigned char* p, CelsNum len)
+{
+    const unsigned char* secret = XxhSecret;
+    XxhHash128 h;
+    if (len == 0) {
+        h.low  = Xxh64Avalanche (ReadLE64(secret+64) ^ ReadLE64(secret+72));
+        h.high = Xxh64Avalanche (ReadLE64(secret+80) ^ ReadLE64(secret+88));
+        return h;
+    }
+    if (len <= 3) {
+        unsigned combined_lo = ((unsigned)p[0] << 16) | ((unsigned)p[len>>1] << 24) | p[len-1] | ((unsigned)len << 8);
+        unsigned combined_hi = XxhRotl32 (XxhSwap32 (combined_lo), 13);
+        h.low  = Xxh64Avalanche ((Uint64)combined_lo ^ (ReadLE32(secret)   ^ ReadLE32(secret+4)));
+        h.high = Xxh64Avalanche ((Uint64)combined_hi ^ (ReadLE32(secret+8) ^ ReadLE32(secret+12)));
+        return h;
+    }
+    if (len <= 8) {
+        Uint64 input = ReadLE32(p) + ((Uint64)ReadLE32(p+len-4) << 32);
+        Uint64 keyed = input ^ (ReadLE64(secret+16) ^ ReadLE64(secret+24));
+        XxhHash128 m = XxhMult64to128 (keyed, XXH_PRIME64_1 + (len << 2));
+        m.high += m.low << 1;
+        m.low  ^= m.high >> 3;
+        m.low   = XxhXorshift (XxhXorshift (m.low, 35) * XXH_PRIME_MX2, 28);
+        m.high  = Xxh3Avalanche (m.high);
+        return m;
+    }
+    if (len <= 16) {
+        Uint64 bitflip_lo = ReadLE64(secret+32) ^ ReadLE64(secret+40);
+        Uint64 bitflip_hi = ReadLE64(secret+48) ^ ReadLE64(secret+56);
+        Uint64 input_lo = ReadLE64(p),  input_hi = ReadLE64(p+len-8);
+        XxhHash128 m = XxhMult64to128 (input_lo ^ input_hi ^ bitflip_lo, XXH_PRIME64_1);
+        m.low += (Uint64)(len-1) << 54;
+        input_hi ^= bitflip_hi;
+        m.high += input_hi + (input_hi & 0xFFFFFFFF) * (XXH_PRIME32_2 - 1);
+        m.low ^= XxhSwap64 (m.high);
+        h = XxhMult64to128 (m.low, XXH_PRIME64_2);
+        h.high += m.high * XXH_PRIME64_2;
+        h.low  = Xxh3Avalanche (h.low);
+        h.high = Xxh3Avalanche (h.high);
+        return h;
+    }
+    if (len <= 240) {
+        XxhHash128 acc = {len * XXH_PRIME64_1, 0};
+        if (len <= 128) {
+            if (len > 32) {
+                if (len > 64) {
+                    if (len > 96)
+                        XxhMix32 (&acc, p+48, p+len-64, secret+96);
+                    XxhMix32 (&acc, p+32, p+len-48, secret+64);
+                }
+                XxhMix32 (&acc, p+16, p+len-32, secret+32);
+            }
+            XxhMix32 (&acc, p, p+len-16, secret);
+        } else {
+            int i, rounds = (int)(len / 32);
+            for (i=0; i<4; i++)
+                XxhMix32 (&acc, p + 32*i, p + 32*i + 16, secret + 32*i);
+            acc.low  = Xxh3Avalanche (acc.low);
+            acc.high = Xxh3Avalanche (acc.high);
+            for (i=4; i<rounds; i++)
+                XxhMix32 (&acc, p + 32*i, p + 32*i + 16, secret + 3 + 32*(i-4));
+            XxhMix32 (&acc, p+len-16, p+len-32, secret + 136-17-16);
+        }
+        h.low  = acc.low + acc.high;
+        h.high = acc.low * XXH_PRIME64_1 + acc.high * XXH_PRIME64_4 + len * XXH_PRIME64_2;
+        h.low  = Xxh3Avalanche (h.low);
+        h.high = 0 - Xxh3Avalanche (h.high);
+        return h;
+    }
+    Uint64 accs[8];
+    XxhHashLong (accs, p, len);
+    h.low  = XxhMergeAccs (accs, secret+11, len * XXH_PRIME64_1);
+    h.high = XxhMergeAccs (accs, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 11, ~(len * XXH_PRIME64_2));
+    return h;
+}
+
+unsigned long long CelsXxh3 (const void* buf, CelsNum size)
+{
+    return Xxh3_64 ((const unsigned char*)buf, size);
+}
+
+void CelsXxh128 (const void* buf, CelsNum size, unsigned long long hash[2])
+{
+    XxhHash128 h = Xxh3_128 ((const unsigned char*)buf, size);
+    hash[0] = h.low,  hash[1] = h.high;
+}
+
+// Streaming XXH3: input is buffered and consumed by 4 stripes, always keeping at least one byte for the final stripe
+typedef struct {
+    Uint64         acc[8];
+    unsigned char  buffer [XXH_BUFFER_SIZE];
+    int            buffered;
+    int            stripes_in_block;     // stripes accumulated since the last scramble
+    Uint64         total_len;
+} XxhState;
+
+static void XxhReset (XxhState* state)
+{
+    XxhInitAccs (state->acc);
+    state->buffered = 0,  state->stripes_in_block = 0,  state->total_len = 0;
+}
+
+static void XxhConsumeStripes (Uint64* acc, int* stripes_in_block, const unsigned char* p, int stripes)
+{
+    int to_end = XXH_STRIPES_PER_BLOCK - *stripes_in_block;
+    if (stripes >= to_end) {
+        XxhAccumulate (acc, p, XxhSecret + *stripes_in_block * 8, to_end);
+        XxhScramble (acc, XxhSecret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+        XxhAccumulate (acc, p + to_end*XXH_STRIPE_LEN, XxhSecret, stripes - to_end);
+        *stripes_in_block = stripes - to_end;
+    } else {
+        XxhAccumulate (acc, p, XxhSecret + *stripes_in_block * 8, stripes);
+        *stripes_in_block += stripes;
+    }
+}
+
+static void XxhUpdate (XxhState* state, const unsigned char* p, CelsNum len)
+{
+    const unsigned char* end = p + len;
+    state->total_len += len;
+    if (state->buffered + len <= XXH_BUFFER_SIZE) {
+        memcpy (state->buffer + state->buffered, p, len);
+        state->buffered += (int)len;
+        return;
+    }
+    if (state->buffered) {
+        int fill = XXH_BUFFER_SIZE - state->buffered;
+        memcpy (state->buffer + state->buffered, p, fill);
+        p += fill;
+        XxhConsumeStripes (state->acc, &state->stripes_in_block, state->buffer, XXH_BUFFER_SIZE/XXH_STRIPE_LEN);
+        state->buffered = 0;
+    }
+    if (end - p > XXH_BUFFER_SIZE) {
+        do {
+            XxhConsumeStripes (state->acc, &state->stripes_in_block, p, XXH_BUFFER_SIZE/XXH_STRIPE_LEN);
+            p += XXH_BUFFER_SIZE;
+        } while (end - p > XXH_BUFFER_SIZE);
+        // Keep the last consumed stripe, since the final stripe may overlap it
+        memcpy (state->buffer + XXH_BUFFER_SIZE - XXH_STRIPE_LEN, p - XXH_STRIPE_LEN, XXH_STRIPE_LEN);
+    }
+    memcpy (state->buffer, p, end - p);
+    state->buffered = (int)(end - p);
+}
+
+// Accumulate buffered data of the long input into copy of the accumulators
+static void XxhDigestLong (const XxhState* state, Uint64* acc)
+{
+    unsigned char last_stripe [XXH_STRIPE_LEN];
+    const unsigned char* last;
+    memcpy (acc, state->acc, sizeof(state->acc));
+    if (state->buffered >= XXH_STRIPE_LEN) {
+        int stripes_in_block = state->stripes_in_block;
+        XxhConsumeStripes (acc, &stripes_in_block, state->buffer, (state->buffered-1) / XXH_STRIPE_LEN);
+        last = state->buffer + state->buffered - XXH_STRIPE_LEN;
+    } else {
+        int catchup = XXH_STRIPE_LEN - state->buffered;
+        memcpy (last_stripe, state->buffer + XXH_BUFFER_SIZE - catchup, catchup);
+        memcpy (last_stripe + catchup, state->buffer, state->buffered);
+        last = last_stripe;
+    }
+    XxhAccumulate512 (acc, last, XxhSecret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+}
+
+static Uint64 XxhDigest64 (const XxhState* state)
+{
+    if (state->total_len <= 240)  return Xxh3_64 (state->buffer, state->total_len);
+    Uint64 acc[8];
+    XxhDigestLong (state, acc);
+    return XxhMergeAccs (acc, XxhSecret+11, state->total_len * XXH_PRIME64_1);
+}
+
+static XxhHash128 XxhDigest128 (const XxhState* state)
+{
+    if (state->total_len <= 240)  return Xxh3_128 (state->buffer, state->total_len);
+    Uint64 acc[8];
+    XxhDigestLong (state, acc);
+    XxhHash128 h;
+    h.low  = XxhMergeAccs (acc, XxhSecret+11, state->total_len * XXH_PRIME64_1);
+    h.high = XxhMergeAccs (acc, XxhSecret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 11, ~(state->total_len * XXH_PRIME64_2));
+    return h;
+}
+
+
+// SHA-256 =====================================================================================================================
+
+const int     SHA256_LANES          = 8;         // messages hashed simultaneously by AVX2 multi-buffer code
+const CelsNum SHA256_PARALLEL_SLICE = 1<<20;     // minimal part of the batch hashed by a separate thread
+
+static const unsigned Sha256K [64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const unsigned Sha256Init [8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static unsigned ReadBE32 (const unsigned char* p)  {return ((unsigned)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3];}
+static void     WriteBE32 (unsigned char* p, unsigned x)  {p[0] = (unsigned char)(x>>24),  p[1] = (unsigned char)(x>>16),  p[2] = (unsigned char)(x>>8),  p[3] = (unsigned char)x;}
+static unsigned Rotr32 (unsigned x, int n)  {return (x >> n) | (x << (32-n));}
+
+static void Sha256BlocksSoftware (unsigned* state, const unsigned char* p, CelsNum blocks)
+{
+    for (;  blocks > 0;  blocks--, p += 64)
+    {
+        unsigned w[64];
+        int i;
+        for (i=0; i<16; i++)
+            w[i] = ReadBE32 (p + 4*i);
+        for (i=16; i<64; i++)
+            w[i] = w[i-16] + (Rotr32(w[i-15],7) ^ Rotr32(w[i-15],18) ^ (w[i-15]>>3)) + w[i-7] + (Rotr32(w[i-2],17) ^ Rotr32(w[i-2],19) ^ (w[i-2]>>10));
+        unsigned a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (i=0; i<64; i++) {
+            unsigned t1 = h + (Rotr32(e,6) ^ Rotr32(e,11) ^ Rotr32(e,25)) + ((e & f) ^ (~e & g)) + Sha256K[i] + w[i];
+            unsigned t2 = (Rotr32(a,2) ^ Rotr32(a,13) ^ Rotr32(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g,  g = f,  f = e,  e = d + t1;
+            d = c,  c = b,  b = a,  a = t1 + t2;
+        }
+        state[0] += a,  state[1] += b,  state[2] += c,  state[3] += d,  state[4] += e,  state[5] += f,  state[6] += g,  state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define TARGET_SHA
+#define TARGET_AVX2
+static int CpuHasSha()   {int info[4];  __cpuidex (info, 7, 0);  return (info[1] >> 29) & 1;}
+static int CpuHasAvx2()  {int info[4];  __cpuidex (info, 7, 0);  return ((info[1] >> 5) & 1)  &&  (_xgetbv(0) & 6) == 6;}
+#else
+#define TARGET_SHA   __attribute__((target("sha,sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+static int CpuHasSha()   {return __builtin_cpu_supports ("sha");}
+static int CpuHasAvx2()  {return __builtin_cpu_supports ("avx2");}
+#endif
+
+// SHA-NI: state is kept as ABEF and CDGH quads, each sha256rnds2 performs two rounds
+TARGET_SHA static void Sha256BlocksHardware (unsigned* state, const unsigned char* p, CelsNum blocks)
+{
+    const __m128i bswap = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp    = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i*)state), 0xB1);       // CDAB
+    __m128i state1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i*)(state+4)), 0x1B);   // EFGH
+    __m128i state0 = _mm_alignr_epi8 (tmp, state1, 8);                                         // ABEF
+    state1 = _mm_blend_epi16 (state1, tmp, 0xF0);                                              // CDGH
+
+    for (;  blocks > 0;  blocks--, p += 64)
+    {
+        __m128i save0 = state0,  save1 = state1,  w[4];
+        int i;
+        for (i=0; i<16; i++) {
+            if (i < 4)  w[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i*)(p + 16*i)), bswap);
+            else        w[i&3] = _mm_sha256msg2_epu32 (_mm_add_epi32 (_mm_sha256msg1_epu32 (w[i&3], w[(i+1)&3]),
+                                                                      _mm_alignr_epi8 (w[(i+3)&3], w[(i+2)&3], 4)), w[(i+3)&3]);
+            __m128i msg = _mm_add_epi32 (w[i&3], _mm_loadu_si128 ((const __m128i*)(Sha256K + 4*i)));
+            state1 = _mm_sha256rnds2_epu32 (state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32 (state0, state1, _mm_shuffle_epi32 (msg, 0x0E));
+        }
+        state0 = _mm_add_epi32 (state0, save0);
+        state1 = _mm_add_epi32 (state1, save1);
+    }
+
+    tmp    = _mm_shuffle_epi32 (state0, 0x1B);                // FEBA
+    state1 = _mm_shuffle_epi32 (state1, 0xB1);                // DCHG
+    _mm_storeu_si128 ((__m128i*)state,     _mm_blend_epi16 (tmp, state1, 0xF0));    // DCBA
+    _mm_storeu_si128 ((__m128i*)(state+4), _mm_alignr_epi8 (state1, tmp, 8));       // HGFE
+}
+
+#define SHA256_ROTR(x,n)  _mm256_or_si256 (_mm256_srli_epi32 (x, n), _mm256_slli_epi32 (x, 32-(n)))
+
+// AVX2 multi-buffer: one block of each of 8 independent messages, state[i] holds word i of all 8 states
+TARGET_AVX2 static void Sha256BlocksLanes (unsigned state [8][SHA256_LANES], const unsigned char* blocks [SHA256_LANES])
+{
+    __m256i w[16], s[8];
+    int i;
+    for (i=0; i<8; i++)
+        s[i] = _mm256_loadu_si256 ((const __m256i*)state[i]);
+    for (i=0; i<64; i++)
+    {
+        __m256i x;
+        if (i < 16) {
+            x = _mm256_set_epi32 (ReadBE32(blocks[7]+4*i), ReadBE32(blocks[6]+4*i), ReadBE32(blocks[5]+4*i), ReadBE32(blocks[4]+4*i),
+                                  ReadBE32(blocks[3]+4*i), ReadBE32(blocks[2]+4*i), ReadBE32(blocks[1]+4*i), ReadBE32(blocks[0]+4*i));
+        } else {
+            __m256i w15 = w[(i-15)&15],  w2 = w[(i-2)&15];
+            __m256i s0 = _mm256_xor_si256 (_mm256_xor_si256 (SHA256_ROTR(w15,7),  SHA256_ROTR(w15,18)), _mm256_srli_epi32 (w15,3));
+            __m256i s1 = _mm256_xor_si256 (_mm256_xor_si256 (SHA256_ROTR(w2,17),  SHA256_ROTR(w2,19)),  _mm256_srli_epi32 (w2,10));
+            x = _mm256_add_epi32 (_mm256_add_epi32 (w[i&15], s0), _mm256_add_epi32 (w[(i-7)&15], s1));
+        }
+        w[i&15] = x;
+
+        __m256i e = s[4],  a = s[0];
+        __m256i S1 = _mm256_xor_si256 (_mm256_xor_si256 (SHA256_ROTR(e,6), SHA256_ROTR(e,11)), SHA256_ROTR(e,25));
+        __m256i ch = _mm256_xor_si256 (_mm256_and_si256 (e, s[5]), _mm256_andnot_si256 (e, s[6]));
+        __m256i t1 = _mm256_add_epi32 (_mm256_add_epi32 (_mm256_add_epi32 (s[7], S1), _mm256_add_epi32 (ch, x)), _mm256_set1_epi32 ((int)Sha256K[i]));
+        __m256i S0 = _mm256_xor_si256 (_mm256_xor_si256 (SHA256_ROTR(a,2), SHA256_ROTR(a,13)), SHA256_ROTR(a,22));
+        __m256i maj = _mm256_or_si256 (_mm256_and_si256 (a, s[1]), _mm256_and_si256 (s[2], _mm256_or_si256 (a, s[1])));
+        s[7] = s[6],  s[6] = s[5],  s[5] = s[4],  s[4] = _mm256_add_epi32 (s[3], t1);
+        s[3] = s[2],  s[2] = s[1],  s[1] = s[0],  s[0] = _mm256_add_epi32 (t1, _mm256_add_epi32 (S0, maj));
+    }
+    for (i=0; i<8; i++)
+        _mm256_storeu_si256 ((__m256i*)state[i], _mm256_add_epi32 (_mm256_loadu_si256 ((const __m256i*)state[i]), s[i]));
+}
+
+static void (*Sha256Blocks) (unsigned* state, const unsigned char* p, CelsNum blocks) = CpuHasSha()?  Sha256BlocksHardware : Sha256BlocksSoftware;
+static int Sha256UseLanes = !CpuHasSha() && CpuHasAvx2();     // SHA-NI hashes a single message faster than AVX2 hashes 8 ones
+#else
+static void (*Sha256Blocks) (unsigned* state, const unsigned char* p, CelsNum blocks) = Sha256BlocksSoftware;
+static int Sha256UseLanes = 0;
+#endif
+
+// Build padded last 1 or 2 blocks of the message into tail, return number of blocks
+static int Sha256Tail (unsigned char* tail, const unsigned char* p, CelsNum size)
+{
+    int rest = (int)(size % 64),  blocks = (rest < 56? 1 : 2),  i;
+    memset (tail, 0, 128);
+    memcpy (tail, p + size - rest, rest);
+    tail[rest] = 0x80;
+    for (i=0; i<8; i++)
+        tail [blocks*64-1-i] = (unsigned char)(((Uint64)size*8) >> (i*8));
+    return blocks;
+}
+
+static void Sha256Digest (const unsigned* state, unsigned char* hash)
+{
+    int i;
+    for (i=0; i<8; i++)
+        WriteBE32 (hash + 4*i, state[i]);
+}
+
+static void Sha256 (const unsigned char* p, CelsNum size, unsigned char* hash)
+{
+    unsigned state[8];
+    unsigned char tail[128];
+    memcpy (state, Sha256Init, sizeof(state));
+    Sha256Blocks (state, p, size/64);
+    Sha256Blocks (state, tail, Sha256Tail (tail, p, size));
+    Sha256Digest (state, hash);
+}
+
+// Hash n independent messages by the calling thread. With AVX2 lanes, each lane takes the next message as soon as
+// its current one is finished, so messages of different sizes keep all lanes busy
+static void Sha256Many (int n, const void* const* bufs, const CelsNum* sizes, unsigned char (*hashes)[32])
+{
+    int i, k;
+    if (!Sha256UseLanes  ||  n < 2) {
+        for (i=0; i<n; i++)
+            Sha256 ((const unsigned char*)bufs[i], sizes[i], hashes[i]);
+        return;
+    }
+#if defined(__x86_64__) || defined(_M_X64)
+    unsigned state [8][SHA256_LANES];
+    unsigned char tails [SHA256_LANES][128],  idle [64] = {0};
+    const unsigned char *ptr [SHA256_LANES],  *blocks [SHA256_LANES];
+    CelsNum full [SHA256_LANES];                     // full blocks of message data left in the lane
+    int message [SHA256_LANES],  tail_blocks [SHA256_LANES],  tail_done [SHA256_LANES],  next = 0,  active = 0;
+    for (k=0; k<SHA256_LANES; k++)
+        message[k] = -1;
+    for (;;)
+    {
+        for (k=0; k<SHA256_LANES; k++)               // start next messages in free lanes
+            if (message[k] < 0  &&  next < n) {
+                message[k] = next++,  active++;
+                ptr[k]  = (const unsigned char*) bufs[message[k]];
+                full[k] = sizes[message[k]] / 64;
+                tail_blocks[k] = Sha256Tail (tails[k], ptr[k], sizes[message[k]]);
+                tail_done[k] = 0;
+                for (i=0; i<8; i++)
+                    state[i][k] = Sha256Init[i];
+            }
+        if (active == 0)  break;
+        for (k=0; k<SHA256_LANES; k++)
+            if (message[k] < 0)   blocks[k] = idle;
+            else if (full[k] > 0) blocks[k] = ptr[k],  ptr[k] += 64,  full[k]--;
+            else                  blocks[k] = tails[k] + 64*tail_done[k]++;
+        Sha256BlocksLanes (state, blocks);
+        for (k=0; k<SHA256_LANES; k++)
+            if (message[k] >= 0  &&  tail_done[k] == tail_blocks[k]) {
+                for (i=0; i<8; i++)
+                    WriteBE32 (hashes[message[k]] + 4*i, state[i][k]);
+                message[k] = -1,  active--;
+            }
+    }
+#endif
+}
+
+void CelsSha256 (const void* buf, CelsNum size, unsigned char hash[32])
+{
+    Sha256 ((const unsigned char*)buf, size, hash);
+}
+
+// Part of the batch hashed by a pool job
+typedef struct {
+    int                 n;
+    const void* const*  bufs;
+    const CelsNum*      sizes;
+    unsigned char     (*hashes)[32];
+} Sha256Job;
+
+static void __cdecl Sha256JobFunction (void* arg)
+{
+    Sha256Job* job = (Sha256Job*) arg;
+    Sha256Many (job->n, job->bufs, job->sizes, job->hashes);
+}
+
+void CelsSha256Batch (int n, const void* const* bufs, const CelsNum* sizes, unsigned char (*hashes)[32], void* ud, CelsCallback* cb)
+{
+    CelsThreadPool* pool = CelsGetThreadPool (cb,ud);
+    if (pool == NULL)  pool = CelsDefaultThreadPool();
+    CelsNum total = 0,  done = 0;
+    int i,  first = 0,  jobs_num = 0;
+    for (i=0; i<n; i++)
+        total += sizes[i];
+
+    // Split batch into jobs of about equal size, at least SHA256_PARALLEL_SLICE bytes each
+    int max_jobs = (pool? pool->threads+1 : 1);
+    if (max_jobs > POOL_MAX_THREADS)                     max_jobs = POOL_MAX_THREADS;
+    if (max_jobs > total / SHA256_PARALLEL_SLICE)        max_jobs = (int)(total / SHA256_PARALLEL_SLICE);
+    if (max_jobs < 2)  {Sha256Many (n, bufs, sizes, hashes);  return;}
+
+    Sha256Job jobs [POOL_MAX_THREADS];
+    volatile long pending = 0;
+    for (i=0; i<n; i++) {
+        done += sizes[i];
+        if (i == n-1  ||  done * max_jobs >= total * (jobs_num+1)) {
+            Sha256Job* job = &jobs[jobs_num++];
+            job->n = i+1-first,  job->bufs = bufs+first,  job->sizes = sizes+first,  job->hashes = hashes+first;
+            if (pool->Submit (pool, Sha256JobFunction, job, &pending) < CELS_OK)
+                Sha256JobFunction (job);
+            first = i+1;
+        }
+    }
+    pool->Wait (pool, &pending);
+}
+
+// Streaming SHA-256 for the checksum codec
+typedef struct {
+    unsigned       state[8];
+    unsigned char  buffer[64];
+    int            buffered;
+    Uint64         total_len;
+} Sha256State;
+
+static void Sha256Reset (Sha256State* s)
+{
+    memcpy (s->state, Sha256Init, sizeof(s->state));
+    s->buffered = 0,  s->total_len = 0;
+}
+
+static void Sha256Update (Sha256State* s, const unsigned char* p, CelsNum size)
+{
+    s->total_len += size;
+    if (s->buffered) {
+        int n = (size < 64 - s->buffered?  (int)size : 64 - s->buffered);
+        memcpy (s->buffer + s->buffered, p, n);
+        s->buffered += n,  p += n,  size -= n;
+        if (s->buffered < 64)  return;
+        Sha256Blocks (s->state, s->buffer, 1);
+        s->buffered = 0;
+    }
+    Sha256Blocks (s->state, p, size/64);
+    s->buffered = (int)(size % 64);
+    memcpy (s->buffer, p + size - s->buffered, s->buffered);
+}
+
+static void Sha256Final (Sha256State* s, unsigned char* hash)
+{
+    unsigned char tail[128];
+    int blocks = Sha256Tail (tail, s->buffer, s->buffered),  i;
+    for (i=0; i<8; i++)
+        tail [blocks*64-1-i] = (unsigned char)((s->total_len*8) >> (i*8));
+    Sha256Blocks (s->state, tail, blocks);
+    Sha256Digest (s->state, hash);
+}
+
+
+// Checksum codec ==============================================================================================================
+
+enum {CHECKSUM_CRC32C, CHECKSUM_XXH3, CHECKSUM_XXH128, CHECKSUM_SHA256, CHECKSUM_TYPES};
+static const char* CHECKSUM_NAMES[]  = {"crc32c", "xxh3", "xxh128", "sha256"};
+static const int   CHECKSUM_SIZES[]  = {4, 8, 16, 32};
+
+const CelsNum CHECKSUM_BUFFER_SIZE    = 256<<10;   // Buffer size for streaming operation
+const CelsNum CHECKSUM_PARALLEL_SLICE = 4<<20;     // Minimal slice of memory buffer checksummed by a separate thread
+
+typedef struct {
+    int          type;
+    unsigned     crc;
+    XxhState     xxh;
+    Sha256State  sha;
+} ChecksumState;
+
+static void ChecksumInit (ChecksumState* state, int type)
+{
+    state->type = type;
+    state->crc  = 0;
+    if (type == CHECKSUM_SHA256)       Sha256Reset (&state->sha);
+    else if (type != CHECKSUM_CRC32C)  XxhReset (&state->xxh);
+}
+
+static void ChecksumUpdate (ChecksumState* state, const void* buf, CelsNum size)
+{
+    if (state->type == CHECKSUM_CRC32C)       state->crc = CelsCrc32c (state->crc, buf, size);
+    else if (state->type == CHECKSUM_SHA256)  Sha256Update (&state->sha, (const unsigned char*)buf, size);
+    else                                      XxhUpdate (&state->xxh, (const unsigned char*)buf, size);
+}
+
+// Store checksum into buf and return its size
+static int ChecksumFinal (ChecksumState* state, unsigned char* buf)
+{
+    if (state->type == CHECKSUM_CRC32C) {
+        WriteLE64 (buf, state->crc);   // only 4 bytes are used
+    } else if (state->type == CHECKSUM_XXH3) {
+        WriteLE64 (buf, XxhDigest64 (&state->xxh));
+    } else if (state->type == CHECKSUM_SHA256) {
+        Sha256Final (&state->sha, buf);
+    } else {
+        XxhHash128 h = XxhDigest128 (&state->xxh);
+        WriteLE64 (buf, h.low);
+        WriteLE64 (buf+8, h.high);
+    }
+    return CHECKSUM_SIZES[state->type];
+}
+
+// Slice of the memory buffer copied and checksummed by a pool job
+typedef struct {
+    const char*  in;
+    char*        out;
+    CelsNum      size;
+    unsigned     crc;
+} ChecksumSlice;
+
+static void __cdecl ChecksumSliceJob (void* arg)
+{
+    ChecksumSlice* slice = (ChecksumSlice*) arg;
+    memcpy (slice->out, slice->in, slice->size);
+    slice->crc = CelsCrc32c (0, slice->in, slice->size);
+}
+
+// Copy in to out and return checksum of the data in buf. CRC-32C of large buffers is computed by slices in parallel
+// using the thread pool, the calling thread processing slices too
+static int ChecksumMem (int type, const char* in, char* out, CelsNum size, unsigned char* checksum, CelsThreadPool* pool)
+{
+    int slices_num = (pool? pool->threads+1 : 1),  i;
+    if (slices_num > size / CHECKSUM_PARALLEL_SLICE)  slices_num = (int)(size / CHECKSUM_PARALLEL_SLICE);
+    if (slices_num > POOL_MAX_THREADS)                slices_num = POOL_MAX_THREADS;
+
+    ChecksumState state;
+    ChecksumInit (&state, type);
+    if (type != CHECKSUM_CRC32C  ||  slices_num < 2) {
+        memmove (out, in, size);
+        ChecksumUpdate (&state, out, size);
+        return ChecksumFinal (&state, checksum);
+    }
+
+    ChecksumSlice slices [POOL_MAX_THREADS];
+    volatile long pending = 0;
+    CelsNum slice_size = size / slices_num;
+    for (i=0; i<slices_num; i++) {
+        slices[i].in   = in  + i*slice_size;
+        slices[i].out  = out + i*slice_size;
+        slices[i].size = (i < slices_num-1? slice_size : size - i*slice_size);
+        if (pool->Submit (pool, ChecksumSliceJob, &slices[i], &pending) < CELS_OK)
+            ChecksumSliceJob (&slices[i]);
+    }
+    pool->Wait (pool, &pending);
+    for (i=0; i<slices_num; i++)
+        state.crc = (i == 0?  slices[0].crc : CelsCrc32cCombine (state.crc, slices[i].crc, slices[i].size));
+    return ChecksumFinal (&state, checksum);
+}
+
+// Thread pool of the host or the default one, used only for large buffers
+static CelsThreadPool* ChecksumPool (int type, CelsNum size, void* ud, CelsCallback* cb)
+{
+    if (type != CHECKSUM_CRC32C  ||  size < 2*CHECKSUM_PARALLEL_SLICE)  return NULL;
+    CelsThreadPool* pool = CelsGetThreadPool (cb,ud);
+    return pool? pool : CelsDefaultThreadPool();
+}
+
+static CelsResult __cdecl ChecksumCodec (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    int type = *(int*)self;   // for codec-level services self is the registration ud, for instance ones - the parsed method
+    int checksum_size = CHECKSUM_SIZES[type];
+    unsigned char checksum[32], expected[32];
+
+    switch (service)
+    {
+    case CELS_PARSE:
+        {
+            char** param = (char**)inbuf;
+            if (param[1])                   return CELS_ERROR_INVALID_COMPRESSOR;
+            if (outsize < (CelsNum)sizeof(int))  return CELS_ERROR_GENERAL;
+            *(int*)outbuf = type;
+            return sizeof(int);
+        }
+
+    case CELS_UNPARSE:
+        if ((CelsNum)strlen(CHECKSUM_NAMES[type]) >= outsize)  return CELS_ERROR_GENERAL;
+        strcpy ((char*)outbuf, CHECKSUM_NAMES[type]);
+        return CELS_OK;
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return insize + checksum_size;
+
+    case CELS_GET_COMPRESSION_MEMORY:
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return CHECKSUM_BUFFER_SIZE;
+
+    case CELS_COMPRESS:
+        {
+            if (inbuf  &&  outbuf) {
+                if (insize + checksum_size > outsize)  return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+                ChecksumMem (type, (char*)inbuf, (char*)outbuf, insize, checksum, ChecksumPool (type, insize, ud,cb));
+                memcpy ((char*)outbuf + insize, checksum, checksum_size);
+                return insize + checksum_size;
+            }
+            if (inbuf  ||  outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;   // framework will emulate buffers with callbacks
+
+            char* buf = (char*) CelsAlloc (cb,ud, CHECKSUM_BUFFER_SIZE);
+            if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            ChecksumState state;
+            ChecksumInit (&state, type);
+            CelsResult len;
+            while ((len = CelsRead (cb,ud, buf,CHECKSUM_BUFFER_SIZE)) > 0) {
+                ChecksumUpdate (&state, buf, len);
+                CelsResult result = CelsWrite (cb,ud, buf,len);
+                if (result != len)  {len = (result<CELS_OK? result : CELS_ERROR_WRITE);  break;}
+            }
+            CelsFreeMemory (cb,ud, buf,CHECKSUM_BUFFER_SIZE);
+            if (len < CELS_OK)  return len;
+            ChecksumFinal (&state, checksum);
+            len = CelsWrite (cb,ud, checksum,checksum_size);
+            return len==checksum_size? CELS_OK : len<CELS_OK? len : CELS_ERROR_WRITE;
+        }
+
+    case CELS_DECOMPRESS:
+        {
+            if (inbuf  &&  outbuf) {
+                if (insize < checksum_size)               return CELS_ERROR_BAD_COMPRESSED_DATA;
+                if (insize - checksum_size > outsize)     return CELS_ERROR_OUTBLOCK_TOO_SMALL;
+                ChecksumMem (type, (char*)inbuf, (char*)outbuf, insize - checksum_size, checksum, ChecksumPool (type, insize, ud,cb));
+                return memcmp (checksum, (char*)inbuf + insize - checksum_size, checksum_size)?  CELS_ERROR_BAD_CRC : insize - checksum_size;
+            }
+            if (inbuf  ||  outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;
+
+            // The last checksum_size bytes read so far may be the checksum, so they are kept at the buffer start
+            char* buf = (char*) CelsAlloc (cb,ud, CHECKSUM_BUFFER_SIZE + checksum_size);
+            if (buf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+            ChecksumState state;
+            ChecksumInit (&state, type);
+            CelsResult len, kept = 0;
+            while ((len = CelsRead (cb,ud, buf+kept,CHECKSUM_BUFFER_SIZE)) > 0) {
+                CelsNum data = kept + len - checksum_size;
+                if (data <= 0)  {kept += len;  continue;}
+                ChecksumUpdate (&state, buf, data);
+                CelsResult result = CelsWrite (cb,ud, buf,data);
+                if (result != data)  {len = (result<CELS_OK? result : CELS_ERROR_WRITE);  break;}
+                memmove (buf, buf+data, checksum_size);
+                kept = checksum_size;
+            }
+            memcpy (expected, buf, checksum_size);
+            CelsFreeMemory (cb,ud, buf,CHECKSUM_BUFFER_SIZE + checksum_size);
+            if (len < CELS_OK)             return len;
+            if (kept < checksum_size)      return CELS_ERROR_BAD_COMPRESSED_DATA;
+            ChecksumFinal (&state, checksum);
+            return memcmp (checksum, expected, checksum_size)?  CELS_ERROR_BAD_CRC : CELS_OK;
+        }
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+static CelsResult __cdecl DedupCodec (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+
+static void RegisterBuiltinCodecs()
+{
+    static int types[] = {CHECKSUM_CRC32C, CHECKSUM_XXH3, CHECKSUM_XXH128, CHECKSUM_SHA256};
+    static int dedup;
+    int i;
+    Lock (&RegistryLock);
+    if (!BuiltinCodecsRegistered) {
+        BuiltinCodecsRegistered = 1;
+        for (i=0; i<CHECKSUM_TYPES; i++)
+            CelsRegister (CHECKSUM_NAMES[i], &types[i], ChecksumCodec);
+        CelsRegister ("dedup", &dedup, DedupCodec);
+    }
+    Unlock (&RegistryLock);
+}
+
+
+
+// ****************************************************************************************************************************
+// Asynchronous file I/O for hosts: input file is read ahead into the queue of buffers, and codec output is written behind   *
+// by asynchronous writes, so the codec waits for disk only when it's faster than the disk. Linux 5.6+ uses io_uring,       *
+// other systems (and older kernels) perform the same requests by the background I/O thread. CelsIoCallback serves both     *
+// CELS_READ/CELS_WRITE and buffer-sharing services, in the latter case lending the I/O buffers directly to the codec.      *
+// ****************************************************************************************************************************
+
+const int     IO_DEFAULT_QUEUE_DEPTH = 4;
+const int     IO_MAX_QUEUE_DEPTH     = 64;
+const CelsNum IO_DEFAULT_BUFFER_SIZE = 1<<20;
+const CelsNum IO_ALIGNMENT           = 4096;   // O_DIRECT requirement for buffer addresses, file offsets and request sizes
+
+enum {IO_FREE, IO_BUSY, IO_READY, IO_LENT};    // IoBuffer states: free, request in flight, waiting for codec/write, lent to codec
+
+typedef struct {
+    char*     data;
+    CelsNum   size;         // input: bytes read; output: bytes to write
+    CelsNum   done;         // input: bytes passed to the codec; output: bytes already written
+    CelsNum   offset;       // file offset of data[0], or -1 for non-seekable files
+    CelsNum   seq;          // input: order of reading; output: order of writing
+    int       state;
+    int       output;
+    int       eof;          // input: no more data after this buffer
+} IoBuffer;
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <errno.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define CELS_IO_URING
+#endif
+#endif
+#endif
+
+struct CelsIo
+{
+    int         fd [2];                        // input and output files, -1 if not used
+    int         seekable [2];                  // non-seekable files (pipes) are accessed by one request at a time
+    int         direct [2];                    // O_DIRECT was enabled for the file
+    int         saved_flags [2];               // file flags to restore at CelsIoClose()
+    CelsNum     position [2];                  // input: file offset of the next byte for the codec; output: of the next write
+    CelsNum     next_offset;                   // file offset of the next read request
+    int         depth;                         // number of buffers in each direction
+    CelsNum     bufsize;
+    char*       memory;                        // all buffers in a single aligned block
+    IoBuffer    in  [IO_MAX_QUEUE_DEPTH];
+    IoBuffer    out [IO_MAX_QUEUE_DEPTH];
+    CelsNum     in_submit_seq, in_consume_seq; // next input buffer to read and to pass to the codec
+    int         in_eof, in_finished;           // read returned EOF (no more read requests); codec got all data
+    CelsNum     out_queue_seq, out_submit_seq; // output buffers are written strictly in the order they were queued
+    IoBuffer*   out_current;                   // output buffer filled by CELS_WRITE
+    int         in_flight [2];                 // number of requests in flight
+    CelsResult  error;                         // first I/O error
+    CelsNum     bytes_read, bytes_written, wait_ns;
+    Mutex       lock;                          // serializes callback calls
+
+    int         uring;                         // 1: io_uring backend, 0: I/O thread backend
+#ifdef CELS_IO_URING
+    int         ring_fd;
+    void        *sq_ptr, *cq_ptr;
+    size_t      sq_len, cq_len, sqes_len;
+    unsigned    *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned    sq_mask, cq_mask;
+    struct io_uring_sqe*  sqes;
+    struct io_uring_cqe*  cqes;
+#endif
+
+    Thread      thread;                        // I/O thread backend: requests and completions are FIFO queues
+    int         thread_started, stop;
+    Mutex       queue_lock;
+    CondVar     request_cv, completion_cv;
+    IoBuffer*   requests [2*IO_MAX_QUEUE_DEPTH];
+    IoBuffer*   completions [2*IO_MAX_QUEUE_DEPTH];
+    CelsNum     results [2*IO_MAX_QUEUE_DEPTH];
+    int         first_request, num_requests, first_completion, num_completions;
+};
+
+
+// Synchronous transfer of the remaining part of the buffer; returns bytes transferred or negative value on error
+static CelsNum IoTransfer (CelsIo* io, IoBuffer* buf)
+{
+    int     fd     = io->fd[buf->output];
+    char*   data   = buf->data + (buf->output? buf->done : buf->size);
+    CelsNum size   = (buf->output? buf->size - buf->done : io->bufsize - buf->size);
+    CelsNum offset = (buf->offset<0? -1 : buf->offset + (buf->output? buf->done : buf->size));
+#ifdef _WIN32
+    if (offset >= 0  &&  _lseeki64 (fd, offset, SEEK_SET) < 0)  return -1;
+    if (size > (1<<30))  size = 1<<30;
+    return buf->output?  _write (fd, data, (unsigned)size) : _read (fd, data, (unsigned)size);
+#else
+    if (offset >= 0)  return buf->output?  pwrite (fd, data, size, offset) : pread (fd, data, size, offset);
+    return buf->output?  write (fd, data, size) : read (fd, data, size);
+#endif
+}
+
+static THREAD_FUNCTION IoThread (void* arg)
+{
+    CelsIo* io = (CelsIo*) arg;
+    LockMutex (&io->queue_lock);
+    for(;;)
+    {
+        while (io->num_requests == 0  &&  !io->stop)
+            WaitCondVar (&io->request_cv, &io->queue_lock);
+        if (io->num_requests == 0)  break;
+        IoBuffer* buf = io->requests [io->first_request];
+        io->first_request = (io->first_request+1) % (2*IO_MAX_QUEUE_DEPTH),  io->num_requests--;
+        UnlockMutex (&io->queue_lock);
+
+        CelsNum result = IoTransfer (io, buf);
+
+        LockMutex (&io->queue_lock);
+        int i = (io->first_completion + io->num_completions++) % (2*IO_MAX_QUEUE_DEPTH);
+        io->completions[i] = buf,  io->results[i] = result;
+        SignalCondVar (&io->completion_cv);
+    }
+    UnlockMutex (&io->queue_lock);
+    return THREAD_RETURN;
+}
+
+
+#ifdef CELS_IO_URING
+static int UringSetup (CelsIo* io, unsigned entries)
+{
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    int fd = (int) syscall (__NR_io_uring_setup, entries, &p);
+    if (fd < 0)  return 0;
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))  {close (fd);  return 0;}   // IORING_OP_READ/WRITE and offset -1 need Linux 5.6+
+
+    io->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_len   = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)  io->sq_len = io->cq_len = (io->sq_len > io->cq_len? io->sq_len : io->cq_len);
+
+    io->sq_ptr = mmap (NULL, io->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_ptr = (single_mmap || io->sq_ptr==MAP_FAILED)?  io->sq_ptr :
+                 mmap (NULL, io->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap (NULL, io->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sq_ptr==MAP_FAILED || io->cq_ptr==MAP_FAILED || sqes==MAP_FAILED) {
+        if (sqes != MAP_FAILED)                                      munmap (sqes, io->sqes_len);
+        if (io->cq_ptr != MAP_FAILED  &&  io->cq_ptr != io->sq_ptr)  munmap (io->cq_ptr, io->cq_len);
+        if (io->sq_ptr != MAP_FAILED)                                munmap (io->sq_ptr, io->sq_len);
+        close (fd);
+        return 0;
+    }
+
+    char* sq = (char*) io->sq_ptr;
+    char* cq = (char*) io->cq_ptr;
+    io->ring_fd  = fd;
+    io->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+    io->sq_array = (unsigned*) (sq + p.sq_off.array);
+    io->sq_mask  = *(unsigned*) (sq + p.sq_off.ring_mask);
+    io->cq_head  = (unsigned*) (cq + p.cq_off.head);
+    io->cq_tail  = (unsigned*) (cq + p.cq_off.tail);
+    io->cq_mask  = *(unsigned*) (cq + p.cq_off.ring_mask);
+    io->cqes     = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    io->sqes     = (struct io_uring_sqe*) sqes;
+    return 1;
+}
+
+static void UringClose (CelsIo* io)
+{
+    munmap (io->sqes, io->sqes_len);
+    if (io->cq_ptr != io->sq_ptr)  munmap (io->cq_ptr, io->cq_len);
+    munmap (io->sq_ptr, io->sq_len);
+    close (io->ring_fd);
+}
+
+// Submission queue can't overflow since it has room for all buffers
+static int UringSubmit (CelsIo* io, IoBuffer* buf)
+{
+    unsigned tail  = *io->sq_tail;
+    unsigned index = tail & io->sq_mask;
+    struct io_uring_sqe* sqe = &io->sqes[index];
+    memset (sqe, 0, sizeof(*sqe));
+    sqe->opcode    = buf->output? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = io->fd[buf->output];
+    sqe->addr      = (size_t) (buf->data + (buf->output? buf->done : buf->size));
+    sqe->len       = (unsigned) (buf->output? buf->size - buf->done : io->bufsize - buf->size);
+    sqe->off       = (buf->offset<0? (__u64)-1 : buf->offset + (buf->output? buf->done : buf->size));
+    sqe->user_data = (size_t) buf;
+    io->sq_array[index] = index;
+    __atomic_store_n (io->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+    int result;
+    while ((result = (int) syscall (__NR_io_uring_enter, io->ring_fd, 1, 0, 0, NULL, 0)) < 0  &&  errno == EINTR)
+        ;
+    return result == 1;
+}
+
+static int UringWait (CelsIo* io, IoBuffer** buf, CelsNum* result)
+{
+    for(;;)
+    {
+        unsigned head = *io->cq_head;
+        if (head != __atomic_load_n (io->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &io->cqes[head & io->cq_mask];
+            *buf = (IoBuffer*) (size_t) cqe->user_data,  *result = cqe->res;
+            __atomic_store_n (io->cq_head, head+1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (syscall (__NR_io_uring_enter, io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0  &&  errno != EINTR)
+            return 0;
+    }
+}
+#endif  // CELS_IO_URING
+
+
+static int IoSubmit (CelsIo* io, IoBuffer* buf)
+{
+    buf->state = IO_BUSY;
+    io->in_flight[buf->output]++;
+#ifdef CELS_IO_URING
+    if (io->uring) {
+        if (UringSubmit (io, buf))  return 1;
+        io->in_flight[buf->output]--;
+        return 0;
+    }
+#endif
+    LockMutex (&io->queue_lock);
+    io->requests [(io->first_request + io->num_requests++) % (2*IO_MAX_QUEUE_DEPTH)] = buf;
+    SignalCondVar (&io->request_cv);
+    UnlockMutex (&io->queue_lock);
+    return 1;
+}
+
+static void IoFail (CelsIo* io, CelsResult errcode)
+{
+    if (!io->error)  io->error = errcode;
+}
+
+// Unaligned requests can't be performed with O_DIRECT
+static void IoDisableDirect (CelsIo* io, int i)
+{
+#ifdef O_DIRECT
+    if (io->direct[i])  fcntl (io->fd[i], F_SETFL, io->saved_flags[i]);
+#endif
+    io->direct[i] = 0;
+}
+
+// Start reading into free input buffers
+static void IoSubmitReads (CelsIo* io)
+{
+    int i;
+    for (i=0;  i < io->depth  &&  !io->in_eof  &&  !io->error;  i++)
+    {
+        IoBuffer* buf = &io->in[i];
+        if (buf->state != IO_FREE)  continue;
+        if (!io->seekable[0]  &&  io->in_flight[0] > 0)  break;
+        buf->size = buf->done = 0,  buf->eof = 0;
+        buf->seq = io->in_submit_seq++;
+        buf->offset = (io->seekable[0]? io->next_offset : -1);
+        io->next_offset += io->bufsize;
+        if (!IoSubmit (io, buf))  {IoFail (io, CELS_ERROR_READ);  buf->state = IO_FREE;}
+    }
+}
+
+// Start writing queued output buffers in their order
+static void IoSubmitWrites (CelsIo* io)
+{
+    for(;;)
+    {
+        if (!io->seekable[1]  &&  io->in_flight[1] > 0)  return;
+        IoBuffer* buf = NULL;
+        int i;
+        for (i=0; i < io->depth; i++)
+            if (io->out[i].state == IO_READY  &&  io->out[i].seq == io->out_submit_seq)
+                buf = &io->out[i];
+        if (buf == NULL)  return;
+        io->out_submit_seq++;
+        if (io->error)  {buf->state = IO_FREE;  continue;}
+        if ((buf->size|buf->offset) % IO_ALIGNMENT)  IoDisableDirect (io, 1);   // f.e. the last incomplete block
+        if (!IoSubmit (io, buf))  {IoFail (io, CELS_ERROR_WRITE);  buf->state = IO_FREE;}
+    }
+}
+
+// Queue output buffer for writing
+static void IoQueueWrite (CelsIo* io, IoBuffer* buf, CelsNum size)
+{
+    buf->size = size,  buf->done = 0;
+    buf->seq = io->out_queue_seq++;
+    buf->offset = (io->seekable[1]? io->position[1] : -1);
+    io->position[1] += size;
+    buf->state = IO_READY;
+    IoSubmitWrites (io);
+}
+
+static void IoComplete (CelsIo* io, IoBuffer* buf, CelsNum result)
+{
+    io->in_flight[buf->output]--;
+    if (buf->output) {
+        if (result > 0)  buf->done += result,  io->bytes_written += result;
+        if (result <= 0  ||  io->error)  {IoFail (io, CELS_ERROR_WRITE);  buf->state = IO_FREE;}
+        else if (buf->done == buf->size)  buf->state = IO_FREE;
+        else {                                                    // short write: write the rest
+            if (buf->done % IO_ALIGNMENT)  IoDisableDirect (io, 1);
+            if (!IoSubmit (io, buf))  {IoFail (io, CELS_ERROR_WRITE);  buf->state = IO_FREE;}
+        }
+        IoSubmitWrites (io);
+    } else {
+        if (result > 0)  buf->size += result,  io->bytes_read += result;
+        buf->state = IO_READY;
+        if (result < 0)  IoFail (io, CELS_ERROR_READ);
+        if (result <= 0)  buf->eof = 1,  io->in_eof = 1;
+        // Short read of a regular file: read the rest of buffer, unless EOF was already seen
+        // or it's the unaligned file tail read with O_DIRECT
+        else if (io->seekable[0]  &&  buf->size < io->bufsize) {
+            if (io->in_eof  ||  (io->direct[0] && buf->size % IO_ALIGNMENT))  buf->eof = 1,  io->in_eof = 1;
+            else if (!IoSubmit (io, buf))  {IoFail (io, CELS_ERROR_READ);  buf->eof = 1,  buf->state = IO_READY;}
+        }
+        IoSubmitReads (io);
+    }
+}
+
+// Wait for completion of any request; return 0 if there are no requests in flight
+static int IoWait (CelsIo* io)
+{
+    if (io->in_flight[0] + io->in_flight[1] == 0)  return 0;
+    CelsNum start = Nanoseconds();
+    IoBuffer* buf = NULL;
+    CelsNum result = 0;
+#ifdef CELS_IO_URING
+    if (io->uring) {
+        if (!UringWait (io, &buf, &result))  {IoFail (io, CELS_ERROR_GENERAL);  return 0;}
+    } else
+#endif
+    {
+        LockMutex (&io->queue_lock);
+        while (io->num_completions == 0)
+            WaitCondVar (&io->completion_cv, &io->queue_lock);
+        buf    = io->completions [io->first_completion];
+        result = io->results [io->first_completion];
+        io->first_completion = (io->first_completion+1) % (2*IO_MAX_QUEUE_DEPTH),  io->num_completions--;
+        UnlockMutex (&io->queue_lock);
+    }
+    io->wait_ns += Nanoseconds() - start;
+    IoComplete (io, buf, result);
+    return 1;
+}
+
+// Next input buffer in the reading order, waiting until it's filled; NULL at the end of data or on error
+static IoBuffer* IoNextInput (CelsIo* io)
+{
+    for(;;)
+    {
+        if (io->in_finished  ||  io->error)  return NULL;
+        IoBuffer* found = NULL;
+        int i;
+        for (i=0; i < io->depth; i++)
+            if ((io->in[i].state==IO_BUSY || io->in[i].state==IO_READY)  &&  io->in[i].seq == io->in_consume_seq)
+                found = &io->in[i];
+        if (found  &&  found->state == IO_READY)  return found;
+        if (found == NULL) {
+            IoSubmitReads (io);
+            if (io->in_submit_seq == io->in_consume_seq) {
+                if (io->in_eof)  io->in_finished = 1;
+                else             IoFail (io, CELS_ERROR_NOT_ENOUGH_MEMORY);   // codec holds all input buffers
+                continue;
+            }
+        }
+        if (!IoWait (io))  IoFail (io, CELS_ERROR_INTERNAL);
+    }
+}
+
+// Pass to the codec the rest of the current input buffer
+static void IoConsumeInput (CelsIo* io, IoBuffer* buf, CelsNum size, int lent)
+{
+    buf->done += size;
+    io->position[0] += size;
+    if (buf->done < buf->size  &&  !lent)  return;
+    if (buf->eof)  io->in_finished = 1;
+    buf->state = (lent? IO_LENT : IO_FREE);
+    io->in_consume_seq++;
+    IoSubmitReads (io);
+}
+
+// Free output buffer, waiting for completion of writes if necessary
+static IoBuffer* IoFreeOutput (CelsIo* io)
+{
+    for(;;)
+    {
+        int i;
+        if (io->error)  return NULL;
+        for (i=0; i < io->depth; i++)
+            if (io->out[i].state == IO_FREE)
+                return &io->out[i];
+        if (!IoWait (io))  {IoFail (io, CELS_ERROR_NOT_ENOUGH_MEMORY);  return NULL;}   // codec holds all output buffers
+    }
+}
+
+// Find buffer lent to the codec
+static IoBuffer* IoLentBuffer (CelsIo* io, IoBuffer* bufs, void* ptr)
+{
+    int i;
+    for (i=0; i < io->depth; i++)
+        if (bufs[i].state == IO_LENT  &&  bufs[i].data <= (char*)ptr  &&  (char*)ptr <= bufs[i].data + io->bufsize)
+            return &bufs[i];
+    return NULL;
+}
+
+static CelsResult IoFlush (CelsIo* io)
+{
+    if (io->out_current  &&  io->out_current->size > 0)
+        IoQueueWrite (io, io->out_current, io->out_current->size);
+    else if (io->out_current)
+        io->out_current->state = IO_FREE;
+    io->out_current = NULL;
+    while (io->in_flight[1] > 0)
+        IoWait (io);
+    return io->error;
+}
+
+CelsResult __cdecl CelsIoCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsIo* io = (CelsIo*) self;
+    CelsResult result = CELS_OK;
+    IoBuffer* buf;
+    LockMutex (&io->lock);
+
+    switch (service)
+    {
+    case CELS_READ:
+        if (io->fd[0] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        {
+            CelsNum done = 0;
+            while (done < insize)
+            {
+                if (done > 0) {     // return available data instead of waiting for the next buffer
+                    int i, ready = 0;
+                    for (i=0; i < io->depth; i++)
+                        ready |= (io->in[i].state==IO_READY  &&  io->in[i].seq == io->in_consume_seq);
+                    if (!ready)  break;
+                }
+                if ((buf = IoNextInput (io)) == NULL)  break;
+                CelsNum n = buf->size - buf->done;
+                if (n > insize-done)  n = insize-done;
+                memcpy ((char*)inbuf+done, buf->data+buf->done, n);
+                done += n;
+                IoConsumeInput (io, buf, n, 0);
+            }
+            result = (done==0 && io->error? io->error : done);
+        }
+        break;
+
+    case CELS_RECEIVE_FILLED_INBUF:
+        if (io->fd[0] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        *(void**)inbuf = NULL;
+        if ((buf = IoNextInput (io)) == NULL)  {result = io->error;  break;}
+        result = buf->size - buf->done;
+        if (result > 0)  *(void**)inbuf = buf->data + buf->done;
+        IoConsumeInput (io, buf, result, result > 0);
+        break;
+
+    case CELS_SEND_EMPTY_INBUF:
+        if (io->fd[0] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        if ((buf = IoLentBuffer (io, io->in, inbuf)) == NULL)  {result = CELS_ERROR_INTERNAL;  break;}
+        buf->state = IO_FREE;
+        IoSubmitReads (io);
+        break;
+
+    case CELS_WRITE:
+        if (io->fd[1] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        {
+            CelsNum done = 0;
+            while (done < outsize)
+            {
+                if (io->out_current == NULL) {
+                    if ((io->out_current = IoFreeOutput (io)) == NULL)  break;
+                    io->out_current->state = IO_LENT,  io->out_current->size = 0;
+                }
+                buf = io->out_current;
+                CelsNum n = io->bufsize - buf->size;
+                if (n > outsize-done)  n = outsize-done;
+                memcpy (buf->data+buf->size, (char*)outbuf+done, n);
+                buf->size += n,  done += n;
+                if (buf->size == io->bufsize)  {io->out_current = NULL;  IoQueueWrite (io, buf, buf->size);}
+            }
+            result = (io->error? io->error : done);
+        }
+        break;
+
+    case CELS_RECEIVE_EMPTY_OUTBUF:
+        if (io->fd[1] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        if (io->out_current  &&  io->out_current->size > 0) {    // data written by CELS_WRITE go first
+            IoQueueWrite (io, io->out_current, io->out_current->size);
+            io->out_current = NULL;
+        }
+        if ((buf = IoFreeOutput (io)) == NULL)  {result = io->error;  break;}
+        buf->state = IO_LENT,  buf->size = 0;
+        *(void**)outbuf = buf->data;
+        result = io->bufsize;
+        break;
+
+    case CELS_SEND_FILLED_OUTBUF:
+        if (io->fd[1] < 0)  {result = CELS_ERROR_NOT_IMPLEMENTED;  break;}
+        if ((buf = IoLentBuffer (io, io->out, outbuf)) == NULL  ||  buf == io->out_current
+            ||  (char*)outbuf+outsize > buf->data+io->bufsize)  {result = CELS_ERROR_INTERNAL;  break;}
+        if (io->out_current  &&  io->out_current->size > 0) {    // data written by CELS_WRITE go first
+            IoQueueWrite (io, io->out_current, io->out_current->size);
+            io->out_current = NULL;
+        }
+        if (outbuf != buf->data)  memmove (buf->data, outbuf, outsize);
+        if (outsize > 0)  IoQueueWrite (io, buf, outsize);  else buf->state = IO_FREE;
+        result = io->error;
+        break;
+
+    default:
+        result = CELS_ERROR_NOT_IMPLEMENTED;
+    }
+
+    UnlockMutex (&io->lock);
+    return result;
+}
+
+// Prepare file for I/O: check whether it's seekable, and enable O_DIRECT if requested
+static void IoPrepareFile (CelsIo* io, int i, int direct)
+{
+    int fd = io->fd[i];
+    if (fd < 0)  return;
+#ifdef _WIN32
+    CelsNum pos = _lseeki64 (fd, 0, SEEK_CUR);
+#else
+    CelsNum pos = lseek (fd, 0, SEEK_CUR);
+    io->saved_flags[i] = fcntl (fd, F_GETFL);
+#ifdef O_DIRECT
+    if (direct  &&  pos >= 0  &&  pos % IO_ALIGNMENT == 0  &&  io->saved_flags[i] >= 0)
+        io->direct[i] = (fcntl (fd, F_SETFL, io->saved_flags[i] | O_DIRECT) == 0);
+#endif
+#endif
+    io->seekable[i] = (pos >= 0);
+    io->position[i] = (pos >= 0? pos : 0);
+}
+
+CelsResult CelsIoOpen (CelsIo** pio, int infd, int outfd, const CelsIoOptions* options)
+{
+    *pio = NULL;
+    CelsIo* io = (CelsIo*) calloc (1, sizeof(CelsIo));
+    if (io == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+    io->depth   = (options && options->queue_depth > 0?  options->queue_depth : IO_DEFAULT_QUEUE_DEPTH);
+    io->bufsize = (options && options->buffer_size > 0?  options->buffer_size : IO_DEFAULT_BUFFER_SIZE);
+    if (io->depth > IO_MAX_QUEUE_DEPTH)  io->depth = IO_MAX_QUEUE_DEPTH;
+    if (io->bufsize > (1<<30))           io->bufsize = 1<<30;
+    io->bufsize = (io->bufsize + IO_ALIGNMENT-1) / IO_ALIGNMENT * IO_ALIGNMENT;
+
+#ifdef _WIN32
+    io->memory = (char*) _aligned_malloc (2 * io->depth * io->bufsize, IO_ALIGNMENT);
+#else
+    if (posix_memalign ((void**)&io->memory, IO_ALIGNMENT, 2 * io->depth * io->bufsize) != 0)  io->memory = NULL;
+#endif
+    if (io->memory == NULL)  {free (io);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    int i;
+    for (i=0; i < io->depth; i++) {
+        io->in[i].data  = io->memory + i * io->bufsize;
+        io->out[i].data = io->memory + (io->depth+i) * io->bufsize,  io->out[i].output = 1;
+    }
+
+    io->fd[0] = infd,  io->fd[1] = outfd;
+    for (i=0; i<2; i++)
+        IoPrepareFile (io, i, options && options->direct);
+    io->next_offset = io->position[0];
+
+    InitMutex (&io->lock);
+    InitMutex (&io->queue_lock);
+    InitCondVar (&io->request_cv);
+    InitCondVar (&io->completion_cv);
+#ifdef CELS_IO_URING
+    io->uring = UringSetup (io, 2*io->depth);
+#endif
+    if (!io->uring  &&  !(io->thread_started = StartThread (&io->thread, IoThread, io))) {
+        CelsIoClose (io);
+        return CELS_ERROR_GENERAL;
+    }
+
+    if (infd >= 0)  IoSubmitReads (io);
+    *pio = io;
+    return CELS_OK;
+}
+
+CelsResult CelsIoClose (CelsIo* io)
+{
+    if (io == NULL)  return CELS_OK;
+    LockMutex (&io->lock);
+    CelsResult result = IoFlush (io);
+    io->in_eof = 1;          // stop read-ahead, and wait for reads in flight since their buffers can't be freed before that
+    while (IoWait (io))
+        ;
+    UnlockMutex (&io->lock);
+
+#ifdef CELS_IO_URING
+    if (io->uring)  UringClose (io);
+#endif
+    if (io->thread_started) {
+        LockMutex (&io->queue_lock);
+        io->stop = 1;
+        SignalCondVar (&io->request_cv);
+        UnlockMutex (&io->queue_lock);
+        JoinThread (io->thread);
+    }
+
+    // Restore file flags, and move file pointers past the processed data, as if the files were read/written sequentially
+    int i;
+    for (i=0; i<2; i++)
+        if (io->fd[i] >= 0  &&  io->seekable[i]) {
+#ifdef _WIN32
+            _lseeki64 (io->fd[i], io->position[i], SEEK_SET);
+#else
+            IoDisableDirect (io, i);
+            lseek (io->fd[i], io->position[i], SEEK_SET);
+#endif
+        }
+
+    DestroyCondVar (&io->completion_cv);
+    DestroyCondVar (&io->request_cv);
+    DestroyMutex (&io->queue_lock);
+    DestroyMutex (&io->lock);
+#ifdef _WIN32
+    _aligned_free (io->memory);
+#else
+    free (io->memory);
+#endif
+    free (io);
+    return result;
+}
+
+void CelsIoStats (CelsIo* io, CelsNum* bytes_read, CelsNum* bytes_written, CelsNum* wait_ns)
+{
+    LockMutex (&io->lock);
+    if (bytes_read)     *bytes_read    = io->bytes_read;
+    if (bytes_written)  *bytes_written = io->bytes_written;
+    if (wait_ns)        *wait_ns       = io->wait_ns;
+    UnlockMutex (&io->lock);
+}
+
+
+
+// ****************************************************************************************************************************
+// Prefetching reader for many small files: prefetch threads open, read and close the upcoming files of the list into the     *
+// bounded read-ahead cache, so per-file syscall latency overlaps with compression. CelsPrefetchCallback passes contents of   *
+// the files to the codec in the list order, as a single (solid) stream. Only the first PREFETCH_MAX_PART bytes of larger    *
+// files are cached, the rest is read when the codec gets there.                                                               *
+// ****************************************************************************************************************************
+
+const int     PREFETCH_DEFAULT_THREADS = 4;
+const CelsNum PREFETCH_DEFAULT_CACHE   = 256<<20;
+const CelsNum PREFETCH_MAX_PART        = 1<<20;   // Max. cached part of a single file
+const int     PREFETCH_MAX_AHEAD       = 4096;    // Max. number of files prefetched ahead (limits empty files, which take no cache)
+const int     PREFETCH_MAX_THREADS     = 64;
+const int     PREFETCH_MAX_OPEN_FILES  = 256;     // Max. number of large files kept open until the codec reads their rest
+
+enum {PREFETCH_FREE, PREFETCH_READING, PREFETCH_READY};
+
+typedef struct {
+    int         state;
+    char*       data;         // cached part of the file
+    CelsNum     cached;       // bytes in data
+    CelsNum     reserved;     // cache space taken by the file
+    CelsNum     pos;          // bytes of data already passed to the codec
+    CelsNum     delivered;    // bytes of the file passed to the codec
+    int         fd;           // kept open when the file is larger than its cached part
+    int         reopen;       // the rest of the file is read by opening it again, since too many files were open
+    CelsResult  error;
+} PrefetchSlot;
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+struct CelsPrefetch
+{
+    const char* const*  filenames;
+    CelsNum     num_files;
+    CelsNum*    results;                       // bytes of each file passed to the codec, or error code
+    CelsNum     cache_size, cache_used;
+    int         open_files;                    // number of fd's kept in the slots
+    PrefetchSlot  slots [PREFETCH_MAX_AHEAD];  // file i uses slot i % PREFETCH_MAX_AHEAD
+    CelsNum     next_claim;                    // next file to be prefetched
+    CelsNum     next_consume;                  // next file to be passed to the codec
+    CelsNum     block_end;                     // CELS_READ returns EOF at this file
+    int         current;                       // 1: file next_consume is being passed to the codec
+    int         stop;
+    Mutex       lock;
+    CondVar     changed;
+    int         num_threads;
+    Thread      threads [PREFETCH_MAX_THREADS];
+};
+
+static int PrefetchOpenFile (const char* filename)
+{
+#ifdef _WIN32
+    int len = MultiByteToWideChar (CP_UTF8, 0, filename, -1, NULL, 0);
+    wchar_t* wname = (wchar_t*) malloc (len * sizeof(wchar_t));
+    if (wname == NULL)  return -1;
+    MultiByteToWideChar (CP_UTF8, 0, filename, -1, wname, len);
+    int fd = _wopen (wname, _O_RDONLY | _O_BINARY);
+    free (wname);
+    return fd;
+#else
+    return open (filename, O_RDONLY);
+#endif
+}
+
+static CelsNum PrefetchFileSize (int fd)
+{
+#ifdef _WIN32
+    struct _stati64 st;
+    return _fstati64 (fd, &st) == 0?  st.st_size : -1;
+#else
+    struct stat st;
+    return fstat (fd, &st) == 0?  st.st_size : -1;
+#endif
+}
+
+static int PrefetchTooManyFiles()
+{
+    return errno == EMFILE  ||  errno == ENFILE;
+}
+
+static CelsNum PrefetchSeekFile (int fd, CelsNum pos)
+{
+#ifdef _WIN32
+    return _lseeki64 (fd, pos, SEEK_SET);
+#else
+    return lseek (fd, pos, SEEK_SET);
+#endif
+}
+
+static CelsNum PrefetchReadFile (int fd, char* buf, CelsNum size)
+{
+    CelsNum done = 0;
+    while (done < size)
+    {
+#ifdef _WIN32
+        CelsNum n = _read (fd, buf+done, (unsigned)(size-done));
+#else
+        CelsNum n = read (fd, buf+done, size-done);
+        if (n < 0  &&  errno == EINTR)  continue;
+#endif
+        if (n < 0)   return -1;
+        if (n == 0)  break;
+        done += n;
+    }
+    return done;
+}
+
+static void PrefetchCloseFile (int fd)
+{
+#ifdef _WIN32
+    _close (fd);
+#else
+    close (fd);
+#endif
+}
+
+// Read the file into its slot. When we are out of file descriptors, the file is left to CelsPrefetchCallback()
+static void PrefetchFile (CelsPrefetch* pf, CelsNum i, PrefetchSlot* slot)
+{
+    int fd = PrefetchOpenFile (pf->filenames[i]);
+    int reopen = (fd < 0  &&  PrefetchTooManyFiles());
+    CelsNum size = (fd >= 0?  PrefetchFileSize (fd) : reopen? 0 : -1);
+    CelsNum part = (size < 0? 0 : size < PREFETCH_MAX_PART? size : PREFETCH_MAX_PART);
+
+    // Wait for the cache space, unless the codec waits for this file
+    LockMutex (&pf->lock);
+    while (!pf->stop  &&  i != pf->next_consume  &&  pf->cache_used + part > pf->cache_size)
+        WaitCondVar (&pf->changed, &pf->lock);
+    pf->cache_used += part;
+    UnlockMutex (&pf->lock);
+
+    char* data = (part > 0?  (char*) malloc (part) : NULL);
+    CelsNum cached = 0;
+    CelsResult error = CELS_OK;
+    if (size < 0)                          error = CELS_ERROR_READ;
+    else if (part > 0  &&  data == NULL)   error = CELS_ERROR_NOT_ENOUGH_MEMORY;
+    else if ((cached = PrefetchReadFile (fd, data, part)) < 0)  cached = 0,  error = CELS_ERROR_READ;
+    if (fd >= 0  &&  (error  ||  cached < PREFETCH_MAX_PART))   // the whole file was read
+        PrefetchCloseFile (fd),  fd = -1;
+
+    LockMutex (&pf->lock);
+    if (fd >= 0  &&  pf->open_files >= PREFETCH_MAX_OPEN_FILES)
+        PrefetchCloseFile (fd),  fd = -1,  reopen = 1;
+    if (fd >= 0)  pf->open_files++;
+    slot->data = data,  slot->cached = cached,  slot->reserved = part,  slot->pos = slot->delivered = 0;
+    slot->fd = fd,  slot->reopen = reopen,  slot->error = error;
+    slot->state = PREFETCH_READY;
+    BroadcastCondVar (&pf->changed);
+    UnlockMutex (&pf->lock);
+}
+
+static THREAD_FUNCTION PrefetchThread (void* arg)
+{
+    CelsPrefetch* pf = (CelsPrefetch*) arg;
+    LockMutex (&pf->lock);
+    for(;;)
+    {
+        while (!pf->stop  &&  (pf->next_claim >= pf->num_files  ||  pf->next_claim >= pf->next_consume + PREFETCH_MAX_AHEAD))
+            WaitCondVar (&pf->changed, &pf->lock);
+        if (pf->stop)  break;
+        CelsNum i = pf->next_claim++;
+        PrefetchSlot* slot = &pf->slots [i % PREFETCH_MAX_AHEAD];
+        slot->state = PREFETCH_READING;
+        UnlockMutex (&pf->lock);
+        PrefetchFile (pf, i, slot);
+        LockMutex (&pf->lock);
+    }
+    UnlockMutex (&pf->lock);
+    return THREAD_RETURN;
+}
+
+// Finish passing the current file to the codec and free its slot
+static void PrefetchFinishFile (CelsPrefetch* pf, PrefetchSlot* slot, CelsResult error)
+{
+    if (slot->fd >= 0)  PrefetchCloseFile (slot->fd);
+    free (slot->data);
+    LockMutex (&pf->lock);
+    if (slot->fd >= 0)  pf->open_files--;
+    pf->results [pf->next_consume] = (error? error : slot->delivered);
+    pf->cache_used -= slot->reserved;
+    slot->state = PREFETCH_FREE,  slot->data = NULL,  slot->fd = -1;
+    pf->next_consume++,  pf->current = 0;
+    BroadcastCondVar (&pf->changed);
+    UnlockMutex (&pf->lock);
+}
+
+CelsResult __cdecl CelsPrefetchCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    CelsPrefetch* pf = (CelsPrefetch*) self;
+    if (service != CELS_READ)  return CELS_ERROR_NOT_IMPLEMENTED;
+
+    CelsNum done = 0;
+    while (done < insize)
+    {
+        PrefetchSlot* slot = &pf->slots [pf->next_consume % PREFETCH_MAX_AHEAD];
+        if (!pf->current) {
+            if (pf->next_consume >= pf->block_end)  break;
+            LockMutex (&pf->lock);
+            if (done > 0  &&  slot->state != PREFETCH_READY)   // return available data instead of waiting for the next file
+                {UnlockMutex (&pf->lock);  break;}
+            while (slot->state != PREFETCH_READY)
+                WaitCondVar (&pf->changed, &pf->lock);
+            UnlockMutex (&pf->lock);
+            pf->current = 1;
+            if (slot->error)  {PrefetchFinishFile (pf, slot, slot->error);  continue;}   // unreadable file is skipped
+        }
+
+        CelsNum n = slot->cached - slot->pos;
+        if (n > 0) {
+            if (n > insize-done)  n = insize-done;
+            memcpy ((char*)inbuf+done, slot->data+slot->pos, n);
+            slot->pos += n;
+        } else if (slot->reopen) {
+            // The file wasn't kept open by the prefetch thread: open it again and skip the cached part
+            slot->reopen = 0;
+            slot->fd = PrefetchOpenFile (pf->filenames [pf->next_consume]);
+            if (slot->fd >= 0)  {LockMutex (&pf->lock);  pf->open_files++;  UnlockMutex (&pf->lock);}
+            if (slot->fd < 0  ||  PrefetchSeekFile (slot->fd, slot->cached) != slot->cached) {
+                CelsNum delivered = slot->delivered;
+                PrefetchFinishFile (pf, slot, CELS_ERROR_READ);
+                if (delivered == 0)  continue;      // unreadable file is skipped
+                return CELS_ERROR_READ;
+            }
+            continue;
+        } else if (slot->fd >= 0) {
+            // The rest of large file
+            if ((n = PrefetchReadFile (slot->fd, (char*)inbuf+done, insize-done)) < 0) {
+                PrefetchFinishFile (pf, slot, CELS_ERROR_READ);
+                return CELS_ERROR_READ;
+            }
+        }
+        done += n,  slot->delivered += n;
+        if (n == 0  ||  (slot->pos == slot->cached  &&  slot->fd < 0  &&  !slot->reopen))
+            PrefetchFinishFile (pf, slot, CELS_OK);
+    }
+    return done;
+}
+
+CelsResult CelsPrefetchOpen (CelsPrefetch** ppf, const char* const* filenames, CelsNum num_files, const CelsPrefetchOptions* options)
+{
+    *ppf = NULL;
+    CelsPrefetch* pf = (CelsPrefetch*) calloc (1, sizeof(CelsPrefetch));
+    if (pf == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    pf->results = (CelsNum*) malloc ((num_files? num_files : 1) * sizeof(CelsNum));
+    if (pf->results == NULL)  {free (pf);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    CelsNum i;
+    for (i=0; i < num_files; i++)
+        pf->results[i] = CELS_ERROR_GENERAL;
+    for (i=0; i < PREFETCH_MAX_AHEAD; i++)
+        pf->slots[i].fd = -1;
+
+    pf->filenames  = filenames;
+    pf->num_files  = pf->block_end = num_files;
+    pf->cache_size = (options && options->cache_size > 0?  options->cache_size : PREFETCH_DEFAULT_CACHE);
+    int threads    = (options && options->threads > 0?     options->threads    : PREFETCH_DEFAULT_THREADS);
+    if (threads > PREFETCH_MAX_THREADS)  threads = PREFETCH_MAX_THREADS;
+
+    InitMutex (&pf->lock);
+    InitCondVar (&pf->changed);
+    for (pf->num_threads = 0;  pf->num_threads < threads;  pf->num_threads++)
+        if (!StartThread (&pf->threads[pf->num_threads], PrefetchThread, pf))
+            break;
+    if (pf->num_threads == 0)  {CelsPrefetchClose (pf);  return CELS_ERROR_GENERAL;}
+    *ppf = pf;
+    return CELS_OK;
+}
+
+CelsResult CelsPrefetchBlock (CelsPrefetch* pf, CelsNum num_files)
+{
+    if (pf->current)  return CELS_ERROR_GENERAL;   // the previous block wasn't read to the end
+    pf->block_end = pf->next_consume + num_files;
+    if (pf->block_end > pf->num_files)  pf->block_end = pf->num_files;
+    return CELS_OK;
+}
+
+CelsResult CelsPrefetchFileResult (CelsPrefetch* pf, CelsNum i)
+{
+    LockMutex (&pf->lock);
+    CelsResult result = (i < pf->next_consume?  pf->results[i] : CELS_ERROR_GENERAL);
+    UnlockMutex (&pf->lock);
+    return result;
+}
+
+CelsResult CelsPrefetchClose (CelsPrefetch* pf)
+{
+    if (pf == NULL)  return CELS_OK;
+    LockMutex (&pf->lock);
+    pf->stop = 1;
+    BroadcastCondVar (&pf->changed);
+    UnlockMutex (&pf->lock);
+    int i;
+    for (i=0; i < pf->num_threads; i++)
+        JoinThread (pf->threads[i]);
+    for (i=0; i < PREFETCH_MAX_AHEAD; i++) {
+        if (pf->slots[i].fd >= 0)  PrefetchCloseFile (pf->slots[i].fd);
+        free (pf->slots[i].data);
+    }
+    DestroyCondVar (&pf->changed);
+    DestroyMutex (&pf->lock);
+    free (pf->results);
+    free (pf);
+    return CELS_OK;
+}
+
+
+
+// ****************************************************************************************************************************
+// Deduplication codec "dedup": input is split into content-defined chunks (FastCDC with normalized chunking), and chunks     *
+// already seen within the last dictionary bytes are replaced by references, so the following codecs (f.e. "dedup+lzma") get  *
+// only unique data. Candidate chunk boundaries are found by the gear rolling hash computed by the thread pool over slices of *
+// the batch, chunks are fingerprinted with XXH128 too, and looked up in the lock-free fingerprint table. Output is a         *
+// sequence of records: varint length*2 followed by literal data, or varint length*2+1 followed by varint distance back in    *
+// the decompressed data. Parameters: c - average chunk size, m - minimal chunk size, d - dictionary size, sha - fingerprint  *
+// with SHA-256, f.e. "dedup:c4k:m48:d1g:sha".                                                                                *
+// ****************************************************************************************************************************
+
+const CelsNum DEDUP_DEFAULT_CHUNK = 4<<10;
+const CelsNum DEDUP_DEFAULT_MIN   = 48;
+const CelsNum DEDUP_DEFAULT_DICT  = 256<<20;
+const CelsNum DEDUP_MIN_CHUNK     = 32;        // shorter chunks would be replaced by longer references
+const CelsNum DEDUP_MAX_CHUNK     = 1<<24;
+const CelsNum DEDUP_BATCH         = 8<<20;     // input is processed by batches of this size
+const CelsNum DEDUP_SLICE         = 1<<20;     // batch part processed by a single job; multiple of 64, so jobs don't share bitmap words
+const CelsNum DEDUP_HISTORY       = 64;        // gear hash depends on the last 64 bytes, so they are kept before the batch data
+const CelsNum DEDUP_IO_SIZE       = 1<<20;     // size of decompression buffers
+const CelsNum DEDUP_SHA_GROUP     = 64;        // chunks passed to the multi-buffer SHA-256 at once
+const CelsNum DEDUP_FREE_SLOT     = 0;         // fingerprint table keys reserved for free slots
+const CelsNum DEDUP_BUSY_SLOT     = 1;         //   and slots being filled by another thread
+
+typedef struct {
+    CelsNum  chunk;         // average chunk size
+    CelsNum  min;           // minimal chunk size
+    CelsNum  dict;          // max. distance of references
+    int      sha;           // fingerprint chunks with SHA-256 instead of XXH128
+} DedupMethod;
+
+static Uint64 GearTable [256];
+
+static int InitGearTable()
+{
+    Uint64 x = 0;
+    int i;
+    for (i=0; i<256; i++) {      // splitmix64
+        Uint64 z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        GearTable[i] = z ^ (z >> 31);
+    }
+    return 1;
+}
+static int GearTableInitialized = InitGearTable();
+
+
+// Fingerprint table: open addressing, key is the low half of XXH128 (remapped to avoid the reserved values) ***************
+
+typedef struct {
+    volatile CelsNum  key;
+    Uint64            check;       // high half of XXH128
+    volatile CelsNum  pos;         // the last position of the chunk in the stream already encoded (or being encoded)
+} DedupEntry;
+
+typedef struct {
+    DedupEntry*    slots;
+    CelsNum        mask;
+    volatile long  count;
+    long           limit;         // insertions fail when the table is filled up to this count
+} DedupTable;
+
+static int InitDedupTable (DedupTable* t, CelsNum capacity, void* ud, CelsCallback* cb)
+{
+    t->slots = (DedupEntry*) CelsAlloc (cb,ud, capacity * sizeof(DedupEntry));
+    if (t->slots == NULL)  return 0;
+    memset (t->slots, 0, capacity * sizeof(DedupEntry));
+    t->mask  = capacity-1;
+    t->count = 0;
+    t->limit = (long)(capacity/4*3);
+    return 1;
+}
+
+// Table is purged once it's half-filled: its capacity is 4x the number of chunks in the dictionary plus batch, so after purging
+// it's at most quarter-filled, and purges happen at most once per dictionary size of input
+static int DedupTableNeedsPurge (const DedupTable* t)
+{
+    return t->count > (long)((t->mask+1) / 2);
+}
+
+// Find the entry with the same fingerprint or add the new one; may be called by multiple threads simultaneously.
+// Entry position is lowered to pos, so the earliest occurrence in the batch wins (DedupEncodeBatch then moves it
+// to the latest occurrence). Return NULL if the table is full.
+static DedupEntry* DedupInsert (DedupTable* t, CelsNum key, Uint64 check, CelsNum pos)
+{
+    CelsNum i = key & t->mask;
+    for(;;)
+    {
+        DedupEntry* e = &t->slots[i];
+        CelsNum k = e->key;
+        if (k == DEDUP_FREE_SLOT) {
+            if (AtomicAdd (&t->count, 1) > t->limit)  {AtomicAdd (&t->count, -1);  return NULL;}
+            if (AtomicCas64 (&e->key, DEDUP_FREE_SLOT, DEDUP_BUSY_SLOT) != DEDUP_FREE_SLOT)
+                {AtomicAdd (&t->count, -1);  continue;}        // another thread took the slot, recheck it
+            e->check = check,  e->pos = pos;
+            AtomicCas64 (&e->key, DEDUP_BUSY_SLOT, key);        // publish the entry
+            return e;
+        }
+        while (k == DEDUP_BUSY_SLOT)
+            YieldCpu(),  k = e->key;
+        MemoryFence();
+        if (k == key  &&  e->check == check) {
+            CelsNum old;
+            while ((old = e->pos) > pos  &&  AtomicCas64 (&e->pos, old, pos) != old)
+                ;
+            return e;
+        }
+        i = (i+1) & t->mask;
+    }
+}
+
+// Drop entries that moved out of the dictionary, so the table doesn't fill up; called when no other thread uses the table
+static int PurgeDedupTable (DedupTable* t, CelsNum min_pos, void* ud, CelsCallback* cb)
+{
+    DedupTable old = *t;
+    if (!InitDedupTable (t, old.mask+1, ud,cb))  {*t = old;  return 0;}
+    CelsNum i;
+    for (i=0; i <= old.mask; i++)
+        if (old.slots[i].key != DEDUP_FREE_SLOT  &&  old.slots[i].pos >= min_pos)
+            DedupInsert (t, old.slots[i].key, old.slots[i].check, old.slots[i].pos);
+    CelsFreeMemory (cb,ud, old.slots, (old.mask+1) * sizeof(DedupEntry));
+    return 1;
+}
+
+
+// Chunking *****************************************************************************************************************
+
+typedef struct {
+    DedupMethod     m;
+    CelsNum         max;                 // max. chunk size
+    Uint64          mask_strong;         // FastCDC normalized chunking: harder condition before the average chunk size,
+    Uint64          mask_weak;           //   easier one after it
+    unsigned char*  buf;                 // DEDUP_HISTORY bytes of history followed by the batch data
+    CelsNum         bufsize, end;        // buffer size and end of data in it
+    CelsNum         base;                // stream position of buf[DEDUP_HISTORY]
+    Uint64          *strong, *weak;      // bitmaps of candidate boundaries: bit i is set when chunk may end after buf[i]
+    CelsNum*        bounds;              // chunk i occupies buf[bounds[i]..bounds[i+1])
+    DedupEntry**    entries;             // fingerprint table entry of each chunk, NULL when the table was full
+    CelsNum         num_chunks, max_chunks;
+    DedupTable      table;
+    unsigned char*  out;                 // output records
+} DedupCompressor;
+
+typedef struct {
+    DedupCompressor* c;
+    CelsNum          from, to;           // buffer range or chunk range
+} DedupJob;
+
+static void SetBit (Uint64* bitmap, CelsNum i)  {bitmap[i>>6] |= (Uint64)1 << (i&63);}
+
+// Mark candidate boundaries in buf[from..to), computing the gear hash of each position sequentially
+static void GearScan (DedupCompressor* c, CelsNum from, CelsNum to)
+{
+    const unsigned char* buf = c->buf;
+    Uint64 h = 0;
+    CelsNum i;
+    for (i = from-(DEDUP_HISTORY-1);  i < from;  i++)
+        h = (h << 1) + GearTable[buf[i]];
+    for (;  i < to;  i++) {
+        h = (h << 1) + GearTable[buf[i]];
+        if ((h & c->mask_weak) == 0) {
+            SetBit (c->weak, i);
+            if ((h & c->mask_strong) == 0)  SetBit (c->strong, i);
+        }
+    }
+}
+
+static void __cdecl DedupScanJob (void* arg)
+{
+    DedupJob* job = (DedupJob*) arg;
+    GearScan (job->c, job->from, job->to);
+}
+
+// First set bit in [from,to), or -1
+static CelsNum FindBit (const Uint64* bitmap, CelsNum from, CelsNum to)
+{
+    while (from < to) {
+        Uint64 word = bitmap[from>>6] >> (from&63);
+        if (word) {
+            CelsNum i = from;
+            while (!(word & 1))  word >>= 1,  i++;
+            return i < to? i : -1;
+        }
+        from = (from|63) + 1;
+    }
+    return -1;
+}
+
+// End of the chunk starting at buf[start], or -1 if it can't be determined until more data are read
+static CelsNum DedupCut (DedupCompressor* c, CelsNum start, int eof)
+{
+    CelsNum limit = (start + c->max < c->end?  start + c->max : c->end);
+    CelsNum avg   = (start + c->m.chunk < limit?  start + c->m.chunk : limit);
+    CelsNum i = FindBit (c->strong, start + c->m.min - 1, avg - 1);
+    if (i < 0)  i = FindBit (c->weak, avg > start + c->m.min? avg - 1 : start + c->m.min - 1, limit - 1);
+    if (i >= 0)                      return i+1;
+    if (start + c->max <= c->end)    return start + c->max;
+    return eof?  c->end : -1;
+}
+
+static void DedupInsertChunk (DedupCompressor* c, CelsNum i, Uint64 low, Uint64 high)
+{
+    CelsNum key = (CelsNum) low;
+    if (key == DEDUP_FREE_SLOT  ||  key == DEDUP_BUSY_SLOT)  key += 2;
+    c->entries[i] = DedupInsert (&c->table, key, high, c->base + c->bounds[i] - DEDUP_HISTORY);
+}
+
+static void __cdecl DedupHashJob (void* arg)
+{
+    DedupJob* job = (DedupJob*) arg;
+    DedupCompressor* c = job->c;
+    CelsNum i;
+    if (c->m.sha) {
+        // SHA-256 hashes groups of chunks simultaneously, the first 128 bits are used as the fingerprint
+        const void* bufs [DEDUP_SHA_GROUP];
+        CelsNum sizes [DEDUP_SHA_GROUP];
+        unsigned char hashes [DEDUP_SHA_GROUP][32];
+        CelsNum first, n;
+        for (first = job->from;  first < job->to;  first += n) {
+            n = (job->to - first < DEDUP_SHA_GROUP?  job->to - first : DEDUP_SHA_GROUP);
+            for (i=0; i<n; i++)
+                bufs[i] = c->buf + c->bounds[first+i],  sizes[i] = c->bounds[first+i+1] - c->bounds[first+i];
+            Sha256Many ((int)n, bufs, sizes, hashes);
+            for (i=0; i<n; i++)
+                DedupInsertChunk (c, first+i, ReadLE64(hashes[i]), ReadLE64(hashes[i]+8));
+        }
+        return;
+    }
+    for (i = job->from;  i < job->to;  i++) {
+        XxhHash128 h = Xxh3_128 (c->buf + c->bounds[i], c->bounds[i+1] - c->bounds[i]);
+        DedupInsertChunk (c, i, h.low, h.high);
+    }
+}
+
+// Run jobs on the pool, or by the calling thread when there is no pool
+static void DedupRunJobs (CelsThreadPool* pool, CelsJobFunction* f, DedupJob* jobs, int num_jobs)
+{
+    volatile long pending = 0;
+    int i;
+    for (i=0; i<num_jobs; i++)
+        if (!pool  ||  pool->Submit (pool, f, &jobs[i], &pending) < CELS_OK)
+            f (&jobs[i]);
+    if (pool)  pool->Wait (pool, &pending);
+}
+
+// Split the batch into chunks, leaving the last incomplete chunk for the next batch; return its start
+static CelsNum DedupChunkBatch (DedupCompressor* c, int eof, CelsThreadPool* pool)
+{
+    DedupJob jobs [64];
+    int num_jobs = 0;
+    CelsNum i,  words = (c->end + 63) / 64;
+    memset (c->strong, 0, words*8);
+    memset (c->weak,   0, words*8);
+    for (i = DEDUP_HISTORY;  i < c->end;  i += DEDUP_SLICE, num_jobs++) {
+        jobs[num_jobs].c = c,  jobs[num_jobs].from = i;
+        jobs[num_jobs].to = (i + DEDUP_SLICE < c->end?  i + DEDUP_SLICE : c->end);
+    }
+    DedupRunJobs (pool, DedupScanJob, jobs, num_jobs);
+
+    CelsNum start = DEDUP_HISTORY,  end;
+    c->num_chunks = 0;
+    c->bounds[0] = start;
+    while (start < c->end  &&  (end = DedupCut (c, start, eof)) > 0)
+        c->bounds[++c->num_chunks] = start = end;
+
+    // Fingerprint chunks, about DEDUP_SLICE bytes per job
+    num_jobs = (int)((start - DEDUP_HISTORY) / DEDUP_SLICE + 1);
+    if (num_jobs > 64)  num_jobs = 64;
+    for (i=0; i<num_jobs; i++) {
+        jobs[i].c    = c;
+        jobs[i].from = c->num_chunks * i / num_jobs;
+        jobs[i].to   = c->num_chunks * (i+1) / num_jobs;
+    }
+    DedupRunJobs (pool, DedupHashJob, jobs, num_jobs);
+    return start;
+}
+
+static CelsNum DedupPutLiteral (unsigned char* out, const unsigned char* data, CelsNum len)
+{
+    CelsNum n = PutVarint (out, len*2);
+    memcpy (out+n, data, len);
+    return n+len;
+}
+
+// Replace repeated chunks by references; return size of output records
+static CelsNum DedupEncodeBatch (DedupCompressor* c)
+{
+    CelsNum outpos = 0,  literal = c->bounds[0],  i;
+    for (i=0; i < c->num_chunks; i++)
+    {
+        CelsNum start = c->bounds[i],  len = c->bounds[i+1] - start;
+        CelsNum pos   = c->base + start - DEDUP_HISTORY;
+        DedupEntry* e = c->entries[i];
+        if (e == NULL  ||  e->pos >= pos)  continue;            // the first occurrence
+        CelsNum prev = e->pos;
+        e->pos = pos;                                           // the next repeat will refer to the nearest occurrence
+        if (pos - prev > c->m.dict)  continue;                  // previous occurrence is out of the dictionary
+        if (start > literal)  outpos += DedupPutLiteral (c->out + outpos, c->buf + literal, start - literal);
+        outpos += PutVarint (c->out + outpos, len*2 + 1);
+        outpos += PutVarint (c->out + outpos, pos - prev);
+        literal = start + len;
+    }
+    CelsNum end = c->bounds[c->num_chunks];
+    if (end > literal)  outpos += DedupPutLiteral (c->out + outpos, c->buf + literal, end - literal);
+    return outpos;
+}
+
+static void FreeDedupCompressor (DedupCompressor* c, void* ud, CelsCallback* cb)
+{
+    CelsNum words = c->bufsize/64 + 1;
+    CelsFreeMemory (cb,ud, c->buf,     c->bufsize);
+    CelsFreeMemory (cb,ud, c->out,     c->bufsize + 64);
+    CelsFreeMemory (cb,ud, c->strong,  words*8);
+    CelsFreeMemory (cb,ud, c->weak,    words*8);
+    CelsFreeMemory (cb,ud, c->bounds,  (c->max_chunks+1) * sizeof(CelsNum));
+    CelsFreeMemory (cb,ud, c->entries, c->max_chunks * sizeof(DedupEntry*));
+    if (c->table.slots)  CelsFreeMemory (cb,ud, c->table.slots, (c->table.mask+1) * sizeof(DedupEntry));
+}
+
+static int Log2 (CelsNum x)  {int n = 0;  while (x > 1)  x >>= 1,  n++;  return n;}
+
+static CelsNum DedupTableCapacity (const DedupMethod* m)
+{
+    CelsNum n = 4096;
+    while (n < 4 * (m->dict + DEDUP_BATCH) / m->chunk)  n *= 2;
+    return n;
+}
+
+// Chunks (and so references) are never longer than that
+static CelsNum DedupMaxChunk (const DedupMethod* m)  {return m->chunk * 8;}
+
+static CelsResult DedupCompress (const DedupMethod* m, void* ud, CelsCallback* cb)
+{
+    DedupCompressor c;
+    memset (&c, 0, sizeof(c));
+    int bits = Log2 (m->chunk);
+    c.m           = *m;
+    c.max         = DedupMaxChunk (m);
+    c.mask_strong = ~(Uint64)0 << (64 - (bits+2));     // high bits depend on all 64 bytes of the window
+    c.mask_weak   = ~(Uint64)0 << (64 - (bits>2? bits-2 : 1));
+    c.bufsize     = DEDUP_HISTORY + DEDUP_BATCH + c.max;
+    c.max_chunks  = (DEDUP_BATCH + c.max) / m->min + 2;
+    CelsNum words = c.bufsize/64 + 1;
+    c.buf     = (unsigned char*) CelsAlloc (cb,ud, c.bufsize);
+    c.out     = (unsigned char*) CelsAlloc (cb,ud, c.bufsize + 64);
+    c.strong  = (Uint64*)        CelsAlloc (cb,ud, words*8);
+    c.weak    = (Uint64*)        CelsAlloc (cb,ud, words*8);
+    c.bounds  = (CelsNum*)       CelsAlloc (cb,ud, (c.max_chunks+1) * sizeof(CelsNum));
+    c.entries = (DedupEntry**)   CelsAlloc (cb,ud, c.max_chunks * sizeof(DedupEntry*));
+    if (!c.buf || !c.out || !c.strong || !c.weak || !c.bounds || !c.entries  ||  !InitDedupTable (&c.table, DedupTableCapacity(m), ud,cb))
+        {FreeDedupCompressor (&c, ud,cb);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    CelsThreadPool* pool = CelsGetThreadPool (cb,ud);
+    if (pool == NULL)  pool = CelsDefaultThreadPool();
+
+    CelsResult result = CELS_OK;
+    int eof = 0;
+    memset (c.buf, 0, DEDUP_HISTORY);
+    c.end = DEDUP_HISTORY;
+    while (!eof)
+    {
+        // Fill the buffer after the data left from the previous batch
+        CelsNum limit = c.end + DEDUP_BATCH;
+        while (c.end < limit) {
+            CelsResult len = CelsRead (cb,ud, c.buf + c.end, limit - c.end);
+            if (len < CELS_OK)  {result = len;  goto done;}
+            if (len == 0)       {eof = 1;  break;}
+            c.end += len;
+        }
+        if (DedupTableNeedsPurge (&c.table))
+            PurgeDedupTable (&c.table, c.base - m->dict, ud,cb);
+
+        CelsNum rest = DedupChunkBatch (&c, eof, pool);
+        CelsNum outsize = DedupEncodeBatch (&c);
+        if (outsize > 0  &&  (result = CelsWrite (cb,ud, c.out,outsize)) != outsize)
+            {if (result >= CELS_OK)  result = CELS_ERROR_WRITE;  goto done;}
+        result = CELS_OK;
+
+        // Keep the incomplete chunk and the history before it
+        memmove (c.buf, c.buf + rest - DEDUP_HISTORY, c.end - rest + DEDUP_HISTORY);
+        c.base += rest - DEDUP_HISTORY;
+        c.end  -= rest - DEDUP_HISTORY;
+    }
+done:
+    FreeDedupCompressor (&c, ud,cb);
+    return result;
+}
+
+
+// Decompression ************************************************************************************************************
+
+typedef struct {
+    unsigned char  *dict, *in, *out, *tmp;
+    CelsNum        dictsize, total;      // dictionary keeps the last dictsize bytes of output, total is the output size
+    CelsNum        inpos, inend, outpos;
+    int            eof;
+    void*          ud;
+    CelsCallback*  cb;
+} DedupDecompressor;
+
+// Make at least n bytes available in the input buffer, unless the input ended
+static CelsResult DedupFill (DedupDecompressor* d, CelsNum n)
+{
+    if (d->inend - d->inpos >= n  ||  d->eof)  return CELS_OK;
+    memmove (d->in, d->in + d->inpos, d->inend - d->inpos);
+    d->inend -= d->inpos,  d->inpos = 0;
+    while (d->inend < n) {
+        CelsResult len = CelsRead (d->cb,d->ud, d->in + d->inend, DEDUP_IO_SIZE - d->inend);
+        if (len < CELS_OK)  return len;
+        if (len == 0)       {d->eof = 1;  break;}
+        d->inend += len;
+    }
+    return CELS_OK;
+}
+
+static CelsResult DedupFlush (DedupDecompressor* d)
+{
+    CelsResult result = (d->outpos > 0?  CelsWrite (d->cb,d->ud, d->out,d->outpos) : d->outpos);
+    if (result != d->outpos)  return result<CELS_OK? result : CELS_ERROR_WRITE;
+    d->outpos = 0;
+    return CELS_OK;
+}
+
+// Append data to the output and the dictionary
+static CelsResult DedupOutput (DedupDecompressor* d, const unsigned char* data, CelsNum len)
+{
+    while (len > 0)
+    {
+        CelsNum n = DEDUP_IO_SIZE - d->outpos,  pos = d->total % d->dictsize;
+        if (n > len)                n = len;
+        if (n > d->dictsize - pos)  n = d->dictsize - pos;
+        memcpy (d->out + d->outpos, data, n);
+        memcpy (d->dict + pos, data, n);
+        d->outpos += n,  d->total += n,  data += n,  len -= n;
+        if (d->outpos == DEDUP_IO_SIZE) {
+            CelsResult result = DedupFlush (d);
+            if (result < CELS_OK)  return result;
+        }
+    }
+    return CELS_OK;
+}
+
+static CelsResult DedupDecompress (const DedupMethod* m, void* ud, CelsCallback* cb)
+{
+    DedupDecompressor d;
+    memset (&d, 0, sizeof(d));
+    d.ud = ud,  d.cb = cb,  d.dictsize = m->dict;
+    d.dict = (unsigned char*) CelsAlloc (cb,ud, m->dict);
+    d.in   = (unsigned char*) CelsAlloc (cb,ud, DEDUP_IO_SIZE);
+    d.out  = (unsigned char*) CelsAlloc (cb,ud, DEDUP_IO_SIZE);
+    d.tmp  = (unsigned char*) CelsAlloc (cb,ud, DEDUP_IO_SIZE);
+    CelsResult result = (d.dict && d.in && d.out && d.tmp?  CELS_OK : CELS_ERROR_NOT_ENOUGH_MEMORY);
+
+    while (result == CELS_OK)
+    {
+        if ((result = DedupFill (&d, 20)) < CELS_OK)  break;
+        if (d.inpos == d.inend)  {result = DedupFlush (&d);  break;}   // end of data
+        const unsigned char* p = d.in + d.inpos;
+        CelsNum header = GetVarint (&p, d.in + d.inend),  len = header/2;
+        if (header < 2)  {result = CELS_ERROR_BAD_COMPRESSED_DATA;  break;}
+        if (header & 1) {
+            // Copy repeated chunk from the dictionary, via the temporary buffer since it may overlap the destination
+            CelsNum distance = GetVarint (&p, d.in + d.inend);
+            d.inpos = p - d.in;
+            if (distance <= 0  ||  distance > d.total  ||  distance > d.dictsize  ||  len > DedupMaxChunk(m))
+                {result = CELS_ERROR_BAD_COMPRESSED_DATA;  break;}
+            while (len > 0  &&  result == CELS_OK) {
+                CelsNum n = (len < DEDUP_IO_SIZE? len : DEDUP_IO_SIZE),  pos = (d.total - distance) % d.dictsize;
+                if (n > distance)             n = distance;
+                if (n > d.dictsize - pos)     n = d.dictsize - pos;
+                memcpy (d.tmp, d.dict + pos, n);
+                result = DedupOutput (&d, d.tmp, n);
+                len -= n;
+            }
+        } else {
+            d.inpos = p - d.in;
+            while (len > 0  &&  result == CELS_OK) {
+                if ((result = DedupFill (&d, 1)) < CELS_OK)  break;
+                if (d.inpos == d.inend)  {result = CELS_ERROR_BAD_COMPRESSED_DATA;  break;}
+                CelsNum n = (len < d.inend - d.inpos?  len : d.inend - d.inpos);
+                result = DedupOutput (&d, d.in + d.inpos, n);
+                d.inpos += n,  len -= n;
+            }
+        }
+    }
+
+    CelsFreeMemory (cb,ud, d.dict, m->dict);
+    CelsFreeMemory (cb,ud, d.in,   DEDUP_IO_SIZE);
+    CelsFreeMemory (cb,ud, d.out,  DEDUP_IO_SIZE);
+    CelsFreeMemory (cb,ud, d.tmp,  DEDUP_IO_SIZE);
+    return result;
+}
+
+
+// Codec interface **********************************************************************************************************
+
+// Parse size like "48", "4k", "256m" or "1g"; return -1 on error
+static CelsNum ParseSize (const char* s)
+{
+    CelsNum x = 0;
+    if (*s < '0'  ||  *s > '9')  return -1;
+    for (;  *s >= '0'  &&  *s <= '9';  s++)
+        if ((x = x*10 + (*s-'0')) > ((CelsNum)1 << 40))  return -1;
+    switch (*s) {
+        case 'b':  s++;  break;
+        case 'k':  s++;  x <<= 10;  break;
+        case 'm':  s++;  x <<= 20;  break;
+        case 'g':  s++;  x <<= 30;  break;
+    }
+    return *s? -1 : x;
+}
+
+static char* FormatSize (char* p, char prefix, CelsNum x)
+{
+    const char* suffix = "";
+    if      (x % (1<<30) == 0)  x >>= 30,  suffix = "g";
+    else if (x % (1<<20) == 0)  x >>= 20,  suffix = "m";
+    else if (x % (1<<10) == 0)  x >>= 10,  suffix = "k";
+    return p + sprintf (p, ":%c%lld%s", prefix, x, suffix);
+}
+
+static CelsResult __cdecl DedupCodec (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb)
+{
+    DedupMethod* m = (DedupMethod*) self;
+    switch (service)
+    {
+    case CELS_PARSE:
+        {
+            char** param = (char**)inbuf;
+            DedupMethod parsed = {DEDUP_DEFAULT_CHUNK, DEDUP_DEFAULT_MIN, DEDUP_DEFAULT_DICT, 0};
+            for (param++;  *param;  param++) {
+                CelsNum x = ParseSize (*param+1);
+                if (strcmp (*param, "sha") == 0)  {parsed.sha = 1;  continue;}
+                switch (**param) {
+                    case 'c':  parsed.chunk = x;  break;
+                    case 'm':  parsed.min   = x;  break;
+                    case 'd':  parsed.dict  = x;  break;
+                    default:   return CELS_ERROR_INVALID_COMPRESSOR;
+                }
+            }
+            if (parsed.min < DEDUP_MIN_CHUNK  ||  parsed.chunk <= parsed.min  ||  parsed.chunk > DEDUP_MAX_CHUNK
+                ||  parsed.dict < parsed.chunk*8)  return CELS_ERROR_INVALID_COMPRESSOR;
+            if (outsize < (CelsNum)sizeof(DedupMethod))  return CELS_ERROR_GENERAL;
+            *(DedupMethod*)outbuf = parsed;
+            return sizeof(DedupMethod);
+        }
+
+    case CELS_UNPARSE:
+        {
+            // Only the dictionary size is required for decompression
+            char str[100],  *p = str + sprintf (str, "dedup");
+            if (subservice != CELS_UNPARSE_PURE)  p = FormatSize (FormatSize (p, 'c', m->chunk), 'm', m->min);
+            p = FormatSize (p, 'd', m->dict);
+            if (m->sha  &&  subservice != CELS_UNPARSE_PURE)  strcpy (p, ":sha");
+            if ((CelsNum)strlen(str) >= outsize)  return CELS_ERROR_GENERAL;
+            strcpy ((char*)outbuf, str);
+            return CELS_OK;
+        }
+
+    case CELS_GET_MAX_COMPRESSED_SIZE:
+        return insize + insize/DEDUP_BATCH*16 + 64;      // references are never longer than the chunks they replace
+
+    case CELS_GET_DICTIONARY_SIZE:
+        return m->dict;
+
+    case CELS_GET_COMPRESSION_MEMORY:
+        return 2*(DEDUP_BATCH + DedupMaxChunk(m)) + (DEDUP_BATCH + DedupMaxChunk(m)) / m->min * 16 + DedupTableCapacity(m) * sizeof(DedupEntry);
+
+    case CELS_GET_DECOMPRESSION_MEMORY:
+        return m->dict + 3*DEDUP_IO_SIZE;
+
+    case CELS_COMPRESS:
+    case CELS_DECOMPRESS:
+        if (inbuf  ||  outbuf)  return CELS_ERROR_NOT_IMPLEMENTED;   // framework will emulate buffers with callbacks
+        return service==CELS_COMPRESS?  DedupCompress (m, ud,cb) : DedupDecompress (m, ud,cb);
+
+    default:
+        return CELS_ERROR_NOT_IMPLEMENTED;
+    }
+}
+
+
+
+// ****************************************************************************************************************************
+// Persistent chunk index: memory-mapped file mapping SHA-256 of chunks to their locations (solid block and offset in it),   *
+// so incremental archiving finds duplicates of already archived chunks without reading the archive. The file consists of  *
+// the header and open-addressing tables, each one twice as large as the previous one. Tables never move: when the last one  *
+// is filled, the next table is appended to the file, so the index grows without a rewrite. Lookups probe tables from the    *
+// largest one. Keys are the first 128 bits of SHA-256. Only tables are mapped: the header is kept in memory and written by  *
+// the flush after the tables are synced, so it never describes unsaved tables. The index isn't thread-safe.                *
+// ****************************************************************************************************************************
+
+const char    CHUNK_INDEX_MAGIC[8]      = {'C','E','L','S','C','I','X','1'};
+const int     CHUNK_INDEX_MAX_TABLES    = 48;
+const int     CHUNK_INDEX_MIN_LOG_SLOTS = 16;      // the first table has 64K slots (2 MB)
+const CelsNum CHUNK_INDEX_HEADER_SIZE   = 64<<10;  // keeps tables aligned to pages and to the 64 KB granularity of Windows views
+
+typedef struct {
+    Uint64  key[2];            // the first 16 bytes of SHA-256, little-endian; empty slot is all zeros
+    Uint64  block, offset;
+} ChunkIndexSlot;
+
+typedef struct {
+    char    magic[8];
+    Uint64  tables;
+    struct {Uint64 log_slots, count;}  table [CHUNK_INDEX_MAX_TABLES];
+} ChunkIndexHeader;
+
+#ifdef _WIN32
+typedef HANDLE ChunkIndexFile;
+#else
+typedef int    ChunkIndexFile;
+#endif
+
+struct CelsChunkIndex {
+    ChunkIndexFile     file;
+    CelsNum            filesize;
+    ChunkIndexHeader   header;                            // written to the file only by the flush
+    ChunkIndexSlot*    slots [CHUNK_INDEX_MAX_TABLES];    // mapped tables
+};
+
+static CelsNum ChunkIndexTableSize (int log_slots)  {return ((CelsNum)1 << log_slots) * sizeof(ChunkIndexSlot);}
+
+static CelsNum ChunkIndexTableOffset (const ChunkIndexHeader* h, int t)
+{
+    CelsNum offset = CHUNK_INDEX_HEADER_SIZE;
+    int i;
+    for (i=0; i<t; i++)
+        offset += ChunkIndexTableSize ((int)h->table[i].log_slots);
+    return offset;
+}
+
+#ifdef _WIN32
+static int ChunkIndexOpenFile (const char* filename, ChunkIndexFile* file, CelsNum* size)
+{
+    int len = MultiByteToWideChar (CP_UTF8, 0, filename, -1, NULL, 0);
+    wchar_t* wname = (wchar_t*) malloc (len * sizeof(wchar_t));
+    if (wname == NULL)  return 0;
+    MultiByteToWideChar (CP_UTF8, 0, filename, -1, wname, len);
+    *file = CreateFileW (wname, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    free (wname);
+    LARGE_INTEGER li;
+    if (*file == INVALID_HANDLE_VALUE)  return 0;
+    if (!GetFileSizeEx (*file, &li))    {CloseHandle (*file);  return 0;}
+    *size = li.QuadPart;
+    return 1;
+}
+
+// CreateFileMapping() extends the file itself, while SetEndOfFile() may fail with views mapped
+static int ChunkIndexResize (ChunkIndexFile file, CelsNum size)          {return 1;}
+
+static int ChunkIndexReadHeader (ChunkIndexFile file, ChunkIndexHeader* h)
+{
+    OVERLAPPED ov;
+    DWORD n;
+    memset (&ov, 0, sizeof(ov));
+    return ReadFile (file, h, sizeof(*h), &n, &ov)  &&  n == sizeof(*h);
+}
+
+static int ChunkIndexWriteHeader (ChunkIndexFile file, const ChunkIndexHeader* h)
+{
+    OVERLAPPED ov;
+    DWORD n;
+    memset (&ov, 0, sizeof(ov));
+    return WriteFile (file, h, sizeof(*h), &n, &ov)  &&  n == sizeof(*h);
+}
+
+static void* ChunkIndexMap (ChunkIndexFile file, CelsNum offset, CelsNum size)
+{
+    CelsNum end = offset + size;
+    HANDLE mapping = CreateFileMappingW (file, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, NULL);
+    if (mapping == NULL)  return NULL;
+    void* ptr = MapViewOfFile (mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)size);
+    CloseHandle (mapping);    // the view keeps the mapping alive
+    return ptr;
+}
+
+static void ChunkIndexUnmap (void* ptr, CelsNum size)                    {UnmapViewOfFile (ptr);}
+static int  ChunkIndexSyncMap (void* ptr, CelsNum size)                  {return FlushViewOfFile (ptr, (SIZE_T)size) != 0;}
+static int  ChunkIndexSyncFile (ChunkIndexFile file)                     {return FlushFileBuffers (file) != 0;}
+static void ChunkIndexCloseFile (ChunkIndexFile file)                    {CloseHandle (file);}
+
+#else
+static int ChunkIndexOpenFile (const char* filename, ChunkIndexFile* file, CelsNum* size)
+{
+    struct stat st;
+    *file = open (filename, O_RDWR|O_CREAT, 0644);
+    if (*file < 0)  return 0;
+    if (fstat (*file, &st) != 0)  {close (*file);  return 0;}
+    *size = st.st_size;
+    return 1;
+}
+
+static int   ChunkIndexResize (ChunkIndexFile file, CelsNum size)        {return ftruncate (file, size) == 0;}
+static int   ChunkIndexReadHeader (ChunkIndexFile file, ChunkIndexHeader* h)         {return pread (file, h, sizeof(*h), 0) == (ssize_t)sizeof(*h);}
+static int   ChunkIndexWriteHeader (ChunkIndexFile file, const ChunkIndexHeader* h)  {return pwrite (file, h, sizeof(*h), 0) == (ssize_t)sizeof(*h);}
+static void* ChunkIndexMap (ChunkIndexFile file, CelsNum offset, CelsNum size)
+{
+    void* ptr = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, file, offset);
+    return ptr==MAP_FAILED? NULL : ptr;
+}
+static void  ChunkIndexUnmap (void* ptr, CelsNum size)                   {munmap (ptr, size);}
+static int   ChunkIndexSyncMap (void* ptr, CelsNum size)                 {return msync (ptr, size, MS_SYNC) == 0;}
+static int   ChunkIndexSyncFile (ChunkIndexFile file)                    {return fsync (file) == 0;}
+static void  ChunkIndexCloseFile (ChunkIndexFile file)                   {close (file);}
+#endif
+
+static void ChunkIndexFree (CelsChunkIndex* index)
+{
+    int t;
+    for (t=0; t < CHUNK_INDEX_MAX_TABLES; t++)
+        if (index->slots[t])  ChunkIndexUnmap (index->slots[t], ChunkIndexTableSize ((int)index->header.table[t].log_slots));
+    ChunkIndexCloseFile (index->file);
+    free (index);
+}
+
+// Append the next table to the file; the header is updated only after the table is mapped
+static CelsResult ChunkIndexAddTable (CelsChunkIndex* index)
+{
+    ChunkIndexHeader* h = &index->header;
+    int t = (int) h->tables;
+    if (t == CHUNK_INDEX_MAX_TABLES)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    int log_slots = (t == 0?  CHUNK_INDEX_MIN_LOG_SLOTS : (int)h->table[t-1].log_slots + 1);
+    CelsNum offset = ChunkIndexTableOffset (h, t),  size = ChunkIndexTableSize (log_slots);
+    if (offset + size > index->filesize) {
+        if (!ChunkIndexResize (index->file, offset + size))  return CELS_ERROR_WRITE;
+    }
+    index->slots[t] = (ChunkIndexSlot*) ChunkIndexMap (index->file, offset, size);
+    if (index->slots[t] == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    // Table appended after the last flush may be left in the file by the crash
+    if (offset < index->filesize)  memset (index->slots[t], 0, (size_t)(index->filesize - offset < size?  index->filesize - offset : size));
+    if (offset + size > index->filesize)  index->filesize = offset + size;
+    h->table[t].log_slots = log_slots;
+    h->table[t].count     = 0;
+    h->tables = t+1;
+    return CELS_OK;
+}
+
+CelsResult CelsChunkIndexOpen (CelsChunkIndex** result, const char* filename)
+{
+    CelsChunkIndex* index = (CelsChunkIndex*) calloc (1, sizeof(CelsChunkIndex));
+    CelsNum filesize;
+    if (index == NULL)  return CELS_ERROR_NOT_ENOUGH_MEMORY;
+    if (!ChunkIndexOpenFile (filename, &index->file, &filesize))  {free (index);  return CELS_ERROR_READ;}
+
+    int created = (filesize == 0),  t;
+    ChunkIndexHeader* h = &index->header;
+    index->filesize = filesize;
+    if (!created  &&  filesize < (CelsNum)sizeof(ChunkIndexHeader))  {ChunkIndexFree (index);  return CELS_ERROR_BAD_HEADERS;}
+    if (created) {
+        memcpy (h->magic, CHUNK_INDEX_MAGIC, sizeof(h->magic));
+        if (!ChunkIndexResize (index->file, CHUNK_INDEX_HEADER_SIZE)  ||  !ChunkIndexWriteHeader (index->file, h))
+            {ChunkIndexFree (index);  return CELS_ERROR_WRITE;}
+        index->filesize = CHUNK_INDEX_HEADER_SIZE;
+    } else if (!ChunkIndexReadHeader (index->file, h))
+        {ChunkIndexFree (index);  return CELS_ERROR_READ;}
+
+    // Validate the header before mapping tables it describes
+    if (memcmp (h->magic, CHUNK_INDEX_MAGIC, sizeof(h->magic))  ||  h->tables > (Uint64)CHUNK_INDEX_MAX_TABLES)
+        {ChunkIndexFree (index);  return CELS_ERROR_BAD_HEADERS;}
+    for (t=0; t < (int)h->tables; t++)
+        if (h->table[t].log_slots != (Uint64)(CHUNK_INDEX_MIN_LOG_SLOTS + t)  ||  h->table[t].count > ((Uint64)1 << h->table[t].log_slots))
+            {ChunkIndexFree (index);  return CELS_ERROR_BAD_HEADERS;}
+    if (!created  &&  ChunkIndexTableOffset (h, (int)h->tables) > filesize)
+        {ChunkIndexFree (index);  return CELS_ERROR_BAD_HEADERS;}
+
+    for (t=0; t < (int)h->tables; t++) {
+        index->slots[t] = (ChunkIndexSlot*) ChunkIndexMap (index->file, ChunkIndexTableOffset (h,t), ChunkIndexTableSize ((int)h->table[t].log_slots));
+        if (index->slots[t] == NULL)  {ChunkIndexFree (index);  return CELS_ERROR_NOT_ENOUGH_MEMORY;}
+    }
+    *result = index;
+    return CELS_OK;
+}
+
+static void ChunkIndexKey (const unsigned char hash[32], Uint64 key[2])
+{
+    key[0] = ReadLE64 (hash),  key[1] = ReadLE64 (hash+8);
+    if (key[0] == 0  &&  key[1] == 0)  key[1] = 1;    // all zeros mark empty slots
+}
+
+// Slot with the key, or the empty slot where it should be inserted into the table t, or NULL if the table is full
+// (table counts may lag behind slots written before the crash, so the fill limit alone doesn't guarantee an empty slot)
+static ChunkIndexSlot* ChunkIndexProbe (CelsChunkIndex* index, int t, const Uint64 key[2])
+{
+    Uint64 mask = ((Uint64)1 << index->header.table[t].log_slots) - 1,  i,  n;
+    ChunkIndexSlot* slots = index->slots[t];
+    for (i = key[0] & mask,  n = 0;  n <= mask;  i = (i+1) & mask,  n++) {
+        ChunkIndexSlot* slot = &slots[i];
+        if ((slot->key[0] == key[0]  &&  slot->key[1] == key[1])  ||  (slot->key[0] == 0  &&  slot->key[1] == 0))
+            return slot;
+    }
+    return NULL;
+}
+
+static ChunkIndexSlot* ChunkIndexLookup (CelsChunkIndex* index, const Uint64 key[2])
+{
+    int t;
+    for (t = (int)index->header.tables - 1;  t >= 0;  t--) {
+        ChunkIndexSlot* slot = ChunkIndexProbe (index, t, key);
+        if (slot  &&  slot->key[0] == key[0]  &&  slot->key[1] == key[1])  return slot;
+    }
+    return NULL;
+}
+
+CelsResult CelsChunkIndexFind (CelsChunkIndex* index, const unsigned char hash[32], CelsNum* block, CelsNum* offset)
+{
+    Uint64 key[2];
+    ChunkIndexKey (hash, key);
+    ChunkIndexSlot* slot = ChunkIndexLookup (index, key);
+    if (slot == NULL)  return 0;
+    if (block)   *block  = slot->block;
+    if (offset)  *offset = slot->offset;
+    return 1;
+}
+
+CelsResult CelsChunkIndexAdd (CelsChunkIndex* index, const unsigned char hash[32], CelsNum block, CelsNum offset)
+{
+    ChunkIndexHeader* h = &index->header;
+    Uint64 key[2];
+    ChunkIndexKey (hash, key);
+    if (ChunkIndexLookup (index, key))  return 1;      // keep the first location
+
+    // Tables are filled up to 3/4 (or until no empty slot is left), then the next one is appended
+    int t = (int)h->tables - 1;
+    ChunkIndexSlot* slot = NULL;
+    if (t >= 0  &&  h->table[t].count < ((Uint64)3 << h->table[t].log_slots) / 4)
+        slot = ChunkIndexProbe (index, t, key);
+    if (slot == NULL) {
+        CelsResult result = ChunkIndexAddTable (index);
+        if (result < CELS_OK)  return result;
+        slot = ChunkIndexProbe (index, ++t, key);
+    }
+    slot->block  = block;
+    slot->offset = offset;
+    slot->key[1] = key[1];
+    slot->key[0] = key[0];
+    h->table[t].count++;
+    return CELS_OK;
+}
+
+CelsNum CelsChunkIndexCount (CelsChunkIndex* index)
+{
+    CelsNum count = 0;
+    int t;
+    for (t=0; t < (int)index->header.tables; t++)
+        count += index->header.table[t].count;
+    return count;
+}
+
+CelsResult CelsChunkIndexFlush (CelsChunkIndex* index)
+{
+    int t, ok = 1;
+    for (t=0; t < (int)index->header.tables; t++)
+        ok &= ChunkIndexSyncMap (index->slots[t], ChunkIndexTableSize ((int)index->header.table[t].log_slots));
+    ok &= ChunkIndexSyncFile (index->file);
+    if (!ok)  return CELS_ERROR_WRITE;
+    // Tables are on the disk now, so the header describing them is written last
+    ok &= ChunkIndexWriteHeader (index->file, &index->header);
+    ok &= ChunkIndexSyncFile (index->file);
+    return ok? CELS_OK : CELS_ERROR_WRITE;
+}
+
+CelsResult CelsChunkIndexClose (CelsChunkIndex* index)
+{
+    CelsResult result = CelsChunkIndexFlush (index);
+    ChunkIndexFree (index);
+    return result;
+}
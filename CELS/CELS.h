@@ -1,10 +1,16 @@
 #ifndef CELS_H
 #define CELS_H
 
+#include <stdlib.h>  // for malloc/free in CelsAlloc/CelsFreeMemory
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#if !defined(_WIN32) && !defined(__cdecl)
+#define __cdecl   // default calling convention on other platforms
+#endif
+
 // Function types representing codecs and callbacks
 typedef long long CelsResult, CelsNum;
 typedef CelsResult __cdecl CelsCallback0(void);
@@ -14,6 +20,9 @@ typedef CelsResult __cdecl CelsFunction (void* self, int service, CelsNum subser
 CelsResult CelsRegister (const char* name, void* ud, CelsFunction* CelsMain);
 CelsResult CelsParseStr (const char* method_str, void* method, CelsNum method_size, void* ud, CelsCallback* cb);
 CelsResult CelsParseSplitted (char const* const* parameters, void* method, CelsNum method_size, void* ud, CelsCallback* cb);
+// Pool of warm instances
+CelsResult CelsAcquireInstance (const char* method_str, void** instance);
+CelsResult CelsReleaseInstance (void* instance);
 // DLL loading/unloading
 CelsResult CelsRegisterModule (void* dll, const char* method_name, CelsFunction* CelsMain);
 CelsResult CelsLoad();
@@ -35,11 +44,14 @@ const int CELS_FREE                             = 0x00000001;   // Last operatio
 const int CELS_UNPARSE                          = 0x00000002;   // Put into (outbuf,outsize) buffer some variant of string representing the method instance, where variant is defined by the insize containing one of CELS_UNPARSE_* constants
 const int CELS_COMPRESS                         = 0x00000004;   // Compress (encode) data using CELS_READ/CELS_WRITE callbacks (and optionally CELS_PROGRESS/CELS_QUASI_WRITE to inform application about operation progress). Also: Compress buffer (inbuf,insize) into buffer (outbuf,outsize) and return compressed size. When inbuf and/or outbuf is NULL, read/write data via callbacks or return CELS_ERROR_NOT_IMPLEMENTED
 const int CELS_DECOMPRESS                       = 0x00000005;   // Like above but decompress (decode)
+const int CELS_COMPRESS_BATCH                   = 0x00000006;   // Compress each of insize CelsBatchItem descriptors at inbuf, storing compressed size or error code into its result field. Return CELS_OK or error code of the first failed item. If codec doesn't implement it, framework compresses items one by one
+const int CELS_DECOMPRESS_BATCH                 = 0x00000007;   // Like above but decompress (decode)
 // Information requests
 const int CELS_GET_EXPAND_DATA                  = 0x01000000;   // Can this compressor expand data (like precomp)?
 const int CELS_GET_NUM_INPUT_STREAMS            = 0x01000001;   // Number of input streams for compression (== number of output streams for decompression)
 const int CELS_GET_NUM_OUTPUT_STREAMS           = 0x01000002;   // Number of output streams for compression (== number of input streams for decompression)
 const int CELS_GET_MAX_COMPRESSED_SIZE          = 0x01000003;   // Upper limit of compressed size for given insize
+const int CELS_GET_ALL_PARAMS                   = 0x01000004;   // Fill CelsParams structure at (outbuf,outsize), whose version field was set by the caller, with all parameters at once. If codec doesn't implement it, framework calls individual getters
 // Get algorithm parameters
 const int CELS_GET_COMPRESSION_MEMORY           = 0x02000000;   // How much memory for compression?
 const int CELS_GET_DECOMPRESSION_MEMORY         = 0x02000001;   // How much memory for decompression?
@@ -74,6 +86,11 @@ const int CELS_RECEIVE_FILLED_INBUF             = 0x10000004;   // Receive next
 const int CELS_SEND_EMPTY_INBUF                 = 0x10000005;   // Send empty input buffer (inbuf,insize) into the queue
 const int CELS_RECEIVE_EMPTY_OUTBUF             = 0x10000006;   // Receive next empty output buffer from the queue: bufsize returned as result, bufptr stored in *outbuf
 const int CELS_SEND_FILLED_OUTBUF               = 0x10000007;   // Send filled output buffer (outbuf,outsize) into the queue
+const int CELS_READ_STREAM                      = 0x10000008;   // Like CELS_READ, but read from the input stream number subservice (0 = the same as CELS_READ)
+const int CELS_WRITE_STREAM                     = 0x10000009;   // Like CELS_WRITE, but write to the output stream number subservice (0 = the same as CELS_WRITE)
+const int CELS_ALLOC                            = 0x1000000A;   // Allocate insize bytes of memory and store pointer to the block into *outbuf. Host implementing it should implement CELS_FREE_MEMORY too
+const int CELS_FREE_MEMORY                      = 0x1000000B;   // Free memory block (inbuf,insize) allocated by CELS_ALLOC
+const int CELS_GET_THREAD_POOL                  = 0x1000000C;   // Store pointer to CelsThreadPool shared by all codecs into *outbuf and return its number of threads. Framework provides the default pool if application doesn't implement it
 
 // Operations that can be implemented by codec in CelsMain()
 inline static int IS_CELS_CODEC_SERVICE (int service)  {return (service&0xFF000000)==0x04000000;}   // Family of codec services
@@ -91,6 +108,16 @@ inline static int IS_CELS_GLOBAL_SERVICE (int service)  {return (service&0xFF000
 const int CELS_LOAD                             = 0x06000000;   // CelsLoad() == Load cels*.dll
 const int CELS_UNLOAD                           = 0x06000001;   // CelsUnload() == Deregister all codecs and free all dlls
 const int CELS_REGISTER                         = 0x06000002;   // CelsRegister(inbuf,ud,cb) == Register codec
+const int CELS_GET_INSTANCE_CACHE_HITS          = 0x06000003;   // Number of string-method Cels() calls served by cached parsed instances (total over all threads)
+const int CELS_GET_INSTANCE_CACHE_MISSES        = 0x06000004;   // Number of string-method Cels() calls that had to parse the method
+const int CELS_FLUSH_INSTANCE_CACHE             = 0x06000005;   // Free all cached and pooled parsed instances that aren't in use right now
+const int CELS_SET_CALLBACK_STATS               = 0x06000006;   // Collect statistics of callback calls made by codecs: subservice=0 disables, 1 enables, 2 enables and prints report to stderr at CelsUnload()
+const int CELS_GET_CALLBACK_STATS               = 0x06000007;   // Write text report of collected callback statistics to (outbuf,outsize) and return its length
+const int CELS_SET_INSTANCE_POOL_MEMORY          = 0x06000008;   // Limit memory kept by idle instances of CelsAcquireInstance() pool to subservice bytes (1 GB by default)
+const int CELS_SET_HOST_MEMORY_BUDGET           = 0x06000009;   // Limit memory allocated by CelsHostAlloc() to subservice bytes (0 = unlimited, by default)
+const int CELS_GET_HOST_MEMORY_USED             = 0x0600000A;   // Memory currently allocated by CelsHostAlloc()
+const int CELS_GET_HOST_MEMORY_PEAK             = 0x0600000B;   // Peak memory allocated by CelsHostAlloc() since the last CELS_SET_HOST_MEMORY_BUDGET
+const int CELS_SET_MAX_CPU_LOAD                 = 0x0600000C;   // Limit total CPU load of the default thread pool and block-parallel operations to subservice percents (100 = 1 thread, 0 = all CPUs, by default)
 
 // Code ranges reserved for applications and 3rd-party libraries
 const int CELS_LIBRARY_CODES                    = 0x40000000;   // Codes available for 3rd-party libraries
@@ -119,6 +146,48 @@ const int CELS_ERROR_BAD_CRC                    = -12;  // File failed CRC check
 const int CELS_ERROR_BAD_PASSWORD               = -13;  // Password/keyfile failed checkcode test
 const int CELS_ERROR_BAD_HEADERS                = -14;  // Archive headers are corrupted
 const int CELS_ERROR_INTERNAL                   = -15;  // It should never happen: implementation error. Please report this bug to developers!
+const int CELS_ERROR_WOULD_BLOCK                = -16;  // Callback can't serve the request right now: asynchronous task should be suspended
+
+// Descriptor of single buffer for CELS_COMPRESS_BATCH/CELS_DECOMPRESS_BATCH
+typedef struct {
+    void*       inbuf;
+    CelsNum     insize;
+    void*       outbuf;
+    CelsNum     outsize;
+    CelsResult  result;     // (de)compressed size or error code
+} CelsBatchItem;
+
+// Snapshot of method parameters filled by CELS_GET_ALL_PARAMS. Each field holds value returned by the corresponding getter,
+// or its error code (CELS_ERROR_NOT_IMPLEMENTED for parameters not supported by the codec).
+// New fields are added only at the end, incrementing CELS_PARAMS_VERSION; codecs fill only fields fitting into outsize.
+const int CELS_PARAMS_VERSION = 1;
+typedef struct {
+    CelsNum     version;                        // CELS_PARAMS_VERSION the caller was compiled with
+    CelsResult  compression_memory;
+    CelsResult  decompression_memory;
+    CelsResult  minimum_compression_memory;
+    CelsResult  minimum_decompression_memory;
+    CelsResult  dictionary_size;
+    CelsResult  blocksize;
+    CelsResult  compression_cpu_load;
+    CelsResult  decompression_cpu_load;
+    CelsResult  minimal_input_size;
+    CelsResult  caching;
+    CelsResult  num_input_streams;
+    CelsResult  num_output_streams;
+} CelsParams;
+
+// Thread pool shared by codecs instead of starting their own threads, obtained with CELS_GET_THREAD_POOL.
+// Submit() runs job(arg) on a pool thread, incrementing *pending now and decrementing it when the job is finished.
+// Wait() returns when *pending becomes 0, running queued jobs meanwhile, so jobs may wait for their own subjobs.
+typedef void __cdecl CelsJobFunction (void* arg);
+typedef struct CelsThreadPool CelsThreadPool;
+struct CelsThreadPool {
+    void*  self;        // pool implementation data
+    int    threads;     // number of threads running jobs
+    CelsResult (__cdecl *Submit) (CelsThreadPool* pool, CelsJobFunction* job, void* arg, volatile long* pending);
+    CelsResult (__cdecl *Wait)   (CelsThreadPool* pool, volatile long* pending);
+};
 
 // Various sizes
 const int CELS_MAX_PARSED_METHOD_SIZE           = 1024;
@@ -129,6 +198,29 @@ const char CELS_METHOD_PARAMETERS_DELIMITER     =  ':';
 // Handy operation shortcuts
 inline static CelsResult CelsRead  (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_READ,0,  buf,size, 0,0, 0,0);}
 inline static CelsResult CelsWrite (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_WRITE,0, 0,0, buf,size, 0,0);}
+// Codecs should allocate large buffers with CelsAlloc, so the host can control their placement and account their memory.
+// When the callback doesn't implement CELS_ALLOC (or no callback was provided), memory is allocated with malloc.
+inline static void* CelsAlloc (CelsCallback* cb, void* ud, CelsNum size)
+{
+    void* ptr = NULL;
+    CelsResult result = (cb? cb(ud, CELS_ALLOC,0, 0,size, &ptr,0, 0,0) : CELS_ERROR_NOT_IMPLEMENTED);
+    if (result == CELS_ERROR_NOT_IMPLEMENTED)  return malloc(size);
+    return result<CELS_OK? NULL : ptr;
+}
+inline static void CelsFreeMemory (CelsCallback* cb, void* ud, void* ptr, CelsNum size)
+{
+    if (ptr == NULL)  return;
+    if (!cb  ||  cb(ud, CELS_FREE_MEMORY,0, ptr,size, 0,0, 0,0) == CELS_ERROR_NOT_IMPLEMENTED)  free(ptr);
+}
+// Get thread pool of the host, or NULL if it doesn't provide one (codec should run single-threaded or start its own threads)
+inline static CelsThreadPool* CelsGetThreadPool (CelsCallback* cb, void* ud)
+{
+    CelsThreadPool* pool = NULL;
+    if (!cb  ||  cb(ud, CELS_GET_THREAD_POOL,0, 0,0, &pool,0, 0,0) < CELS_OK)  return NULL;
+    return pool;
+}
+inline static CelsResult CelsReadStream  (CelsCallback* cb, void* ud, int stream, void* buf, CelsNum size)  {return cb(ud, CELS_READ_STREAM,stream,  buf,size, 0,0, 0,0);}
+inline static CelsResult CelsWriteStream (CelsCallback* cb, void* ud, int stream, void* buf, CelsNum size)  {return cb(ud, CELS_WRITE_STREAM,stream, 0,0, buf,size, 0,0);}
 inline static CelsResult CelsProgress (CelsCallback* cb, void* ud, CelsNum insize, CelsNum outsize)    {return cb(ud, CELS_PROGRESS,0, 0,insize, 0,outsize, 0,0);}
 inline static CelsResult CelsReceiveFilledInbuf (CelsCallback* cb, void* ud, void** buf)               {return cb(ud, CELS_RECEIVE_FILLED_INBUF,0,  buf,0,    0,0, 0,0);}
 inline static CelsResult CelsSendEmptyInbuf     (CelsCallback* cb, void* ud, void* buf, CelsNum size)  {return cb(ud, CELS_SEND_EMPTY_INBUF,0,      buf,size, 0,0, 0,0);}
@@ -137,6 +229,8 @@ inline static CelsResult CelsSendFilledOutbuf   (CelsCallback* cb, void* ud, voi
 
 inline static CelsResult CelsCompress  (const void* method, void* ud, CelsCallback* cb)  {return Cels(method, CELS_COMPRESS,0,   0,0, 0,0, ud,cb);}
 inline static CelsResult CelsDecompress(const void* method, void* ud, CelsCallback* cb)  {return Cels(method, CELS_DECOMPRESS,0, 0,0, 0,0, ud,cb);}
+inline static CelsResult CelsCompressBatch   (const void* method, CelsBatchItem* items, CelsNum num_items)  {return Cels(method, CELS_COMPRESS_BATCH,0,   items,num_items, 0,0, 0,0);}
+inline static CelsResult CelsDecompressBatch (const void* method, CelsBatchItem* items, CelsNum num_items)  {return Cels(method, CELS_DECOMPRESS_BATCH,0, items,num_items, 0,0, 0,0);}
 
 inline static CelsResult CelsCanonize (const void* method, char* outbuf)  {return Cels(method, CELS_UNPARSE,CELS_UNPARSE_FULL,    0,0, outbuf,CELS_MAX_METHOD_STRING_SIZE, 0,0);}
 inline static CelsResult CelsDisplay  (const void* method, char* outbuf)  {return Cels(method, CELS_UNPARSE,CELS_UNPARSE_DISPLAY, 0,0, outbuf,CELS_MAX_METHOD_STRING_SIZE, 0,0);}
@@ -151,12 +245,37 @@ inline static CelsResult CelsGetMaxCompressedSize (const void* method, CelsNum s
 inline static CelsResult CelsFree (void* method)
         {return Cels(method, CELS_FREE,0, 0,0, 0,0, 0,(CelsCallback*)Cels);}
 
+inline static CelsResult CelsGetInstanceCacheHits()    {return Cels(0, CELS_GET_INSTANCE_CACHE_HITS,0,   0,0, 0,0, 0,0);}
+inline static CelsResult CelsGetInstanceCacheMisses()  {return Cels(0, CELS_GET_INSTANCE_CACHE_MISSES,0, 0,0, 0,0, 0,0);}
+inline static CelsResult CelsFlushInstanceCache()      {return Cels(0, CELS_FLUSH_INSTANCE_CACHE,0,      0,0, 0,0, 0,0);}
+inline static CelsResult CelsSetInstancePoolMemory (CelsNum memory)  {return Cels(0, CELS_SET_INSTANCE_POOL_MEMORY,memory, 0,0, 0,0, 0,0);}
+
+// Default host implementation of CELS_ALLOC/CELS_FREE_MEMORY: large blocks use huge pages and NUMA node of the calling
+// thread, all blocks are counted against the budget. Application callback may forward these services to them.
+CelsResult CelsHostAlloc (void** ptr, CelsNum size);
+CelsResult CelsHostFree  (void* ptr, CelsNum size);
+inline static CelsResult CelsSetHostMemoryBudget (CelsNum budget)  {return Cels(0, CELS_SET_HOST_MEMORY_BUDGET,budget, 0,0, 0,0, 0,0);}
+inline static CelsResult CelsGetHostMemoryUsed()                  {return Cels(0, CELS_GET_HOST_MEMORY_USED,0,       0,0, 0,0, 0,0);}
+inline static CelsResult CelsGetHostMemoryPeak()                  {return Cels(0, CELS_GET_HOST_MEMORY_PEAK,0,       0,0, 0,0, 0,0);}
+// Default thread pool having one worker per CPU; application callback may return it for CELS_GET_THREAD_POOL
+CelsThreadPool* CelsDefaultThreadPool();
+inline static CelsResult CelsSetMaxCpuLoad (CelsNum cpu_load)      {return Cels(0, CELS_SET_MAX_CPU_LOAD,cpu_load,    0,0, 0,0, 0,0);}
+inline static CelsResult CelsSetCallbackStats (int mode)                        {return Cels(0, CELS_SET_CALLBACK_STATS,mode, 0,0, 0,0, 0,0);}
+inline static CelsResult CelsGetCallbackStats (char* outbuf, CelsNum outsize)   {return Cels(0, CELS_GET_CALLBACK_STATS,0,    0,0, outbuf,outsize, 0,0);}
+
 inline static CelsResult CelsGetNamedService (const void* method, const char* serviceName, CelsNum size)
         {return Cels(method, CELS_GET_NAMED_SERVICE,0, (void*)serviceName,size, 0,0, 0,0);}
 
 inline static CelsResult CelsSetNamedService (void* method, const char* serviceName, CelsNum size, char* outbuf)
         {return Cels(method, CELS_SET_NAMED_SERVICE,0, (void*)serviceName,size, outbuf,CELS_MAX_METHOD_STRING_SIZE, 0,0);}
 
+// Get all method parameters with a single call, parsing the method string only once
+inline static CelsResult CelsGetAllParams (const void* method, CelsParams* params)
+{
+    params->version = CELS_PARAMS_VERSION;
+    return Cels(method, CELS_GET_ALL_PARAMS,0, 0,0, params,sizeof(CelsParams), 0,0);
+}
+
 #define CELS_DEFINE_GETTER(function,code)                                                               \
 inline static CelsResult CelsGet##function (const void* method)                                         \
 {                                                                                                       \
@@ -207,6 +326,95 @@ CELS_DEFINE_GETTER_AND_SETTER (Caching,             CACHING);
 CelsResult CelsCompressMem   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 CelsResult CelsDecompressMem (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
 
+// Order-0 entropy of the buffer in percents of 8 bits/byte, estimated by sampling windows of large buffers
+double CelsOrder0Entropy (const void* buf, CelsNum size);
+
+// Compress data, or store them when their order-0 entropy exceeds ratio percents (f.e. 99), so incompressible data
+// (media, already compressed files) skip expensive codecs. Output starts with 1-byte flag, so it should be decompressed
+// by CelsDecompressAuto. When inbuf is NULL, data are read via callback and only their first 256 KB are estimated.
+CelsResult CelsCompressAuto   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, double ratio, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressAuto (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+
+// Checksums used by built-in codecs "crc32c", "xxh3", "xxh128" and "sha256". These codecs pass data through unchanged,
+// appending their checksum on compression, and checking and removing it on decompression.
+// CelsCrc32c continues CRC of preceding data (0 for the beginning of data), CelsCrc32cCombine returns CRC of concatenated
+// data1+data2 given their CRCs and size of data2, so slices of large buffer may be checksummed in parallel.
+unsigned           CelsCrc32c        (unsigned crc, const void* buf, CelsNum size);
+unsigned           CelsCrc32cCombine (unsigned crc1, unsigned crc2, CelsNum size2);
+unsigned long long CelsXxh3          (const void* buf, CelsNum size);
+void               CelsXxh128        (const void* buf, CelsNum size, unsigned long long hash[2]);   // low half first
+void               CelsSha256        (const void* buf, CelsNum size, unsigned char hash[32]);
+// SHA-256 of n independent buffers, f.e. dedup chunks. The batch is split between threads of the pool provided by callback
+// (or the default one), and each thread hashes 8 buffers simultaneously with AVX2 when the CPU lacks SHA extensions.
+void               CelsSha256Batch   (int n, const void* const* bufs, const CelsNum* sizes, unsigned char (*hashes)[32], void* ud, CelsCallback* cb);
+
+// Block-parallel compression with any codec: input is split into blocks of blocksize bytes (0 - choose automatically),
+// compressed independently by multiple threads each using its own instance of the method. Number of threads is chosen
+// from the codec CPU load and memory requirements, and limited by memory_budget (0 - no limit).
+// Output has its own framing, so it can be decompressed only by CelsDecompressParallel (also using multiple threads).
+CelsResult CelsCompressParallel   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum blocksize, CelsNum memory_budget, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressParallel (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, CelsNum memory_budget, void* ud, CelsCallback* cb);
+
+// (De)compress data with chain of methods like "rep+lzma+aes", running all methods simultaneously in separate threads.
+// Methods are connected by bounded queues of buffers, so the speed is limited only by the slowest method.
+// When inbuf and/or outbuf is NULL, read/write data via callbacks.
+CelsResult CelsCompressChain   (const char* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressChain (const char* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+
+// (De)compress data with multi-output codec writing multiple streams with CELS_WRITE_STREAM (and reading them back
+// with CELS_READ_STREAM on decompression). Output streams are interleaved by chunks into the single output, followed by
+// the compact chunk map, so decompressor reads each stream directly. Decompression requires inbuf, i.e. input in memory.
+CelsResult CelsCompressInterleaved   (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+CelsResult CelsDecompressInterleaved (const void* method, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback* cb);
+
+// Asynchronous (de)compression: the operation runs on its own fiber, and when the callback returns CELS_ERROR_WOULD_BLOCK
+// (f.e. no input data arrived yet or all output buffers are busy), the fiber suspends and CelsResumeTask() returns
+// CELS_ERROR_WOULD_BLOCK. Any thread may resume the task later, so thousands of streams can be served by a small thread pool.
+typedef struct CelsTask CelsTask;
+CelsResult CelsCreateTask (CelsTask** task, const void* method, int service, CelsNum stack_size, void* ud, CelsCallback* cb);
+CelsResult CelsResumeTask (CelsTask* task);   // Operation result, or CELS_ERROR_WOULD_BLOCK if the task was suspended
+CelsResult CelsFreeTask   (CelsTask* task);   // Terminate unfinished operation and free the task
+
+// Asynchronous file I/O for hosts: input file is read ahead into queue_depth buffers, and output is written behind
+// by asynchronous writes, overlapping disk I/O with (de)compression. Pass CelsIoCallback with CelsIo* as its userdata
+// to CelsCompress/CelsDecompress; it serves both CELS_READ/CELS_WRITE and buffer-sharing services.
+// Files are given by descriptors (-1 if not used) and processed from their current positions; pipes are supported too.
+typedef struct CelsIo CelsIo;
+typedef struct {
+    int      queue_depth;     // Number of buffers in each direction (0 - default: 4)
+    CelsNum  buffer_size;     // Size of each buffer, rounded up to 4 KB (0 - default: 1 MB)
+    int      direct;          // Bypass OS cache with O_DIRECT where supported
+} CelsIoOptions;
+CelsResult CelsIoOpen  (CelsIo** io, int infd, int outfd, const CelsIoOptions* options);   // options may be NULL
+CelsResult CelsIoClose (CelsIo* io);   // Write the rest of output and free resources; returns the first I/O error
+CelsResult __cdecl CelsIoCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+void       CelsIoStats (CelsIo* io, CelsNum* bytes_read, CelsNum* bytes_written, CelsNum* wait_ns);   // wait_ns: time spent waiting for disk
+
+// Prefetching reader for many small files: upcoming files of the list are opened, read and closed by prefetch threads
+// into the bounded read-ahead cache. CelsPrefetchCallback (with CelsPrefetch* as userdata) serves CELS_READ, passing contents
+// of the files in the list order as a single stream, f.e. a solid block. Unreadable files are skipped.
+typedef struct CelsPrefetch CelsPrefetch;
+typedef struct {
+    int      threads;         // Number of prefetch threads (0 - default: 4)
+    CelsNum  cache_size;      // Size of the read-ahead cache (0 - default: 256 MB)
+} CelsPrefetchOptions;
+CelsResult CelsPrefetchOpen  (CelsPrefetch** pf, const char* const* filenames, CelsNum num_files, const CelsPrefetchOptions* options);   // UTF-8 filenames, kept until close
+CelsResult CelsPrefetchBlock (CelsPrefetch* pf, CelsNum num_files);   // The stream read by the next (de)compression ends after num_files files (all by default)
+CelsResult CelsPrefetchFileResult (CelsPrefetch* pf, CelsNum index);  // Bytes of the file passed to the codec, or error code if it was skipped
+CelsResult CelsPrefetchClose (CelsPrefetch* pf);
+CelsResult __cdecl CelsPrefetchCallback (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb);
+
+// Persistent index of chunk fingerprints: memory-mapped file mapping SHA-256 of chunks to their archive locations (solid block
+// and offset in it), so incremental archiving finds already archived chunks without reading the archive. The index grows by
+// appending new hash tables to the file, never rewriting existing data. Not thread-safe.
+typedef struct CelsChunkIndex CelsChunkIndex;
+CelsResult CelsChunkIndexOpen  (CelsChunkIndex** index, const char* filename);   // UTF-8 filename; the file is created if it doesn't exist
+CelsResult CelsChunkIndexFind  (CelsChunkIndex* index, const unsigned char hash[32], CelsNum* block, CelsNum* offset);   // 1 if found, 0 otherwise
+CelsResult CelsChunkIndexAdd   (CelsChunkIndex* index, const unsigned char hash[32], CelsNum block, CelsNum offset);    // 1 if the chunk was already indexed (its location is kept)
+CelsNum    CelsChunkIndexCount (CelsChunkIndex* index);
+CelsResult CelsChunkIndexFlush (CelsChunkIndex* index);   // Make added entries durable, f.e. after the archive update is committed
+CelsResult CelsChunkIndexClose (CelsChunkIndex* index);   // Flush and free resources
+
 #ifdef __cplusplus
 }       // extern "C"
 #endif
@@ -0,0 +1,371 @@
+// Codec benchmark: compress and decompress all files from the corpus directory with each method,
+// using in-memory, streaming (CELS_READ/CELS_WRITE) and buffer-sharing callbacks.
+// Prints one JSON object per method and mode, so results can be compared by scripts.
+//
+// Usage: cels_bench [-iITERATIONS] [-mMODE,MODE...] CORPUS_DIR METHOD...
+//   f.e.  cels_bench -i5 -mmem,share corpus lzma:8m test
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "CELS.h"
+
+const CelsNum BENCH_BUFFER_SIZE = 1<<20;   // Size of buffers passed by the host callbacks
+
+
+// OS-specific functions =======================================================================================================
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+
+static double Now()
+{
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency (&freq);
+    QueryPerformanceCounter (&t);
+    return (double)t.QuadPart / freq.QuadPart;
+}
+
+// Windows can't reset peak working set, so it's process-wide peak
+static void    ResetPeakMemory()  {}
+static CelsNum CurrentMemory()    {PROCESS_MEMORY_COUNTERS pmc;  GetProcessMemoryInfo (GetCurrentProcess(), &pmc, sizeof(pmc));  return pmc.WorkingSetSize;}
+static CelsNum PeakMemory()       {PROCESS_MEMORY_COUNTERS pmc;  GetProcessMemoryInfo (GetCurrentProcess(), &pmc, sizeof(pmc));  return pmc.PeakWorkingSetSize;}
+
+// Call f(filename) for each file in the directory
+static void ForEachFile (const char* dir, void (*f)(const char* filename))
+{
+    char pattern[MAX_PATH], filename[MAX_PATH];
+    snprintf (pattern, MAX_PATH, "%s\\*", dir);
+    WIN32_FIND_DATAA FindData;
+    HANDLE ff = FindFirstFileA (pattern, &FindData);
+    BOOL found;
+    for (found = (ff!=INVALID_HANDLE_VALUE);  found;  found = FindNextFileA(ff, &FindData))
+        if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            snprintf (filename, MAX_PATH, "%s\\%s", dir, FindData.cFileName);
+            f (filename);
+        }
+    FindClose (ff);
+}
+
+#else
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static double Now()
+{
+    struct timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// Read the field (in KB) of /proc/self/status
+static CelsNum ProcStatus (const char* field)
+{
+    char line[256];
+    CelsNum kb = 0;
+    FILE* f = fopen ("/proc/self/status", "r");
+    if (f == NULL)  return 0;
+    while (fgets (line, sizeof(line), f))
+        if (strncmp (line, field, strlen(field)) == 0)
+            kb = atoll (line + strlen(field));
+    fclose (f);
+    return kb * 1024;
+}
+
+// Writing "5" to clear_refs resets VmHWM (peak RSS) to the current RSS
+static void ResetPeakMemory()
+{
+    FILE* f = fopen ("/proc/self/clear_refs", "w");
+    if (f)  fputs ("5", f),  fclose (f);
+}
+
+static CelsNum CurrentMemory()   {return ProcStatus ("VmRSS:");}
+static CelsNum PeakMemory()      {return ProcStatus ("VmHWM:");}
+
+// Call f(filename) for each file in the directory
+static void ForEachFile (const char* dir, void (*f)(const char* filename))
+{
+    DIR* d = opendir (dir);
+    if (d == NULL)  return;
+    struct dirent* entry;
+    char filename[4096];
+    struct stat st;
+    while ((entry = readdir(d)) != NULL) {
+        snprintf (filename, sizeof(filename), "%s/%s", dir, entry->d_name);
+        if (stat (filename, &st) == 0  &&  S_ISREG(st.st_mode))
+            f (filename);
+    }
+    closedir (d);
+}
+#endif
+
+
+// Corpus ======================================================================================================================
+
+typedef struct {
+    char*    data;
+    CelsNum  size;
+} CorpusFile;
+
+static CorpusFile* Corpus = NULL;
+static int NumFiles = 0;
+static CelsNum CorpusSize = 0;
+
+static void LoadFile (const char* filename)
+{
+    FILE* f = fopen (filename, "rb");
+    if (f == NULL)  return;
+    fseek (f, 0, SEEK_END);
+    CelsNum size = ftell (f);
+    fseek (f, 0, SEEK_SET);
+    char* data = (char*) malloc (size+1);
+    CorpusFile* files = (CorpusFile*) realloc (Corpus, (NumFiles+1) * sizeof(CorpusFile));
+    if (data  &&  files  &&  fread (data, 1, size, f) == (size_t)size) {
+        Corpus = files;
+        Corpus[NumFiles].data = data;
+        Corpus[NumFiles].size = size;
+        NumFiles++;
+        CorpusSize += size;
+    } else {
+        if (files)  Corpus = files;
+        free (data);
+        fprintf (stderr, "Can't read %s\n", filename);
+    }
+    fclose (f);
+}
+
+
+// Host callbacks ==============================================================================================================
+
+// State of the host callback: input is read from memory and output is written to memory
+typedef struct {
+    char    *in;   CelsNum insize,  inpos;
+    char    *out;  CelsNum outsize, outpos;
+    char    *bufs[2];  int num_free;          // buffers lent to the codec by CELS_RECEIVE_EMPTY_OUTBUF
+    char    *free_bufs[2];
+    double   callback_time;                   // total time spent inside callbacks
+    CelsNum  callback_calls;
+} BenchHost;
+
+// CELS_READ/CELS_WRITE callback: copies data like a host reading and writing files
+static CelsResult __cdecl StreamHost (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    BenchHost* host = (BenchHost*) self;
+    double start = Now();
+    CelsResult result = CELS_ERROR_NOT_IMPLEMENTED;
+    if (service == CELS_READ) {
+        result = host->insize - host->inpos;
+        if (result > insize)  result = insize;
+        memcpy (inbuf, host->in + host->inpos, result);
+        host->inpos += result;
+    } else if (service == CELS_WRITE) {
+        if (outsize > host->outsize - host->outpos) {
+            result = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        } else {
+            memcpy (host->out + host->outpos, outbuf, outsize);
+            host->outpos += outsize;
+            result = outsize;
+        }
+    } else if (service == CELS_PROGRESS  ||  service == CELS_QUASI_WRITE) {
+        result = CELS_OK;
+    }
+    host->callback_time += Now() - start;
+    host->callback_calls++;
+    return result;
+}
+
+// Buffer-sharing callback: lends input data directly (like a host reading files via mmap or prefetching)
+// and lends its own output buffers whose contents are copied out on return (like a host writing files)
+static CelsResult __cdecl ShareHost (void* self, int service, CelsNum subservice, void* inbuf, CelsNum insize, void* outbuf, CelsNum outsize, void* ud, CelsCallback0* cb)
+{
+    BenchHost* host = (BenchHost*) self;
+    double start = Now();
+    CelsResult result = CELS_ERROR_NOT_IMPLEMENTED;
+    if (service == CELS_RECEIVE_FILLED_INBUF) {
+        result = host->insize - host->inpos;
+        if (result > BENCH_BUFFER_SIZE)  result = BENCH_BUFFER_SIZE;
+        *(void**)inbuf = host->in + host->inpos;
+        host->inpos += result;
+    } else if (service == CELS_SEND_EMPTY_INBUF) {
+        result = CELS_OK;
+    } else if (service == CELS_RECEIVE_EMPTY_OUTBUF) {
+        if (host->num_free == 0)  result = CELS_ERROR_GENERAL;    // codec holds too many buffers
+        else  *(void**)outbuf = host->free_bufs[--host->num_free],  result = BENCH_BUFFER_SIZE;
+    } else if (service == CELS_SEND_FILLED_OUTBUF) {
+        result = CELS_OK;
+        if (outsize > host->outsize - host->outpos)
+            result = CELS_ERROR_OUTBLOCK_TOO_SMALL;
+        else
+            memcpy (host->out + host->outpos, outbuf, outsize),  host->outpos += outsize;
+        host->free_bufs[host->num_free++] = (char*)outbuf;
+    } else if (service == CELS_PROGRESS  ||  service == CELS_QUASI_WRITE) {
+        result = CELS_OK;
+    }
+    host->callback_time += Now() - start;
+    host->callback_calls++;
+    return result;
+}
+
+
+// Benchmark ===================================================================================================================
+
+const char* MODES[] = {"mem", "stream", "share"};
+const int NUM_MODES = 3;
+
+typedef struct {
+    double   time;              // total time of all operations
+    CelsNum  peak_memory;       // max memory increase during operation
+    double   callback_time;
+    CelsNum  callback_calls;
+} BenchResult;
+
+// Run (de)compression in the given mode; return output size or error code
+static CelsResult RunOnce (const char* method, int decompress, int mode, char* in, CelsNum insize, char* out, CelsNum outsize, BenchHost* host, BenchResult* res)
+{
+    host->in  = in,   host->insize  = insize,   host->inpos  = 0;
+    host->out = out,  host->outsize = outsize,  host->outpos = 0;
+    host->num_free = 2,  host->free_bufs[0] = host->bufs[0],  host->free_bufs[1] = host->bufs[1];
+    host->callback_time = 0,  host->callback_calls = 0;
+
+    ResetPeakMemory();
+    CelsNum base_memory = CurrentMemory();
+    double start = Now();
+
+    CelsResult result;
+    if (mode == 0) {
+        result = decompress?  CelsDecompressMem (method, in,insize, out,outsize, NULL,NULL)
+                           :  CelsCompressMem   (method, in,insize, out,outsize, NULL,NULL);
+    } else {
+        CelsCallback* cb = (mode == 1? StreamHost : ShareHost);
+        result = decompress?  CelsDecompress (method, host, cb)  :  CelsCompress (method, host, cb);
+        if (result >= CELS_OK)  result = host->outpos;
+    }
+
+    res->time += Now() - start;
+    CelsNum memory = PeakMemory() - base_memory;
+    if (memory > res->peak_memory)  res->peak_memory = memory;
+    res->callback_time  += host->callback_time;
+    res->callback_calls += host->callback_calls;
+    return result;
+}
+
+// Print string as JSON string literal
+static void PrintJsonString (const char* s)
+{
+    putchar ('"');
+    for (;  *s;  s++) {
+        if (*s=='"' || *s=='\\')        printf ("\\%c", *s);
+        else if ((unsigned char)*s < 32)  printf ("\\u%04x", *s);
+        else                            putchar (*s);
+    }
+    putchar ('"');
+}
+
+// Print number, or null if the codec can't report it
+static void PrintJsonNum (CelsResult x)
+{
+    if (x < CELS_OK)  printf ("null");
+    else              printf ("%lld", x);
+}
+
+static void Benchmark (const char* method, int mode, int iterations, BenchHost* host)
+{
+    BenchResult comp, decomp;
+    memset (&comp, 0, sizeof(comp));
+    memset (&decomp, 0, sizeof(decomp));
+    CelsNum compressed_total = 0;
+    CelsResult error = CELS_OK;
+    int i, iter;
+
+    for (i=0;  i<NumFiles && error>=CELS_OK;  i++)
+    {
+        CelsNum size = Corpus[i].size;
+        CelsResult max_size = CelsGetMaxCompressedSize (method, size);
+        CelsNum bufsize = size + size/2 + 65536;
+        if (max_size > bufsize)  bufsize = max_size;
+        char* compressed   = (char*) malloc (bufsize);
+        char* decompressed = (char*) malloc (size+1);
+        if (!compressed || !decompressed)  error = CELS_ERROR_NOT_ENOUGH_MEMORY;
+
+        // The first iteration warms up caches and isn't timed
+        for (iter=0;  iter<=iterations && error>=CELS_OK;  iter++)
+        {
+            BenchResult dummy;
+            memset (&dummy, 0, sizeof(dummy));
+            CelsResult csize = RunOnce (method, 0, mode, Corpus[i].data, size, compressed, bufsize, host, iter? &comp : &dummy);
+            if (csize < CELS_OK)  {error = csize;  break;}
+            CelsResult dsize = RunOnce (method, 1, mode, compressed, csize, decompressed, size+1, host, iter? &decomp : &dummy);
+            if (dsize < CELS_OK)  {error = dsize;  break;}
+            if (dsize != size  ||  memcmp (decompressed, Corpus[i].data, size))  {error = CELS_ERROR_BAD_COMPRESSED_DATA;  break;}
+            if (iter == 0)  compressed_total += csize;
+        }
+        free (compressed);
+        free (decompressed);
+    }
+
+    double total = (double)CorpusSize * iterations;
+    printf ("{\"method\":");  PrintJsonString (method);
+    printf (",\"mode\":\"%s\",\"files\":%d,\"iterations\":%d,\"input_bytes\":%lld", MODES[mode], NumFiles, iterations, CorpusSize);
+    if (error < CELS_OK) {
+        printf (",\"ok\":false,\"error\":%lld,\"error_message\":", error);
+        PrintJsonString (CelsErrorMessage (error));
+    } else {
+        printf (",\"ok\":true,\"compressed_bytes\":%lld", compressed_total);
+        printf (",\"compress_mbps\":%.3f,\"decompress_mbps\":%.3f", total/1e6/(comp.time+1e-9), total/1e6/(decomp.time+1e-9));
+        printf (",\"compression_mem_reported\":");    PrintJsonNum (CelsGetCompressionMem(method));
+        printf (",\"compression_mem_measured\":%lld", comp.peak_memory);
+        printf (",\"decompression_mem_reported\":");  PrintJsonNum (CelsGetDecompressionMem(method));
+        printf (",\"decompression_mem_measured\":%lld", decomp.peak_memory);
+        printf (",\"peak_rss_bytes\":%lld", PeakMemory());
+        printf (",\"compress_callback_seconds\":%.6f,\"compress_callback_calls\":%lld", comp.callback_time, comp.callback_calls);
+        printf (",\"decompress_callback_seconds\":%.6f,\"decompress_callback_calls\":%lld", decomp.callback_time, decomp.callback_calls);
+    }
+    printf ("}\n");
+    fflush (stdout);
+}
+
+int main (int argc, char **argv)
+{
+    int iterations = 3,  use_mode[NUM_MODES] = {1,1,1},  mode;
+    for (;  argc > 1  &&  argv[1][0] == '-';  argc--, argv++)
+    {
+        if (argv[1][1] == 'i') {
+            iterations = atoi (argv[1]+2);
+        } else if (argv[1][1] == 'm') {
+            for (mode=0; mode<NUM_MODES; mode++)
+                use_mode[mode] = (strstr (argv[1]+2, MODES[mode]) != NULL);
+        } else {
+            fprintf (stderr, "Unknown option %s\n", argv[1]);
+            return 1;
+        }
+    }
+    if (argc < 3  ||  iterations < 1) {
+        fprintf (stderr, "Usage: cels_bench [-iITERATIONS] [-mMODE,MODE...] CORPUS_DIR METHOD...\n"
+                         "  modes: mem (CelsCompressMem), stream (CELS_READ/CELS_WRITE), share (buffer-sharing API)\n");
+        return 1;
+    }
+
+    ForEachFile (argv[1], LoadFile);
+    if (NumFiles == 0)  {fprintf (stderr, "No files in %s\n", argv[1]);  return 1;}
+
+    CelsLoad();
+    BenchHost host;
+    memset (&host, 0, sizeof(host));
+    host.bufs[0] = (char*) malloc (BENCH_BUFFER_SIZE);
+    host.bufs[1] = (char*) malloc (BENCH_BUFFER_SIZE);
+
+    int i;
+    for (i=2; i<argc; i++)
+        for (mode=0; mode<NUM_MODES; mode++)
+            if (use_mode[mode])
+                Benchmark (argv[i], mode, iterations, &host);
+
+    CelsUnload();
+    free (host.bufs[0]);
+    free (host.bufs[1]);
+    for (i=0; i<NumFiles; i++)
+        free (Corpus[i].data);
+    free (Corpus);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+g++ -O3 CELS.cpp simple_host.cpp -o simple_host -ldl
+g++ -O3 -DCELS_REGISTER_CODECS CELS.cpp simple_host.cpp easy_codec.cpp -o simple_host_with_easy_codec -ldl
+g++ -O3 -shared -fPIC -s easy_codec.cpp -o cels-test.so
+g++ -O3 CELS.cpp cels_bench.cpp -o cels_bench -ldl
+g++ -O3 -DCELS_REGISTER_CODECS CELS.cpp io_host.cpp easy_codec.cpp -o io_host -ldl
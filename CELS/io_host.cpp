@@ -0,0 +1,61 @@
+// File (de)compressor using asynchronous host I/O: input is read ahead and output is written behind,
+// so the codec works while the disk transfers data. Prints time spent by the codec waiting for I/O.
+//
+// Usage: io_host [-d] [-qQUEUE_DEPTH] [-bBUFFER_SIZE_KB] [-direct] METHOD INFILE OUTFILE
+//   f.e.  io_host -q8 -b4096 lzma:64m enwik9 enwik9.lzma
+//   "-" means stdin/stdout
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "CELS.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define open   _open
+#define close  _close
+#define O_FLAGS  O_BINARY
+#else
+#include <unistd.h>
+#define O_FLAGS  0
+#endif
+
+int main (int argc, char **argv)
+{
+    int decompress = 0;
+    CelsIoOptions options = {0, 0, 0};
+    for (;  argc > 1  &&  argv[1][0] == '-'  &&  argv[1][1];  argc--, argv++)
+    {
+        if      (strcmp (argv[1], "-d") == 0)       decompress = 1;
+        else if (strcmp (argv[1], "-direct") == 0)  options.direct = 1;
+        else if (argv[1][1] == 'q')                 options.queue_depth = atoi (argv[1]+2);
+        else if (argv[1][1] == 'b')                 options.buffer_size = (CelsNum) atoi (argv[1]+2) << 10;
+        else  {fprintf (stderr, "Unknown option %s\n", argv[1]);  return 1;}
+    }
+    if (argc != 4) {
+        fprintf (stderr, "Usage: io_host [-d] [-qQUEUE_DEPTH] [-bBUFFER_SIZE_KB] [-direct] METHOD INFILE OUTFILE\n");
+        return 1;
+    }
+
+    int infd  = (strcmp (argv[2], "-") == 0?  0 : open (argv[2], O_RDONLY | O_FLAGS));
+    int outfd = (strcmp (argv[3], "-") == 0?  1 : open (argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_FLAGS, 0644));
+    if (infd < 0)   {fprintf (stderr, "Can't open %s\n", argv[2]);  return 1;}
+    if (outfd < 0)  {fprintf (stderr, "Can't create %s\n", argv[3]);  return 1;}
+
+    CelsLoad();
+    CelsIo* io;
+    CelsResult result = CelsIoOpen (&io, infd, outfd, &options);
+    if (result < CELS_OK)  {fprintf (stderr, "%s\n", CelsErrorMessage(result));  return 1;}
+
+    result = (decompress?  CelsDecompress (argv[1], io, CelsIoCallback) : CelsCompress (argv[1], io, CelsIoCallback));
+    CelsNum bytes_read, wait_ns;
+    CelsIoStats (io, &bytes_read, NULL, &wait_ns);
+    CelsResult io_result = CelsIoClose (io);
+    if (result >= CELS_OK)  result = io_result;
+    if (result < CELS_OK)  {fprintf (stderr, "%s\n", CelsErrorMessage(result));  return 1;}
+
+    fprintf (stderr, "%.0f bytes read, codec waited for I/O %.3f s\n", (double)bytes_read, wait_ns/1e9);
+    if (outfd != 1)  close (outfd);
+    if (infd != 0)   close (infd);
+    return 0;
+}
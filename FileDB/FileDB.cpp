@@ -0,0 +1,475 @@
+// Columnar file database, see FileDB.h
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "FileDB.h"
+
+typedef unsigned long long Uint64;
+
+const FileDbId FILEDB_MIN_CAPACITY  = 1024;
+const size_t   FILEDB_ARENA_CHUNK   = 1<<20;
+const size_t   FILEDB_MAX_NAME      = 65535;     // extension offset is stored in 16 bits
+const int      FILEDB_RADIX_BITS    = 11;        // LSD radix sort digit; 6 passes cover 64-bit keys
+const int      FILEDB_RADIX_PASSES  = (64 + FILEDB_RADIX_BITS - 1) / FILEDB_RADIX_BITS;
+
+// Names are allocated from chunks that are never moved, so name pointers remain valid while the database grows
+struct FileDbArenaChunk {
+    FileDbArenaChunk*  next;
+    size_t             size, used;
+    char               data[1];
+};
+
+struct FileDb {
+    FileDbId            count, capacity;
+    // Columns indexed by FileDbId
+    const char**        name;
+    unsigned short*     ext;        // offset of the extension in the name (name length if there is no extension)
+    FileDbId*           parent;
+    Uint64*             size;
+    long long*          time;
+    unsigned*           attr;
+    unsigned*           crc;
+    unsigned short*     group;
+    FileDbId*           order;      // ids in the sorted order, NULL for the order of addition
+    FileDbArenaChunk*   arena;      // the current chunk is the first one in the list
+};
+
+
+// Managing a database ****************************************************************************************************
+
+FileDb* FileDbCreate (void)
+{
+    return (FileDb*) calloc (1, sizeof(FileDb));
+}
+
+static void FreeArena (FileDbArenaChunk* chunk)
+{
+    while (chunk) {
+        FileDbArenaChunk* next = chunk->next;
+        free (chunk);
+        chunk = next;
+    }
+}
+
+void FileDbClear (FileDb* db)
+{
+    // Keep columns and the first arena chunk for reuse
+    if (db->arena) {
+        FileDbArenaChunk* last = db->arena;
+        while (last->next)  last = last->next;
+        if (last != db->arena) {
+            FileDbArenaChunk* chunk = db->arena;
+            while (chunk->next != last)  chunk = chunk->next;
+            chunk->next = NULL;
+            FreeArena (db->arena);
+            db->arena = last;
+        }
+        db->arena->used = 0;
+    }
+    free (db->order),  db->order = NULL;
+    db->count = 0;
+}
+
+void FileDbClose (FileDb* db)
+{
+    if (db == NULL)  return;
+    FreeArena (db->arena);
+    free (db->name),  free (db->ext),  free (db->parent),  free (db->size),  free (db->time);
+    free (db->attr),  free (db->crc),  free (db->group),   free (db->order);
+    free (db);
+}
+
+FileDbId FileDbSize (const FileDb* db)
+{
+    return db->count;
+}
+
+// Realloc the column to the new capacity, leaving it intact on failure
+template <typename T>
+static int GrowColumn (T** column, FileDbId capacity)
+{
+    T* p = (T*) realloc (*column, (size_t)capacity * sizeof(T));
+    if (p == NULL)  return 0;
+    *column = p;
+    return 1;
+}
+
+static int GrowDb (FileDb* db)
+{
+    FileDbId capacity = (db->capacity < FILEDB_MIN_CAPACITY?  FILEDB_MIN_CAPACITY : db->capacity*2);
+    if (capacity <= db->capacity)  return 0;     // 4G records
+    if (!GrowColumn (&db->name, capacity)   ||  !GrowColumn (&db->ext, capacity)   ||  !GrowColumn (&db->parent, capacity)
+        ||  !GrowColumn (&db->size, capacity)   ||  !GrowColumn (&db->time, capacity)   ||  !GrowColumn (&db->attr, capacity)
+        ||  !GrowColumn (&db->crc, capacity)    ||  !GrowColumn (&db->group, capacity))
+        return 0;
+    db->capacity = capacity;
+    return 1;
+}
+
+static char* ArenaStrdup (FileDb* db, const char* str, size_t len)
+{
+    FileDbArenaChunk* chunk = db->arena;
+    if (chunk == NULL  ||  chunk->size - chunk->used < len+1) {
+        size_t size = (len+1 > FILEDB_ARENA_CHUNK?  len+1 : FILEDB_ARENA_CHUNK);
+        chunk = (FileDbArenaChunk*) malloc (offsetof(FileDbArenaChunk, data) + size);
+        if (chunk == NULL)  return NULL;
+        chunk->size = size,  chunk->used = 0;
+        chunk->next = db->arena;
+        db->arena = chunk;
+    }
+    char* p = chunk->data + chunk->used;
+    memcpy (p, str, len);
+    p[len] = '\0';
+    chunk->used += len+1;
+    return p;
+}
+
+FileDbId FileDbAddFile (FileDb* db, const FileDbFile* file)
+{
+    size_t len = strlen (file->name);
+    if (len > FILEDB_MAX_NAME)                                          return FILEDB_NO_PARENT;
+    if (file->parent != FILEDB_NO_PARENT  &&  file->parent >= db->count)   return FILEDB_NO_PARENT;
+    if (db->count == db->capacity  &&  !GrowDb (db))                    return FILEDB_NO_PARENT;
+    const char* name = ArenaStrdup (db, file->name, len);
+    if (name == NULL)                                                   return FILEDB_NO_PARENT;
+
+    const char* dot = strrchr (name, '.');
+    FileDbId id = db->count++;
+    db->name[id]   = name;
+    db->ext[id]    = (unsigned short)(dot?  dot+1-name : len);
+    db->parent[id] = file->parent;
+    db->size[id]   = file->size;
+    db->time[id]   = file->time;
+    db->attr[id]   = file->attr;
+    db->crc[id]    = file->crc;
+    db->group[id]  = file->group;
+    free (db->order),  db->order = NULL;    // new records invalidate the sorted order
+    return id;
+}
+
+
+// Sorting ****************************************************************************************************************
+
+// Stable LSD radix sort of (keys,ids) pairs by keys. Digits having the same value in all keys are skipped,
+// so small keys such as ranks or groups take only one or two passes
+static void RadixSort (Uint64* keys, FileDbId* ids, Uint64* tmp_keys, FileDbId* tmp_ids, size_t n)
+{
+    const size_t DIGITS = (size_t)1 << FILEDB_RADIX_BITS;
+    std::vector<size_t> count (FILEDB_RADIX_PASSES * DIGITS, 0);
+    size_t i;
+    int pass;
+    for (i=0; i<n; i++)
+        for (pass=0; pass < FILEDB_RADIX_PASSES; pass++)
+            count [pass*DIGITS + ((keys[i] >> (pass*FILEDB_RADIX_BITS)) & (DIGITS-1))]++;
+
+    Uint64 *src_keys = keys,  *dst_keys = tmp_keys;
+    FileDbId *src_ids = ids,  *dst_ids = tmp_ids;
+    for (pass=0; pass < FILEDB_RADIX_PASSES; pass++)
+    {
+        size_t* c = &count [pass*DIGITS];
+        int shift = pass*FILEDB_RADIX_BITS;
+        if (c [(keys[0] >> shift) & (DIGITS-1)] == n)  continue;     // all keys have the same digit
+        size_t sum = 0,  d;
+        for (d=0; d<DIGITS; d++)
+            sum += c[d],  c[d] = sum - c[d];
+        for (i=0; i<n; i++) {
+            size_t pos = c [(src_keys[i] >> shift) & (DIGITS-1)]++;
+            dst_keys[pos] = src_keys[i],  dst_ids[pos] = src_ids[i];
+        }
+        std::swap (src_keys, dst_keys),  std::swap (src_ids, dst_ids);
+    }
+    if (src_ids != ids)  memcpy (ids, src_ids, n * sizeof(FileDbId));
+}
+
+// String keys are replaced by their ranks before radix sorting. Equal strings are merged by hashing first (there are
+// usually much less distinct names, and especially extensions, than files), then distinct strings are radix sorted
+// by their first 8 bytes, and only strings sharing these bytes are compared entirely
+enum {KEY_NAME, KEY_EXT, KEY_REVERSED};
+
+struct StringKeys {
+    const FileDb* db;
+    int           kind;
+
+    const char* Str (FileDbId id) const  {return kind == KEY_EXT?  db->name[id] + db->ext[id] : db->name[id];}
+
+    // Byte i of the key, 0 past its end
+    unsigned char Byte (const char* s, size_t len, size_t i) const
+    {
+        if (i >= len)  return 0;
+        return (unsigned char) (kind == KEY_REVERSED?  s[len-1-i] : s[i]);
+    }
+
+    Uint64 Prefix (FileDbId id) const
+    {
+        const char* s = Str(id);
+        size_t len = strlen(s),  i;
+        Uint64 x = 0;
+        for (i=0; i<8; i++)
+            x = (x << 8) + Byte (s, len, i);
+        return x;
+    }
+
+    bool Less (FileDbId a, FileDbId b) const
+    {
+        const char *sa = Str(a),  *sb = Str(b);
+        size_t la = strlen(sa),  lb = strlen(sb),  i;
+        for (i=0;  i < la  &&  i < lb;  i++) {
+            unsigned char ca = Byte (sa, la, i),  cb = Byte (sb, lb, i);
+            if (ca != cb)  return ca < cb;
+        }
+        return la < lb;
+    }
+};
+
+static Uint64 HashString (const char* s)
+{
+    Uint64 h = 14695981039346656037ULL;     // FNV-1a
+    for (;  *s;  s++)
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h;
+}
+
+// rank[ids[i]] = number of distinct smaller keys among ids[0..n)
+static int RankStrings (const FileDb* db, int kind, const FileDbId* ids, FileDbId n, unsigned* rank)
+{
+    StringKeys keys = {db, kind};
+    FileDbId i;
+    try {
+        // Merge equal strings: rank[id] temporarily holds index of its distinct string
+        size_t table_size = 1024;
+        while (table_size < (size_t)n + n/2)  table_size *= 2;
+        std::vector<unsigned> table (table_size, 0);       // index+1 of distinct string, 0 for empty slot
+        std::vector<FileDbId> distinct;
+        for (i=0; i<n; i++) {
+            const char* s = keys.Str (ids[i]);
+            size_t slot = HashString(s) & (table_size-1);
+            while (table[slot]  &&  strcmp (keys.Str (distinct [table[slot]-1]), s))
+                slot = (slot+1) & (table_size-1);
+            if (!table[slot]) {
+                distinct.push_back (ids[i]);
+                table[slot] = (unsigned) distinct.size();
+            }
+            rank[ids[i]] = table[slot]-1;
+        }
+        std::vector<unsigned>().swap (table);
+
+        // Sort distinct strings by 8-byte prefixes, then sort each run of equal prefixes by entire strings
+        FileDbId m = (FileDbId) distinct.size();
+        std::vector<Uint64>   prefix (m),  tmp_prefix (m);
+        std::vector<FileDbId> order (m),   tmp_order (m);
+        for (i=0; i<m; i++)
+            prefix[i] = keys.Prefix (distinct[i]),  order[i] = i;
+        RadixSort (&prefix[0], &order[0], &tmp_prefix[0], &tmp_order[0], m);
+        for (i=0; i<m; i++)
+            prefix[i] = keys.Prefix (distinct [order[i]]);
+        FileDbId start, end;
+        for (start = 0;  start < m;  start = end) {
+            for (end = start+1;  end < m  &&  prefix[end] == prefix[start];  end++);
+            if (end - start > 1)
+                std::sort (&order[0]+start, &order[0]+end, [&](FileDbId a, FileDbId b) {return keys.Less (distinct[a], distinct[b]);});
+        }
+        std::vector<unsigned>& distinct_rank = tmp_order;       // reuse memory
+        for (i=0; i<m; i++)
+            distinct_rank [order[i]] = i;
+        for (i=0; i<n; i++)
+            rank[ids[i]] = distinct_rank [rank[ids[i]]];
+    } catch (...) {
+        return FILEDB_ERROR_NOT_ENOUGH_MEMORY;
+    }
+    return FILEDB_OK;
+}
+
+// Path key: rank of the parent directory among all directories ordered by their full paths (0 for top-level files).
+// Paths are compared component by component, so a directory is followed by its entire subtree. This order is
+// the pre-order traversal of the directory tree with children of each directory sorted by name, computed without
+// building paths: directories are radix sorted by (parent, name rank), giving sorted lists of children.
+// Directories with the same path (f.e. the same root scanned twice) are merged, so their contents are mixed.
+static int RankPaths (const FileDb* db, unsigned* rank)
+{
+    FileDbId n = db->count,  i;
+    try {
+        std::vector<FileDbId> dirs;
+        {
+            std::vector<char> is_parent (n, 0);
+            for (i=0; i<n; i++)
+                if (db->parent[i] != FILEDB_NO_PARENT)  is_parent [db->parent[i]] = 1;
+            for (i=0; i<n; i++)
+                if (is_parent[i])  dirs.push_back (i);
+        }
+        FileDbId m = (FileDbId) dirs.size();
+        if (m == 0)  {memset (rank, 0, (size_t)n * sizeof(unsigned));  return FILEDB_OK;}
+        int result = RankStrings (db, KEY_NAME, &dirs[0], m, rank);
+        if (result < FILEDB_OK)  return result;
+
+        // Merge directories with the same (parent, name) key into the first one, canon[d]. Parents precede their
+        // contents, so the parent is already merged and its canon is used in the key. NO_PARENT+1 == 0, so top-level
+        // directories go first
+        std::vector<FileDbId> canon (n, FILEDB_NO_PARENT),  unique;
+        std::vector<Uint64> key;
+        {
+            size_t table_size = 1024;
+            while (table_size < (size_t)m + m/2)  table_size *= 2;
+            std::vector<unsigned> table (table_size, 0);       // index+1 in unique[], 0 for empty slot
+            for (i=0; i<m; i++) {
+                FileDbId d = dirs[i],  parent = db->parent[d];
+                Uint64 k = ((Uint64)((parent == FILEDB_NO_PARENT?  parent : canon[parent]) + 1) << 32) + rank[d];
+                size_t slot = (size_t)((k * 0x9E3779B97F4A7C15ULL) >> 32) & (table_size-1);
+                while (table[slot]  &&  key [table[slot]-1] != k)
+                    slot = (slot+1) & (table_size-1);
+                if (!table[slot]) {
+                    unique.push_back (d),  key.push_back (k);
+                    table[slot] = (unsigned) unique.size();
+                }
+                canon[d] = unique [table[slot]-1];
+            }
+        }
+        FileDbId u = (FileDbId) unique.size();
+        {
+            std::vector<Uint64>   tmp_key (u);
+            std::vector<FileDbId> tmp_dirs (u);
+            RadixSort (&key[0], &unique[0], &tmp_key[0], &tmp_dirs[0], u);
+        }
+        for (i=0; i<u; i++) {
+            FileDbId parent = db->parent[unique[i]];
+            key[i] = ((Uint64)((parent == FILEDB_NO_PARENT?  parent : canon[parent]) + 1) << 32) + rank[unique[i]];
+        }
+        std::vector<FileDbId> first_child (n, u);       // position in unique of the first child of the directory
+        for (i=u; i-- > 0; )
+            if (key[i] >> 32)
+                first_child [(key[i] >> 32) - 1] = i;
+
+        // Pre-order traversal assigning rank[] of merged directories, then the rest get ranks of the ones they were merged into
+        std::vector<FileDbId> stack;
+        for (i=0;  i < u  &&  (key[i] >> 32) == 0;  i++);
+        while (i-- > 0)
+            stack.push_back (i);
+        unsigned r = 0;
+        while (!stack.empty()) {
+            FileDbId pos = stack.back(),  d = unique[pos],  child;
+            stack.pop_back();
+            rank[d] = ++r;
+            for (child = first_child[d];  child < u  &&  (key[child] >> 32) == (Uint64)d + 1;  child++);
+            while (child-- > first_child[d])
+                stack.push_back (child);
+        }
+        for (i=0; i<m; i++)
+            rank[dirs[i]] = rank [canon[dirs[i]]];
+    } catch (...) {
+        return FILEDB_ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    // Replace rank of each record by rank of its parent; going backwards, parents are updated after their contents
+    for (i=n; i-- > 0; )
+        rank[i] = (db->parent[i] == FILEDB_NO_PARENT?  0 : rank [db->parent[i]]);
+    return FILEDB_OK;
+}
+
+// Fill keys[i] with the sort key of the record order[i]; rank is used for string keys
+static int MakeKeys (const FileDb* db, char key, const FileDbId* order, Uint64* keys, unsigned* rank)
+{
+    FileDbId n = db->count,  i;
+    int result = FILEDB_OK;
+    switch (key | 0x20)    // lowercase
+    {
+    case 's':  for (i=0; i<n; i++)  keys[i] = db->size [order[i]];                                break;
+    case 'd':
+    case 't':  for (i=0; i<n; i++)  keys[i] = (Uint64)db->time [order[i]] ^ ((Uint64)1 << 63);    break;   // signed -> unsigned order
+    case 'g':  for (i=0; i<n; i++)  keys[i] = db->group [order[i]];                               break;
+    case 'n':  result = RankStrings (db, KEY_NAME,     order, n, rank);  break;
+    case 'e':  result = RankStrings (db, KEY_EXT,      order, n, rank);  break;
+    case 'r':  result = RankStrings (db, KEY_REVERSED, order, n, rank);  break;
+    case 'p':  result = RankPaths (db, rank);                             break;
+    }
+    if (result < FILEDB_OK)  return result;
+    if (strchr ("nerp", key | 0x20))
+        for (i=0; i<n; i++)
+            keys[i] = rank [order[i]];
+    if (key >= 'A'  &&  key <= 'Z')
+        for (i=0; i<n; i++)
+            keys[i] = ~keys[i];
+    return FILEDB_OK;
+}
+
+int FileDbSort (FileDb* db, const char* sort_order)
+{
+    const char* p;
+    for (p = sort_order;  *p;  p++)
+        if (!strchr ("gerpnsdtGERPNSDT", *p))  return FILEDB_ERROR_INVALID_SORT_ORDER;
+    free (db->order),  db->order = NULL;
+    FileDbId n = db->count,  i;
+    if (*sort_order == '\0'  ||  n < 2)  return FILEDB_OK;
+
+    FileDbId *order     = (FileDbId*) malloc ((size_t)n * sizeof(FileDbId));
+    FileDbId *tmp_order = (FileDbId*) malloc ((size_t)n * sizeof(FileDbId));
+    Uint64   *keys      = (Uint64*)   malloc ((size_t)n * sizeof(Uint64));
+    Uint64   *tmp_keys  = (Uint64*)   malloc ((size_t)n * sizeof(Uint64));
+    unsigned *rank      = (unsigned*) malloc ((size_t)n * sizeof(unsigned));
+    int result = (order && tmp_order && keys && tmp_keys && rank?  FILEDB_OK : FILEDB_ERROR_NOT_ENOUGH_MEMORY);
+
+    // LSD order: sort by the least significant key first, each next stable sort keeps the order of equal keys
+    if (result == FILEDB_OK) {
+        for (i=0; i<n; i++)
+            order[i] = i;
+        for (p = sort_order + strlen(sort_order);  p > sort_order  &&  result == FILEDB_OK; ) {
+            result = MakeKeys (db, *--p, order, keys, rank);
+            if (result == FILEDB_OK)
+                RadixSort (keys, order, tmp_keys, tmp_order, n);
+        }
+    }
+    free (tmp_order),  free (keys),  free (tmp_keys),  free (rank);
+    if (result == FILEDB_OK)  db->order = order;
+    else                      free (order);
+    return result;
+}
+
+
+// Listing ****************************************************************************************************************
+
+FileDbId FileDbSortedId (const FileDb* db, FileDbId position)
+{
+    return db->order?  db->order[position] : position;
+}
+
+int FileDbList (const FileDb* db, FileDbId first, FileDbId count, FileDbFile* files)
+{
+    FileDbId i;
+    if (first > db->count  ||  count > db->count - first)  return FILEDB_ERROR_OUT_OF_RANGE;
+    for (i=0; i<count; i++) {
+        FileDbId id = FileDbSortedId (db, first+i);
+        files[i].name   = db->name[id];
+        files[i].parent = db->parent[id];
+        files[i].size   = db->size[id];
+        files[i].time   = db->time[id];
+        files[i].attr   = db->attr[id];
+        files[i].crc    = db->crc[id];
+        files[i].group  = db->group[id];
+    }
+    return FILEDB_OK;
+}
+
+// Directory name is followed by the separator unless it already ends with one, as roots "/" and "C:\" do
+static int NeedsSeparator (const char* dir)
+{
+    size_t n = strlen (dir);
+    return n == 0  ||  (dir[n-1] != '/'  &&  dir[n-1] != '\\');
+}
+
+size_t FileDbPath (const FileDb* db, FileDbId id, char* buf, size_t bufsize)
+{
+    // Measure the path, then fill the buffer from its end
+    size_t len = 0,  pos;
+    FileDbId p;
+    for (p = id;  p != FILEDB_NO_PARENT;  p = db->parent[p])
+        len += strlen (db->name[p]) + (p != id  &&  NeedsSeparator (db->name[p]));
+    if (len >= bufsize)  return len;
+    buf[pos = len] = '\0';
+    for (p = id;  p != FILEDB_NO_PARENT;  p = db->parent[p]) {
+        size_t n = strlen (db->name[p]);
+        if (p != id  &&  NeedsSeparator (db->name[p]))  buf[--pos] = '/';
+        pos -= n;
+        memcpy (buf+pos, db->name[p], n);
+    }
+    return len;
+}
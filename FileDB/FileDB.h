@@ -0,0 +1,85 @@
+#ifndef FILEDB_H
+#define FILEDB_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// File database: list of files being archived or extracted, stored as a set of columns (struct-of-arrays).
+// Names are kept in the arena without per-file allocations, directories are ordinary records referenced by
+// the parent column, so the full path is built by walking parents. Files are numbered by FileDbId in the order
+// of addition; Sort() doesn't move records, it only computes the order in which List() returns them.
+typedef struct FileDb FileDb;
+typedef unsigned FileDbId;
+
+const FileDbId FILEDB_NO_PARENT = 0xFFFFFFFF;   // parent of top-level files, also returned by FileDbAddFile on error
+const unsigned FILEDB_ATTR_DIRECTORY = 0x10;    // attr of directory records, as in Windows FILE_ATTRIBUTE_DIRECTORY
+
+// Error codes
+const int FILEDB_OK                        =  0;
+const int FILEDB_ERROR_NOT_ENOUGH_MEMORY   = -1;
+const int FILEDB_ERROR_INVALID_SORT_ORDER  = -2;
+const int FILEDB_ERROR_OUT_OF_RANGE        = -3;
+
+// One record, as passed to FileDbAddFile and returned by FileDbList
+typedef struct {
+    const char*         name;      // UTF-8 name without the path; stays valid until Clear/Close of the database
+    FileDbId            parent;    // directory record containing the file, or FILEDB_NO_PARENT
+    unsigned long long  size;
+    long long           time;      // modification time, in the units chosen by the host
+    unsigned            attr;
+    unsigned            crc;
+    unsigned short      group;     // index of the file group (-ds 'g'), assigned by the host from the groups file
+} FileDbFile;
+
+// Managing a database
+FileDb*  FileDbCreate (void);                 // NULL if there is not enough memory
+void     FileDbClear  (FileDb* db);           // Reset the database to the empty state, keeping allocated memory
+void     FileDbClose  (FileDb* db);           // Free memory occupied by the database
+FileDbId FileDbSize   (const FileDb* db);     // Number of records
+
+// Add record and return its id, or FILEDB_NO_PARENT on error. Parent should be added before its contents.
+// This is how Scan and ReadDir fill the database.
+FileDbId FileDbAddFile (FileDb* db, const FileDbFile* file);
+
+// Sort records in the order defined by sort_order chars, the first one being the primary key:
+//   g - group, e - extension, r - name compared from its end, p - path, n - name, s - size, d/t - time.
+// Capital letter sorts by the key in descending order, "" restores the order of addition.
+// Each key is sorted by stable LSD radix sort over the current order; string keys are first replaced by their ranks.
+int      FileDbSort   (FileDb* db, const char* sort_order);
+
+// Copy count records starting from the position first in the sorted order to files[], return FILEDB_OK or error code
+int      FileDbList   (const FileDb* db, FileDbId first, FileDbId count, FileDbFile* files);
+FileDbId FileDbSortedId (const FileDb* db, FileDbId position);   // id of the record at the position in the sorted order
+
+// Scan the disk adding found files to the database. Directories are read by multiple threads, each one taking
+// subdirectories found by itself and stealing them from other threads when idle; Linux uses raw getdents64 and statx
+// requesting only the fields stored in FileDB. Each root path is added as a top-level record with the path as its name,
+// time is in nanoseconds since 1970, attr holds Windows attributes with POSIX mode in the high 16 bits. Symlinks aren't
+// followed. Records are added in nondeterministic order (but always after their parent), so Sort the database after Scan.
+typedef struct {
+    const char* const*  paths;        // files and directories to scan, UTF-8
+    int                 num_paths;
+    const char* const*  include;      // wildcards (*, ?) matched against file names; no masks - include all files (-n)
+    int                 num_include;
+    const char* const*  exclude;      // wildcards excluding files and entire directories (-x)
+    int                 num_exclude;
+    int                 recursive;    // scan subdirectories (-r)
+    int                 threads;      // 0 - number of CPUs
+    void              (*on_error) (void* ud, const char* path, int error);   // optional; error is errno or GetLastError() code
+    void*               ud;
+} FileDbScanSettings;
+
+int      FileDbScan   (FileDb* db, const FileDbScanSettings* settings);    // FILEDB_OK or error code; unreadable entries are only reported
+
+// Full path of the record with '/' separators; like snprintf, returns the path length, and the path is stored only if it's
+// shorter than bufsize
+size_t   FileDbPath   (const FileDb* db, FileDbId id, char* buf, size_t bufsize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FILEDB_H
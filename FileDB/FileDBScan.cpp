@@ -0,0 +1,427 @@
+// Parallel filesystem scanner filling FileDB, see FileDbScan in FileDB.h
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FileDB.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+const int    SCAN_MAX_THREADS   = 64;
+#ifdef _WIN32
+const char   PATH_SEPARATOR     = '\\';
+#else
+const char   PATH_SEPARATOR     = '/';
+#endif
+const size_t SCAN_DIRENTS_SIZE  = 64<<10;    // getdents64 buffer
+const unsigned SCAN_ATTR_READONLY = 0x01;    // Windows attribute bits; POSIX mode is stored in the high 16 bits, as in zip
+
+// Directory waiting to be read
+struct ScanJob {
+    std::string  path;      // path to open
+    FileDbId     id;        // its record in the database
+};
+
+// Entry of the directory being read, added to the database in one batch
+struct ScanEntry {
+    std::string  name;
+    FileDbFile   file;
+    int          is_dir;
+};
+
+// Each thread pops directories from the back of its own deque (depth-first, so the deque stays short), and idle threads
+// steal from the front of other deques, where the directories closest to the root with largest subtrees wait
+struct ScanWorker {
+    std::mutex           lock;
+    std::deque<ScanJob>  jobs;
+};
+
+struct Scanner {
+    FileDb*                    db;
+    const FileDbScanSettings*  settings;
+    std::mutex                 db_lock;
+    std::vector<ScanWorker>    workers;
+    std::atomic<long>          pending;     // queued and running jobs: workers exit when it drops to zero
+    std::atomic<long>          queued;      // jobs waiting in the deques
+    std::mutex                 idle_lock;   // idle workers sleep on idle until a job is queued or pending drops to zero
+    std::condition_variable    idle;
+    std::atomic<int>           result;
+
+    Scanner (FileDb* _db, const FileDbScanSettings* _settings, int threads)
+        : db(_db), settings(_settings), workers(threads), pending(0), queued(0), result(FILEDB_OK)  {}
+};
+
+
+// Filters *****************************************************************************************************************
+
+static int LowerChar (int c)
+{
+#ifdef _WIN32
+    return c >= 'A' && c <= 'Z'?  c + 32 : c;     // Windows filenames are case-insensitive
+#else
+    return c;
+#endif
+}
+
+// Match name against wildcard with '*' and '?'
+static int MatchWildcard (const char* mask, const char* name)
+{
+    const char *star = NULL,  *star_name = NULL;
+    while (*name) {
+        if (*mask == '*')                                               star = mask++,  star_name = name;
+        else if (*mask == '?'  ||  LowerChar(*mask) == LowerChar(*name))  mask++,  name++;
+        else if (star)                                                  mask = star+1,  name = ++star_name;
+        else                                                            return 0;
+    }
+    while (*mask == '*')  mask++;
+    return *mask == '\0';
+}
+
+static int MatchAny (const char* const* masks, int num_masks, const char* name)
+{
+    int i;
+    for (i=0; i<num_masks; i++)
+        if (MatchWildcard (masks[i], name))  return 1;
+    return 0;
+}
+
+// Directories are filtered only by exclusions, files by both lists
+static int Excluded (const FileDbScanSettings* s, const char* name)   {return MatchAny (s->exclude, s->num_exclude, name);}
+static int Included (const FileDbScanSettings* s, const char* name)
+{
+    return (s->num_include == 0  ||  MatchAny (s->include, s->num_include, name))  &&  !Excluded (s, name);
+}
+
+
+// Reading directories *****************************************************************************************************
+
+// Path of the directory entry; roots such as "/" already end with the separator
+static std::string JoinPath (const std::string& dir, const std::string& name)
+{
+    char last = (dir.empty()?  '\0' : dir.back());
+    return (last == '/'  ||  last == PATH_SEPARATOR?  dir + name : dir + PATH_SEPARATOR + name);
+}
+
+static void ReportError (Scanner* scanner, const char* path, int error)
+{
+    if (scanner->settings->on_error)  scanner->settings->on_error (scanner->settings->ud, path, error);
+}
+
+#ifdef _WIN32
+
+static std::wstring Utf8ToWide (const std::string& s)
+{
+    int len = MultiByteToWideChar (CP_UTF8, 0, s.c_str(), -1, NULL, 0);
+    std::wstring w (len, L'\0');
+    MultiByteToWideChar (CP_UTF8, 0, s.c_str(), -1, &w[0], len);
+    w.resize (len-1);
+    return w;
+}
+
+static std::string WideToUtf8 (const wchar_t* w)
+{
+    int len = WideCharToMultiByte (CP_UTF8, 0, w, -1, NULL, 0, NULL, NULL);
+    std::string s (len, '\0');
+    WideCharToMultiByte (CP_UTF8, 0, w, -1, &s[0], len, NULL, NULL);
+    s.resize (len-1);
+    return s;
+}
+
+// FILETIME (100 ns ticks since 1601) -> nanoseconds since 1970; ticks are rebased first, so current times don't overflow
+static long long FileTimeToNs (const FILETIME& ft)
+{
+    long long ticks = (long long)(((unsigned long long)ft.dwHighDateTime << 32) + ft.dwLowDateTime);
+    return (ticks - 116444736000000000LL) * 100;
+}
+
+// FindFirstFileEx returns size, time and attributes with the names, so no extra calls are required
+static int ReadDirectory (Scanner* scanner, const std::string& path, std::vector<ScanEntry>& entries)
+{
+    WIN32_FIND_DATAW fd;
+    HANDLE h = FindFirstFileExW (Utf8ToWide(JoinPath(path, "*")).c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE)  return GetLastError();
+    do {
+        if (wcscmp (fd.cFileName, L".") == 0  ||  wcscmp (fd.cFileName, L"..") == 0)  continue;
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)  continue;    // don't follow links
+        ScanEntry e;
+        e.name   = WideToUtf8 (fd.cFileName);
+        e.is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (e.is_dir?  Excluded (scanner->settings, e.name.c_str()) : !Included (scanner->settings, e.name.c_str()))  continue;
+        memset (&e.file, 0, sizeof(e.file));
+        e.file.size = e.is_dir?  0 : ((unsigned long long)fd.nFileSizeHigh << 32) + fd.nFileSizeLow;
+        e.file.time = FileTimeToNs (fd.ftLastWriteTime);
+        e.file.attr = fd.dwFileAttributes;
+        entries.push_back (e);
+    } while (FindNextFileW (h, &fd));
+    FindClose (h);
+    return 0;
+}
+
+static int StatPath (const std::string& path, FileDbFile* file, int* is_dir)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fd;
+    if (!GetFileAttributesExW (Utf8ToWide(path).c_str(), GetFileExInfoStandard, &fd))  return GetLastError();
+    *is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    file->size = *is_dir?  0 : ((unsigned long long)fd.nFileSizeHigh << 32) + fd.nFileSizeLow;
+    file->time = FileTimeToNs (fd.ftLastWriteTime);
+    file->attr = fd.dwFileAttributes;
+    return 0;
+}
+
+
+#else
+
+static unsigned ModeToAttr (unsigned mode)
+{
+    unsigned attr = mode << 16;
+    if (S_ISDIR(mode))      attr |= FILEDB_ATTR_DIRECTORY;
+    if (!(mode & S_IWUSR))  attr |= SCAN_ATTR_READONLY;
+    return attr;
+}
+
+// Fill file and is_dir for the entry of the directory dirfd, not following symlinks.
+// statx asks only for the fields FileDB stores, so filesystems may skip the rest.
+static int StatAt (int dirfd, const char* name, FileDbFile* file, int* is_dir)
+{
+#if defined(__linux__) && defined(SYS_statx) && defined(STATX_BASIC_STATS)
+    struct statx stx;
+    if (syscall (SYS_statx, dirfd, name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC, STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME, &stx) == 0) {
+        *is_dir    = S_ISDIR(stx.stx_mode);
+        file->size = *is_dir?  0 : stx.stx_size;
+        file->time = (long long)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+        file->attr = ModeToAttr (stx.stx_mode);
+        return 0;
+    }
+    if (errno != ENOSYS)  return errno;
+#endif
+    struct stat st;
+    if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)  return errno;
+    *is_dir    = S_ISDIR(st.st_mode);
+    file->size = *is_dir?  0 : st.st_size;
+#ifdef __APPLE__
+    file->time = (long long)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    file->time = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    file->attr = ModeToAttr (st.st_mode);
+    return 0;
+}
+
+// Add the entry unless it's filtered out. Names are filtered before statx when the type is known from the directory
+// itself, so excluded files cost no extra syscalls
+static void ScanDirEntry (Scanner* scanner, const std::string& path, int dirfd, const char* name, unsigned char type, std::vector<ScanEntry>& entries)
+{
+    const FileDbScanSettings* s = scanner->settings;
+    if (strcmp (name, ".") == 0  ||  strcmp (name, "..") == 0)  return;
+    if (type == DT_DIR  &&  Excluded (s, name))                  return;
+    if (type != DT_DIR  &&  type != DT_UNKNOWN  &&  !Included (s, name))  return;
+    if (type == DT_LNK)                                          return;    // symlinks aren't followed
+
+    ScanEntry e;
+    memset (&e.file, 0, sizeof(e.file));
+    int error = StatAt (dirfd, name, &e.file, &e.is_dir);
+    if (error)  {ReportError (scanner, JoinPath (path, name).c_str(), error);  return;}
+    if (type == DT_UNKNOWN  &&  (e.is_dir?  Excluded (s, name) : !Included (s, name)))  return;
+    if (!e.is_dir  &&  !S_ISREG(e.file.attr >> 16))  return;           // devices, fifos, sockets
+    e.name = name;
+    entries.push_back (e);
+}
+
+static int ReadDirectory (Scanner* scanner, const std::string& path, std::vector<ScanEntry>& entries)
+{
+    int fd = open (path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0)  return errno;
+#if defined(__linux__) && defined(SYS_getdents64)
+    // Raw getdents64 returns names with their types for the whole buffer at once
+    struct Dirent64 {
+        unsigned long long  d_ino;
+        long long           d_off;
+        unsigned short      d_reclen;
+        unsigned char       d_type;
+        char                d_name[1];
+    };
+    std::vector<char> buf (SCAN_DIRENTS_SIZE);
+    for (;;) {
+        long n = syscall (SYS_getdents64, fd, &buf[0], buf.size());
+        if (n < 0  &&  errno == EINTR)  continue;
+        if (n < 0)  {int error = errno;  close (fd);  return error;}
+        if (n == 0)  break;
+        long pos;
+        for (pos = 0;  pos < n;  ) {
+            Dirent64* d = (Dirent64*) &buf[pos];
+            ScanDirEntry (scanner, path, fd, d->d_name, d->d_type, entries);
+            pos += d->d_reclen;
+        }
+    }
+#else
+    DIR* dir = fdopendir (fd);
+    if (dir == NULL)  {int error = errno;  close (fd);  return error;}
+    struct dirent* d;
+    while ((d = readdir (dir)) != NULL)
+        ScanDirEntry (scanner, path, fd, d->d_name, d->d_type, entries);
+    closedir (dir);    // closes fd too
+    return 0;
+#endif
+    close (fd);
+    return 0;
+}
+
+static int StatPath (const std::string& path, FileDbFile* file, int* is_dir)
+{
+    return StatAt (AT_FDCWD, path.c_str(), file, is_dir);
+}
+
+
+#endif
+
+
+// Work distribution *******************************************************************************************************
+
+// Wake up workers sleeping in ScanThread; taking the lock ensures that a worker that has just found nothing to do
+// is already waiting
+static void WakeWorkers (Scanner* scanner, int all)
+{
+    {std::lock_guard<std::mutex> guard (scanner->idle_lock);}
+    if (all)  scanner->idle.notify_all();
+    else      scanner->idle.notify_one();
+}
+
+// The job is counted as pending before it's queued, so pending can't drop to zero while it waits
+static void PushJob (Scanner* scanner, int worker, const std::string& path, FileDbId id)
+{
+    ScanJob job = {path, id};
+    scanner->pending++;
+    try {
+        std::lock_guard<std::mutex> guard (scanner->workers[worker].lock);
+        scanner->workers[worker].jobs.push_back (job);
+    } catch (...) {
+        scanner->pending--;    // the pusher's own job is still pending, so it doesn't drop to zero here
+        throw;
+    }
+    scanner->queued++;
+    WakeWorkers (scanner, 0);
+}
+
+// Pop own job, or steal one from other workers
+static int PopJob (Scanner* scanner, int worker, ScanJob* job)
+{
+    int n = (int) scanner->workers.size(),  i;
+    for (i=0; i<n; i++) {
+        ScanWorker& w = scanner->workers [(worker+i) % n];
+        std::lock_guard<std::mutex> guard (w.lock);
+        if (w.jobs.empty())  continue;
+        if (i == 0)  *job = std::move (w.jobs.back()),   w.jobs.pop_back();
+        else         *job = std::move (w.jobs.front()),  w.jobs.pop_front();
+        scanner->queued--;
+        return 1;
+    }
+    return 0;
+}
+
+static void ScanDirectory (Scanner* scanner, int worker, const ScanJob& job)
+{
+    std::vector<ScanEntry> entries;
+    int error = ReadDirectory (scanner, job.path, entries);
+    if (error)  ReportError (scanner, job.path.c_str(), error);
+
+    // Add the whole directory under one lock; subdirectories get their ids before they are queued
+    std::vector<FileDbId> ids (entries.size());
+    {
+        std::lock_guard<std::mutex> guard (scanner->db_lock);
+        size_t i;
+        for (i=0; i < entries.size(); i++) {
+            entries[i].file.name   = entries[i].name.c_str();
+            entries[i].file.parent = job.id;
+            ids[i] = FileDbAddFile (scanner->db, &entries[i].file);
+            if (ids[i] == FILEDB_NO_PARENT)  {scanner->result = FILEDB_ERROR_NOT_ENOUGH_MEMORY;  return;}
+        }
+    }
+    if (!scanner->settings->recursive)  return;
+    size_t i;
+    for (i = entries.size();  i-- > 0; )     // popped from the back, so subdirectories are scanned in the directory order
+        if (entries[i].is_dir)
+            PushJob (scanner, worker, JoinPath (job.path, entries[i].name), ids[i]);
+}
+
+// Exceptions (out of memory) are caught here, so the job is always finished and other workers don't wait for it forever
+static void ScanThread (Scanner* scanner, int worker)
+{
+    ScanJob job;
+    for (;;) {
+        if (!PopJob (scanner, worker, &job)) {
+            std::unique_lock<std::mutex> lock (scanner->idle_lock);
+            scanner->idle.wait (lock, [scanner] {return scanner->queued > 0  ||  scanner->pending == 0;});
+            if (scanner->pending == 0)  return;
+            continue;
+        }
+        try {
+            if (scanner->result == FILEDB_OK)  ScanDirectory (scanner, worker, job);
+        } catch (...) {
+            scanner->result = FILEDB_ERROR_NOT_ENOUGH_MEMORY;
+        }
+        if (--scanner->pending == 0)    // after its subdirectories were queued
+            WakeWorkers (scanner, 1);
+    }
+}
+
+int FileDbScan (FileDb* db, const FileDbScanSettings* settings)
+{
+    int threads = settings->threads;
+    if (threads <= 0)                threads = (int) std::thread::hardware_concurrency();
+    if (threads <= 0)                threads = 1;
+    if (threads > SCAN_MAX_THREADS)  threads = SCAN_MAX_THREADS;
+    try {
+        Scanner scanner (db, settings, threads);
+
+        // Roots are added as top-level records with their paths as names; root directories are scanned even if
+        // they don't match filters, and are read regardless of the recursive flag
+        int i;
+        for (i=0; i < settings->num_paths; i++) {
+            std::string path = settings->paths[i];
+            while (path.size() > 1  &&  (path.back() == '/'  ||  path.back() == PATH_SEPARATOR)
+                   &&  !(path.size() == 3  &&  path[1] == ':'))    // keep "C:\", "C:" is the current directory of drive C
+                path.pop_back();
+            FileDbFile file;
+            int is_dir;
+            memset (&file, 0, sizeof(file));
+            int error = StatPath (path, &file, &is_dir);
+            if (error)  {ReportError (&scanner, path.c_str(), error);  continue;}
+            if (!is_dir  &&  !Included (settings, path.c_str() + path.find_last_of ("/\\") + 1))  continue;
+            file.name   = path.c_str();
+            file.parent = FILEDB_NO_PARENT;
+            FileDbId id = FileDbAddFile (db, &file);
+            if (id == FILEDB_NO_PARENT)  return FILEDB_ERROR_NOT_ENOUGH_MEMORY;
+            if (is_dir)  PushJob (&scanner, i % threads, path, id);
+        }
+
+        // If a thread can't be started, the scan goes on with the ones already running, so they are always joined
+        std::vector<std::thread> pool;
+        pool.reserve (threads);
+        try {
+            for (i=1; i<threads; i++)
+                pool.push_back (std::thread (ScanThread, &scanner, i));
+        } catch (...) {}
+        ScanThread (&scanner, 0);
+        for (i=0; i < (int)pool.size(); i++)
+            pool[i].join();
+        return scanner.result;
+    } catch (...) {
+        return FILEDB_ERROR_NOT_ENOUGH_MEMORY;
+    }
+}